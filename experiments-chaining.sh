@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+
+# Compares standard chaining, one offset per wire, with SCMC chaining, one
+# offset per component edge: the online traffic, printed on stdout, and the
+# online times, logged per run.
+
+set -e
+
+mkdir -p logs
+
+prog=./src/compgc
+
+export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:$(readlink -f build)/lib
+
+times=$1
+if [ x"$times" == x"" ]; then
+    times=100
+fi
+
+echo -e "Repeating $times times..."
+
+run() {
+    type=$1
+    chaining=$2
+    shift 2
+    name=$type$*-$chaining
+    name=${name// /}
+
+    echo -e "\n$type $* $chaining Offline\n"
+
+    rm -f function/garbler_gcs/*
+    rm -f function/evaluator_gcs/*
+
+    $prog --type $type --chaining $chaining --garb-off "$@" 2> logs/$name-garb-off.txt 1>/dev/null &
+    sleep 1
+    $prog --type $type --chaining $chaining --eval-off "$@" 2> logs/$name-eval-off.txt 1>/dev/null
+
+    echo -e "\n$type $* $chaining Online\n"
+
+    $prog --type $type --chaining $chaining --times $times --garb-on "$@" 2> logs/$name-garb-on.txt &
+    sleep 1
+    $prog --type $type --chaining $chaining --times $times --eval-on "$@" 2> logs/$name-eval-on.txt
+}
+
+for chaining in STANDARD SCMC
+do
+    for type in AES CBC
+    do
+        run $type $chaining
+    done
+    for nsymbols in 30 60
+    do
+        run LEVEN $chaining --nsymbols $nsymbols
+    done
+done
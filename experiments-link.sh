@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+
+# Sweeps the full, offline and online phases over emulated links (--link),
+# so no tc/root is needed.  The parties connect on ports PORT to PORT+2, so
+# sweeps with different ports can run side by side from separate checkouts.
+#
+# Usage: experiments-link.sh [TIMES] [PORT]
+
+set -e
+
+mkdir -p logs
+
+prog=./src/compgc
+
+export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:$(readlink -f build)/lib
+
+times=$1
+if [ x"$times" == x"" ]; then
+    times=100
+fi
+
+port=$2
+if [ x"$port" == x"" ]; then
+    port=8000
+fi
+
+echo -e "Repeating $times times on port $port..."
+
+for type in AES CBC
+do
+    for delay in 0 10 20 50
+    do
+        for rate in 10 50 100 1000
+        do
+            link=$delay:$rate
+            opts="--type $type --link $link --port $port"
+
+            echo -e "\n$type Full, $delay ms, $rate Mbit/s\n"
+
+            $prog $opts --times $times --garb-full 2> logs/$type-garb-full-$delay-$rate.txt &
+            sleep 1
+            $prog $opts --times $times --eval-full 2> logs/$type-eval-full-$delay-$rate.txt
+            wait
+
+            echo -e "\n$type Offline, $delay ms, $rate Mbit/s\n"
+
+            rm -f function/garbler_gcs/*
+            rm -f function/evaluator_gcs/*
+
+            $prog $opts --garb-off 2> logs/$type-garb-off-$delay-$rate.txt 1>/dev/null &
+            sleep 1
+            $prog $opts --eval-off 2> logs/$type-eval-off-$delay-$rate.txt 1>/dev/null
+            wait
+
+            echo -e "\n$type Online, $delay ms, $rate Mbit/s\n"
+
+            $prog $opts --times $times --garb-on 2> logs/$type-garb-on-$delay-$rate.txt &
+            sleep 1
+            $prog $opts --times $times --eval-on 2> logs/$type-eval-on-$delay-$rate.txt
+            wait
+        done
+    done
+done
@@ -16,48 +16,46 @@ int aesNumEvalInputs() { return 128; }
 int aesNumCircs() { return 10; }
 int aesNumOutputs() { return 128; }
 
-void
-aes_garb_off(char *dir, int nchains, ChainingType chainingType)
-{
-    ChainedGarbledCircuit *chained_gcs =
-        calloc(nchains, sizeof(ChainedGarbledCircuit));
-    block delta = garble_create_delta();
-
-    for (int i = 0; i < nchains; i++) {
-        garble_circuit *gc = &chained_gcs[i].gc;
-        gc->type = garble_type;
-        if (i == nchains - 1) {
-            buildAESRoundComponentCircuit(gc, true, &delta);
-            chained_gcs[i].type = AES_FINAL_ROUND;
-        } else {
-            buildAESRoundComponentCircuit(gc, false, &delta);
-            chained_gcs[i].type = AES_ROUND;
-        }
-        chained_gcs[i].id = i;
-        chained_gcs[i].inputLabels = garble_allocate_blocks(2 * gc->n);
-        chained_gcs[i].outputMap = garble_allocate_blocks(2 * gc->m);
-
-        if (chainingType == CHAINING_TYPE_SIMD) {
-            createSIMDInputLabelsWithR(&chained_gcs[i], delta);
-        } else {
-            garble_create_input_labels(chained_gcs[i].inputLabels, gc->n, &delta, false);
-        }
+typedef struct {
+    int nchains;
+    block delta;
+    ChainingType chainingType;
+} AESOfflineArgs;
 
-        garble_garble(gc, chained_gcs[i].inputLabels, chained_gcs[i].outputMap);
+static void
+aes_garble_component(ChainedGarbledCircuit *cgc, int i, void *arg)
+{
+    AESOfflineArgs *args = arg;
+    garble_circuit *gc = &cgc->gc;
 
+    gc->type = garble_type;
+    if (i == args->nchains - 1) {
+        buildAESRoundComponentCircuit(gc, true, &args->delta);
+        cgc->type = AES_FINAL_ROUND;
+    } else {
+        buildAESRoundComponentCircuit(gc, false, &args->delta);
+        cgc->type = AES_ROUND;
     }
+    cgc->id = i;
+    cgc->inputLabels = garble_allocate_blocks(2 * gc->n);
+    cgc->outputMap = garble_allocate_blocks(2 * gc->m);
 
-    if (chainingType == CHAINING_TYPE_SIMD) {
-        for (int i = 0; i < nchains; i++) {
-            generateOfflineChainingOffsets(&chained_gcs[i]);
-        }
+    if (args->chainingType == CHAINING_TYPE_SIMD) {
+        createSIMDInputLabelsWithR(cgc, args->delta);
+    } else {
+        createInputLabels(cgc->inputLabels, gc->n, args->delta);
     }
 
-    garbler_offline(dir, chained_gcs, aesNumEvalInputs(), nchains, chainingType);
-    for (int i = 0; i < nchains; ++i) {
-        freeChainedGarbledCircuit(&chained_gcs[i], true, chainingType);
-    }
-    free(chained_gcs);
+    garble_garble(gc, cgc->inputLabels, cgc->outputMap);
+}
+
+void
+aes_garb_off(char *dir, int nchains, ChainingType chainingType)
+{
+    AESOfflineArgs args = { nchains, garblerDelta(dir), chainingType };
+
+    garbler_offline(dir, aes_garble_component, &args, aesNumEvalInputs(),
+                    nchains, chainingType);
 }
 
 ChainedGarbledCircuit*
@@ -0,0 +1,333 @@
+#include "2pc_bench.h"
+#include "2pc_common.h"
+#include "2pc_function_spec.h"
+
+#include "codec.h"
+#include "crypto.h"
+#include "net.h"
+#include "ot_co.h"
+#include "ot_iknp.h"
+#include "ot_np.h"
+#include "state.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "garble.h"
+
+typedef int (*ot_send_fn)(struct state *st, int fd, void *msgs, int msglength,
+                          int num_ots, int N, ot_msg_reader msg_reader,
+                          ot_item_reader item_reader);
+typedef int (*ot_recv_fn)(struct state *st, int fd, const void *choices,
+                          int nchoices, int msglength, int N, void *out,
+                          ot_choice_reader choice_reader,
+                          ot_msg_writer msg_writer);
+
+static void *
+bench_msg_reader(void *msgs, int idx)
+{
+    return &((block *) msgs)[2 * idx];
+}
+
+static void *
+bench_item_reader(void *item, int idx, ssize_t *mlen)
+{
+    *mlen = sizeof(block);
+    return &((block *) item)[idx];
+}
+
+static int
+bench_choice_reader(const void *choices, int idx)
+{
+    return ((const int *) choices)[idx];
+}
+
+static int
+bench_msg_writer(void *array, int idx, void *msg, size_t maxlength)
+{
+    (void) maxlength;
+    memcpy(&((block *) array)[idx], msg, sizeof(block));
+    return 0;
+}
+
+/*
+ * Runs 'num_ots' 1-out-of-2 OTs on 128-bit messages between this process
+ * (sender) and a forked child (receiver) over loopback, and prints the OT
+ * throughput as seen by the sender.  The child checks that it learned the
+ * chosen messages.
+ */
+static int
+bench_ot_run(const char *name, ot_base_type_e base, ot_send_fn ot_send,
+             ot_recv_fn ot_recv, int num_ots)
+{
+    block *msgs;
+    int *choices;
+    int sockfd, fd, status, res;
+    uint64_t start = 0, end = 0;
+    pid_t pid;
+
+    msgs = garble_allocate_blocks(2 * num_ots);
+    choices = calloc(num_ots, sizeof choices[0]);
+    for (int i = 0; i < 2 * num_ots; ++i)
+        msgs[i] = garble_random_block();
+    for (int i = 0; i < num_ots; ++i)
+        choices[i] = rand() % 2;
+
+    ot_base_type = base;
+
+    if ((sockfd = net_init_server(HOST, net_port(NET_PORT_MAIN))) == FAILURE) {
+        fprintf(stderr, "%s: could not start server\n", name);
+        res = FAILURE;
+        goto cleanup;
+    }
+
+    (void) fflush(stdout);
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        close(sockfd);
+        res = FAILURE;
+        goto cleanup;
+    } else if (pid == 0) {
+        struct state st;
+        block *out;
+        int bad = 0;
+
+        close(sockfd);
+        if ((fd = net_init_client(HOST, net_port(NET_PORT_MAIN))) == FAILURE)
+            exit(EXIT_FAILURE);
+        out = garble_allocate_blocks(num_ots);
+        state_init(&st);
+        if (ot_recv(&st, fd, choices, num_ots, sizeof(block), 2, out,
+                 bench_choice_reader, bench_msg_writer) != 0)
+            exit(EXIT_FAILURE);
+        for (int i = 0; i < num_ots; ++i) {
+            if (!garble_equal(out[i], msgs[2 * i + choices[i]]))
+                bad++;
+        }
+        state_cleanup(&st);
+        close(fd);
+        exit(bad ? EXIT_FAILURE : EXIT_SUCCESS);
+    } else {
+        struct state st;
+
+        if ((fd = net_server_accept(sockfd)) == FAILURE) {
+            close(sockfd);
+            (void) waitpid(pid, &status, 0);
+            res = FAILURE;
+            goto cleanup;
+        }
+        state_init(&st);
+        start = current_time_();
+        res = ot_send(&st, fd, msgs, sizeof(block), num_ots, 2,
+                   bench_msg_reader, bench_item_reader) == 0 ? SUCCESS : FAILURE;
+        end = current_time_();
+        state_cleanup(&st);
+        close(fd);
+        close(sockfd);
+
+        (void) waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            res = FAILURE;
+    }
+
+    if (res == SUCCESS) {
+        printf("%-12s %9d OTs %10.3f ms %12.0f OTs/sec\n", name, num_ots,
+               (end - start) / 1000000.0,
+               num_ots / ((end - start) / 1000000000.0));
+    } else {
+        fprintf(stderr, "%s: OT failed\n", name);
+    }
+
+cleanup:
+    free(choices);
+    free(msgs);
+    return res;
+}
+
+void
+benchOT(int num_base_ots, int num_ext_ots)
+{
+    ot_base_type_e saved = ot_base_type;
+
+    printf("OT benchmark (1-out-of-2, 128-bit messages, loopback)\n");
+    (void) bench_ot_run("NP", OT_BASE_NP, ot_np_send, ot_np_recv,
+                        num_base_ots);
+    (void) bench_ot_run("CO", OT_BASE_CO, ot_co_send, ot_co_recv,
+                        num_base_ots);
+    (void) bench_ot_run("IKNP/NP", OT_BASE_NP, ot_iknp_send, ot_iknp_recv,
+                        num_ext_ots);
+    (void) bench_ot_run("IKNP/CO", OT_BASE_CO, ot_iknp_send, ot_iknp_recv,
+                        num_ext_ots);
+
+    ot_base_type = saved;
+}
+
+/*
+ * Compares SHA-1 based hashing of 128-bit blocks (one sha1_hash call per
+ * block) with the batched fixed-key AES hash
+ */
+void
+benchHash(int nblocks)
+{
+    block *in, *out;
+    uint64_t start, end;
+
+    in = garble_allocate_blocks(nblocks);
+    out = garble_allocate_blocks(nblocks);
+    for (int i = 0; i < nblocks; ++i)
+        in[i] = garble_make_block(0, i);
+
+    printf("Hash benchmark (128-bit inputs and outputs)\n");
+
+    start = current_time_();
+    for (int i = 0; i < nblocks; ++i) {
+        out[i] = garble_zero_block();
+        sha1_hash((char *) &out[i], sizeof(block), i,
+                  (unsigned char *) &in[i], sizeof(block));
+    }
+    end = current_time_();
+    printf("%-12s %9d blocks %10.3f ms %12.0f hashes/sec\n", "SHA-1",
+           nblocks, (end - start) / 1000000.0,
+           nblocks / ((end - start) / 1000000000.0));
+
+    start = current_time_();
+    aes_crh(out, in, NULL, nblocks);
+    end = current_time_();
+    printf("%-12s %9d blocks %10.3f ms %12.0f hashes/sec\n", "AES-CRH",
+           nblocks, (end - start) / 1000000.0,
+           nblocks / ((end - start) / 1000000000.0));
+
+    free(out);
+    free(in);
+}
+
+/*
+ * Compresses and decompresses 'length' bytes chunk by chunk, as
+ * net_send_compressed does, and returns the compressed size and the time
+ * taken by each direction.
+ */
+static int
+bench_codec_run(const struct codec *codec, const char *buf, size_t length,
+                size_t *clength, uint64_t *ctime, uint64_t *dtime)
+{
+    size_t cap = codec_bound(codec->type, NET_CODEC_CHUNK);
+    size_t nchunks = (length + NET_CODEC_CHUNK - 1) / NET_CODEC_CHUNK;
+    char *cbuf, *out;
+    size_t *clens;
+    uint64_t start;
+    int res = SUCCESS;
+
+    cbuf = malloc(nchunks * cap);
+    clens = calloc(nchunks, sizeof clens[0]);
+    out = malloc(NET_CODEC_CHUNK);
+
+    *clength = 0;
+    start = current_time_();
+    for (size_t i = 0; i < nchunks && res == SUCCESS; ++i) {
+        size_t rawlen = length - i * NET_CODEC_CHUNK;
+        if (rawlen > NET_CODEC_CHUNK)
+            rawlen = NET_CODEC_CHUNK;
+        res = codec_compress(codec, buf + i * NET_CODEC_CHUNK, rawlen,
+                             cbuf + i * cap, cap, &clens[i]);
+        *clength += clens[i];
+    }
+    *ctime = current_time_() - start;
+
+    start = current_time_();
+    for (size_t i = 0; i < nchunks && res == SUCCESS; ++i) {
+        size_t rawlen = length - i * NET_CODEC_CHUNK;
+        if (rawlen > NET_CODEC_CHUNK)
+            rawlen = NET_CODEC_CHUNK;
+        res = codec_decompress(codec->type, cbuf + i * cap, clens[i], out, rawlen);
+        if (res == SUCCESS
+            && memcmp(out, buf + i * NET_CODEC_CHUNK, rawlen) != 0)
+            res = FAILURE;
+    }
+    *dtime = current_time_() - start;
+
+    free(out);
+    free(clens);
+    free(cbuf);
+    return res;
+}
+
+/*
+ * Measures each available codec on the instruction array of the function in
+ * 'function_path', then picks the codec minimizing the transfer time of that
+ * array for a range of link bandwidths.  Since chunks are compressed, sent
+ * and decompressed in a pipeline, a transfer takes about the time of its
+ * slowest stage.
+ */
+void
+benchCodec(char *function_path)
+{
+    static const char *specs[] = {
+        "none", "zlib:1", "zlib:6", "zlib:9", "lz4", "lz4:9",
+        "zstd:1", "zstd:3", "zstd:9", "zstd:19",
+    };
+    static const double mbits[] = { 10, 100, 1000, 10000 };
+    const size_t nspecs = sizeof specs / sizeof specs[0];
+    const size_t nlinks = sizeof mbits / sizeof mbits[0];
+    FunctionSpec function;
+    struct codec codecs[nspecs];
+    size_t clengths[nspecs];
+    uint64_t ctimes[nspecs], dtimes[nspecs];
+    bool ok[nspecs];
+    size_t length;
+
+    if (load_function_via_json(function_path, &function,
+                               CHAINING_TYPE_STANDARD) == FAILURE) {
+        fprintf(stderr, "Could not load function %s\n", function_path);
+        return;
+    }
+    length = function.instructions.size * sizeof(Instruction);
+
+    printf("Codec benchmark (%s: %zu bytes of instructions)\n",
+           function_path, length);
+    for (size_t i = 0; i < nspecs; ++i) {
+        /* codecs that were not compiled in are reported and skipped */
+        ok[i] = codec_parse(&codecs[i], specs[i]) == SUCCESS;
+        if (!ok[i])
+            continue;
+        if (bench_codec_run(&codecs[i], (char *) function.instructions.instr,
+                            length, &clengths[i], &ctimes[i], &dtimes[i]) == FAILURE) {
+            fprintf(stderr, "%s: round trip failed\n", specs[i]);
+            ok[i] = false;
+            continue;
+        }
+        printf("%-8s %10zu bytes  ratio %6.2f  compress %8.1f MB/s  "
+               "decompress %8.1f MB/s\n", specs[i], clengths[i],
+               (double) length / (clengths[i] ? clengths[i] : 1),
+               length / (ctimes[i] / 1000.0 + 1e-9),
+               length / (dtimes[i] / 1000.0 + 1e-9));
+    }
+
+    for (size_t l = 0; l < nlinks; ++l) {
+        size_t best = nspecs;
+        double besttime = 0.0;
+
+        for (size_t i = 0; i < nspecs; ++i) {
+            double t;
+            if (!ok[i])
+                continue;
+            t = clengths[i] * 8 / (mbits[l] * 1000.0);
+            if (ctimes[i] / 1000000.0 > t)
+                t = ctimes[i] / 1000000.0;
+            if (dtimes[i] / 1000000.0 > t)
+                t = dtimes[i] / 1000000.0;
+            if (best == nspecs || t < besttime) {
+                best = i;
+                besttime = t;
+            }
+        }
+        if (best < nspecs)
+            printf("%7.0f Mbit/s: best codec %-8s (%.3f ms)\n", mbits[l],
+                   specs[best], besttime);
+    }
+
+    freeFunctionSpec(&function);
+}
@@ -0,0 +1,8 @@
+#ifndef TWOPC_BENCH_H
+#define TWOPC_BENCH_H
+
+void benchOT(int num_base_ots, int num_ext_ots);
+void benchHash(int nblocks);
+void benchCodec(char *function_path);
+
+#endif
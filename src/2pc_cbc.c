@@ -31,51 +31,48 @@ static int cbcNumGates() {
         getNumFinalAESCircs() * gates_per_aes_final;
 }
 
-void cbc_garb_off(char *dir, ChainingType chainingType)
+typedef struct {
+    block delta;
+    ChainingType chainingType;
+} CBCOfflineArgs;
+
+static void
+cbc_garble_component(ChainedGarbledCircuit *cgc, int i, void *arg)
 {
-    printf("Running cbc garb offline\n");
-    int num_chained_gcs = cbcNumCircs(); 
+    CBCOfflineArgs *args = arg;
+    garble_circuit *gc = &cgc->gc;
     int num_xor_circs = getNumXORCircs();
     int num_aes_circs = getNumAESCircs();
-    ChainedGarbledCircuit *chained_gcs = malloc(sizeof(ChainedGarbledCircuit) * num_chained_gcs);
-
-    block delta = garble_create_delta();
 
-    for (int i = 0; i < num_chained_gcs; i++) {
-        garble_circuit *gc = &(chained_gcs[i].gc);
-        if (i < num_xor_circs) {
-            buildXORCircuit(gc, &delta);
-            chained_gcs[i].type = XOR;
-        } else if (i < num_xor_circs + num_aes_circs) {
-            buildAESRoundComponentCircuit(gc, false, &delta);
-            chained_gcs[i].type = AES_ROUND;
-        } else {
-            buildAESRoundComponentCircuit(gc, true, &delta);
-            chained_gcs[i].type = AES_FINAL_ROUND;
-
-        }
-        chained_gcs[i].id = i;
-        chained_gcs[i].inputLabels = garble_allocate_blocks(2 * gc->n);
-        chained_gcs[i].outputMap = garble_allocate_blocks(2 * gc->m);
-
-        if (chainingType == CHAINING_TYPE_SIMD) {
-            createSIMDInputLabelsWithR(&chained_gcs[i], delta);
-        } else { 
-            garble_create_input_labels(chained_gcs[i].inputLabels, gc->n, &delta, false);
-        }
-        garble_garble(gc, chained_gcs[i].inputLabels, chained_gcs[i].outputMap);
+    if (i < num_xor_circs) {
+        buildXORCircuit(gc, &args->delta);
+        cgc->type = XOR;
+    } else if (i < num_xor_circs + num_aes_circs) {
+        buildAESRoundComponentCircuit(gc, false, &args->delta);
+        cgc->type = AES_ROUND;
+    } else {
+        buildAESRoundComponentCircuit(gc, true, &args->delta);
+        cgc->type = AES_FINAL_ROUND;
     }
-
-    if (chainingType == CHAINING_TYPE_SIMD) {
-        for (int i = 0; i < num_chained_gcs; i++)
-            generateOfflineChainingOffsets(&chained_gcs[i]);
+    cgc->id = i;
+    cgc->inputLabels = garble_allocate_blocks(2 * gc->n);
+    cgc->outputMap = garble_allocate_blocks(2 * gc->m);
+
+    if (args->chainingType == CHAINING_TYPE_SIMD) {
+        createSIMDInputLabelsWithR(cgc, args->delta);
+    } else { 
+        createInputLabels(cgc->inputLabels, gc->n, args->delta);
     }
+    garble_garble(gc, cgc->inputLabels, cgc->outputMap);
+}
 
-    garbler_offline(dir, chained_gcs, cbcNumEvalInputs(), num_chained_gcs, chainingType);
-    for (int i = 0; i < num_chained_gcs; ++i) {
-        freeChainedGarbledCircuit(&chained_gcs[i], true, chainingType);
-    }
-    free(chained_gcs);
+void cbc_garb_off(char *dir, ChainingType chainingType)
+{
+    printf("Running cbc garb offline\n");
+    CBCOfflineArgs args = { garblerDelta(dir), chainingType };
+
+    garbler_offline(dir, cbc_garble_component, &args, cbcNumEvalInputs(),
+                    cbcNumCircs(), chainingType);
 }
 
 ChainedGarbledCircuit* cbc_circuits() {
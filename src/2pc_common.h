@@ -1,9 +1,49 @@
 #ifndef MPC_COMMON_H
 #define MPC_COMMON_H
 
+#include <stdint.h>
+
 #define MAX_BUF_SIZE 1000000
 
 #define HOST "127.0.0.1"
-#define PORT "8000"
+
+/* maximum number of components queued between two offline pipeline stages */
+#define OFFLINE_QUEUE_DEPTH 8
+
+/*
+ * Header of a batch of components sent by the offline phase or by the
+ * component pool's background replenishment; a batch of zero components ends
+ * the stream.  The evaluator acknowledges a batch once it is in its pool, and
+ * only then does the garbler add it to its own, so that the garbler never
+ * hands out a component the evaluator does not have.
+ */
+typedef struct {
+    int32_t first;              /* id of the first component */
+    int32_t n;
+} BatchHeader;
+
+/*
+ * Framing of the queries of an online session.  The evaluator asks for each
+ * query with a header carrying its sequence number, marked SESSION_QUERY or,
+ * for the last one, SESSION_LAST, or ends the session with SESSION_END.  Only
+ * then does the garbler reserve the query's OT pool slice and fresh
+ * components and announce them back with the same sequence number, so
+ * nothing is reserved for a query that never comes.  The ids of the
+ * components follow the header.
+ */
+#define SESSION_MAGIC 0x53534347    /* "GCSS" */
+
+typedef enum {
+    SESSION_QUERY = 1,
+    SESSION_LAST = 2,
+    SESSION_END = 3,
+} SessionMsgType;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint64_t otOffset;
+} SessionHeader;
 
 #endif
@@ -1,7 +1,9 @@
 #include "2pc_evaluator.h"
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <assert.h>
 #include <unistd.h> // sleep
 #include <time.h>
@@ -9,10 +11,13 @@
 #include <garble.h>
 #include <garble/aes.h>
 
+#include "bqueue.h"
 #include "gc_comm.h"
 #include "net.h"
-#include "ot_np.h"
+#include "ot_iknp.h"
+#include "otpool.h"
 #include "2pc_common.h"
+#include "2pc_gc_pool.h"
 #include "utils.h"
 
 static int
@@ -30,10 +35,242 @@ new_msg_writer(void *array, int idx, void *msg, size_t msglength)
     return 0;
 }
 
+/*
+ * Runs the preprocessing OTs for the evaluator's inputs, learning one random
+ * label per choice bit in 'selections'
+ */
+static int
+recvEvalOTs(struct state *state, int fd, int *selections, int n, block *labels)
+{
+    if (ot_correlated)
+        return ot_iknp_cot_recv(state, fd, selections, n, labels,
+                                new_choice_reader, new_msg_writer);
+    else
+        return ot_iknp_recv(state, fd, selections, n, sizeof(block), 2, labels,
+                            new_choice_reader, new_msg_writer);
+}
+
+/*
+ * Receives the garbler's masked labels for the evaluator's inputs and unmasks
+ * them in place.  With correlated OTs there is one masked label per input,
+ * otherwise a pair from which the one matching the input is picked.
+ */
+static void
+unmaskEvalLabels(struct net_conn *conn, block *labels, const int *inputs, int n)
+{
+    int nper = ot_correlated ? 1 : 2;
+    block *recvLabels;
+
+    recvLabels = garble_allocate_blocks(nper * n);
+    net_conn_tag(conn, NET_CAT_LABELS);
+    (void) net_conn_recv(conn, recvLabels, sizeof(block) * nper * n);
+    for (int i = 0; i < n; ++i) {
+        labels[i] = garble_xor(labels[i],
+                               recvLabels[nper * i + (ot_correlated ? 0 : inputs[i])]);
+    }
+    free(recvLabels);
+}
+
+int evaluator_threads = 1;
+
+static int evaluatorWaitComponent(EvaluatorSession *session, int idx);
+
+/*
+ * Applies one chain.  With SIMD chaining, 'fromOffsets' are the offline
+ * chaining offsets of the source component, which map its output labels to
+ * the input labels of any component up to the one offset of the edge;
+ * otherwise it is NULL and each wire has its own offset.
+ */
 static void
+evaluatorChain(const ChainInstruction *ch, block **labels,
+               block **computedOutputMap, const block *offsets,
+               const block *fromOffsets)
+{
+    block *to = &labels[ch->toCircId][ch->toWireId];
+    const block *from = &computedOutputMap[ch->fromCircId][ch->fromWireId];
+
+    if (ch->fromCircId == 0) {
+        // if mapping inputs: one offset for the whole range
+        xorLabelsWith(to, from, offsets[ch->offsetIdx], ch->wireDist);
+    } else if (fromOffsets) {
+        xorLabels(to, from, &fromOffsets[ch->fromWireId], ch->wireDist);
+        xorLabelsWith(to, to, offsets[ch->offsetIdx], ch->wireDist);
+    } else {
+        // if not inputs: one offset per wire, from offsetIdx on
+        xorLabels(to, from, &offsets[ch->offsetIdx], ch->wireDist);
+    }
+}
+
+/* offline chaining offsets of the source of 'ch' with SIMD chaining */
+static const block *
+evaluatorFromOffsets(const ChainedGarbledCircuit *chained_gcs,
+                     const ChainInstruction *ch, const int *circuitMapping,
+                     ChainingType chainingType)
+{
+    if (chainingType != CHAINING_TYPE_SIMD || ch->fromCircId == 0)
+        return NULL;
+    return chained_gcs[circuitMapping[ch->fromCircId]].offlineChainingOffsets;
+}
+
+static int
+evaluatorEval(ChainedGarbledCircuit *chained_gcs, int circId, block **labels,
+              const int *circuitMapping, block **computedOutputMap,
+              EvaluatorSession *session)
+{
+    int savedCircId = circuitMapping[circId];
+
+    if (session && evaluatorWaitComponent(session, savedCircId) == FAILURE)
+        return FAILURE;
+    garble_eval(&chained_gcs[savedCircId].gc, labels[circId],
+                computedOutputMap[circId], NULL);
+    return SUCCESS;
+}
+
+/*
+ * Dependencies between the EVAL instructions, from which EvaluatorPlan is
+ * compiled.  Each node is one EVAL, preceded by the CHAINs that fill its
+ * input labels; a node depends on the nodes whose outputs those CHAINs read.
+ * CHAINs into circuits not evaluated after them form a tail, run once all
+ * nodes are done.
+ */
+typedef struct {
+    struct workpool_dag graph;
+    int *evals;                 /* instruction of each node */
+    int *chainStart;            /* chains[chainStart[i]] .. of node i */
+    int *chains;
+    int *tail;
+    int ntail;
+} EvaluatorDag;
+
+/*
+ * Derives the dependencies of the EVALs of 'instructions'.  Fails on
+ * instructions whose effect depends on their order beyond that, i.e. a
+ * circuit evaluated twice or a CHAIN reading outputs of a circuit evaluated
+ * after it, which are then interpreted in order.
+ */
+static int
+evaluatorBuildDag(EvaluatorDag *dag, const Instructions *instructions)
+{
+    const Instruction *instr = instructions->instr;
+    int ncircs = 1, nnodes = 0, nedges = 0;
+    int *evalAt, *chainNode, *from, *to, *lastFrom;
+    int res = FAILURE;
+
+    memset(dag, '\0', sizeof *dag);
+    for (int i = 0; i < instructions->size; ++i) {
+        if (instr[i].type == EVAL) {
+            ncircs = MAX(ncircs, instr[i].ev.circId + 1);
+        } else if (instr[i].type == CHAIN) {
+            ncircs = MAX(ncircs, instr[i].ch.fromCircId + 1);
+            ncircs = MAX(ncircs, instr[i].ch.toCircId + 1);
+        } else {
+            return FAILURE;
+        }
+    }
+    evalAt = malloc(ncircs * sizeof evalAt[0]);        /* instruction, or -1 */
+    chainNode = malloc(ncircs * sizeof chainNode[0]);   /* node, or -1 */
+    lastFrom = malloc(ncircs * sizeof lastFrom[0]);     /* to drop duplicate edges */
+    from = malloc(instructions->size * sizeof from[0] + 1);
+    to = malloc(instructions->size * sizeof to[0] + 1);
+    dag->evals = malloc(instructions->size * sizeof dag->evals[0] + 1);
+    dag->chains = malloc(instructions->size * sizeof dag->chains[0] + 1);
+    dag->tail = malloc(instructions->size * sizeof dag->tail[0] + 1);
+    if (evalAt == NULL || chainNode == NULL || lastFrom == NULL || from == NULL
+        || to == NULL || dag->evals == NULL || dag->chains == NULL
+        || dag->tail == NULL)
+        goto cleanup;
+
+    for (int c = 0; c < ncircs; ++c) {
+        evalAt[c] = -1;
+        lastFrom[c] = -1;
+    }
+    for (int i = 0; i < instructions->size; ++i) {
+        if (instr[i].type != EVAL)
+            continue;
+        if (instr[i].ev.circId < 0 || evalAt[instr[i].ev.circId] != -1)
+            goto cleanup;
+        evalAt[instr[i].ev.circId] = i;
+        chainNode[instr[i].ev.circId] = nnodes;
+        dag->evals[nnodes++] = i;
+    }
+
+    /* the chains of each node, in order, counted first */
+    dag->chainStart = calloc(nnodes + 1, sizeof dag->chainStart[0]);
+    if (dag->chainStart == NULL)
+        goto cleanup;
+    for (int i = 0; i < instructions->size; ++i) {
+        const ChainInstruction *ch = &instr[i].ch;
+        int f, t;
+
+        if (instr[i].type != CHAIN)
+            continue;
+        if (ch->fromCircId < 0 || ch->toCircId < 0)
+            goto cleanup;
+        f = ch->fromCircId == 0 ? -1 : evalAt[ch->fromCircId];
+        t = evalAt[ch->toCircId];
+        if (f > i)
+            goto cleanup;
+        if (t < i) {
+            dag->tail[dag->ntail++] = i;
+            continue;
+        }
+        dag->chainStart[chainNode[ch->toCircId] + 1]++;
+        if (f != -1 && lastFrom[ch->fromCircId] != chainNode[ch->toCircId]) {
+            lastFrom[ch->fromCircId] = chainNode[ch->toCircId];
+            from[nedges] = chainNode[ch->fromCircId];
+            to[nedges] = chainNode[ch->toCircId];
+            nedges++;
+        }
+    }
+    for (int n = 0; n < nnodes; ++n)
+        dag->chainStart[n + 1] += dag->chainStart[n];
+    for (int i = 0; i < instructions->size; ++i) {
+        int t;
+
+        if (instr[i].type != CHAIN || evalAt[instr[i].ch.toCircId] < i)
+            continue;
+        t = chainNode[instr[i].ch.toCircId];
+        /* chainStart[t] is the next free slot of node t for now */
+        dag->chains[dag->chainStart[t]++] = i;
+    }
+    for (int n = nnodes; n > 0; --n)
+        dag->chainStart[n] = dag->chainStart[n - 1];
+    dag->chainStart[0] = 0;
+
+    res = workpool_dag_build(&dag->graph, nnodes, from, to, nedges);
+
+cleanup:
+    free(evalAt);
+    free(chainNode);
+    free(lastFrom);
+    free(from);
+    free(to);
+    if (res == FAILURE) {
+        free(dag->evals);
+        free(dag->chainStart);
+        free(dag->chains);
+        free(dag->tail);
+        memset(dag, '\0', sizeof *dag);
+    }
+    return res;
+}
+
+static void
+evaluatorDestroyDag(EvaluatorDag *dag)
+{
+    workpool_dag_destroy(&dag->graph);
+    free(dag->evals);
+    free(dag->chainStart);
+    free(dag->chains);
+    free(dag->tail);
+    memset(dag, '\0', sizeof *dag);
+}
+
+static int
 evaluator_evaluate(ChainedGarbledCircuit* chained_gcs, int num_chained_gcs,
         const Instructions* instructions, block** labels, const int* circuitMapping,
-        block **computedOutputMap, const block *offsets, ChainingType chainingType)
+        block **computedOutputMap, const block *offsets, ChainingType chainingType,
+        EvaluatorSession *session)
 {
     /* Evaluates the chained garbled circuits using the array of chained_gcs, the instructions,
      * input labels, and other information provided. Ignoring abstractions, this 
@@ -60,67 +297,31 @@ evaluator_evaluate(ChainedGarbledCircuit* chained_gcs, int num_chained_gcs,
      *        where computedOutputMap[i] is the list of output labels of gc i
      * @param offsets otherwise known as the chaining mask, the offsets are the
      *        blocks needed to map output labels of one gc to input labels of another gc.
+     * @param session if non-NULL, the session whose loader each component is
+     *        waited for before its evaluation.
      *
      */
 
-    int savedCircId, offsetIdx;
     for (int i = 0; i < instructions->size; i++) {
         Instruction* cur = &instructions->instr[i];
         switch(cur->type) {
         case EVAL:
-            savedCircId = circuitMapping[cur->ev.circId];
-            garble_eval(&chained_gcs[savedCircId].gc, labels[cur->ev.circId],
-                        computedOutputMap[cur->ev.circId], NULL);
+            if (evaluatorEval(chained_gcs, cur->ev.circId, labels,
+                              circuitMapping, computedOutputMap,
+                              session) == FAILURE)
+                return FAILURE;
             break;
         case CHAIN:
-            assert(chainingType == CHAINING_TYPE_STANDARD);
-            /* if (chainingType == CHAINING_TYPE_STANDARD) { */
-                // if mapping inputs
-                if (cur->ch.fromCircId == 0) {
-                    int offsetIdx = cur->ch.offsetIdx;
-                    for (int j = cur->ch.fromWireId, k = cur->ch.toWireId; 
-                         j < cur->ch.fromWireId + cur->ch.wireDist;
-                         ++j, ++k) {
-
-                        labels[cur->ch.toCircId][k] = garble_xor(
-                            computedOutputMap[cur->ch.fromCircId][j],
-                            offsets[offsetIdx]);
-                    }
-                } else {
-                    // if not inputs:
-                    block b = garble_xor(
-                        computedOutputMap[cur->ch.fromCircId][cur->ch.fromWireId], 
-                        offsets[cur->ch.offsetIdx]);
-                    memcpy(&labels[cur->ch.toCircId][cur->ch.toWireId], &b, sizeof(b));
-                }
-            /* } else { */
-            /*     /\* CHAINING_TYPE_SIMD *\/ */
-            /*     savedCircId = circuitMapping[cur->ch.fromCircId]; */
-            /*     offsetIdx = cur->ch.offsetIdx; */
-
-            /*     for (int j = cur->ch.fromWireId, k = cur->ch.toWireId;  */
-            /*          j < cur->ch.fromWireId + cur->ch.wireDist; */
-            /*          ++j, ++k) { */
-
-            /*         /\* correct computedOutputMap offlineChainingOffsets *\/ */
-            /*         /\* i.e. correct to enable SIMD trick *\/ */
-            /*         labels[cur->ch.toCircId][k] = garble_xor( */
-            /*             computedOutputMap[cur->ch.fromCircId][j], */
-            /*             offsets[offsetIdx]); */
-
-            /*         if (cur->ch.fromCircId != 0) { /\* if not the input component *\/ */
-            /*             labels[cur->ch.toCircId][k] = garble_xor( */
-            /*                 labels[cur->ch.toCircId][k], */
-            /*                 chained_gcs[savedCircId].offlineChainingOffsets[j]); */
-            /*         } */
-            /*     } */
-            /* } */
+            evaluatorChain(&cur->ch, labels, computedOutputMap, offsets,
+                           evaluatorFromOffsets(chained_gcs, &cur->ch,
+                                                circuitMapping, chainingType));
             break;
         default:
             printf("Error: Instruction %d is not of a valid type\n", i);
             abort();
         }
     }
+    return SUCCESS;
 }
 
 void
@@ -134,6 +335,7 @@ evaluator_classic_2pc(garble_circuit *gc, const int *input, bool *output,
      */
 
     int sockfd;
+    struct net_conn *conn;
     OldInputMapping map;
     uint64_t start, end;
     int selections[num_eval_inputs];
@@ -142,61 +344,64 @@ evaluator_classic_2pc(garble_circuit *gc, const int *input, bool *output,
     block labels[gc->n];
     block output_map[2 * gc->m];
 
-    if ((sockfd = net_init_client(HOST, PORT)) == FAILURE) {
+    if ((sockfd = net_init_client(HOST, net_port(NET_PORT_MAIN))) == FAILURE) {
         perror("net_init_client");
         exit(EXIT_FAILURE);
     }
+    if ((conn = net_conn_new(sockfd)) == NULL) {
+        perror("net_conn_new");
+        exit(EXIT_FAILURE);
+    }
 
     /* pre-process OT */
+    net_conn_set_phase(conn, NET_PHASE_PREPROCESS);
+    net_conn_tag(conn, NET_CAT_OT);
     if (num_eval_inputs > 0) {
         struct state state;
         state_init(&state);
         for (int i = 0; i < num_eval_inputs; ++i) {
             selections[i] = rand() % 2;
         }
-        ot_np_recv(&state, sockfd, selections, num_eval_inputs, sizeof(block),
-                   2, eval_labels, new_choice_reader, new_msg_writer);
+        recvEvalOTs(&state, sockfd, selections, num_eval_inputs, eval_labels);
         state_cleanup(&state);
     }
 
     /* Start timing after pre-processing of OT as we only want to record online
      * time */
     start = current_time_();
-    g_bytes_sent = g_bytes_received = 0;
+    net_conn_set_phase(conn, NET_PHASE_ONLINE);
 
     if (num_eval_inputs > 0) {
         for (int i = 0; i < num_eval_inputs; ++i) {
             selections[i] ^= input[i];
         }
-        (void) net_send(sockfd, selections, sizeof selections, 0);
+        (void) net_conn_send(conn, selections, sizeof selections);
     }
 
     if (num_eval_inputs > 0) {
-        block recvLabels[2 * num_eval_inputs];
-        net_recv(sockfd, recvLabels, sizeof recvLabels, 0);
-        for (int i = 0; i < num_eval_inputs; ++i) {
-            eval_labels[i] = garble_xor(eval_labels[i],
-                                        recvLabels[2 * i + input[i]]);
-        }
+        unmaskEvalLabels(conn, eval_labels, input, num_eval_inputs);
     }
 
     if (num_garb_inputs > 0) {
-        (void) net_recv(sockfd, garb_labels, sizeof garb_labels, 0);
+        (void) net_conn_recv(conn, garb_labels, sizeof garb_labels);
     }
 
-    gc_comm_recv(sockfd, gc);
+    net_conn_tag(conn, NET_CAT_TABLES);
+    gc_comm_recv(conn, gc);
 
-    (void) net_recv(sockfd, output_map, sizeof output_map, 0);
+    net_conn_tag(conn, NET_CAT_OUTPUT);
+    (void) net_conn_recv(conn, output_map, sizeof output_map);
 
+    net_conn_tag(conn, NET_CAT_MAPPING);
     {
         size_t size;
-        (void) net_recv(sockfd, &size, sizeof size, 0);
+        (void) net_conn_recv(conn, &size, sizeof size);
         char buffer[size];
-        (void) net_recv(sockfd, buffer, sizeof buffer, 0);
+        (void) net_conn_recv(conn, buffer, sizeof buffer);
         readBufferIntoInputMapping(&map, buffer);
     }
 
-    close(sockfd);
+    net_conn_close(conn);
     
     /* Plug labels in correctly based on input_mapping */
     {
@@ -222,44 +427,139 @@ evaluator_classic_2pc(garble_circuit *gc, const int *input, bool *output,
     *tot_time = end - start;
 }
 
+/*
+ * One batch of components on its way into the evaluator's pool: received on
+ * the calling thread and saved by a saver thread, with at most
+ * OFFLINE_QUEUE_DEPTH received components waiting to be saved
+ */
+typedef struct {
+    BatchHeader hdr;
+    struct bqueue toSave;
+    ChainedGCSaver saver;
+    uint64_t recvTime;
+} EvaluatorBatch;
+
+/*
+ * Receives the garbler's batch header and the components of the batch,
+ * returning once everything is received, saving possibly still going on; see
+ * evaluatorBatchFinish.  A batch of no components ends the stream and is not
+ * to be finished.
+ */
+static int
+evaluatorBatchStart(EvaluatorBatch *b, struct net_conn *conn, char *dir,
+                    ChainingType chainingType)
+{
+    memset(b, '\0', sizeof *b);
+    net_conn_tag(conn, NET_CAT_CONTROL);
+    if (net_conn_recv(conn, &b->hdr, sizeof b->hdr) == FAILURE)
+        return FAILURE;
+    if (b->hdr.n < 0 || b->hdr.first < 0) {
+        fprintf(stderr, "Bad batch header\n");
+        return FAILURE;
+    }
+    if (b->hdr.n == 0)
+        return SUCCESS;
+
+    if (bqueue_init(&b->toSave, OFFLINE_QUEUE_DEPTH) == FAILURE) {
+        perror("bqueue_init");
+        return FAILURE;
+    }
+    if (startChainedGCSaver(&b->saver, &b->toSave, dir, b->hdr.first, false,
+                            chainingType) == FAILURE) {
+        perror("pthread_create");
+        return FAILURE;
+    }
+    for (int i = 0; i < b->hdr.n; i++) {
+        uint64_t t = current_time_();
+        ChainedGarbledCircuit *cgc = calloc(1, sizeof *cgc);
+
+        if (chained_gc_comm_recv(conn, cgc, chainingType) == FAILURE) {
+            perror("chained_gc_comm_recv");
+            exit(EXIT_FAILURE);
+        }
+        b->recvTime += current_time_() - t;
+        bqueue_push(&b->toSave, cgc);
+    }
+    bqueue_push(&b->toSave, NULL);
+    return SUCCESS;
+}
+
+/*
+ * Waits for the batch to be saved, adds it to the pool and acknowledges it,
+ * after which the garbler may hand its components out
+ */
+static int
+evaluatorBatchFinish(EvaluatorBatch *b, struct net_conn *conn, GCPool *pool)
+{
+    char ack = 1;
+    int res = SUCCESS;
+
+    if (joinChainedGCSaver(&b->saver) == FAILURE) {
+        fprintf(stderr, "Could not save chained GCs\n");
+        res = FAILURE;
+    }
+    bqueue_destroy(&b->toSave);
+    if (res == SUCCESS)
+        res = gcPoolAddBatch(pool, b->hdr.first);
+    if (res == SUCCESS) {
+        net_conn_tag(conn, NET_CAT_CONTROL);
+        if (net_conn_send(conn, &ack, sizeof ack) == FAILURE
+            || net_conn_flush(conn) == FAILURE)
+            res = FAILURE;
+    }
+    return res;
+}
+
 void
-evaluator_offline(char *dir, int num_eval_inputs, int nchains,
-                  ChainingType chainingType)
+evaluator_offline(char *dir, int num_eval_inputs, ChainingType chainingType)
 {
     /* Does the offline stage for the evaluator.
-     * This includes receiving pre-exchanged garbled circuits,
-     * performing the offline phase of OT-preprocessing, and
+     * This includes receiving a batch of garbled circuits for the
+     * component pool, performing the offline phase of OT-preprocessing, and
      * saving relevant information to disk.
      *
      * @param dir the directory to save information
      * @param num_eval_inputs the number of evaluator inputs
-     * @param nchains the number of garbled circuits to be pre-exchanged
      * @param chainingType indicates whether we are using SIMD or standard chaining.
-     *        WARNING: SIMD-style chaining is now deprecated.
      */
     int sockfd;
+    struct net_conn *conn;
     struct state state;
-    ChainedGarbledCircuit cgc;
+    GCPool gcPool;
+    EvaluatorBatch batch;
     uint64_t start, end;
     
     state_init(&state);
-    memset(&cgc, '\0', sizeof cgc);
 
-    if ((sockfd = net_init_client(HOST, PORT)) == FAILURE) {
+    if ((sockfd = net_init_client(HOST, net_port(NET_PORT_MAIN))) == FAILURE) {
         perror("net_init_client");
         exit(EXIT_FAILURE);
     }
+    if ((conn = net_conn_new(sockfd)) == NULL) {
+        perror("net_conn_new");
+        exit(EXIT_FAILURE);
+    }
+    net_conn_set_phase(conn, NET_PHASE_OFFLINE);
 
     start = current_time_();
 
-    for (int i = 0; i < nchains; i++) {
-        chained_gc_comm_recv(sockfd, &cgc, chainingType);
-        saveChainedGC(&cgc, dir, false, chainingType);
-        freeChainedGarbledCircuit(&cgc, false, chainingType);
+    if (gcPoolOpen(&gcPool, dir, false) == FAILURE)
+        exit(EXIT_FAILURE);
+    if (evaluatorBatchStart(&batch, conn, dir, chainingType) == FAILURE) {
+        fprintf(stderr, "Could not receive chained GCs\n");
+        exit(EXIT_FAILURE);
     }
 
     /* pre-processing OT using random selection bits */
-    if (num_eval_inputs > 0) {
+    net_conn_tag(conn, NET_CAT_OT);
+    if (num_eval_inputs > 0 && ot_pool_size > 0) {
+        struct otpool pool;
+
+        if (otpool_open(&pool, dir, false) == SUCCESS) {
+            (void) otpool_fill_recv(&pool, &state, sockfd);
+            otpool_close(&pool);
+        }
+    } else if (num_eval_inputs > 0) {
         int *selections;
         block *evalLabels;
         char *fname;
@@ -274,8 +574,7 @@ evaluator_offline(char *dir, int num_eval_inputs, int nchains,
             selections[i] = rand() % 2;
         }
         evalLabels = garble_allocate_blocks(num_eval_inputs);
-        ot_np_recv(&state, sockfd, selections, num_eval_inputs, sizeof(block),
-                   2, evalLabels, new_choice_reader, new_msg_writer);
+        recvEvalOTs(&state, sockfd, selections, num_eval_inputs, evalLabels);
         (void) snprintf(fname, size, "%s/%s", dir, "sel");
         saveOTSelections(fname, selections, num_eval_inputs);
         (void) snprintf(fname, size, "%s/%s", dir, "lbl");
@@ -286,21 +585,71 @@ evaluator_offline(char *dir, int num_eval_inputs, int nchains,
         free(fname);
     }
 
+    if (batch.hdr.n > 0
+        && evaluatorBatchFinish(&batch, conn, &gcPool) == FAILURE)
+        exit(EXIT_FAILURE);
+    gcPoolClose(&gcPool);
+
     end = current_time_();
-    fprintf(stderr, "evaluator offline: %llu\n", (end - start));
+    fprintf(stderr, "evaluator offline: %" PRIu64 " (recv %" PRIu64
+            ", save %" PRIu64 ")\n",
+            (end - start), batch.recvTime, batch.saver.busy);
 
-    close(sockfd);
+    net_conn_close(conn);
     state_cleanup(&state);
 }
 
-static void 
-loadChainedGarbledCircuits(ChainedGarbledCircuit *cgc, int ncgcs, char *dir,
-                           ChainingType chainingType) 
+static void *
+evaluatorPoolRefillerThread(void *arg)
 {
-    /* Loads chained garbled circuits from disk, assuming the loader is the evaluator */
-    for (int i = 0; i < ncgcs; ++i) {
-        loadChainedGC(&cgc[i], dir, i, false, chainingType);
+    GCPoolRefiller *r = arg;
+    struct net_conn *conn;
+    EvaluatorBatch batch;
+    GCPool pool;
+    int fd = FAILURE;
+
+    /* the garbler's refiller refuses SIMD chaining too */
+    if (r->chainingType == CHAINING_TYPE_SIMD)
+        return NULL;
+    if (gcPoolOpen(&pool, r->dir, false) == FAILURE)
+        return NULL;
+
+    /* the garbler's refiller may not be listening yet */
+    for (int tries = 0; tries < 50 && !gcPoolRefillerWait(r, 0); ++tries) {
+        if ((fd = net_init_client(HOST, net_port(NET_PORT_GC_POOL))) != FAILURE)
+            break;
+        (void) usleep(100 * 1000);
+    }
+    if (fd == FAILURE || (conn = net_conn_new(fd)) == NULL) {
+        fprintf(stderr, "GC pool: could not connect refill connection\n");
+        if (fd != FAILURE)
+            (void) close(fd);
+        gcPoolClose(&pool);
+        return NULL;
+    }
+    net_conn_set_phase(conn, NET_PHASE_OFFLINE);
+
+    for (;;) {
+        if (evaluatorBatchStart(&batch, conn, r->dir, r->chainingType) == FAILURE
+            || (batch.hdr.n > 0
+                && evaluatorBatchFinish(&batch, conn, &pool) == FAILURE)) {
+            fprintf(stderr, "GC pool: refill failed\n");
+            break;
+        }
+        if (batch.hdr.n == 0)
+            break;
     }
+
+    net_conn_close(conn);
+    gcPoolClose(&pool);
+    return NULL;
+}
+
+int
+evaluator_pool_refiller_start(GCPoolRefiller *r, const char *dir,
+                              ChainingType chainingType)
+{
+    return gcPoolRefillerStart(r, dir, chainingType, evaluatorPoolRefillerThread);
 }
 
 static void
@@ -317,6 +666,253 @@ loadOTPreprocessing(block **eval_labels, int **corrections, char *dir)
     *eval_labels = loadOTLabels(fname);
 }
 
+/*
+ * Loader thread of a session: opens the OT preprocessing, then loads the
+ * components of session->loadOrder each time a query posts fresh ones; see
+ * evaluatorLoadComponents
+ */
+static void *
+evaluatorLoaderThread(void *arg)
+{
+    EvaluatorSession *session = arg;
+    bool failed = false;
+    uint64_t gen = 0;
+
+    if (ot_pool_size > 0) {
+        if (otpool_open(&session->pool, session->dir, false) == FAILURE)
+            failed = true;
+        else
+            session->usePool = true;
+    } else {
+        loadOTPreprocessing(&session->otLabels, &session->otSelections,
+                            session->dir);
+    }
+
+    pthread_mutex_lock(&session->lock);
+    __atomic_store_n(&session->otReady, true, __ATOMIC_RELEASE);
+    session->loadFailed |= failed;
+    for (;;) {
+        session->loaderIdle = true;
+        pthread_cond_broadcast(&session->cond);
+        while (session->loadGen == gen && !session->stopLoading)
+            pthread_cond_wait(&session->cond, &session->lock);
+        if (session->stopLoading)
+            break;
+        gen = session->loadGen;
+        pthread_mutex_unlock(&session->lock);
+
+        for (int k = 0; k < session->nload && !failed; ++k) {
+            int idx = session->loadOrder[k];
+            int id = session->componentIds[idx];
+            ChainedGarbledCircuit *cgc = &session->chained_gcs[idx];
+
+            if (__atomic_load_n(&session->stopLoading, __ATOMIC_RELAXED)
+                || __atomic_load_n(&session->pauseLoading, __ATOMIC_RELAXED))
+                break;
+            /* components of earlier queries are used up */
+            if (cgc->archive == NULL || cgc->id != id) {
+                if (cgc->archive)
+                    freeChainedGarbledCircuit(cgc, false, session->chainingType);
+                if (loadChainedGC(cgc, session->dir, session->componentBatches[idx],
+                                  id, false, session->chainingType) == FAILURE)
+                    failed = true;
+            }
+            pthread_mutex_lock(&session->lock);
+            __atomic_store_n(&session->loaded[idx], !failed, __ATOMIC_RELEASE);
+            session->loadFailed |= failed;
+            pthread_cond_broadcast(&session->cond);
+            pthread_mutex_unlock(&session->lock);
+        }
+        pthread_mutex_lock(&session->lock);
+    }
+    pthread_mutex_unlock(&session->lock);
+    return NULL;
+}
+
+/*
+ * Stops the loader after the component it is loading and waits until it is
+ * idle, so that the session's components can be replaced
+ */
+static void
+evaluatorPauseLoader(EvaluatorSession *session)
+{
+    pthread_mutex_lock(&session->lock);
+    __atomic_store_n(&session->pauseLoading, true, __ATOMIC_RELAXED);
+    while (!session->loaderIdle)
+        pthread_cond_wait(&session->cond, &session->lock);
+    __atomic_store_n(&session->pauseLoading, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&session->lock);
+}
+
+/* hands the components of a new query to the paused loader */
+static void
+evaluatorLoadComponents(EvaluatorSession *session)
+{
+    pthread_mutex_lock(&session->lock);
+    for (int k = 0; k < session->ncomponents; ++k)
+        __atomic_store_n(&session->loaded[k], false, __ATOMIC_RELEASE);
+    session->loadGen++;
+    session->loaderIdle = false;
+    pthread_cond_broadcast(&session->cond);
+    pthread_mutex_unlock(&session->lock);
+}
+
+/* waits until '*ready' is set by the loader */
+static int
+evaluatorWaitLoader(EvaluatorSession *session, const bool *ready)
+{
+    uint64_t start;
+    int res;
+
+    if (__atomic_load_n(ready, __ATOMIC_ACQUIRE))
+        return SUCCESS;
+    start = current_time_();
+    pthread_mutex_lock(&session->lock);
+    while (!*ready && !session->loadFailed)
+        pthread_cond_wait(&session->cond, &session->lock);
+    res = *ready ? SUCCESS : FAILURE;
+    pthread_mutex_unlock(&session->lock);
+    /* several evaluation threads may wait */
+    (void) __atomic_fetch_add(&session->loadWait, current_time_() - start,
+                              __ATOMIC_RELAXED);
+    if (res == FAILURE)
+        fprintf(stderr, "Could not load the evaluator's preprocessing\n");
+    return res;
+}
+
+static int
+evaluatorWaitComponent(EvaluatorSession *session, int idx)
+{
+    return evaluatorWaitLoader(session, &session->loaded[idx]);
+}
+
+static void
+evaluatorStopLoader(EvaluatorSession *session)
+{
+    if (!session->loaderStarted)
+        return;
+    pthread_mutex_lock(&session->lock);
+    session->stopLoading = true;
+    pthread_cond_broadcast(&session->cond);
+    pthread_mutex_unlock(&session->lock);
+    (void) pthread_join(session->loader, NULL);
+    pthread_cond_destroy(&session->cond);
+    pthread_mutex_destroy(&session->lock);
+    session->loaderStarted = false;
+}
+
+/*
+ * Shape of the component used for circuit 'circId' of the instructions, or
+ * NULL if the mapping does not use it; every query's components have the
+ * first one's shapes
+ */
+static const GCArchiveEntry *
+evaluatorComponentEntry(const EvaluatorSession *session, int circId)
+{
+    int idx;
+
+    if (circId <= 0 || circId >= session->mappingSize)
+        return NULL;
+    idx = session->circuitMapping[circId];
+    if (idx < 0 || idx >= session->ncomponents)
+        return NULL;
+    return &session->shapes[idx];
+}
+
+/*
+ * Receives the ids of the components the garbler reserved for a query, marks
+ * them consumed in the pool and maps their archives, in place of those of
+ * the previous query.  The loader must be paused.
+ */
+static int
+evaluatorRecvComponents(EvaluatorSession *session)
+{
+    int n = session->ncomponents;
+
+    if (net_conn_recv(session->conn, session->componentIds,
+                      sizeof(int) * n) == FAILURE)
+        return FAILURE;
+    if (gcPoolConsume(&session->gcPool, session->componentIds, n) == FAILURE)
+        return FAILURE;
+    for (int k = 0; k < n; ++k) {
+        if (session->archives[k])
+            gcArchivePut(session->archives[k]);
+        session->archives[k] = NULL;
+        if (gcPoolLookup(&session->gcPool, session->componentIds[k],
+                         &session->componentBatches[k], NULL) == FAILURE
+            || (session->archives[k] = gcArchiveGet(session->dir,
+                                                    session->componentBatches[k])) == NULL)
+            return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Checks that the components of a query have the shapes of those of the
+ * first query, which the label buffers and the plan were made for
+ */
+static int
+evaluatorCheckComponents(EvaluatorSession *session, bool first)
+{
+    for (int k = 0; k < session->ncomponents; ++k) {
+        const GCArchiveEntry *e =
+            gcArchiveFind(session->archives[k], session->componentIds[k]);
+
+        if (e == NULL)
+            return FAILURE;
+        if (first) {
+            session->shapes[k] = *e;
+        } else if (e->type != session->shapes[k].type
+                   || e->n != session->shapes[k].n
+                   || e->m != session->shapes[k].m) {
+            fprintf(stderr, "Component %d does not match the session's\n",
+                    session->componentIds[k]);
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Decides which components to load and in which order: those the circuit
+ * mapping references, the ones evaluated first first
+ */
+static void
+evaluatorRequestComponents(EvaluatorSession *session)
+{
+    const Instructions *instr = &session->instructions;
+    int *order;
+    bool *requested;
+    int n = 0;
+
+    order = malloc(sizeof(int) * session->ncomponents);
+    requested = calloc(session->ncomponents, sizeof(bool));
+    for (int i = 0; i < instr->size; ++i) {
+        int circId, idx;
+        if (instr->instr[i].type != EVAL)
+            continue;
+        circId = instr->instr[i].ev.circId;
+        if (circId <= 0 || circId >= session->mappingSize)
+            continue;           /* see evaluatorCheckInstructions */
+        idx = session->circuitMapping[circId];
+        if (!requested[idx]) {
+            requested[idx] = true;
+            order[n++] = idx;
+        }
+    }
+    for (int i = 1; i < session->mappingSize; ++i) {
+        int idx = session->circuitMapping[i];
+        if (!requested[idx]) {
+            requested[idx] = true;
+            order[n++] = idx;
+        }
+    }
+    free(requested);
+
+    session->loadOrder = order;
+    session->nload = n;
+}
+
 static int
 computeOutputs(const OutputInstructions *ois, int *output,
                block **computed_outputmap)
@@ -359,163 +955,765 @@ computeOutputs(const OutputInstructions *ois, int *output,
     return SUCCESS;
 }
 
+/*
+ * Checks that every circuit and wire range the instructions name exists in
+ * the session's components, so that neither the plan nor the interpreter
+ * can go out of bounds
+ */
+static int
+evaluatorCheckInstructions(const EvaluatorSession *session)
+{
+    const Instructions *instructions = &session->instructions;
+    int i;
+
+    for (i = 0; i < instructions->size; ++i) {
+        const Instruction *cur = &instructions->instr[i];
+        const GCArchiveEntry *from, *to;
+
+        switch (cur->type) {
+        case EVAL:
+            if (evaluatorComponentEntry(session, cur->ev.circId) == NULL)
+                goto bad;
+            break;
+        case CHAIN:
+            to = evaluatorComponentEntry(session, cur->ch.toCircId);
+            from = evaluatorComponentEntry(session, cur->ch.fromCircId);
+            if (to == NULL || cur->ch.wireDist < 0 || cur->ch.toWireId < 0
+                || cur->ch.fromWireId < 0 || cur->ch.offsetIdx < 0
+                || cur->ch.toWireId + cur->ch.wireDist > (int) to->n
+                || (cur->ch.fromCircId != 0
+                    && (from == NULL
+                        || cur->ch.fromWireId + cur->ch.wireDist > (int) from->m)))
+                goto bad;
+            break;
+        default:
+            goto bad;
+        }
+    }
+    return SUCCESS;
+bad:
+    fprintf(stderr, "Bad instruction %d\n", i);
+    return FAILURE;
+}
+
+/*
+ * Checks the chains against what a query sent for them: 'noffsets' offsets,
+ * and 'ninputs' input labels.  A chain from the inputs and a SIMD chain take
+ * one offset, any other chain one per wire.
+ */
+static int
+evaluatorCheckQuery(const EvaluatorSession *session, int noffsets, int ninputs)
+{
+    const Instructions *instructions = &session->instructions;
+
+    if (noffsets < 0) {
+        fprintf(stderr, "Bad number of offsets %d\n", noffsets);
+        return FAILURE;
+    }
+    for (int i = 0; i < instructions->size; ++i) {
+        const ChainInstruction *ch = &instructions->instr[i].ch;
+        int nused;
+
+        if (instructions->instr[i].type != CHAIN)
+            continue;
+        if (ch->fromCircId == 0 || session->chainingType == CHAINING_TYPE_SIMD)
+            nused = 1;
+        else
+            nused = ch->wireDist;
+        if (ch->offsetIdx > noffsets - nused
+            || (ch->fromCircId == 0
+                && ch->fromWireId > ninputs - ch->wireDist)) {
+            fprintf(stderr, "Instruction %d does not fit the query\n", i);
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+static void
+evaluatorFreePlan(EvaluatorPlan *plan)
+{
+    workpool_dag_destroy(&plan->graph);
+    free(plan->gcs);
+    free(plan->loaded);
+    free(plan->inputs);
+    free(plan->outputs);
+    free(plan->chainStart);
+    free(plan->chainKind);
+    free(plan->chainTo);
+    free(plan->chainFrom);
+    free(plan->chainSource);
+    free(plan->chainFromWire);
+    free(plan->chainLen);
+    free(plan->chainOffsetIdx);
+    free(plan->circOutputs);
+    free(plan->scratch);
+    memset(plan, '\0', sizeof *plan);
+}
+
+/*
+ * Compiles the session's instructions into its plan; see EvaluatorPlan.
+ * Fails if the instructions depend on their order beyond what the plan
+ * keeps, in which case they are to be interpreted.
+ */
+static int
+evaluatorCompilePlan(EvaluatorSession *session)
+{
+    EvaluatorPlan *plan = &session->plan;
+    const Instruction *instr = session->instructions.instr;
+    int ncircs = session->num_chained_gcs + 1;
+    block **inputs;
+    EvaluatorDag dag;
+    size_t nblocks = 0;
+    int k = 0;
+
+    memset(plan, '\0', sizeof *plan);
+    if (evaluatorBuildDag(&dag, &session->instructions) == FAILURE)
+        return FAILURE;
+
+    /* the labels of all the circuits, inputs then outputs of each */
+    for (int c = 1; c < session->mappingSize; ++c) {
+        const GCArchiveEntry *e = evaluatorComponentEntry(session, c);
+        nblocks += e->n + e->m;
+    }
+    plan->scratch = garble_allocate_blocks(nblocks > 0 ? nblocks : 1);
+    plan->circOutputs = calloc(ncircs, sizeof plan->circOutputs[0]);
+    inputs = calloc(ncircs, sizeof inputs[0]);
+    if (plan->scratch == NULL || plan->circOutputs == NULL || inputs == NULL)
+        goto fail;
+    memset(plan->scratch, '\0', nblocks * sizeof(block));
+    nblocks = 0;
+    for (int c = 1; c < session->mappingSize; ++c) {
+        const GCArchiveEntry *e = evaluatorComponentEntry(session, c);
+        inputs[c] = &plan->scratch[nblocks];
+        plan->circOutputs[c] = &plan->scratch[nblocks + e->n];
+        nblocks += e->n + e->m;
+    }
+
+    plan->nsteps = dag.graph.n;
+    plan->nchains = dag.chainStart[dag.graph.n] + dag.ntail;
+    plan->gcs = malloc((plan->nsteps + 1) * sizeof plan->gcs[0]);
+    plan->loaded = malloc((plan->nsteps + 1) * sizeof plan->loaded[0]);
+    plan->inputs = malloc((plan->nsteps + 1) * sizeof plan->inputs[0]);
+    plan->outputs = malloc((plan->nsteps + 1) * sizeof plan->outputs[0]);
+    plan->chainStart = malloc((plan->nsteps + 2) * sizeof plan->chainStart[0]);
+    plan->chainKind = malloc((plan->nchains + 1) * sizeof plan->chainKind[0]);
+    plan->chainTo = malloc((plan->nchains + 1) * sizeof plan->chainTo[0]);
+    plan->chainFrom = malloc((plan->nchains + 1) * sizeof plan->chainFrom[0]);
+    plan->chainSource = malloc((plan->nchains + 1) * sizeof plan->chainSource[0]);
+    plan->chainFromWire = malloc((plan->nchains + 1) * sizeof plan->chainFromWire[0]);
+    plan->chainLen = malloc((plan->nchains + 1) * sizeof plan->chainLen[0]);
+    plan->chainOffsetIdx = malloc((plan->nchains + 1) * sizeof plan->chainOffsetIdx[0]);
+    if (plan->gcs == NULL || plan->loaded == NULL || plan->inputs == NULL
+        || plan->outputs == NULL || plan->chainStart == NULL
+        || plan->chainKind == NULL || plan->chainTo == NULL
+        || plan->chainFrom == NULL || plan->chainSource == NULL
+        || plan->chainFromWire == NULL || plan->chainLen == NULL
+        || plan->chainOffsetIdx == NULL)
+        goto fail;
+
+    /* the chains of each step, then the tail */
+    for (int s = 0; s <= plan->nsteps; ++s) {
+        int lo = s < plan->nsteps ? dag.chainStart[s] : 0;
+        int hi = s < plan->nsteps ? dag.chainStart[s + 1] : dag.ntail;
+
+        plan->chainStart[s] = k;
+        for (int j = lo; j < hi; ++j, ++k) {
+            const ChainInstruction *ch =
+                &instr[s < plan->nsteps ? dag.chains[j] : dag.tail[j]].ch;
+
+            plan->chainTo[k] = &inputs[ch->toCircId][ch->toWireId];
+            plan->chainFromWire[k] = ch->fromWireId;
+            plan->chainLen[k] = ch->wireDist;
+            plan->chainOffsetIdx[k] = ch->offsetIdx;
+            plan->chainSource[k] = NULL;
+            if (ch->fromCircId == 0) {
+                plan->chainKind[k] = PLAN_CHAIN_INPUT;
+                plan->chainFrom[k] = NULL;
+            } else {
+                plan->chainFrom[k] =
+                    &plan->circOutputs[ch->fromCircId][ch->fromWireId];
+                if (session->chainingType == CHAINING_TYPE_SIMD) {
+                    plan->chainKind[k] = PLAN_CHAIN_SIMD;
+                    /* its offsets are only there once it is loaded */
+                    plan->chainSource[k] = &session->chained_gcs[
+                        session->circuitMapping[ch->fromCircId]];
+                } else {
+                    plan->chainKind[k] = PLAN_CHAIN_WIRES;
+                }
+            }
+        }
+    }
+    plan->chainStart[plan->nsteps + 1] = k;
+
+    for (int s = 0; s < plan->nsteps; ++s) {
+        int circId = instr[dag.evals[s]].ev.circId;
+        int idx = session->circuitMapping[circId];
+
+        plan->gcs[s] = &session->chained_gcs[idx].gc;
+        plan->loaded[s] = &session->loaded[idx];
+        plan->inputs[s] = inputs[circId];
+        plan->outputs[s] = plan->circOutputs[circId];
+    }
+
+    /* the graph is all the plan keeps of the instructions */
+    plan->graph = dag.graph;
+    memset(&dag.graph, '\0', sizeof dag.graph);
+    evaluatorDestroyDag(&dag);
+    free(inputs);
+    return SUCCESS;
+
+fail:
+    evaluatorDestroyDag(&dag);
+    free(inputs);
+    evaluatorFreePlan(plan);
+    return FAILURE;
+}
+
+/* runs the chains k of the plan with lo <= k < hi */
+static void
+planChains(const EvaluatorPlan *plan, int lo, int hi, const block *inputs,
+           const block *offsets)
+{
+    for (int k = lo; k < hi; ++k) {
+        block *to = plan->chainTo[k];
+        int len = plan->chainLen[k];
+
+        switch (plan->chainKind[k]) {
+        case PLAN_CHAIN_INPUT:
+            xorLabelsWith(to, &inputs[plan->chainFromWire[k]],
+                          offsets[plan->chainOffsetIdx[k]], len);
+            break;
+        case PLAN_CHAIN_WIRES:
+            xorLabels(to, plan->chainFrom[k], &offsets[plan->chainOffsetIdx[k]],
+                      len);
+            break;
+        case PLAN_CHAIN_SIMD:
+            xorLabels(to, plan->chainFrom[k],
+                      &plan->chainSource[k]->offlineChainingOffsets[plan->chainFromWire[k]],
+                      len);
+            xorLabelsWith(to, to, offsets[plan->chainOffsetIdx[k]], len);
+            break;
+        }
+    }
+}
+
+/* one query's view of a plan */
+typedef struct {
+    const EvaluatorPlan *plan;
+    const block *inputs;
+    const block *offsets;
+    EvaluatorSession *session;
+} PlanRun;
+
+static int
+planStep(int s, int worker, void *arg)
+{
+    const PlanRun *r = arg;
+    const EvaluatorPlan *plan = r->plan;
+
+    (void) worker;
+    planChains(plan, plan->chainStart[s], plan->chainStart[s + 1], r->inputs,
+               r->offsets);
+    if (evaluatorWaitLoader(r->session, plan->loaded[s]) == FAILURE)
+        return FAILURE;
+    garble_eval(plan->gcs[s], plan->inputs[s], plan->outputs[s], NULL);
+    return SUCCESS;
+}
+
+/*
+ * Executes the session's plan on the labels of the input component, filling
+ * plan->circOutputs
+ */
+static int
+evaluatorRunPlan(EvaluatorSession *session, block *inputs, const block *offsets)
+{
+    EvaluatorPlan *plan = &session->plan;
+    PlanRun run = { plan, inputs, offsets, session };
+
+    plan->circOutputs[0] = inputs;
+    if (session->useWorkers) {
+        if (workpool_run_dag(&session->workers, &plan->graph, planStep,
+                             &run) == FAILURE)
+            return FAILURE;
+    } else {
+        for (int s = 0; s < plan->nsteps; ++s) {
+            if (planStep(s, 0, &run) == FAILURE)
+                return FAILURE;
+        }
+    }
+    planChains(plan, plan->chainStart[plan->nsteps],
+               plan->chainStart[plan->nsteps + 1], inputs, offsets);
+    return SUCCESS;
+}
+
+/*
+ * Takes the components the garbler announced for a query and hands them to
+ * the loader.  With the first query's come the instructions, which are then
+ * checked against them and compiled.
+ */
+static int
+evaluatorTakeComponents(EvaluatorSession *session)
+{
+    bool first = session->instructions.instr == NULL;
+
+    evaluatorPauseLoader(session);
+    if (evaluatorRecvComponents(session) == FAILURE
+        || evaluatorCheckComponents(session, first) == FAILURE)
+        return FAILURE;
+
+    if (first) {
+        Instructions *instr = &session->instructions;
+
+        net_conn_set_phase(session->conn, NET_PHASE_SETUP);
+        net_conn_tag(session->conn, NET_CAT_INSTRUCTIONS);
+        if (net_conn_recv(session->conn, &instr->size, sizeof(int)) == FAILURE
+            || instr->size < 0)
+            return FAILURE;
+        instr->instr = calloc(instr->size > 0 ? instr->size : 1,
+                              sizeof(Instruction));
+        if (net_conn_recv_compressed(session->conn, instr->instr,
+                                     instr->size * sizeof(Instruction)) == FAILURE)
+            return FAILURE;
+        net_conn_set_phase(session->conn, NET_PHASE_ONLINE);
+
+        evaluatorRequestComponents(session);
+        if (evaluatorCheckInstructions(session) == FAILURE)
+            return FAILURE;
+        /* label buffers are sized from the archives' indexes, not the
+         * loaded components */
+        session->usePlan = evaluatorCompilePlan(session) == SUCCESS;
+        if (!session->usePlan) {
+            fprintf(stderr, "Instructions depend on their order, interpreting "
+                    "them in order\n");
+            for (int i = 1; i < session->mappingSize; i++) {
+                session->labels[i] =
+                    garble_allocate_blocks(evaluatorComponentEntry(session, i)->n);
+            }
+        }
+    }
+
+    evaluatorLoadComponents(session);
+    return SUCCESS;
+}
+
 int
-evaluator_online(char *dir, const int *eval_inputs, int num_eval_inputs,
-                 int num_chained_gcs, ChainingType chainingType,
-                 uint64_t *tot_time, uint64_t *tot_time_no_load, 
-                 ChainedGarbledCircuit *chained_gcs)
+evaluator_check_plan(ChainedGarbledCircuit *chained_gcs, int ncomponents,
+                     const Instructions *instructions,
+                     const int *circuitMapping, int mappingSize,
+                     ChainingType chainingType, block *inputs,
+                     const block *offsets, int nthreads)
 {
-    /* Performs the online stage of the evaluator.
-     * The first part of the function loads data from disk
-     * that was saved during the online phase. 
-     * Next, perform OT correction to acquire input labels
-     * corresponding to the evaluators' inputs.
-     * Next, receive instructions on how to evaluate and chain 
-     * the garbled circuits.
-     * Next, receive garbler labels and the output instructions.
-     * The output instructions are unary gates mapping output labels to 0 or 1.
-     * Next, we call evaluator_evaluate to evaluate the garbled circuits using 
-     * the information acquired.
-     * Finally, use the output instructions to process the output of the 
-     * evaluation subprocedure to acquire actual bits of the output.
+    /* Evaluates the instructions on components already in memory, once in
+     * order and once through a compiled plan run on nthreads workers, and
+     * fails unless both give every circuit the same output labels.
+     */
+    EvaluatorSession session;
+    block *labels[mappingSize], *outputs[mappingSize];
+    int res = FAILURE;
+
+    memset(&session, '\0', sizeof session);
+    memset(labels, '\0', sizeof labels);
+    memset(outputs, '\0', sizeof outputs);
+    session.chained_gcs = chained_gcs;
+    session.num_chained_gcs = ncomponents;
+    session.ncomponents = ncomponents;
+    session.chainingType = chainingType;
+    session.instructions = *instructions;
+    session.circuitMapping = (int *) circuitMapping;
+    session.mappingSize = mappingSize;
+    session.shapes = calloc(ncomponents, sizeof session.shapes[0]);
+    session.loaded = malloc(ncomponents * sizeof session.loaded[0]);
+    if (session.shapes == NULL || session.loaded == NULL)
+        goto cleanup;
+    for (int k = 0; k < ncomponents; ++k) {
+        session.shapes[k].type = chained_gcs[k].type;
+        session.shapes[k].n = chained_gcs[k].gc.n;
+        session.shapes[k].m = chained_gcs[k].gc.m;
+        session.loaded[k] = true;
+    }
+    if (nthreads > 1) {
+        if (workpool_init(&session.workers, nthreads) == FAILURE)
+            goto cleanup;
+        session.useWorkers = true;
+    }
+    if (evaluatorCheckInstructions(&session) == FAILURE
+        || evaluatorCompilePlan(&session) == FAILURE)
+        goto cleanup;
+    session.usePlan = true;
+
+    labels[0] = outputs[0] = inputs;
+    for (int c = 1; c < mappingSize; ++c) {
+        const GCArchiveEntry *e = evaluatorComponentEntry(&session, c);
+        labels[c] = garble_allocate_blocks(e->n);
+        outputs[c] = garble_allocate_blocks(e->m);
+        memset(labels[c], '\0', e->n * sizeof(block));
+    }
+    if (evaluator_evaluate(chained_gcs, ncomponents, instructions, labels,
+                           circuitMapping, outputs, offsets, chainingType,
+                           NULL) == FAILURE
+        || evaluatorRunPlan(&session, inputs, offsets) == FAILURE)
+        goto cleanup;
+
+    res = SUCCESS;
+    for (int c = 1; c < mappingSize; ++c) {
+        const GCArchiveEntry *e = evaluatorComponentEntry(&session, c);
+        if (memcmp(outputs[c], session.plan.circOutputs[c],
+                   e->m * sizeof(block)) != 0)
+            res = FAILURE;
+    }
+
+cleanup:
+    for (int c = 1; c < mappingSize; ++c) {
+        free(labels[c]);
+        free(outputs[c]);
+    }
+    if (session.usePlan)
+        evaluatorFreePlan(&session.plan);
+    if (session.useWorkers)
+        workpool_destroy(&session.workers);
+    free(session.shapes);
+    free(session.loaded);
+    return res;
+}
+
+int
+evaluator_session_open(EvaluatorSession *session, char *dir, int num_eval_inputs,
+                       int num_chained_gcs, ChainingType chainingType,
+                       ChainedGarbledCircuit *chained_gcs, uint64_t *load_time)
+{
+    /* Connects to the garbler and receives the circuit mapping, which stays
+     * the same for all queries of the session.  The OT preprocessing is
+     * loaded by a loader thread meanwhile; see EvaluatorSession.
      *
-     * @param dir the director which OT and gc data are saved during the offline phase
-     * @param eval_inputs an array of the evaluator's inputs; either 0 or 1
-     * @param num_eval_inputs the length of the eval_inputs array
-     * @param num_chained_gcs the number of garbled circuits saved to disk.
-     * @param chainingType indicates whether to do standard or SIMD-style chaining.
-     *        WARNING: SIMD-style chaining is deprecated.
-     * @param tot_time an unpopulated int* (of length 1). evaluator_online populates
-     *        value with the total amount of time it took to evaluate.
-     * @param tot_time_no_load an unpopulated int* (of length 1). evaluator_online populates
-     *        value with the total amount of time it took to evaluate, not including 
-     *        the time to load data from disk.
+     * @param load_time if non-NULL, set to the time spent loading from disk
+     *        before the session could proceed
      */
-    FunctionSpec function;
-    block *eval_labels;
-    int *corrections = NULL, sockfd;
-    uint64_t start, end, _start, _end, loading_time;
-    int num_garb_inputs = 0; /* later received from garbler */
-    size_t tmp;
+    uint64_t _start;
 
-    block *labels[num_chained_gcs + 1];
+    memset(session, '\0', sizeof *session);
+    session->dir = dir;
+    session->chained_gcs = chained_gcs;
+    session->num_chained_gcs = num_chained_gcs;
+    session->num_eval_inputs = num_eval_inputs;
+    session->chainingType = chainingType;
 
+    /* start loading before even connecting */
     _start = current_time_();
-    {
-        loadChainedGarbledCircuits(chained_gcs, num_chained_gcs, dir, chainingType);
-        loadOTPreprocessing(&eval_labels, &corrections, dir);
-        for (int i = 1; i < num_chained_gcs + 1; i++) {
-            labels[i] = garble_allocate_blocks(chained_gcs[i-1].gc.n);
-        }
+    if (gcPoolOpen(&session->gcPool, dir, false) == FAILURE)
+        return FAILURE;
+    session->loaded = calloc(num_chained_gcs, sizeof(bool));
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->cond, NULL);
+    if (pthread_create(&session->loader, NULL, evaluatorLoaderThread,
+                       session) != 0) {
+        perror("pthread_create");
+        return FAILURE;
+    }
+    session->loaderStarted = true;
+    session->loadWait = current_time_() - _start;
+    if (evaluator_threads > 1) {
+        if (workpool_init(&session->workers, evaluator_threads) == FAILURE)
+            return FAILURE;
+        session->useWorkers = true;
     }
-    _end = current_time_();
-    loading_time = _end - _start;
 
-    if ((sockfd = net_init_client(HOST, PORT)) == FAILURE) {
+    if ((session->sockfd = net_init_client(HOST, net_port(NET_PORT_MAIN))) == FAILURE) {
         perror("net_init_client");
-        exit(EXIT_FAILURE);
+        return FAILURE;
     }
+    if ((session->conn = net_conn_new(session->sockfd)) == NULL) {
+        perror("net_conn_new");
+        close(session->sockfd);
+        return FAILURE;
+    }
+    net_conn_set_phase(session->conn, NET_PHASE_SETUP);
+    net_conn_tag(session->conn, NET_CAT_CONTROL);
+    {
+        int n;
 
-    /* Receive instructions */
-    (void) net_recv(sockfd, &function.instructions.size, sizeof(int), 0);
-    function.instructions.instr = calloc(function.instructions.size, sizeof(Instruction));
-    net_recv_compressed(sockfd, function.instructions.instr, function.instructions.size * sizeof(Instruction), 0);
+        if (net_conn_recv(session->conn, &n, sizeof n) == FAILURE)
+            return FAILURE;
+        if (n < 0 || n > num_chained_gcs) {
+            fprintf(stderr, "Bad number of components %d\n", n);
+            return FAILURE;
+        }
+        session->ncomponents = n;
+        session->componentIds = malloc(sizeof(int) * n);
+        session->componentBatches = malloc(sizeof(int) * n);
+        session->archives = calloc(n, sizeof session->archives[0]);
+        session->shapes = calloc(n, sizeof session->shapes[0]);
+    }
 
     /* Receive circuitMapping */
-    int size;
-    (void) net_recv(sockfd, &size, sizeof(int), 0);
-    int circuitMapping[size];
-    (void) net_recv_compressed(sockfd, circuitMapping, sizeof(int) * size, 0);
+    net_conn_tag(session->conn, NET_CAT_MAPPING);
+    {
+        int size;
+        (void) net_conn_recv(session->conn, &size, sizeof(int));
+        if (size < 1 || size > session->ncomponents + 1) {
+            fprintf(stderr, "Bad circuit mapping size %d\n", size);
+            return FAILURE;
+        }
+        session->circuitMapping = malloc(sizeof(int) * size);
+        session->mappingSize = size;
+        if (net_conn_recv_compressed(session->conn, session->circuitMapping,
+                                     sizeof(int) * size) == FAILURE)
+            return FAILURE;
+        for (int i = 1; i < size; ++i) {
+            if (session->circuitMapping[i] < 0
+                || session->circuitMapping[i] >= session->ncomponents) {
+                fprintf(stderr, "Bad circuit mapping entry %d\n", i);
+                return FAILURE;
+            }
+        }
+    }
+    session->labels = calloc(num_chained_gcs + 1, sizeof session->labels[0]);
 
-    /* *************************** */
-    /* Actually start timing here! */
-    /* *************************** */
+    if (load_time)
+        *load_time = session->loadWait;
+    return SUCCESS;
+}
+
+int
+evaluator_session_query(EvaluatorSession *session, const int *eval_inputs,
+                        bool last, uint64_t *query_time)
+{
+    /* Runs one online execution on the fresh components the garbler
+     * announces for it: OT correction to acquire the input labels
+     * corresponding to the evaluator's inputs, then receives the garbler's
+     * labels, the output instructions and the offsets, evaluates, and uses
+     * the output instructions to recover the output bits.
+     *
+     * @param last whether this is the last query of the session
+     */
+    struct net_conn *conn = session->conn;
+    int num_eval_inputs = session->num_eval_inputs;
+    int num_chained_gcs = session->num_chained_gcs;
+    ChainedGarbledCircuit *chained_gcs = session->chained_gcs;
+    block **labels = session->labels;
+    SessionHeader hdr;
+    int res;
+    block *eval_labels;
+    int *corrections;
+    int num_garb_inputs = 0; /* later received from garbler */
+    uint64_t start, end;
+
+    if (session->ended)
+        return FAILURE;
 
     start = current_time_();
-    g_bytes_sent = g_bytes_received = 0;
+    net_conn_set_phase(conn, NET_PHASE_ONLINE);
+    net_conn_tag(conn, NET_CAT_CONTROL);
+
+    /* Ask for the query; the garbler announces it with the preprocessed OTs
+     * to use */
+    hdr.magic = SESSION_MAGIC;
+    hdr.type = last ? SESSION_LAST : SESSION_QUERY;
+    hdr.seq = session->seq;
+    hdr.otOffset = 0;
+    if (net_conn_send(conn, &hdr, sizeof hdr) == FAILURE)
+        return FAILURE;
+    session->ended = last;
+    if (net_conn_recv(conn, &hdr, sizeof hdr) == FAILURE
+        || hdr.magic != SESSION_MAGIC || hdr.type != SESSION_QUERY
+        || hdr.seq != session->seq) {
+        fprintf(stderr, "Bad session header\n");
+        return FAILURE;
+    }
+    session->seq++;
+    if (evaluatorTakeComponents(session) == FAILURE) {
+        fprintf(stderr, "Could not take the query's components\n");
+        return FAILURE;
+    }
+
+    if (evaluatorWaitLoader(session, &session->otReady) == FAILURE)
+        return FAILURE;
+    eval_labels = garble_allocate_blocks(num_eval_inputs);
+    corrections = malloc(sizeof(int) * num_eval_inputs);
+    if (session->usePool) {
+        if (otpool_read_receiver(&session->pool, hdr.otOffset, num_eval_inputs,
+                                 eval_labels, corrections) == FAILURE
+            || otpool_consume(&session->pool, hdr.otOffset, num_eval_inputs) == FAILURE) {
+            free(corrections);
+            free(eval_labels);
+            return FAILURE;
+        }
+    } else {
+        memcpy(eval_labels, session->otLabels, sizeof(block) * num_eval_inputs);
+        memcpy(corrections, session->otSelections, sizeof(int) * num_eval_inputs);
+    }
 
     /* Receive eval labels: OT correction */
     if (num_eval_inputs > 0) {
-        block recvLabels[2 * num_eval_inputs];
-        uint64_t _start, _end;
         for (int i = 0; i < num_eval_inputs; ++i) {
             assert(corrections[i] == 0 || corrections[i] == 1);
             assert(eval_inputs[i] == 0 || eval_inputs[i] == 1);
             corrections[i] ^= eval_inputs[i];
         }
-        (void) net_send(sockfd, corrections, sizeof(int) * num_eval_inputs, 0);
-        (void) net_recv(sockfd, recvLabels, sizeof recvLabels, 0);
-        for (int i = 0; i < num_eval_inputs; ++i) {
-            eval_labels[i] = garble_xor(eval_labels[i],
-                                        recvLabels[2 * i + eval_inputs[i]]);
-        }
+        net_conn_tag(conn, NET_CAT_OT);
+        (void) net_conn_send(conn, corrections, sizeof(int) * num_eval_inputs);
+        unmaskEvalLabels(conn, eval_labels, eval_inputs, num_eval_inputs);
     }
     free(corrections);
     
     /* receive garbler labels */
-    (void) net_recv(sockfd, &num_garb_inputs, sizeof(int), 0);
+    net_conn_tag(conn, NET_CAT_LABELS);
+    (void) net_conn_recv(conn, &num_garb_inputs, sizeof(int));
+    if (num_garb_inputs < 0) {
+        fprintf(stderr, "Bad number of garbler inputs\n");
+        free(eval_labels);
+        return FAILURE;
+    }
     block garb_labels[num_garb_inputs];
     if (num_garb_inputs > 0) {
-        (void) net_recv(sockfd, garb_labels, sizeof(block) * num_garb_inputs, 0);
+        (void) net_conn_recv(conn, garb_labels, sizeof(block) * num_garb_inputs);
     }
 
     /* Receive output instructions */
     OutputInstructions output_instructions;
+    net_conn_tag(conn, NET_CAT_OUTPUT);
     {
-        (void) net_recv(sockfd, &output_instructions.size, 
-                        sizeof(output_instructions.size), 0);
+        (void) net_conn_recv(conn, &output_instructions.size, 
+                             sizeof(output_instructions.size));
         output_instructions.output_instruction = 
             malloc(output_instructions.size * sizeof(OutputInstruction));
 
-        (void) net_recv(sockfd, output_instructions.output_instruction, 
-                        output_instructions.size * sizeof(OutputInstruction), 0);
+        (void) net_conn_recv(conn, output_instructions.output_instruction, 
+                             output_instructions.size * sizeof(OutputInstruction));
     }
 
     /* Receive offsets */
     int noffsets;
-    net_recv(sockfd, &noffsets, sizeof noffsets, 0);
-    block *offsets = malloc(noffsets * sizeof offsets[0]);
-    (void) net_recv(sockfd, offsets, noffsets * sizeof offsets[0], 0);
-
-    close(sockfd);
+    block *offsets = NULL;
+    net_conn_tag(conn, NET_CAT_OFFSETS);
+    net_conn_recv(conn, &noffsets, sizeof noffsets);
+    res = evaluatorCheckQuery(session, noffsets,
+                              num_garb_inputs + num_eval_inputs);
+    if (res == SUCCESS) {
+        offsets = malloc(noffsets * sizeof offsets[0]);
+        (void) net_conn_recv(conn, offsets, noffsets * sizeof offsets[0]);
+    }
 
     /* Follow instructions and evaluate */
+    block *inputLabels = garble_allocate_blocks(num_garb_inputs + num_eval_inputs);
     block *computedOutputMap[num_chained_gcs + 1];
-    {
-        computedOutputMap[0] = garble_allocate_blocks(num_garb_inputs + num_eval_inputs);
-        labels[0] = garble_allocate_blocks(num_garb_inputs + num_eval_inputs);
-        memcpy(&computedOutputMap[0][0], garb_labels, sizeof(block) * num_garb_inputs);
-        memcpy(&computedOutputMap[0][num_garb_inputs], eval_labels, sizeof(block) * num_eval_inputs);
-        memcpy(&labels[0][0], garb_labels, sizeof(block) * num_garb_inputs);
-        memcpy(&labels[0][num_garb_inputs], eval_labels, sizeof(block) * num_eval_inputs);
+    block **outputMap = computedOutputMap;
+    memcpy(&inputLabels[0], garb_labels, sizeof(block) * num_garb_inputs);
+    memcpy(&inputLabels[num_garb_inputs], eval_labels, sizeof(block) * num_eval_inputs);
+    memset(computedOutputMap, '\0', sizeof computedOutputMap);
+    if (res == FAILURE) {
+        /* nothing to evaluate */
+    } else if (session->usePlan) {
+        res = evaluatorRunPlan(session, inputLabels, offsets);
+        outputMap = session->plan.circOutputs;
+    } else {
+        computedOutputMap[0] = inputLabels;
+        labels[0] = inputLabels;
         for (int i = 1; i < num_chained_gcs + 1; i++) {
-            computedOutputMap[i] = garble_allocate_blocks(chained_gcs[i-1].gc.m);
+            const GCArchiveEntry *e = evaluatorComponentEntry(session, i);
+            computedOutputMap[i] = e ? garble_allocate_blocks(e->m) : NULL;
         }
-        evaluator_evaluate(chained_gcs, num_chained_gcs, &function.instructions,
-                           labels, circuitMapping, computedOutputMap, offsets, chainingType);
+        res = evaluator_evaluate(chained_gcs, num_chained_gcs,
+                                 &session->instructions, labels,
+                                 session->circuitMapping, computedOutputMap,
+                                 offsets, session->chainingType, session);
     }
 
     int output[output_instructions.size];
-    {
-        int res = computeOutputs(&output_instructions, output, computedOutputMap);
+    if (res == SUCCESS) {
+        res = computeOutputs(&output_instructions, output, outputMap);
         assert(res == SUCCESS);
     }
     free(output_instructions.output_instruction);
 
-    for (int i = 0; i < num_chained_gcs + 1; ++i) {
-        free(labels[i]);
+    free(inputLabels);
+    labels[0] = NULL;
+    for (int i = 1; i < num_chained_gcs + 1; ++i) {
         free(computedOutputMap[i]);
     }
     free(eval_labels);
-    free(function.instructions.instr);
-    function.instructions.instr = NULL;
     free(offsets);
 
     end = current_time_();
+    if (query_time)
+        *query_time = end - start;
+    return res;
+}
+
+void
+evaluator_session_close(EvaluatorSession *session)
+{
+    if (!session->ended) {
+        SessionHeader hdr = { SESSION_MAGIC, SESSION_END, 0, 0 };
+        net_conn_tag(session->conn, NET_CAT_CONTROL);
+        (void) net_conn_send(session->conn, &hdr, sizeof hdr);
+    }
+    net_conn_close(session->conn);
+    evaluatorStopLoader(session);
+    for (int k = 0; k < session->ncomponents; ++k) {
+        if (session->archives[k])
+            gcArchivePut(session->archives[k]);
+    }
+    free(session->archives);
+    free(session->componentIds);
+    free(session->componentBatches);
+    free(session->shapes);
+    gcPoolClose(&session->gcPool);
+    free(session->loaded);
+    free(session->loadOrder);
+
+    for (int i = 0; i < session->num_chained_gcs + 1; ++i) {
+        free(session->labels[i]);
+    }
+    free(session->labels);
+    free(session->instructions.instr);
+    if (session->usePlan)
+        evaluatorFreePlan(&session->plan);
+    if (session->useWorkers)
+        workpool_destroy(&session->workers);
+    free(session->circuitMapping);
+    free(session->otLabels);
+    free(session->otSelections);
+    if (session->usePool)
+        otpool_close(&session->pool);
+}
+
+int
+evaluator_online(char *dir, const int *eval_inputs, int num_eval_inputs,
+                 int num_chained_gcs, ChainingType chainingType,
+                 uint64_t *tot_time, uint64_t *tot_time_no_load, 
+                 ChainedGarbledCircuit *chained_gcs)
+{
+    /* Performs the online stage of the evaluator as a session of a single
+     * query; see evaluator_session_open and evaluator_session_query.
+     *
+     * @param dir the director which OT and gc data are saved during the offline phase
+     * @param eval_inputs an array of the evaluator's inputs; either 0 or 1
+     * @param num_eval_inputs the length of the eval_inputs array
+     * @param num_chained_gcs the number of garbled circuits saved to disk.
+     * @param chainingType indicates whether to do standard or SIMD-style chaining.
+     * @param tot_time an unpopulated int* (of length 1). evaluator_online populates
+     *        value with the total amount of time it took to evaluate.
+     * @param tot_time_no_load an unpopulated int* (of length 1). evaluator_online populates
+     *        value with the total amount of time it took to evaluate, not including 
+     *        the time to load data from disk.
+     */
+    EvaluatorSession session;
+    uint64_t loading_time = 0, query_time = 0, stall;
+    int res;
+
+    if (evaluator_session_open(&session, dir, num_eval_inputs, num_chained_gcs,
+                               chainingType, chained_gcs, &loading_time) == FAILURE)
+        exit(EXIT_FAILURE);
+    res = evaluator_session_query(&session, eval_inputs, true, &query_time);
+    /* what the query spent waiting for components still being loaded */
+    stall = session.loadWait - loading_time;
+    evaluator_session_close(&session);
+
     if (tot_time)
-        *tot_time = end - start + loading_time;
+        *tot_time = query_time + loading_time;
     if (tot_time_no_load)
-        *tot_time_no_load = end - start;
-    return SUCCESS;
+        *tot_time_no_load = stall < query_time ? query_time - stall : 0;
+    return res;
 }
 
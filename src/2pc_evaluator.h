@@ -2,6 +2,11 @@
 #define MPC_EVALUATOR_H
 
 #include "2pc_function_spec.h"
+#include "2pc_gc_pool.h"
+#include "net.h"
+#include "otpool.h"
+#include "workpool.h"
+#include <pthread.h>
 #include <stdint.h>
 
 void
@@ -10,8 +15,140 @@ evaluator_classic_2pc(garble_circuit *gc, const int *input, bool *output,
                       uint64_t *tot_time);
 
 void
-evaluator_offline(char *dir, int num_eval_inputs, int nchains,
-                  ChainingType chainingType);
+evaluator_offline(char *dir, int num_eval_inputs, ChainingType chainingType);
+
+/* adds the batches the garbler's refiller sends to the evaluator's pool,
+ * until the garbler's refiller stops; see GCPoolRefiller */
+int
+evaluator_pool_refiller_start(GCPoolRefiller *r, const char *dir,
+                              ChainingType chainingType);
+
+/* threads evaluating independent components in parallel online; 1 evaluates
+ * them one after the other */
+extern int evaluator_threads;
+
+/*
+ * A session's instructions compiled, once the circuit mapping is known, into
+ * a plan that each query executes.  Each step evaluates one component, after
+ * the chains that feed it, and names it and its labels by pointer, the
+ * labels of all components lying in one scratch buffer.  Chains into
+ * circuits not evaluated after them run after the last step.  With
+ * evaluator_threads > 1, the steps run along their dependency graph.
+ */
+typedef enum {
+    PLAN_CHAIN_INPUT,           /* from the inputs, one offset for the range */
+    PLAN_CHAIN_WIRES,           /* one offset per wire */
+    PLAN_CHAIN_SIMD,            /* offline chaining offsets, then one offset */
+} PlanChainKind;
+
+typedef struct {
+    /* steps */
+    int nsteps;
+    garble_circuit **gcs;
+    const bool **loaded;        /* loader flag of each step's component */
+    block **inputs;
+    block **outputs;
+    int *chainStart;            /* chains of step s start at chainStart[s],
+                                 * the tail at chainStart[nsteps] */
+    /* chains */
+    int nchains;
+    PlanChainKind *chainKind;
+    block **chainTo;
+    const block **chainFrom;    /* NULL for PLAN_CHAIN_INPUT */
+    const ChainedGarbledCircuit **chainSource; /* for PLAN_CHAIN_SIMD */
+    int *chainFromWire;
+    int *chainLen;
+    int *chainOffsetIdx;
+    /* output labels of each circuit of the instructions, 0 being the inputs */
+    block **circOutputs;
+    block *scratch;
+    struct workpool_dag graph;
+} EvaluatorPlan;
+
+/*
+ * Evaluator's end of an online session: the OT preprocessing and circuit
+ * mapping are loaded and received once, the instructions with the first
+ * query, then any number of queries run over the same connection.
+ * Components are single-use: each query runs on fresh ones the garbler
+ * reserved from the pool for it alone, which are marked consumed in the
+ * evaluator's pool before use.
+ *
+ * Loading happens on a loader thread: the OT preprocessing while the session
+ * is set up, then the components of each query as soon as the garbler
+ * announces them, only those the circuit mapping references, in the order of
+ * their first EVAL.  Evaluation waits for each component just before using
+ * it.
+ */
+typedef struct {
+    char *dir;
+    int sockfd;
+    struct net_conn *conn;
+    ChainedGarbledCircuit *chained_gcs;
+    int num_chained_gcs;
+    int num_eval_inputs;
+    ChainingType chainingType;
+    Instructions instructions;
+    int *circuitMapping;
+    int mappingSize;
+    block **labels;
+    block *otLabels;
+    int *otSelections;
+    struct otpool pool;
+    bool usePool;
+    uint64_t seq;               /* number of the next query */
+    bool ended;
+    /* components of the current query, from the pool */
+    GCPool gcPool;
+    int *componentIds;
+    int *componentBatches;
+    GCArchive **archives;       /* archive of each component */
+    GCArchiveEntry *shapes;     /* entries of the first query's components */
+    int ncomponents;
+    /* lazy loading */
+    pthread_t loader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool loaderStarted;
+    int *loadOrder;             /* components to load, by index in chained_gcs */
+    int nload;
+    uint64_t loadGen;           /* number of queries handed to the loader */
+    bool loaderIdle;
+    bool pauseLoading;
+    bool otReady;
+    bool *loaded;               /* per component of chained_gcs */
+    bool loadFailed;
+    bool stopLoading;
+    uint64_t loadWait;          /* time spent waiting on the loader */
+    EvaluatorPlan plan;
+    bool usePlan;
+    /* evaluator_threads workers running the plan, kept for the session */
+    struct workpool workers;
+    bool useWorkers;
+} EvaluatorSession;
+
+int
+evaluator_session_open(EvaluatorSession *session, char *dir, int num_eval_inputs,
+                       int num_chained_gcs, ChainingType chainingType,
+                       ChainedGarbledCircuit *chained_gcs, uint64_t *load_time);
+
+int
+evaluator_session_query(EvaluatorSession *session, const int *eval_inputs,
+                        bool last, uint64_t *query_time);
+
+void
+evaluator_session_close(EvaluatorSession *session);
+
+/*
+ * Evaluates 'instructions' on ncomponents components already in memory both
+ * in order and through a compiled plan on 'nthreads' workers, failing unless
+ * they agree on the output labels of every circuit; for the tests
+ */
+int
+evaluator_check_plan(ChainedGarbledCircuit *chained_gcs, int ncomponents,
+                     const Instructions *instructions,
+                     const int *circuitMapping, int mappingSize,
+                     ChainingType chainingType, block *inputs,
+                     const block *offsets, int nthreads);
 
 int
 evaluator_online(char *dir, const int *eval_inputs, int num_eval_inputs,
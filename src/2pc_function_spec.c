@@ -389,21 +389,15 @@ json_load_instructions(json_t *root, FunctionSpec *function, ChainingType chaini
     /* preliminary work */
     Instructions* instructions = &(function->instructions);
     InputMapping *imap = &function->input_mapping;
-    json_t *jInstructions, *jInstr, *jPtr, *jMetadata;
+    json_t *jInstructions, *jInstr, *jPtr;
     const char* sType;
-    jMetadata = json_object_get(root, "metadata");
-    jPtr = json_object_get(jMetadata, "instructions_size");
-    assert(json_is_integer(jPtr));
-    int num_instructions = json_integer_value(jPtr);
     jInstructions = json_object_get(root, "instructions");
     assert(json_is_array(jInstructions));
     int loop_size = json_array_size(jInstructions); 
 
-    if (chainingType == CHAINING_TYPE_STANDARD) {
-        instructions->size = num_instructions + imap->size;
-    } else {
-        instructions->size = imap->size + loop_size;
-    }
+    /* chains stay ranges of wires, one instruction each */
+    (void) chainingType;
+    instructions->size = imap->size + loop_size;
     instructions->instr = malloc(instructions->size * sizeof(Instruction));
     assert(instructions->instr);
 
@@ -468,25 +462,13 @@ json_load_instructions(json_t *root, FunctionSpec *function, ChainingType chaini
 
                 assert(from_wire_id_end - from_wire_id_start == to_wire_id_end - to_wire_id_start);
 
-                if (chainingType == CHAINING_TYPE_STANDARD) {
-                    for (int f = from_wire_id_start, t = to_wire_id_start ; f<=from_wire_id_end; f++, t++) {
-                        // f for from, t for to
-                        instructions->instr[idx].type = CHAIN;
-                        instructions->instr[idx].ch.fromCircId = from_gc_id;
-                        instructions->instr[idx].ch.fromWireId = f;
-                        instructions->instr[idx].ch.toCircId = to_gc_id;
-                        instructions->instr[idx].ch.toWireId = t;
-                        idx++;
-                    }
-                } else { /* CHAINING_TYPE_SIMD */
-                    instructions->instr[idx].type = CHAIN;
-                    instructions->instr[idx].ch.fromCircId = from_gc_id;
-                    instructions->instr[idx].ch.fromWireId = from_wire_id_start;
-                    instructions->instr[idx].ch.toCircId = to_gc_id;
-                    instructions->instr[idx].ch.toWireId = to_wire_id_start;
-                    instructions->instr[idx].ch.wireDist = from_wire_id_end - from_wire_id_start + 1;
-                    idx++;
-                }
+                instructions->instr[idx].type = CHAIN;
+                instructions->instr[idx].ch.fromCircId = from_gc_id;
+                instructions->instr[idx].ch.fromWireId = from_wire_id_start;
+                instructions->instr[idx].ch.toCircId = to_gc_id;
+                instructions->instr[idx].ch.toWireId = to_wire_id_start;
+                instructions->instr[idx].ch.wireDist = from_wire_id_end - from_wire_id_start + 1;
+                idx++;
                 break;
             default:
                 fprintf(stderr, "Instruction %d was invalid: %s\n", i, sType);
@@ -3,42 +3,220 @@
 #include <assert.h>
 #include <stdint.h>
 #include <math.h>  /* log2 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <openssl/rand.h>
+#include <garble/aes.h>
+#include <immintrin.h>
 
 #include "crypto.h"
 #include "utils.h"
 #include "2pc_common.h"
 #include "circuits.h"
+#include "otpool.h"
 //#include "gates.h"
 
 #include "2pc_garbled_circuit.h"
+#include "2pc_gc_pool.h"
+
+int component_slices = 1;
+int component_threads = 1;
+
+/*
+ * Per-thread AES-CTR stream that component labels are drawn from, seeded
+ * from OpenSSL on first use, so that components can be garbled on several
+ * threads at once: libgarble's generator is a single unsynchronized counter.
+ */
+static __thread struct {
+    AES_KEY key;
+    uint64_t ctr;
+    bool seeded;
+} labelPrg;
+
+void
+componentRandomBlocks(block *out, size_t n)
+{
+    if (!labelPrg.seeded) {
+        block seed;
+        if (RAND_bytes((unsigned char *) &seed, sizeof seed) != 1) {
+            fprintf(stderr, "RAND_bytes failed\n");
+            exit(EXIT_FAILURE);
+        }
+        AES_set_encrypt_key(seed, &labelPrg.key);
+        labelPrg.seeded = true;
+    }
+    for (size_t i = 0; i < n; ++i)
+        out[i] = garble_make_block((uint64_t) 0, labelPrg.ctr++);
+    AES_ecb_encrypt_blks(out, n, &labelPrg.key);
+}
+
+block
+componentRandomBlock(void)
+{
+    block b;
+    componentRandomBlocks(&b, 1);
+    return b;
+}
+
+void
+createInputLabels(block *labels, size_t n, block delta)
+{
+    componentRandomBlocks(labels, n);
+    /* spread out in place, from the back */
+    for (size_t i = n; i-- > 0;) {
+        labels[2 * i] = labels[i];
+        labels[2 * i + 1] = garble_xor(labels[i], delta);
+    }
+}
+
+/*
+ * Chaining kernels.  Labels are 128-bit blocks, so an AVX-512 register takes
+ * four and an AVX2 register two; whichever the build targets (-march=native)
+ * is used, with plain SSE for the rest.  Loads and stores are unaligned, as
+ * ranges start at any wire.
+ */
+void
+xorLabels(block *out, const block *in, const block *offsets, int n)
+{
+    int i = 0;
+
+#if defined(__AVX512F__)
+    for (; i + 4 <= n; i += 4) {
+        __m512i a = _mm512_loadu_si512((const void *) &in[i]);
+        __m512i b = _mm512_loadu_si512((const void *) &offsets[i]);
+        _mm512_storeu_si512((void *) &out[i], _mm512_xor_si512(a, b));
+    }
+#elif defined(__AVX2__)
+    for (; i + 2 <= n; i += 2) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) &in[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *) &offsets[i]);
+        _mm256_storeu_si256((__m256i *) &out[i], _mm256_xor_si256(a, b));
+    }
+#endif
+    for (; i < n; ++i)
+        out[i] = garble_xor(in[i], offsets[i]);
+}
+
+void
+xorLabelsWith(block *out, const block *in, block offset, int n)
+{
+    int i = 0;
+
+#if defined(__AVX512F__)
+    {
+        __m512i b = _mm512_broadcast_i32x4(offset);
+        for (; i + 4 <= n; i += 4) {
+            __m512i a = _mm512_loadu_si512((const void *) &in[i]);
+            _mm512_storeu_si512((void *) &out[i], _mm512_xor_si512(a, b));
+        }
+    }
+#elif defined(__AVX2__)
+    {
+        __m256i b = _mm256_broadcastsi128_si256(offset);
+        for (; i + 2 <= n; i += 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i *) &in[i]);
+            _mm256_storeu_si256((__m256i *) &out[i], _mm256_xor_si256(a, b));
+        }
+    }
+#endif
+    for (; i < n; ++i)
+        out[i] = garble_xor(in[i], offset);
+}
+
+/*
+ * Sets hashes[i] = H(i) for i = 0, ..., n - 1, using the batched fixed-key AES
+ * hash
+ */
+void
+indexHashes(block *hashes, int n)
+{
+    for (int i = 0; i < n; i++) {
+        hashes[i] = garble_make_block(0, i);
+    }
+    aes_crh(hashes, hashes, NULL, n);
+}
+
+/*
+ * Returns the free-XOR offset the first component of type 'type' in the
+ * component pool in 'dir' was garbled with
+ */
+static int
+componentPoolDelta(const char *dir, CircuitType type, block *delta)
+{
+    const GCArchiveEntry *e;
+    GCArchive *ar;
+    GCPool pool;
+    int id, batch, res = FAILURE;
+
+    if (gcPoolOpen(&pool, dir, true) == FAILURE)
+        return FAILURE;
+    if (gcPoolTemplate(&pool, type, &id) == SUCCESS
+        && gcPoolLookup(&pool, id, &batch, NULL) == SUCCESS
+        && (ar = gcArchiveGet(dir, batch)) != NULL) {
+        if ((e = gcArchiveFind(ar, id)) != NULL) {
+            memcpy(delta, e->delta, sizeof *delta);
+            res = SUCCESS;
+        }
+        gcArchivePut(ar);
+    }
+    gcPoolClose(&pool);
+    return res;
+}
+
+/*
+ * Returns the free-XOR offset to garble a new set of chained circuits with.
+ * Correlated OTs from the garbler's OT pool only work with the offset the pool
+ * was created with, and components are only chained to components garbled
+ * with the same offset, so the offset of either pool is reused if there is
+ * one.
+ */
+block
+garblerDelta(const char *dir)
+{
+    block delta;
+
+    if (ot_correlated && ot_pool_size > 0) {
+        struct otpool pool;
+
+        if (otpool_open(&pool, dir, true) == SUCCESS) {
+            delta = pool.delta;
+            otpool_close(&pool);
+            return delta;
+        }
+    }
+    for (int t = 0; t < GC_POOL_NTYPES; ++t) {
+        if (componentPoolDelta(dir, t, &delta) == SUCCESS)
+            return delta;
+    }
+    return garble_create_delta();
+}
 
 void 
 createSIMDInputLabelsWithR(ChainedGarbledCircuit *cgc, block R)
 {
-    block hashBlock;
+    block *hashes;
     //cgc->inputSIMDBlock = randomBlock();
     SimdInformation *si = &cgc->simd_info;
 
     si->num_iblocks = 1;
     si->input_blocks = garble_allocate_blocks(si->num_iblocks);
-    si->input_blocks[0] = garble_random_block();
+    si->input_blocks[0] = componentRandomBlock();
 
     assert(cgc->gc.n > 0);
     si->iblock_map = malloc(cgc->gc.n * sizeof(int));
 
     int n = cgc->gc.n;
+    hashes = garble_allocate_blocks(n);
+    indexHashes(hashes, n);
     for (int i = 0; i < n; i++) {
         si->iblock_map[i] = 0;
-        hashBlock = garble_zero_block();
-        sha1_hash((char *) &hashBlock, sizeof(block), i, 
-            (unsigned char *) &i, sizeof i);
-
         cgc->inputLabels[2*i] = garble_xor(
                 //cgc->inputSIMDBlock, 
                 si->input_blocks[0], 
-                hashBlock);
+                hashes[i]);
 		cgc->inputLabels[2*i + 1] = garble_xor(R, cgc->inputLabels[2*i]);
     }
+    free(hashes);
 }
 
 void 
@@ -54,25 +232,25 @@ createSIMDInputLabelsWithRForLeven(ChainedGarbledCircuit *cgc, block R, int l)
     assert(cgc->gc.n > 0);
     si->iblock_map = malloc(cgc->gc.n * sizeof(int));
 
+    block *hashes = garble_allocate_blocks(d_int_size);
+    indexHashes(hashes, d_int_size);
+
     int idx = 0;
     for (int i = 0; i < si->num_iblocks; i++) {
-        si->input_blocks[i] = garble_random_block();
+        si->input_blocks[i] = componentRandomBlock();
         for (int j = 0; j < d_int_size; j++) {
             si->iblock_map[idx] = i;
-            block hashBlock = garble_zero_block();
-            sha1_hash((char *) &hashBlock, sizeof(block), j, 
-                (unsigned char *) &j, sizeof j);
-
             cgc->inputLabels[2*idx] = garble_xor(
                     si->input_blocks[i], 
-                    hashBlock);
+                    hashes[j]);
 		    cgc->inputLabels[2*idx + 1] = garble_xor(R, cgc->inputLabels[2*idx]);
             ++idx;
         }
     }
+    free(hashes);
 
-    for (; idx < cgc->gc.n; idx++) {
-        cgc->inputLabels[2*idx] = garble_random_block();
+    for (; (size_t) idx < cgc->gc.n; idx++) {
+        cgc->inputLabels[2*idx] = componentRandomBlock();
         cgc->inputLabels[2*idx + 1] = garble_xor(R, cgc->inputLabels[2*idx]);
         si->iblock_map[idx] = 0;
     }
@@ -81,31 +259,57 @@ createSIMDInputLabelsWithRForLeven(ChainedGarbledCircuit *cgc, block R, int l)
 int 
 generateOfflineChainingOffsets(ChainedGarbledCircuit *cgc)
 {
-    block hashBlock;
     int m = cgc->gc.m;
 
     cgc->offlineChainingOffsets = garble_allocate_blocks(m);
-    cgc->simd_info.output_block = garble_random_block();
+    cgc->simd_info.output_block = componentRandomBlock();
 
+    indexHashes(cgc->offlineChainingOffsets, m);
     for (int i = 0; i < m; ++i) {
-        /* TODO check with Ask Alex M to see about hash function */
-        hashBlock = garble_zero_block();
-
-        sha1_hash((char *) &hashBlock, sizeof(block), i, 
-                (unsigned char *) &i, sizeof i);
-
         cgc->offlineChainingOffsets[i] = garble_xor(
                 garble_xor(cgc->simd_info.output_block, cgc->outputMap[2*i]),
-                hashBlock);
+                cgc->offlineChainingOffsets[i]);
     }
     return 0;
 }
 
+bool
+simdChainable(const ChainedGarbledCircuit *from, int fromWireId,
+              const ChainedGarbledCircuit *to, int toWireId, int n,
+              const block *hashes, int nhashes)
+{
+    /* the evaluator gets H(fromWireId + j) ^ the input block of the first
+     * wire, which must be the zero-label of each wire */
+    const SimdInformation *si = &to->simd_info;
+    int simdIdx;
+
+    if (fromWireId < 0 || toWireId < 0 || n < 0
+        || (size_t) fromWireId + n > from->gc.m
+        || (size_t) toWireId >= to->gc.n || (size_t) toWireId + n > to->gc.n
+        || fromWireId + n > nhashes)
+        return false;
+    simdIdx = si->iblock_map[toWireId];
+    for (int j = 0; j < n; ++j) {
+        block label = garble_xor(si->input_blocks[simdIdx],
+                                 hashes[fromWireId + j]);
+        if (si->iblock_map[toWireId + j] != simdIdx
+            || !garble_equal(label, to->inputLabels[2 * (toWireId + j)]))
+            return false;
+    }
+    return true;
+}
+
 int 
 freeChainedGarbledCircuit(ChainedGarbledCircuit *chained_gc, bool isGarb, ChainingType chainingType) 
 {
     /* TODO will need to remove offlineChainingOffsets */
     garble_delete(&chained_gc->gc); // frees memory in gc
+    if (chained_gc->archive) {
+        /* everything else lives in the archive's mapping */
+        gcArchivePut(chained_gc->archive);
+        chained_gc->archive = NULL;
+        return 0;
+    }
     if (isGarb) {
         free(chained_gc->inputLabels);
         free(chained_gc->outputMap);
@@ -122,81 +326,67 @@ freeChainedGarbledCircuit(ChainedGarbledCircuit *chained_gc, bool isGarb, Chaini
     return 0;
 }
 
-int
-saveChainedGC(ChainedGarbledCircuit* chained_gc, char *dir, bool isGarbler,
-              ChainingType chainingType)
+static void *
+chainedGCSaverThread(void *arg)
 {
-    char fname[50];
-    FILE *f;
-    garble_circuit *gc = &chained_gc->gc;
-
-    sprintf(fname, "%s/chained_gc_%d", dir, chained_gc->id); /* XXX: Security hole */
-    if ((f = fopen(fname, "w")) == NULL) {
-        return FAILURE;
-    }
-    garble_save(gc, f, true, isGarbler);
-
-    /* ChainedGarbleCircuit fields */
-    fwrite(&chained_gc->id, sizeof(int), 1, f);
-    fwrite(&chained_gc->type, sizeof(CircuitType), 1, f);
-    if (isGarbler) {
-        fwrite(chained_gc->inputLabels, sizeof(block), 2 * gc->n, f);
-        fwrite(chained_gc->outputMap, sizeof(block), 2 * gc->m, f);
-        if (chainingType == CHAINING_TYPE_SIMD) {
-            fwrite(&chained_gc->simd_info.output_block, sizeof(block), 1, f);
-            fwrite(&chained_gc->simd_info.num_iblocks, sizeof(int), 1, f);
-            fwrite(chained_gc->simd_info.input_blocks, 
-                    sizeof(block), chained_gc->simd_info.num_iblocks, f);
-            fwrite(chained_gc->simd_info.iblock_map, sizeof(int), chained_gc->gc.n, f);
+    ChainedGCSaver *saver = arg;
+    ChainedGarbledCircuit *cgc;
+
+    while ((cgc = bqueue_pop(saver->queue)) != NULL) {
+        uint64_t start = current_time_();
+        if (saver->err == SUCCESS
+            && gcArchiveAppend(&saver->writer, cgc) == FAILURE) {
+            fprintf(stderr, "Could not save chained GC %d\n", cgc->id);
+            saver->err = FAILURE;
         }
+        freeChainedGarbledCircuit(cgc, saver->isGarbler, saver->chainingType);
+        free(cgc);
+        saver->busy += current_time_() - start;
     }
+    return NULL;
+}
 
-    if (!isGarbler && chainingType == CHAINING_TYPE_SIMD) {
-        fwrite(chained_gc->offlineChainingOffsets, sizeof(block), gc->m, f);
-    }
-    fclose(f);
+int
+startChainedGCSaver(ChainedGCSaver *saver, struct bqueue *queue, char *dir,
+                    int batch, bool isGarbler, ChainingType chainingType)
+{
+    saver->queue = queue;
+    saver->dir = dir;
+    saver->isGarbler = isGarbler;
+    saver->chainingType = chainingType;
+    saver->busy = 0;
+    saver->err = SUCCESS;
+    if (gcArchiveCreate(&saver->writer, dir, batch, isGarbler,
+                        chainingType) == FAILURE)
+        return FAILURE;
+    if (pthread_create(&saver->thread, NULL, chainedGCSaverThread, saver) != 0)
+        return FAILURE;
     return SUCCESS;
 }
 
 int
-loadChainedGC(ChainedGarbledCircuit* chained_gc, char *dir, int id,
-              bool isGarbler, ChainingType chainingType)
+joinChainedGCSaver(ChainedGCSaver *saver)
 {
-    char fname[50];
-    FILE *f;
-    garble_circuit *gc = &chained_gc->gc;
+    (void) pthread_join(saver->thread, NULL);
+    if (gcArchiveFinish(&saver->writer) == FAILURE)
+        saver->err = FAILURE;
+    return saver->err;
+}
 
-    sprintf(fname, "%s/chained_gc_%d", dir, id); /* XXX: security hole */
-    if ((f = fopen(fname, "r")) == NULL) {
-        perror("fopen");
-        return FAILURE;
-    }
-    garble_load(gc, f, true, isGarbler);
-
-    fread(&chained_gc->id, sizeof(int), 1, f);
-    fread(&chained_gc->type, sizeof(CircuitType), 1, f);
-    if (isGarbler) {
-        chained_gc->inputLabels = garble_allocate_blocks(2 * gc->n);
-        chained_gc->outputMap = garble_allocate_blocks(2 * gc->m);
-        fread(chained_gc->inputLabels, sizeof(block), 2 * gc->n, f);
-        fread(chained_gc->outputMap, sizeof(block), 2 * gc->m, f);
-
-        if (chainingType == CHAINING_TYPE_SIMD) {
-            fread(&chained_gc->simd_info.output_block, sizeof(block), 1, f);
-            fread(&chained_gc->simd_info.num_iblocks, sizeof(int), 1, f);
-            chained_gc->simd_info.input_blocks = garble_allocate_blocks(chained_gc->simd_info.num_iblocks);
-            fread(chained_gc->simd_info.input_blocks, sizeof(block),
-                    chained_gc->simd_info.num_iblocks, f);
-            chained_gc->simd_info.iblock_map = allocate_ints(chained_gc->gc.n);
-            fread(chained_gc->simd_info.iblock_map, sizeof(int), chained_gc->gc.n, f);
-        }
-    }
+int
+loadChainedGC(ChainedGarbledCircuit* chained_gc, const char *dir, int batch,
+              int id, bool isGarbler, ChainingType chainingType)
+{
+    GCArchive *ar;
 
-    if (!isGarbler && chainingType == CHAINING_TYPE_SIMD) {
-        chained_gc->offlineChainingOffsets = garble_allocate_blocks(gc->m);
-        fread(chained_gc->offlineChainingOffsets, sizeof(block), gc->m, f);
+    if ((ar = gcArchiveGet(dir, batch)) == NULL)
+        return FAILURE;
+    if (gcArchiveLoad(ar, chained_gc, id, isGarbler, chainingType) == FAILURE) {
+        gcArchivePut(ar);
+        return FAILURE;
     }
-    fclose(f);
+    if (chained_gc->archive == NULL)
+        gcArchivePut(ar);
     return SUCCESS;
 }
 
@@ -3,7 +3,12 @@
 
 #include "components.h"
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "bqueue.h"
+#include "2pc_gc_archive.h"
 
 /* Our abstraction/layer on top of GarbledCircuit */
 typedef enum {
@@ -28,21 +33,88 @@ typedef struct {
     block *outputMap;
     block *offlineChainingOffsets; /* for SIMD chaining operation */
     SimdInformation simd_info;
+    /* if loaded from an archive by the evaluator, the arrays above point
+     * into its mapping */
+    GCArchive *archive;
 } ChainedGarbledCircuit; 
 
+/* number of disjoint copies of a function's components made offline; each
+ * concurrently served evaluator uses its own copy */
+extern int component_slices;
+/* number of threads components are garbled on offline */
+extern int component_threads;
+
+/* thread-safe replacements for libgarble's generator, for use while
+ * garbling components; see component_threads */
+void componentRandomBlocks(block *out, size_t n);
+block componentRandomBlock(void);
+/* label pairs (L, L ^ delta) for 'n' inputs */
+void createInputLabels(block *labels, size_t n, block delta);
+
+/* out[i] = in[i] ^ offsets[i], resp. in[i] ^ offset, for i < n, vectorized;
+ * how chains apply their offsets */
+void xorLabels(block *out, const block *in, const block *offsets, int n);
+void xorLabelsWith(block *out, const block *in, block offset, int n);
+
 int generateOfflineChainingOffsets(ChainedGarbledCircuit *cgc);
+/* sets hashes[i] = H(i) for i = 0, ..., n - 1 */
+void indexHashes(block *hashes, int n);
+/* whether outputs fromWireId.. of 'from' can be chained to inputs toWireId..
+ * of 'to' with a single SIMD offset; both hold SIMD information, and
+ * hashes holds the nhashes first indexHashes */
+bool simdChainable(const ChainedGarbledCircuit *from, int fromWireId,
+                   const ChainedGarbledCircuit *to, int toWireId, int n,
+                   const block *hashes, int nhashes);
+
+block garblerDelta(const char *dir);
 
 int
 freeChainedGarbledCircuit(ChainedGarbledCircuit *chained_gc, bool isGarb, ChainingType chainingType);
 
-int
-saveChainedGC(ChainedGarbledCircuit* chained_gc, char *dir, bool isGarbler,
-              ChainingType chainingType);
-int loadChainedGC(ChainedGarbledCircuit* chained_gc, char *dir, int id,
+/* loads component 'id' from the archive of batch 'batch' in 'dir' */
+int loadChainedGC(ChainedGarbledCircuit* chained_gc, const char *dir,
+                  int batch, int id, bool isGarbler, ChainingType chainingType);
+
+int gcArchiveCreate(GCArchiveWriter *w, const char *dir, int batch,
+                    bool isGarbler, ChainingType chainingType);
+int gcArchiveAppend(GCArchiveWriter *w, const ChainedGarbledCircuit *cgc);
+/* writes the index and moves the archive into place */
+int gcArchiveFinish(GCArchiveWriter *w);
+/* maps the archive of 'batch' in 'dir', or takes another reference to its
+ * mapping */
+GCArchive *gcArchiveGet(const char *dir, int batch);
+void gcArchivePut(GCArchive *ar);
+const GCArchiveEntry *gcArchiveFind(const GCArchive *ar, int id);
+/* a component loaded by the evaluator holds a reference to 'ar' until it
+ * is freed; one loaded by the garbler is self-contained */
+int gcArchiveLoad(GCArchive *ar, ChainedGarbledCircuit *cgc, int id,
                   bool isGarbler, ChainingType chainingType);
+/* decodes the circuit of component 'id', if its record kept it */
+int gcArchiveLoadCircuit(GCArchive *ar, garble_circuit *gc, int id,
+                         CircuitType *type);
 
 void freeChainedGcs(ChainedGarbledCircuit* chained_gcs, int num);
 
+/*
+ * Disk stage of the pipelined offline phase.  Appends each heap-allocated
+ * component popped from 'queue' to the archive of batch 'batch' and frees
+ * it, until it pops NULL.
+ */
+typedef struct {
+    pthread_t thread;
+    struct bqueue *queue;
+    GCArchiveWriter writer;
+    char *dir;
+    bool isGarbler;
+    ChainingType chainingType;
+    uint64_t busy;              /* time spent saving, in ns */
+    int err;
+} ChainedGCSaver;
+
+int startChainedGCSaver(ChainedGCSaver *saver, struct bqueue *queue, char *dir,
+                        int batch, bool isGarbler, ChainingType chainingType);
+int joinChainedGCSaver(ChainedGCSaver *saver);
+
 int saveOutputMap(char *fname, block *labels, int nlabels);
 int loadOutputMap(char *fname, block* labels);
 int saveOTLabels(char *fname, block *labels, int n, bool isSender);
@@ -1,6 +1,9 @@
 #include "2pc_garbler.h"
 
 #include <assert.h> 
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <malloc.h>
@@ -12,21 +15,18 @@
 #include <garble.h>
 #include <garble/aes.h>
 
+#include "bqueue.h"
 #include "gc_comm.h"
 #include "net.h"
-#include "ot_np.h"
+#include "ot_iknp.h"
+#include "otpool.h"
 #include "2pc_common.h"
+#include "2pc_gc_pool.h"
 #include "utils.h"
+#include "workpool.h"
 
 #include "gc_comm.h"
 
-static inline size_t
-addToBuffer(char *buffer, const void *item, size_t length)
-{
-    (void) memcpy(buffer, item, length);
-    return length;
-}
-
 static void *
 new_msg_reader(void *msgs, int idx)
 {
@@ -42,6 +42,43 @@ new_item_reader(void *item, int idx, ssize_t *mlen)
     return &a[idx];
 }
 
+/*
+ * Returns the free-XOR offset of the label pair 'labels'
+ */
+static inline block
+labelOffset(const block *labels)
+{
+    return garble_xor(labels[0], labels[1]);
+}
+
+/*
+ * Masks the evaluator's label pairs in 'evalLabels' with the preprocessed OT
+ * messages, given the evaluator's corrections c_i = x_i ^ r_i, and returns the
+ * number of bytes of 'evalLabels' to send.
+ *
+ * With correlated OTs, randLabels[2i + 1] = randLabels[2i] ^ delta, so the
+ * single block L_i^0 ^ randLabels[2i + c_i] lets the evaluator recover
+ * L_i^{x_i} and the masked labels are compacted into the first 'n' blocks.
+ */
+static size_t
+maskEvalLabels(block *evalLabels, const block *randLabels,
+               const int *corrections, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        assert(corrections[i] == 0 || corrections[i] == 1);
+        if (ot_correlated) {
+            evalLabels[i] = garble_xor(evalLabels[2 * i],
+                                       randLabels[2 * i + corrections[i]]);
+        } else {
+            evalLabels[2 * i] = garble_xor(evalLabels[2 * i],
+                                           randLabels[2 * i + corrections[i]]);
+            evalLabels[2 * i + 1] = garble_xor(evalLabels[2 * i + 1],
+                                               randLabels[2 * i + !corrections[i]]);
+        }
+    }
+    return (ot_correlated ? 1 : 2) * n * sizeof(block);
+}
+
 static void
 extract_labels_gc(block *garbLabels, block *evalLabels, const garble_circuit *gc,
                   const OldInputMapping *map, const bool *inputs)
@@ -75,12 +112,13 @@ garbler_classic_2pc(garble_circuit *gc, const OldInputMapping *input_mapping,
     block *randLabels;
     block garb_labels[num_garb_inputs], eval_labels[2 * num_eval_inputs];
     int serverfd, fd;
+    struct net_conn *conn;
     size_t p = 0;
     uint64_t start, end;
 
     assert(gc->n == (size_t) num_garb_inputs + num_eval_inputs);
 
-    if ((serverfd = net_init_server(HOST, PORT)) == FAILURE) {
+    if ((serverfd = net_init_server(HOST, net_port(NET_PORT_MAIN))) == FAILURE) {
         perror("net_init_server");
         exit(EXIT_FAILURE);
     }
@@ -88,60 +126,71 @@ garbler_classic_2pc(garble_circuit *gc, const OldInputMapping *input_mapping,
         perror("net_server_accept");
         exit(EXIT_FAILURE);
     }
+    if ((conn = net_conn_new(fd)) == NULL) {
+        perror("net_conn_new");
+        exit(EXIT_FAILURE);
+    }
 
     /* pre-process OT */
+    net_conn_set_phase(conn, NET_PHASE_PREPROCESS);
+    net_conn_tag(conn, NET_CAT_OT);
     if (num_eval_inputs > 0) {
         struct state state;
         state_init(&state);
         if (num_eval_inputs > 0) {
             randLabels = garble_allocate_blocks(2 * num_eval_inputs);
-            for (int i = 0; i < 2 * num_eval_inputs; ++i) {
-                randLabels[i] = garble_random_block();
+            if (ot_correlated) {
+                ot_iknp_cot_send(&state, fd, labelOffset(gc->wires), randLabels,
+                                 num_eval_inputs);
+            } else {
+                for (int i = 0; i < 2 * num_eval_inputs; ++i) {
+                    randLabels[i] = garble_random_block();
+                }
+                ot_iknp_send(&state, fd, randLabels, sizeof(block), num_eval_inputs, 2,
+                             new_msg_reader, new_item_reader);
             }
-            ot_np_send(&state, fd, randLabels, sizeof(block), num_eval_inputs, 2,
-                       new_msg_reader, new_item_reader);
         }
         state_cleanup(&state);
     }
 
     start = current_time_();
-    g_bytes_sent = g_bytes_received = 0;
+    net_conn_set_phase(conn, NET_PHASE_ONLINE);
 
     extract_labels_gc(garb_labels, eval_labels, gc, input_mapping, inputs);
 
     if (num_eval_inputs > 0) {
         int corrections[num_eval_inputs];
-        (void) net_recv(fd, corrections, sizeof corrections, 0);
-        for (int i = 0; i < num_eval_inputs; ++i) {
-            assert(corrections[i] == 0 || corrections[i] == 1);
-            eval_labels[2 * i] = garble_xor(eval_labels[2 * i],
-                                           randLabels[2 * i + corrections[i]]);
-            eval_labels[2 * i + 1] = garble_xor(eval_labels[2 * i + 1],
-                                               randLabels[2 * i + !corrections[i]]);
-        }
+        (void) net_conn_recv(conn, corrections, sizeof corrections);
+        p = maskEvalLabels(eval_labels, randLabels, corrections,
+                           num_eval_inputs);
         free(randLabels);
 
-        (void) net_send(fd, eval_labels, sizeof eval_labels, 0);
+        net_conn_tag(conn, NET_CAT_LABELS);
+        (void) net_conn_send(conn, eval_labels, p);
     }
 
+    net_conn_tag(conn, NET_CAT_LABELS);
     if (num_garb_inputs > 0) {
-        (void) net_send(fd, garb_labels, sizeof garb_labels, 0);
+        (void) net_conn_send(conn, garb_labels, sizeof garb_labels);
     }
 
-    gc_comm_send(fd, gc);
+    net_conn_tag(conn, NET_CAT_TABLES);
+    gc_comm_send(conn, gc);
 
-    (void) net_send(fd, output_map, 2 * gc->m * sizeof output_map[0], 0);
+    net_conn_tag(conn, NET_CAT_OUTPUT);
+    (void) net_conn_send(conn, output_map, 2 * gc->m * sizeof output_map[0]);
 
+    net_conn_tag(conn, NET_CAT_MAPPING);
     {
         size_t size;
         size = inputMappingBufferSize(input_mapping);
-        (void) net_send(fd, &size, sizeof size, 0);
+        (void) net_conn_send(conn, &size, sizeof size);
         char buffer[size];
         (void) writeInputMappingToBuffer(input_mapping, buffer);
-        (void) net_send(fd, buffer, size, 0);
+        (void) net_conn_send(conn, buffer, size);
     }
 
-    close(fd);
+    net_conn_close(conn);
     close(serverfd);
 
     end = current_time_();
@@ -150,7 +199,7 @@ garbler_classic_2pc(garble_circuit *gc, const OldInputMapping *input_mapping,
 }
 
 static void
-garbler_go(int fd, const FunctionSpec *function, const char *dir,
+garbler_go(struct net_conn *conn, const FunctionSpec *function, const char *dir,
            const ChainedGarbledCircuit *chained_gcs, const block *randLabels,
            int num_chained_gcs, const int *circuitMapping, const bool *inputs,
            const block *offsets, int noffsets, uint64_t *tot_time)
@@ -164,13 +213,10 @@ garbler_go(int fd, const FunctionSpec *function, const char *dir,
     int num_eval_inputs = function->num_eval_inputs;
     int num_garb_inputs = function->num_garb_inputs;
     block garbLabels[num_garb_inputs], evalLabels[2 * num_eval_inputs];
-    char *buffer;
-    size_t p = 0;
-    uint64_t start, end, _start, _end;
+    uint64_t start, end;
 
     start = current_time_();
-    g_bytes_sent = 0;
-    g_bytes_received = 0;
+    net_conn_set_phase(conn, NET_PHASE_ONLINE);
 
     {
         bool *usedInput[2];
@@ -215,58 +261,37 @@ garbler_go(int fd, const FunctionSpec *function, const char *dir,
         free(usedInput[1]);
     }
 
-    /* Send evaluator's labels via OT correction */
-    if (num_eval_inputs > 0) {
+    /* Gather everything into a single write */
+    {
+        const OutputInstructions *oi = &function->output_instructions;
         int corrections[num_eval_inputs];
-        (void) net_recv(fd, corrections, sizeof(int) * num_eval_inputs, 0);
+        size_t size = 0;
 
-        for (int i = 0; i < num_eval_inputs; ++i) {
-            assert(corrections[i] == 0 || corrections[i] == 1);
-            evalLabels[2 * i] = garble_xor(evalLabels[2 * i],
-                                           randLabels[2 * i + corrections[i]]);
-            evalLabels[2 * i + 1] = garble_xor(evalLabels[2 * i + 1],
-                                               randLabels[2 * i + !corrections[i]]);
+        /* Send evaluator's labels via OT correction */
+        if (num_eval_inputs > 0) {
+            net_conn_tag(conn, NET_CAT_OT);
+            (void) net_conn_recv(conn, corrections, sizeof(int) * num_eval_inputs);
+            size = maskEvalLabels(evalLabels, randLabels, corrections,
+                                  num_eval_inputs);
         }
 
-        buffer = realloc(NULL, sizeof(block) * 2 * num_eval_inputs);
-        p += addToBuffer(buffer + p, evalLabels, sizeof(block) * 2 * num_eval_inputs);
-    } else {
-        buffer = NULL;
-    }
-    
-
-    {
-        buffer = realloc(buffer, p + sizeof num_garb_inputs
-                         + (num_garb_inputs ? sizeof(block) * num_garb_inputs
-                            : 0));
-        p += addToBuffer(buffer + p, &num_garb_inputs, sizeof num_garb_inputs);
-        if (num_garb_inputs) {
-            p += addToBuffer(buffer + p, garbLabels, sizeof(block) * num_garb_inputs);
-        }
-    }
-    {
-        buffer = realloc(buffer, p + sizeof function->output_instructions.size
-                         + function->output_instructions.size * sizeof(OutputInstruction));
-        p += addToBuffer(buffer + p, &function->output_instructions.size,
-                         sizeof(function->output_instructions.size));
-        p += addToBuffer(buffer + p,
-                         function->output_instructions.output_instruction,
-                         function->output_instructions.size * sizeof(OutputInstruction));
+        struct iovec iov[] = {
+            { evalLabels, size },
+            { &num_garb_inputs, sizeof num_garb_inputs },
+            { garbLabels, sizeof(block) * num_garb_inputs },
+            { (void *) &oi->size, sizeof oi->size },
+            { oi->output_instruction, oi->size * sizeof(OutputInstruction) },
+            { &noffsets, sizeof noffsets },
+            { (void *) offsets, sizeof(block) * noffsets },
+        };
+        static const enum net_category cats[] = {
+            NET_CAT_LABELS, NET_CAT_LABELS, NET_CAT_LABELS, NET_CAT_OUTPUT,
+            NET_CAT_OUTPUT, NET_CAT_OFFSETS, NET_CAT_OFFSETS,
+        };
+        (void) net_conn_sendv_tagged(conn, iov, cats, sizeof iov / sizeof iov[0]);
+        (void) net_conn_flush(conn);
     }
 
-    {
-        buffer = realloc(buffer, p + sizeof(int) + (sizeof(block) * noffsets));
-        p += addToBuffer(buffer + p, &noffsets, sizeof noffsets);
-        p += addToBuffer(buffer + p, offsets, sizeof(block) * noffsets);
-    }
-
-    /* Send everything */
-    {
-        net_send(fd, buffer, p, 0);
-    }
-
-    free(buffer);
-
     end = current_time_();
 
     if (tot_time)
@@ -312,6 +337,98 @@ make_real_output_instructions(FunctionSpec* function,
 }
 
 
+/*
+ * Offsets laid out for SIMD chaining, by (from, to, input block): an open
+ * addressing table of at least twice as many slots as there can be keys
+ */
+typedef struct {
+    int from, to, simd;         /* from is 0 in free slots */
+    int offsetIdx;
+} ChainingMapEntry;
+
+typedef struct {
+    ChainingMapEntry *slots;
+    size_t mask;
+} ChainingMap;
+
+static int
+chainingMapInit(ChainingMap *map, int nkeys)
+{
+    size_t nslots = 16;
+
+    while (nslots < 2 * (size_t) nkeys)
+        nslots *= 2;
+    if ((map->slots = calloc(nslots, sizeof map->slots[0])) == NULL)
+        return FAILURE;
+    map->mask = nslots - 1;
+    return SUCCESS;
+}
+
+static void
+chainingMapDestroy(ChainingMap *map)
+{
+    free(map->slots);
+}
+
+/* the offset index of a key, -1 if it was not in the map yet */
+static int *
+chainingMapGet(ChainingMap *map, int from, int to, int simd)
+{
+    uint64_t h = ((uint64_t) from << 40) ^ ((uint64_t) to << 12) ^ (uint64_t) simd;
+    size_t i;
+
+    /* 64-bit finalizer of MurmurHash3 */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    for (i = h & map->mask; map->slots[i].from != 0; i = (i + 1) & map->mask) {
+        ChainingMapEntry *e = &map->slots[i];
+        if (e->from == from && e->to == to && e->simd == simd)
+            return &e->offsetIdx;
+    }
+    map->slots[i].from = from;
+    map->slots[i].to = to;
+    map->slots[i].simd = simd;
+    map->slots[i].offsetIdx = -1;
+    return &map->slots[i].offsetIdx;
+}
+
+/* most offsets make_real_instructions may need for 'instructions' */
+static int
+maxChainingOffsets(const Instructions *instructions)
+{
+    int n = 1;
+
+    for (int i = 0; i < instructions->size; ++i) {
+        const Instruction *cur = &instructions->instr[i];
+        if (cur->type == CHAIN)
+            n += cur->ch.fromCircId == 0 ? 1 : cur->ch.wireDist;
+    }
+    return n;
+}
+
+/*
+ * Maps the circuit ids of the function's instructions to indices of the
+ * components reserved for it, which come type by type in the order of its
+ * component list.  The mapping only depends on the function, so it stays the
+ * same whatever components are reserved.
+ */
+static void
+make_circuit_mapping(const FunctionSpec *function, int *circuitMapping)
+{
+    int k = 0;
+
+    circuitMapping[0] = 0;
+    for (int i = 0; i < function->components.numComponentTypes; i++) {
+        int *circuit_ids = function->components.circuitIds[i];
+
+        for (int j = 0; j < function->components.nCircuits[i]; j++, k++)
+            circuitMapping[circuit_ids[j]] = k;
+    }
+}
+
 static int
 make_real_instructions(FunctionSpec *function,
                        ChainedGarbledCircuit *chained_gcs,
@@ -320,40 +437,30 @@ make_real_instructions(FunctionSpec *function,
 {
     /* primary role: populate circuitMapping
      * circuitMapping maps instruction-gc-ids --> saved-gc-ids 
+     *
+     * chained_gcs holds the components reserved from the pool for the
+     * function, type by type in the order of its component list, so the
+     * mapping follows that order.
      */
 
-    bool* is_circuit_used;
     int num_component_types;
-        
-    is_circuit_used = calloc(num_chained_gcs, sizeof(bool));
+    int k = 0;
+
     num_component_types = function->components.numComponentTypes;
-    circuitMapping[0] = 0;
+    make_circuit_mapping(function, circuitMapping);
 
-    /* construct circuit mapping */
+    /* check the circuit mapping against the components */
     for (int i = 0; i < num_component_types; i++) {
         CircuitType needed_type = function->components.circuitType[i];
         int num_needed = function->components.nCircuits[i];
-        int *circuit_ids = function->components.circuitIds[i];
-        
-        // j indexes circuit_ids, k indexes is_circuit_used and saved_gcs
-        int j = 0;
-
-        // find an available circuit
-        for (int k = 0; k < num_chained_gcs; k++) {
-            if (!is_circuit_used[k] && chained_gcs[k].type == needed_type) {
-                // map it, and increment j
-                circuitMapping[circuit_ids[j]] = k;
-                is_circuit_used[k] = true;
-                j++;
+
+        for (int j = 0; j < num_needed; j++, k++) {
+            if (k >= num_chained_gcs || chained_gcs[k].type != needed_type) {
+                fprintf(stderr, "Not enough circuits of type %d available\n", needed_type);
+                return FAILURE;
             }
-            if (num_needed == j) break;
-        }
-        if (j < num_needed) {
-            fprintf(stderr, "Not enough circuits of type %d available\n", needed_type);
-            return FAILURE;
         }
     }
-    free(is_circuit_used);
 
     /* Part 2: Set chaining offsets */
     /* This is done in two loops. The first loop does everything for the input
@@ -405,83 +512,257 @@ make_real_instructions(FunctionSpec *function,
         for (int i = 0; i < num_instructions; ++i) {
             cur = &(function->instructions.instr[i]);
             if (cur->type == CHAIN && cur->ch.fromCircId != 0) {
-                offsets[offsetsIdx] = garble_xor(
-                    chained_gcs[circuitMapping[cur->ch.fromCircId]].outputMap[2*cur->ch.fromWireId],
-                    chained_gcs[circuitMapping[cur->ch.toCircId]].inputLabels[2*cur->ch.toWireId]); 
-                
+                /* one offset per wire of the range, contiguous */
+                const block *outputMap =
+                    chained_gcs[circuitMapping[cur->ch.fromCircId]].outputMap;
+                const block *inputLabels =
+                    chained_gcs[circuitMapping[cur->ch.toCircId]].inputLabels;
+
                 cur->ch.offsetIdx = offsetsIdx;
-                ++offsetsIdx;
+                for (int j = 0; j < cur->ch.wireDist; ++j) {
+                    offsets[offsetsIdx++] = garble_xor(
+                        outputMap[2 * (cur->ch.fromWireId + j)],
+                        inputLabels[2 * (cur->ch.toWireId + j)]);
+                }
             }
         }
     } else { /* CHAINING_TYPE_SIMD */
         /* Do chaining with SIMD. Here an entire component is chained with a single offset */
 
-        /* gcChainingMap tracks which component is mapping to which component. 
-         * maps (gc-id, gc-id, simd-idx) --> offset-idx */
+        /* chainingMap tracks which component is mapping to which component:
+         * (gc-id, gc-id, simd-idx) --> offset-idx */
+        ChainingMap chainingMap;
+        block *hashes;
+        int nhashes = 0;
 
-        int ***gcChainingMap;
-        /* int gcChainingMap[num_chained_gcs+1][num_chained_gcs+1][3];  */
-
-        gcChainingMap = calloc(num_chained_gcs + 1, sizeof(int **));
-        for (int i = 0; i < num_chained_gcs+1; i++) {
-            gcChainingMap[i] = calloc(num_chained_gcs + 1, sizeof(int *));
-            for (int j = 0; j < num_chained_gcs+1; j++) {
-                gcChainingMap[i][j] = calloc(3, sizeof(int));
-                for (int k = 0; k < 3; k++) {
-                    gcChainingMap[i][j][k] = -1;
-                }
-            }
+        /* the hashes of output indices are the same for every component, so
+         * compute them once, for the widest one */
+        for (int i = 0; i < num_chained_gcs; ++i) {
+            if ((size_t) nhashes < chained_gcs[i].gc.m)
+                nhashes = chained_gcs[i].gc.m;
         }
-        
+        if (chainingMapInit(&chainingMap, num_instructions) == FAILURE)
+            return FAILURE;
+        hashes = garble_allocate_blocks(nhashes);
+        indexHashes(hashes, nhashes);
         for (int i = 0; i < num_instructions; ++i) {
             cur = &(function->instructions.instr[i]);
             if (cur->type == CHAIN && cur->ch.fromCircId != 0) {
-                int simd_idx = chained_gcs[circuitMapping[cur->ch.toCircId]]
-                    .simd_info.iblock_map[cur->ch.toWireId];
-
-                if (gcChainingMap[cur->ch.fromCircId][cur->ch.toCircId][simd_idx] == -1) {
+                const ChainedGarbledCircuit *from =
+                    &chained_gcs[circuitMapping[cur->ch.fromCircId]];
+                const ChainedGarbledCircuit *to =
+                    &chained_gcs[circuitMapping[cur->ch.toCircId]];
+                int simd_idx;
+                int *offsetIdx;
+
+                if (!simdChainable(from, cur->ch.fromWireId, to,
+                                   cur->ch.toWireId, cur->ch.wireDist,
+                                   hashes, nhashes)) {
+                    fprintf(stderr, "Chain %d of the function cannot be done "
+                            "with SIMD chaining\n", i);
+                    chainingMapDestroy(&chainingMap);
+                    free(hashes);
+                    return FAILURE;
+                }
+                simd_idx = to->simd_info.iblock_map[cur->ch.toWireId];
+                offsetIdx = chainingMapGet(&chainingMap, cur->ch.fromCircId,
+                                           cur->ch.toCircId, simd_idx);
+                if (*offsetIdx == -1) {
                     /* add approparite offset to offsets */
                     offsets[offsetsIdx] = garble_xor(
-                            chained_gcs[circuitMapping[cur->ch.toCircId]].simd_info.input_blocks[simd_idx],
-                            chained_gcs[circuitMapping[cur->ch.fromCircId]].simd_info.output_block);
-
-                    gcChainingMap[cur->ch.fromCircId][cur->ch.toCircId][simd_idx] = offsetsIdx;
-                    
-                    cur->ch.offsetIdx = offsetsIdx;
+                            to->simd_info.input_blocks[simd_idx],
+                            from->simd_info.output_block);
+                    *offsetIdx = offsetsIdx;
                     ++offsetsIdx;
-
-
-
-                } else {
-                    /* reference block already in offsets */
-                    cur->ch.offsetIdx = gcChainingMap[cur->ch.fromCircId][cur->ch.toCircId][simd_idx];
                 }
+                /* else reference block already in offsets */
+                cur->ch.offsetIdx = *offsetIdx;
             }
         }
+        chainingMapDestroy(&chainingMap);
+        free(hashes);
+    }
+    *noffsets = offsetsIdx;
+    return SUCCESS;
+}
 
-        for (int i = 0; i < num_chained_gcs + 1; ++i) {
-            for (int j = 0; j < num_chained_gcs + 1; ++j) {
-                free(gcChainingMap[i][j]);
-            }
-            free(gcChainingMap[i]);
+/*
+ * Network stage of the pipelined offline phase: sends each component popped
+ * from 'in' and passes it on to 'out', until it pops NULL.
+ */
+typedef struct {
+    pthread_t thread;
+    struct bqueue *in, *out;
+    struct net_conn *conn;
+    ChainingType chainingType;
+    uint64_t busy;
+} ChainedGCSender;
+
+static void *
+chainedGCSenderThread(void *arg)
+{
+    ChainedGCSender *sender = arg;
+    ChainedGarbledCircuit *cgc;
+
+    while ((cgc = bqueue_pop(sender->in)) != NULL) {
+        uint64_t start = current_time_();
+        if (chained_gc_comm_send(sender->conn, cgc, sender->chainingType) == FAILURE) {
+            perror("chained_gc_comm_send");
+            exit(EXIT_FAILURE);
         }
-        free(gcChainingMap);
+        sender->busy += current_time_() - start;
+        bqueue_push(sender->out, cgc);
     }
-    *noffsets = offsetsIdx;
+    bqueue_push(sender->out, NULL);
+    return NULL;
+}
+
+/*
+ * One batch of components on its way to both parties' pools: garbled on the
+ * calling thread, sent by a sender thread and saved by a saver thread,
+ * connected by bounded queues.
+ */
+typedef struct {
+    BatchHeader hdr;
+    struct bqueue toSend, toSave;
+    ChainedGCSender sender;
+    ChainedGCSaver saver;
+    block delta;                /* offset of the batch's labels */
+    uint64_t garbleTime;
+} GarblerBatch;
+
+/* garbling of the components of a batch, spread over component_threads */
+typedef struct {
+    GarblerBatch *b;
+    ComponentGarbler garbleComponent;
+    void *arg;
+    int nper;
+    ChainingType chainingType;
+} GarbleTask;
+
+static void
+garbleTask(int i, int worker, void *arg)
+{
+    GarbleTask *task = arg;
+    ChainedGarbledCircuit *cgc = calloc(1, sizeof *cgc);
+
+    (void) worker;
+    task->garbleComponent(cgc, i % task->nper, task->arg);
+    cgc->id = task->b->hdr.first + i;
+    if (task->chainingType == CHAINING_TYPE_SIMD)
+        generateOfflineChainingOffsets(cgc);
+    if (i == 0)
+        task->b->delta = labelOffset(cgc->inputLabels);
+    /* in whatever order they are done; archives are sorted by id */
+    bqueue_push(&task->b->toSend, cgc);
+}
+
+/*
+ * Takes fresh ids for 'n' components, announces the batch and garbles and
+ * sends its components, component i being built by garbleComponent with
+ * index i % nper, on the workers of 'workers'.  Returns once everything is
+ * sent, saving possibly still going on; see garblerBatchFinish.  A batch of no components ends the
+ * stream and is not to be finished.
+ */
+static int
+garblerBatchStart(GarblerBatch *b, struct net_conn *conn, GCPool *pool,
+                  struct workpool *workers, char *dir,
+                  ComponentGarbler garbleComponent, void *arg,
+                  int nper, int n, ChainingType chainingType)
+{
+    memset(b, '\0', sizeof *b);
+    b->hdr.n = n;
+    if (gcPoolNewBatch(pool, n, &b->hdr.first) == FAILURE)
+        return FAILURE;
+    net_conn_tag(conn, NET_CAT_CONTROL);
+    if (net_conn_send(conn, &b->hdr, sizeof b->hdr) == FAILURE)
+        return FAILURE;
+    if (n == 0)
+        return SUCCESS;
+
+    if (bqueue_init(&b->toSend, OFFLINE_QUEUE_DEPTH) == FAILURE
+        || bqueue_init(&b->toSave, OFFLINE_QUEUE_DEPTH) == FAILURE) {
+        perror("bqueue_init");
+        return FAILURE;
+    }
+    b->sender.in = &b->toSend;
+    b->sender.out = &b->toSave;
+    b->sender.conn = conn;
+    b->sender.chainingType = chainingType;
+    b->sender.busy = 0;
+    if (pthread_create(&b->sender.thread, NULL, chainedGCSenderThread, &b->sender) != 0
+        || startChainedGCSaver(&b->saver, &b->toSave, dir, b->hdr.first, true,
+                               chainingType) == FAILURE) {
+        perror("pthread_create");
+        return FAILURE;
+    }
+
+    {
+        GarbleTask task = { b, garbleComponent, arg, nper, chainingType };
+        uint64_t t = current_time_();
+
+        (void) workpool_run(workers, n, garbleTask, &task);
+        b->garbleTime = current_time_() - t;
+    }
+    bqueue_push(&b->toSend, NULL);
+    (void) pthread_join(b->sender.thread, NULL);
     return SUCCESS;
 }
 
+/*
+ * Waits for the batch to be saved and for the evaluator to acknowledge it,
+ * and adds it to the pool
+ */
+static int
+garblerBatchFinish(GarblerBatch *b, struct net_conn *conn, GCPool *pool)
+{
+    int res = SUCCESS;
+    char ack;
+
+    if (joinChainedGCSaver(&b->saver) == FAILURE) {
+        fprintf(stderr, "Could not save chained GCs\n");
+        res = FAILURE;
+    }
+    bqueue_destroy(&b->toSend);
+    bqueue_destroy(&b->toSave);
+
+    net_conn_tag(conn, NET_CAT_CONTROL);
+    if (res == SUCCESS
+        && (net_conn_flush(conn) == FAILURE
+            || net_conn_recv(conn, &ack, sizeof ack) == FAILURE)) {
+        fprintf(stderr, "Evaluator did not acknowledge batch %d\n", b->hdr.first);
+        res = FAILURE;
+    }
+    if (res == SUCCESS)
+        res = gcPoolAddBatch(pool, b->hdr.first);
+    return res;
+}
+
 void
-garbler_offline(char *dir, ChainedGarbledCircuit* chained_gcs,
+garbler_offline(char *dir, ComponentGarbler garbleComponent, void *arg,
                 int num_eval_inputs, int num_chained_gcs, ChainingType chainingType)
 {
+    /* Garbles, sends and saves the components as a pipeline: this thread
+     * garbles, a sender thread transfers and a saver thread writes to disk,
+     * connected by bounded queues.  At most about 2 * OFFLINE_QUEUE_DEPTH
+     * components are alive at any time, however many are generated.
+     *
+     * component_slices copies of the num_chained_gcs components are made
+     * and added to the component pool as one batch with fresh ids, next to
+     * whatever earlier runs left in it.
+     */
     int serverfd, fd;
+    struct net_conn *conn;
     struct state state;
+    GCPool gcPool;
+    GarblerBatch batch;
+    struct workpool workers;
+    block delta;
     uint64_t start, end;
 
     state_init(&state);
 
-    if ((serverfd = net_init_server(HOST, PORT)) == FAILURE) {
+    if ((serverfd = net_init_server(HOST, net_port(NET_PORT_MAIN))) == FAILURE) {
         perror("net_init_server");
         exit(EXIT_FAILURE);
     }
@@ -490,16 +771,50 @@ garbler_offline(char *dir, ChainedGarbledCircuit* chained_gcs,
         perror("net_server_accept");
         exit(EXIT_FAILURE);
     }
+    /* the OTs below share the buffered connection through fd */
+    if ((conn = net_conn_new(fd)) == NULL) {
+        perror("net_conn_new");
+        exit(EXIT_FAILURE);
+    }
+    net_conn_set_phase(conn, NET_PHASE_OFFLINE);
 
     start = current_time_();
 
-    for (int i = 0; i < num_chained_gcs; i++) {
-        chained_gc_comm_send(fd, &chained_gcs[i], chainingType);
-        saveChainedGC(&chained_gcs[i], dir, true, chainingType);
+    if (gcPoolOpen(&gcPool, dir, true) == FAILURE
+        || workpool_init(&workers, component_threads) == FAILURE)
+        exit(EXIT_FAILURE);
+    if (garblerBatchStart(&batch, conn, &gcPool, &workers, dir,
+                          garbleComponent, arg, num_chained_gcs,
+                          num_chained_gcs * component_slices,
+                          chainingType) == FAILURE) {
+        fprintf(stderr, "Could not send chained GCs\n");
+        exit(EXIT_FAILURE);
     }
-
-    /* pre-processing OT using random labels */
-    if (num_eval_inputs > 0) {
+    workpool_destroy(&workers);
+    /* all chained circuits share one offset, and the evaluator's labels must
+     * use it too.  It is read back from the garbled components rather than
+     * from garblerDelta, which draws a fresh offset each time it is called
+     * while neither pool exists yet. */
+    if (num_chained_gcs > 0)
+        delta = batch.delta;
+    else
+        delta = garblerDelta(dir);
+
+    /* pre-processing OT using random labels; saving may still overlap them */
+    net_conn_tag(conn, NET_CAT_OT);
+    if (num_eval_inputs > 0 && ot_pool_size > 0) {
+        struct otpool pool;
+        uint64_t navailable;
+
+        if (otpool_open(&pool, dir, true) == SUCCESS) {
+            if (otpool_available(&pool, &navailable) == SUCCESS
+                && navailable < ot_pool_size)
+                (void) otpool_fill_send(&pool, &state, fd,
+                                        ot_pool_size - navailable);
+            otpool_close(&pool);
+        }
+        (void) otpool_fill_done(fd);
+    } else if (num_eval_inputs > 0) {
         block *evalLabels;
         char *fname;
         size_t size;
@@ -509,133 +824,569 @@ garbler_offline(char *dir, ChainedGarbledCircuit* chained_gcs,
         (void) snprintf(fname, size, "%s/%s", dir, "lbl");
 
         evalLabels = garble_allocate_blocks(2 * num_eval_inputs);
-        for (int i = 0; i < 2 * num_eval_inputs; ++i) {
-            evalLabels[i] = garble_random_block();
+        if (ot_correlated) {
+            /* all chained circuits share one offset */
+            ot_iknp_cot_send(&state, fd, delta, evalLabels, num_eval_inputs);
+        } else {
+            for (int i = 0; i < 2 * num_eval_inputs; ++i) {
+                evalLabels[i] = garble_random_block();
+            }
+            ot_iknp_send(&state, fd, evalLabels, sizeof(block), num_eval_inputs, 2,
+                         new_msg_reader, new_item_reader);
         }
-            
-        ot_np_send(&state, fd, evalLabels, sizeof(block), num_eval_inputs, 2,
-                   new_msg_reader, new_item_reader);
         saveOTLabels(fname, evalLabels, num_eval_inputs, true);
 
         free(evalLabels);
         free(fname);
     }
 
-    end = current_time_();
-    fprintf(stderr, "garbler offline: %llu\n", (end - start));
+    if (batch.hdr.n > 0
+        && garblerBatchFinish(&batch, conn, &gcPool) == FAILURE)
+        exit(EXIT_FAILURE);
+    gcPoolClose(&gcPool);
 
-    close(fd);
+    end = current_time_();
+    fprintf(stderr, "garbler offline: %" PRIu64 " (garble %" PRIu64
+            ", send %" PRIu64 ", save %" PRIu64 ")\n",
+            (end - start), batch.garbleTime, batch.sender.busy, batch.saver.busy);
+    if (batch.garbleTime > 0)
+        fprintf(stderr, "garbler offline: %.1f components/sec on %d threads\n",
+                batch.hdr.n / (batch.garbleTime / 1000000000.0),
+                component_threads);
+
+    net_conn_close(conn);
     close(serverfd);
     state_cleanup(&state);
 }
 
+/*
+ * Garbles the circuit of a component already in the pool anew, with fresh
+ * labels under the pool's offset
+ */
+typedef struct {
+    GCPool *pool;
+    int templateId;
+    block delta;
+    ChainingType chainingType;
+} RegarbleArgs;
+
+static void
+regarbleComponent(ChainedGarbledCircuit *cgc, int idx, void *arg)
+{
+    RegarbleArgs *args = arg;
+    garble_circuit *gc = &cgc->gc;
+
+    (void) idx;
+    if (gcPoolLoadCircuit(args->pool, gc, args->templateId,
+                          &cgc->type) == FAILURE) {
+        fprintf(stderr, "GC pool: could not load component %d\n",
+                args->templateId);
+        exit(EXIT_FAILURE);
+    }
+
+    cgc->inputLabels = garble_allocate_blocks(2 * gc->n);
+    cgc->outputMap = garble_allocate_blocks(2 * gc->m);
+    createInputLabels(cgc->inputLabels, gc->n, args->delta);
+    garble_garble(gc, cgc->inputLabels, cgc->outputMap);
+}
+
+static bool
+refillerStopped(GCPoolRefiller *r)
+{
+    return gcPoolRefillerWait(r, 0);
+}
+
+/*
+ * Waits for the evaluator's refiller to connect, giving up once the refiller
+ * is stopped
+ */
+static int
+refillerAccept(GCPoolRefiller *r, int serverfd)
+{
+    struct pollfd pfd = { .fd = serverfd, .events = POLLIN };
+
+    while (!refillerStopped(r)) {
+        int res = poll(&pfd, 1, 100);
+        if (res == -1 && errno != EINTR) {
+            perror("poll");
+            return FAILURE;
+        }
+        if (res > 0)
+            return net_server_accept(serverfd);
+    }
+    return FAILURE;
+}
+
+/*
+ * Tops up every type of component the pool has ever held to twice the
+ * watermark once it drops below it
+ */
+static int
+refillerRound(GCPoolRefiller *r, GCPool *pool, struct workpool *workers,
+              struct net_conn *conn, block delta, bool *refilled)
+{
+    *refilled = false;
+    for (int t = 0; t < GC_POOL_NTYPES && !refillerStopped(r); ++t) {
+        RegarbleArgs args = { pool, 0, delta, r->chainingType };
+        GarblerBatch batch;
+        int nfree;
+
+        if (gcPoolTemplate(pool, t, &args.templateId) == FAILURE)
+            continue;
+        if (gcPoolAvailable(pool, t, &nfree) == FAILURE)
+            return FAILURE;
+        if (nfree >= gc_pool_watermark)
+            continue;
+        if (garblerBatchStart(&batch, conn, pool, workers, r->dir,
+                              regarbleComponent, &args, 1,
+                              2 * gc_pool_watermark - nfree,
+                              r->chainingType) == FAILURE
+            || garblerBatchFinish(&batch, conn, pool) == FAILURE)
+            return FAILURE;
+        *refilled = true;
+    }
+    return SUCCESS;
+}
+
+static void *
+garblerPoolRefillerThread(void *arg)
+{
+    GCPoolRefiller *r = arg;
+    struct net_conn *conn = NULL;
+    BatchHeader end = { 0, 0 };
+    GCPool pool;
+    struct workpool workers;
+    block delta;
+    int serverfd, fd = FAILURE;
+
+    if (r->chainingType == CHAINING_TYPE_SIMD) {
+        fprintf(stderr, "GC pool: replenishment does not support SIMD chaining\n");
+        return NULL;
+    }
+    if (gcPoolOpen(&pool, r->dir, true) == FAILURE)
+        return NULL;
+    /* kept for every batch the refiller garbles */
+    if (workpool_init(&workers, component_threads) == FAILURE) {
+        gcPoolClose(&pool);
+        return NULL;
+    }
+    /* new components must chain to the ones already there */
+    delta = garblerDelta(r->dir);
+
+    if ((serverfd = net_init_server(HOST, net_port(NET_PORT_GC_POOL))) == FAILURE
+        || (fd = refillerAccept(r, serverfd)) == FAILURE
+        || (conn = net_conn_new(fd)) == NULL) {
+        if (!refillerStopped(r))
+            fprintf(stderr, "GC pool: could not accept refill connection\n");
+        goto cleanup;
+    }
+    net_conn_set_phase(conn, NET_PHASE_OFFLINE);
+
+    while (!refillerStopped(r)) {
+        bool refilled;
+
+        if (refillerRound(r, &pool, &workers, conn, delta, &refilled) == FAILURE) {
+            fprintf(stderr, "GC pool: refill failed\n");
+            break;
+        }
+        /* other processes may consume from the pool too, so poll */
+        if (!refilled)
+            (void) gcPoolRefillerWait(r, 100);
+    }
+    net_conn_tag(conn, NET_CAT_CONTROL);
+    if (net_conn_send(conn, &end, sizeof end) == SUCCESS)
+        (void) net_conn_flush(conn);
+
+cleanup:
+    if (conn)
+        net_conn_close(conn);
+    else if (fd != FAILURE)
+        (void) close(fd);
+    if (serverfd != FAILURE)
+        (void) close(serverfd);
+    workpool_destroy(&workers);
+    gcPoolClose(&pool);
+    return NULL;
+}
+
 int
-garbler_online(char *function_path, char *dir, bool *inputs, int num_garb_inputs,
-               int num_chained_gcs, uint64_t *tot_time, ChainingType chainingType) 
+garbler_pool_refiller_start(GCPoolRefiller *r, const char *dir,
+                            ChainingType chainingType)
 {
-    /*runs the garbler code
-     * First, initializes and loads function, and then calls garbler_go which
-     * runs the core of the garbler's code
-     */
+    return gcPoolRefillerStart(r, dir, chainingType, garblerPoolRefillerThread);
+}
 
-    int serverfd, fd;
-    uint64_t start, end;
-    ChainedGarbledCircuit *chained_gcs;
-    FunctionSpec function;
-    int *circuitMapping, noffsets = 0;
-    block *randLabels = NULL, *offsets = NULL;
+/*
+ * Reserves fresh components for a query from the pool, type by type in the
+ * order of the function's component list, in place of those of the previous
+ * query, and resolves the function's instructions and output instructions
+ * against them
+ */
+static int
+sessionReserve(GarblerSession *session)
+{
+    const FunctionComponent *components = &session->function.components;
+    int n = session->num_chained_gcs, res = SUCCESS;
+    GCPool pool;
+
+    /* an evaluator has seen the previous query's components */
+    for (int k = 0; k < n; ++k) {
+        freeChainedGarbledCircuit(&session->chained_gcs[k], true,
+                                  session->chainingType);
+        memset(&session->chained_gcs[k], '\0', sizeof session->chained_gcs[k]);
+    }
 
-    if ((serverfd = net_init_server(HOST, PORT)) == FAILURE) {
-        perror("net_init_server");
+    if (gcPoolOpen(&pool, session->dir, true) == FAILURE)
         return FAILURE;
+    for (int i = 0, k = 0; res == SUCCESS && i < components->numComponentTypes; ++i) {
+        res = gcPoolReserve(&pool, components->circuitType[i],
+                            components->nCircuits[i], &session->componentIds[k]);
+        k += components->nCircuits[i];
+    }
+    for (int k = 0; res == SUCCESS && k < n; ++k) {
+        if (gcPoolLoad(&pool, &session->chained_gcs[k], session->componentIds[k],
+                       session->chainingType) == FAILURE) {
+            fprintf(stderr, "Could not load chained GC\n");
+            res = FAILURE;
+        }
     }
+    gcPoolClose(&pool);
+    if (res == FAILURE)
+        return FAILURE;
 
-    start = current_time_();
+    if (session->usePool && session->pool.correlated && n > 0
+        && !garble_equal(session->pool.delta,
+                         labelOffset(session->chained_gcs[0].inputLabels))) {
+        fprintf(stderr, "Circuits were not garbled with the OT pool's offset\n");
+        return FAILURE;
+    }
+    if (make_real_instructions(&session->function, session->chained_gcs,
+                               n, session->circuitMapping, session->offsets,
+                               &session->noffsets,
+                               session->chainingType) == FAILURE) {
+        fprintf(stderr, "Could not make instructions\n");
+        return FAILURE;
+    }
+    /* the layout of the offsets only depends on the types of the
+     * components, so the evaluator keeps the instructions it was sent */
+    if (session->resolved == NULL) {
+        size_t size = session->function.instructions.size * sizeof(Instruction);
+
+        session->resolved = malloc(size > 0 ? size : 1);
+        (void) memcpy(session->resolved, session->function.instructions.instr,
+                      size);
+    } else if (memcmp(session->resolved, session->function.instructions.instr,
+                      session->function.instructions.size
+                      * sizeof(Instruction)) != 0) {
+        fprintf(stderr, "Components of the same type differ in layout\n");
+        return FAILURE;
+    }
+    if (make_real_output_instructions(&session->function, session->chained_gcs,
+                                      n, session->circuitMapping) == FAILURE) {
+        fprintf(stderr, "Could not make output instructions\n");
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+int
+garbler_session_load(GarblerSession *session, char *function_path, char *dir,
+                     ChainingType chainingType)
+{
+    /* Loads the function and everything its queries share: the circuit
+     * mapping and the OT pool.  Each query then reserves fresh components
+     * from the pool; see sessionReserve.  Cleans up after itself on failure.
+     */
+    const FunctionComponent *components;
+    int n = 0;
+
+    memset(session, '\0', sizeof *session);
+    session->functionPath = function_path;
+    session->dir = dir;
+    session->chainingType = chainingType;
+    session->serverfd = -1;
 
     /* Load function from disk */
-    if (load_function_via_json(function_path, &function, chainingType) == FAILURE) {
+    if (load_function_via_json(function_path, &session->function, chainingType) == FAILURE) {
         fprintf(stderr, "Could not load function %s\n", function_path);
         return FAILURE;
     }
-
-    /* Load everything else from disk */
-    {
-        size_t size;
-        /* load chained garbled circuits from disk */
-        chained_gcs = calloc(num_chained_gcs, sizeof(ChainedGarbledCircuit));
-        for (int i = 0; i < num_chained_gcs; ++i) {
-            if (loadChainedGC(&chained_gcs[i], dir, i, true, chainingType) == FAILURE) {
-                fprintf(stderr, "Could not load chained GC\n");
-                return FAILURE;
-            }
-        }
-
-        size = strlen(dir)  + strlen("/lbl") + 1;
+    session->functionLoaded = true;
+
+    components = &session->function.components;
+    for (int i = 0; i < components->numComponentTypes; ++i)
+        n += components->nCircuits[i];
+    session->num_chained_gcs = n;
+    session->componentIds = malloc(sizeof(int) * n);
+    session->chained_gcs = calloc(n, sizeof(ChainedGarbledCircuit));
+
+    if (ot_pool_size > 0) {
+        /* each query reserves its own slice of the pool */
+        session->randLabels = garble_allocate_blocks(2 * session->function.num_eval_inputs);
+        if (otpool_open(&session->pool, dir, true) == FAILURE)
+            goto fail;
+        session->usePool = true;
+    } else {
+        size_t size = strlen(dir)  + strlen("/lbl") + 1;
         char lblName[size];
         (void) snprintf(lblName, size, "%s/%s", dir, "lbl");
-        randLabels = loadOTLabels(lblName);
+        session->randLabels = loadOTLabels(lblName);
     }
 
-    {
-        /* +1 because 0th component is inputComponent*/
-        circuitMapping = malloc(sizeof(int) * (function.components.totComponents + 1));
-        offsets = garble_allocate_blocks(function.instructions.size);
-        if (make_real_instructions(&function, chained_gcs, num_chained_gcs,
-                                   circuitMapping, offsets, &noffsets,
-                                   chainingType) == FAILURE) {
-            fprintf(stderr, "Could not make instructions\n");
+    /* +1 because 0th component is inputComponent*/
+    session->circuitMapping = malloc(sizeof(int) * (components->totComponents + 1));
+    session->offsets =
+        garble_allocate_blocks(maxChainingOffsets(&session->function.instructions));
+    make_circuit_mapping(&session->function, session->circuitMapping);
+    return SUCCESS;
+
+fail:
+    garbler_session_cleanup(session);
+    return FAILURE;
+}
+
+int
+garbler_session_init(GarblerSession *session, char *function_path, char *dir,
+                     ChainingType chainingType)
+{
+    /* Opens the listening socket, so that evaluators can connect while
+     * loading is going on, and loads the session.
+     */
+    int serverfd;
+
+    if ((serverfd = net_init_server(HOST, net_port(NET_PORT_MAIN))) == FAILURE) {
+        perror("net_init_server");
+        return FAILURE;
+    }
+    if (garbler_session_load(session, function_path, dir,
+                             chainingType) == FAILURE) {
+        close(serverfd);
+        return FAILURE;
+    }
+    session->serverfd = serverfd;
+    return SUCCESS;
+}
+
+/*
+ * Announces query 'seq' to the evaluator, along with the components and the
+ * slice of preprocessed OTs it uses, which are reserved here.
+ */
+static int
+sessionAnnounce(GarblerSession *session, struct net_conn *conn, uint64_t seq)
+{
+    SessionHeader hdr = { SESSION_MAGIC, SESSION_QUERY, seq, 0 };
+
+    if (sessionReserve(session) == FAILURE) {
+        fprintf(stderr, "Could not reserve components for query %" PRIu64 "\n",
+                seq);
+        return FAILURE;
+    }
+    if (session->usePool) {
+        int n = session->function.num_eval_inputs;
+
+        if (otpool_reserve(&session->pool, n, &hdr.otOffset) == FAILURE
+            || otpool_read_sender(&session->pool, hdr.otOffset, n,
+                                  session->randLabels) == FAILURE)
             return FAILURE;
-        }
     }
+    net_conn_tag(conn, NET_CAT_CONTROL);
+    if (net_conn_send(conn, &hdr, sizeof hdr) == FAILURE
+        || net_conn_send(conn, session->componentIds,
+                         sizeof(int) * session->num_chained_gcs) == FAILURE)
+        return FAILURE;
+    if (seq == 0) {
+        /* resolved against the components, but the same for every query */
+        const Instructions *instructions = &session->function.instructions;
+
+        net_conn_set_phase(conn, NET_PHASE_SETUP);
+        net_conn_tag(conn, NET_CAT_INSTRUCTIONS);
+        (void) net_conn_send(conn, &instructions->size, sizeof(int));
+        (void) net_conn_send_compressed(conn, instructions->instr,
+                                        instructions->size * sizeof(Instruction));
+        net_conn_set_phase(conn, NET_PHASE_ONLINE);
+    }
+    return net_conn_flush(conn);
+}
+
+int
+garbler_session_start(GarblerSession *session, struct net_conn *conn)
+{
+    /* Sends a newly connected evaluator the number of components of each
+     * query and the circuit mapping.  Queries are announced once the
+     * evaluator asks for them; see garbler_session_step.
+     */
+    FunctionSpec *function = &session->function;
+
+    session->seq = 0;
+    session->pending = false;
 
+    net_conn_set_phase(conn, NET_PHASE_SETUP);
+    net_conn_tag(conn, NET_CAT_CONTROL);
+    (void) net_conn_send(conn, &session->num_chained_gcs, sizeof(int));
+
+    // Send circuit mapping
+    net_conn_tag(conn, NET_CAT_MAPPING);
     {
-        int res = make_real_output_instructions(&function, chained_gcs,
-                                                num_chained_gcs, circuitMapping);
-        if (res == FAILURE) {
-            fprintf(stderr, "Could not make output instructions\n");
+        int size = function->components.totComponents + 1;
+        (void) net_conn_send(conn, &size, sizeof size);
+        (void) net_conn_send_compressed(conn, session->circuitMapping, sizeof(int) * size);
+    }
+
+    return net_conn_flush(conn);
+}
+
+int
+garbler_session_step(GarblerSession *session, struct net_conn *conn,
+                     bool *inputs, bool *ran, bool *done, uint64_t *query_time)
+{
+    /* Handles the next message from the evaluator: a header asking for a
+     * query, which is then announced, or the OT corrections of the announced
+     * query, which is then run.  Returns in between, so that a server can
+     * wait for the evaluator's reply without holding a thread; a query with
+     * no evaluator inputs has no corrections and runs right away.
+     *
+     * @param ran set to whether a query ran, taking *query_time
+     * @param done set to whether the session is over
+     */
+    SessionHeader hdr;
+    uint64_t end;
+
+    *ran = false;
+    *done = true;
+
+    if (!session->pending) {
+        net_conn_set_phase(conn, NET_PHASE_ONLINE);
+        net_conn_tag(conn, NET_CAT_CONTROL);
+        if (net_conn_recv(conn, &hdr, sizeof hdr) == FAILURE)
+            return SUCCESS;     /* evaluator went away */
+        session->queryStart = current_time_();
+        if (hdr.magic != SESSION_MAGIC
+            || (hdr.type != SESSION_QUERY && hdr.type != SESSION_LAST
+                && hdr.type != SESSION_END)) {
+            fprintf(stderr, "Bad session header\n");
             return FAILURE;
         }
-
+        if (hdr.type == SESSION_END)
+            return SUCCESS;
+        if (hdr.seq != session->seq) {
+            fprintf(stderr, "Query %" PRIu64 " out of sequence (expected %"
+                    PRIu64 ")\n", (uint64_t) hdr.seq, session->seq);
+            return FAILURE;
+        }
+        if (sessionAnnounce(session, conn, session->seq) == FAILURE)
+            return FAILURE;
+        session->pending = true;
+        session->pendingLast = hdr.type == SESSION_LAST;
+        if (session->function.num_eval_inputs > 0) {
+            *done = false;
+            return SUCCESS;
+        }
     }
 
-    /* Accept connection after loading is all done */
-    if ((fd = net_server_accept(serverfd)) == FAILURE) {
+    /*main function; does core of work*/
+    garbler_go(conn, &session->function, session->dir, session->chained_gcs,
+               session->randLabels, session->num_chained_gcs,
+               session->circuitMapping, inputs, session->offsets,
+               session->noffsets, NULL);
+    end = current_time_();
+
+    *ran = true;
+    if (query_time)
+        *query_time = end - session->queryStart;
+
+    session->pending = false;
+    session->seq++;
+    *done = session->pendingLast;
+    return SUCCESS;
+}
+
+int
+garbler_session_serve(GarblerSession *session, bool *inputs,
+                      uint64_t *query_times, uint64_t max_queries,
+                      uint64_t *nqueries)
+{
+    /* Serves one evaluator connection, running one online execution per
+     * query until the evaluator ends the session or disconnects.  The time
+     * of each query is stored in query_times, up to max_queries of them.
+     */
+    struct net_conn *conn;
+    bool ran, done = false;
+    int fd, res;
+
+    if ((fd = net_server_accept(session->serverfd)) == FAILURE) {
         perror("net_server_accept");
         return FAILURE;
     }
+    if ((conn = net_conn_new(fd)) == NULL) {
+        perror("net_conn_new");
+        close(fd);
+        return FAILURE;
+    }
 
-    // Send instructions to evaluator
-    (void) net_send(fd, &function.instructions.size, sizeof(int), 0);
-    (void) net_send_compressed(fd, function.instructions.instr, function.instructions.size * sizeof(Instruction), 0);
+    res = garbler_session_start(session, conn);
+    while (res == SUCCESS && !done) {
+        uint64_t t;
 
-    // Send circuit mapping
-    {
-        int size = function.components.totComponents + 1;
-        (void) net_send(fd, &size, sizeof size, 0);
-        (void) net_send_compressed(fd, circuitMapping, sizeof(int) * size, 0);
+        res = garbler_session_step(session, conn, inputs, &ran, &done, &t);
+        if (ran) {
+            if (query_times && *nqueries < max_queries)
+                query_times[*nqueries] = t;
+            ++*nqueries;
+        }
     }
 
-    /*main function; does core of work*/
-    garbler_go(fd, &function, dir, chained_gcs, randLabels, num_chained_gcs,
-               circuitMapping, inputs, offsets, noffsets, NULL);
+    net_conn_close(conn);
+    return res;
+}
 
-    free(circuitMapping);
-    for (int i = 0; i < num_chained_gcs; ++i) {
-        freeChainedGarbledCircuit(&chained_gcs[i], true, chainingType);
+void
+garbler_session_cleanup(GarblerSession *session)
+{
+    free(session->circuitMapping);
+    for (int i = 0; session->chained_gcs && i < session->num_chained_gcs; ++i) {
+        freeChainedGarbledCircuit(&session->chained_gcs[i], true, session->chainingType);
     }
-    free(chained_gcs);
-    freeFunctionSpec(&function);
-    free(offsets);
-    free(randLabels);
+    free(session->chained_gcs);
+    free(session->componentIds);
+    if (session->functionLoaded)
+        freeFunctionSpec(&session->function);
+    free(session->offsets);
+    free(session->resolved);
+    free(session->randLabels);
+    if (session->usePool)
+        otpool_close(&session->pool);
+    if (session->serverfd >= 0)
+        close(session->serverfd);
+}
+
+int
+garbler_online(char *function_path, char *dir, bool *inputs, int num_garb_inputs,
+               uint64_t *tot_time, ChainingType chainingType) 
+{
+    /*runs the garbler code
+     * First, initializes and loads function, and then serves a single
+     * evaluator session, which calls garbler_go for each query.  Every call
+     * takes fresh components from the pool.
+     */
+    GarblerSession session;
+    uint64_t start, end, nqueries = 0;
+    int res;
+
+    (void) num_garb_inputs;
+
+    start = current_time_();
+
+    if (garbler_session_init(&session, function_path, dir,
+                             chainingType) == FAILURE)
+        return FAILURE;
+    res = garbler_session_serve(&session, inputs, NULL, 0, &nqueries);
+    garbler_session_cleanup(&session);
 
     end = current_time_();
-    
-    close(fd);
-    close(serverfd);
 
     if (tot_time) {
         *tot_time = end - start;
     }
 
-    return SUCCESS;
+    return res;
 }
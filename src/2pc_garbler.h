@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include "2pc_function_spec.h"
+#include "2pc_gc_pool.h"
+#include "net.h"
+#include "otpool.h"
 
 
 void
@@ -10,11 +13,66 @@ garbler_classic_2pc(garble_circuit *gc, const OldInputMapping *input_mapping,
                     const block *outputMap, int num_garb_inputs, int num_eval_inputs,
                     const bool *inputs, uint64_t *tot_time);
 
-void garbler_offline(char *dir, ChainedGarbledCircuit* chained_gcs,
+/* Builds and garbles component 'idx' of the offline pool into 'cgc' */
+typedef void (*ComponentGarbler)(ChainedGarbledCircuit *cgc, int idx, void *arg);
+
+void garbler_offline(char *dir, ComponentGarbler garbleComponent, void *arg,
                      int num_eval_inputs, int num_chained_gcs, ChainingType chainingType);
 
+/* keeps the garbler's component pool at gc_pool_watermark; see
+ * GCPoolRefiller */
+int garbler_pool_refiller_start(GCPoolRefiller *r, const char *dir,
+                                ChainingType chainingType);
+
+/*
+ * Online state shared by all queries of a garbler session: the function, its
+ * circuit mapping, the OT pool and the listening socket.  Components are
+ * single-use, so each query reserves fresh ones from the pool and resolves
+ * the function's instructions against them.
+ */
+typedef struct {
+    char *functionPath;
+    char *dir;
+    FunctionSpec function;
+    bool functionLoaded;
+    int *componentIds;          /* pool ids of chained_gcs */
+    ChainedGarbledCircuit *chained_gcs;
+    int num_chained_gcs;
+    int *circuitMapping;
+    block *offsets;
+    int noffsets;
+    Instruction *resolved;      /* instructions as first resolved */
+    block *randLabels;
+    struct otpool pool;
+    bool usePool;
+    ChainingType chainingType;
+    uint64_t seq;               /* number of the next query */
+    bool pending;               /* query seq announced, waiting to run */
+    bool pendingLast;
+    uint64_t queryStart;        /* when the evaluator asked for it */
+    int serverfd;               /* -1 if the session does not listen itself */
+} GarblerSession;
+
+int garbler_session_load(GarblerSession *session, char *function_path,
+                         char *dir, ChainingType chainingType);
+
+int garbler_session_init(GarblerSession *session, char *function_path,
+                         char *dir, ChainingType chainingType);
+
+int garbler_session_start(GarblerSession *session, struct net_conn *conn);
+
+int garbler_session_step(GarblerSession *session, struct net_conn *conn,
+                         bool *inputs, bool *ran, bool *done,
+                         uint64_t *query_time);
+
+int garbler_session_serve(GarblerSession *session, bool *inputs,
+                          uint64_t *query_times, uint64_t max_queries,
+                          uint64_t *nqueries);
+
+void garbler_session_cleanup(GarblerSession *session);
+
 int garbler_online(char *function_path, char *dir, bool *inputs,
-                   int num_garb_inputs, int num_chained_gcs,
-                   uint64_t *tot_time, ChainingType chainingType);
+                   int num_garb_inputs, uint64_t *tot_time,
+                   ChainingType chainingType);
 
 #endif
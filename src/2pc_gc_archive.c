@@ -0,0 +1,419 @@
+#include "2pc_garbled_circuit.h"
+#include "2pc_gc_archive.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define GC_ARCHIVE_PAGE 4096
+#define GC_ARCHIVE_ALIGN 64
+
+/* archives mapped by this process, by directory */
+static GCArchive *archives;
+static pthread_mutex_t archivesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+archivePath(const char *dir, int batch, const char *suffix)
+{
+    size_t size = strlen(dir) + strlen("/" GC_ARCHIVE_NAME) + 11
+        + strlen(suffix) + 1;
+    char *path = malloc(size);
+    (void) snprintf(path, size, "%s/" GC_ARCHIVE_NAME "%s", dir, batch, suffix);
+    return path;
+}
+
+/* pads the archive being written up to a multiple of 'align' */
+static int
+writerAlign(GCArchiveWriter *w, uint64_t align)
+{
+    static const char zeros[GC_ARCHIVE_PAGE];
+    uint64_t pad = (align - w->pos % align) % align;
+
+    if (pad && fwrite(zeros, 1, pad, w->f) != pad)
+        return FAILURE;
+    w->pos += pad;
+    return SUCCESS;
+}
+
+/* writes a section aligned to 'align', returning its offset in '*offset' */
+static int
+writerSection(GCArchiveWriter *w, const void *buf, size_t size, uint64_t align,
+              uint64_t *offset)
+{
+    if (writerAlign(w, align) == FAILURE)
+        return FAILURE;
+    *offset = w->pos;
+    if (size && fwrite(buf, 1, size, w->f) != size)
+        return FAILURE;
+    w->pos += size;
+    return SUCCESS;
+}
+
+int
+gcArchiveCreate(GCArchiveWriter *w, const char *dir, int batch, bool isGarbler,
+                ChainingType chainingType)
+{
+    /* The archive is written next to its final name and renamed into place
+     * by gcArchiveFinish, so a reader never maps a partial archive */
+    memset(w, '\0', sizeof *w);
+    w->path = archivePath(dir, batch, "");
+    w->tmpPath = archivePath(dir, batch, ".tmp");
+    if ((w->f = fopen(w->tmpPath, "w")) == NULL) {
+        perror("fopen");
+        free(w->path);
+        free(w->tmpPath);
+        return FAILURE;
+    }
+    w->header.magic = GC_ARCHIVE_MAGIC;
+    w->header.version = GC_ARCHIVE_VERSION;
+    w->header.isGarbler = isGarbler;
+    w->header.chainingType = chainingType;
+    /* rewritten with the index offset once everything is in */
+    if (fwrite(&w->header, sizeof w->header, 1, w->f) != 1) {
+        perror("fwrite");
+        (void) fclose(w->f);
+        free(w->path);
+        free(w->tmpPath);
+        return FAILURE;
+    }
+    w->pos = sizeof w->header;
+    return SUCCESS;
+}
+
+/*
+ * Writes the zero-labels of the 'n' label pairs in 'pairs', checking that
+ * each pair is (L, L ^ delta)
+ */
+static int
+writerZeroLabels(GCArchiveWriter *w, const block *pairs, uint64_t n,
+                 block delta, uint64_t *offset)
+{
+    block *zeros = garble_allocate_blocks(n ? n : 1);
+    int res;
+
+    for (uint64_t i = 0; i < n; ++i) {
+        if (!garble_equal(garble_xor(pairs[2 * i], pairs[2 * i + 1]), delta)) {
+            fprintf(stderr, "Label pair %lu does not differ by the offset\n",
+                    (unsigned long) i);
+            free(zeros);
+            return FAILURE;
+        }
+        zeros[i] = pairs[2 * i];
+    }
+    res = writerSection(w, zeros, sizeof(block) * n, GC_ARCHIVE_ALIGN, offset);
+    free(zeros);
+    return res;
+}
+
+/* label pairs (L, L ^ delta) of the 'n' zero-labels in 'zeros' */
+static block *
+expandLabels(const block *zeros, uint64_t n, block delta)
+{
+    block *pairs = garble_allocate_blocks(2 * n);
+
+    for (uint64_t i = 0; i < n; ++i) {
+        pairs[2 * i] = zeros[i];
+        pairs[2 * i + 1] = garble_xor(zeros[i], delta);
+    }
+    return pairs;
+}
+
+/* whether the garbler's record of 'cgc' keeps its circuit */
+static bool
+writerKeepsCircuit(GCArchiveWriter *w, const ChainedGarbledCircuit *cgc)
+{
+    if (!w->header.isGarbler || cgc->type < 0 || cgc->type >= 64)
+        return true;
+    if (w->circuitTypes & (1ULL << cgc->type))
+        return false;
+    w->circuitTypes |= 1ULL << cgc->type;
+    return true;
+}
+
+int
+gcArchiveAppend(GCArchiveWriter *w, const ChainedGarbledCircuit *cgc)
+{
+    const garble_circuit *gc = &cgc->gc;
+    const bool isGarbler = w->header.isGarbler;
+    GCArchiveEntry e;
+    char *buf;
+    int res;
+
+    if (w->header.count == w->capacity) {
+        GCArchiveEntry *tmp;
+        w->capacity = w->capacity ? 2 * w->capacity : 64;
+        if ((tmp = realloc(w->entries, w->capacity * sizeof tmp[0])) == NULL)
+            return FAILURE;
+        w->entries = tmp;
+    }
+
+    memset(&e, '\0', sizeof e);
+    e.id = cgc->id;
+    e.type = cgc->type;
+    e.n = gc->n;
+    e.m = gc->m;
+    e.q = gc->q;
+
+    if (writerKeepsCircuit(w, cgc)) {
+        e.gcSize = garble_size(gc, true, isGarbler);
+        buf = garble_to_buffer(gc, NULL, true, isGarbler);
+        res = writerSection(w, buf, e.gcSize, GC_ARCHIVE_PAGE, &e.gcOffset);
+        free(buf);
+        if (res == FAILURE)
+            return FAILURE;
+    }
+
+    if (isGarbler) {
+        block delta = gc->n > 0 ? garble_xor(cgc->inputLabels[0], cgc->inputLabels[1])
+                                : garble_xor(cgc->outputMap[0], cgc->outputMap[1]);
+
+        memcpy(e.delta, &delta, sizeof e.delta);
+        if (writerZeroLabels(w, cgc->inputLabels, gc->n, delta,
+                             &e.inputLabelsOffset) == FAILURE
+            || writerZeroLabels(w, cgc->outputMap, gc->m, delta,
+                                &e.outputMapOffset) == FAILURE) {
+            fprintf(stderr, "Chained GC %d is not free-XOR garbled\n", cgc->id);
+            return FAILURE;
+        }
+        if (w->header.chainingType == CHAINING_TYPE_SIMD) {
+            const SimdInformation *si = &cgc->simd_info;
+            uint64_t off;
+            e.numIblocks = si->num_iblocks;
+            if (writerSection(w, &si->output_block, sizeof(block),
+                              GC_ARCHIVE_ALIGN, &e.simdOffset) == FAILURE
+                || writerSection(w, si->input_blocks,
+                                 sizeof(block) * si->num_iblocks,
+                                 sizeof(block), &off) == FAILURE
+                || writerSection(w, si->iblock_map, sizeof(int) * gc->n,
+                                 sizeof(block), &off) == FAILURE)
+                return FAILURE;
+        }
+    } else if (w->header.chainingType == CHAINING_TYPE_SIMD) {
+        if (writerSection(w, cgc->offlineChainingOffsets, sizeof(block) * gc->m,
+                          GC_ARCHIVE_ALIGN, &e.chainingOffsetsOffset) == FAILURE)
+            return FAILURE;
+    }
+    e.end = w->pos;
+
+    w->entries[w->header.count++] = e;
+    return SUCCESS;
+}
+
+static int
+compareEntries(const void *a, const void *b)
+{
+    const GCArchiveEntry *x = a, *y = b;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+int
+gcArchiveFinish(GCArchiveWriter *w)
+{
+    int res = FAILURE;
+
+    qsort(w->entries, w->header.count, sizeof w->entries[0], compareEntries);
+    if (writerSection(w, w->entries, sizeof w->entries[0] * w->header.count,
+                      GC_ARCHIVE_ALIGN, &w->header.indexOffset) == FAILURE
+        || fseek(w->f, 0, SEEK_SET) == -1
+        || fwrite(&w->header, sizeof w->header, 1, w->f) != 1) {
+        perror("gcArchiveFinish");
+        (void) fclose(w->f);
+    } else if (fclose(w->f) != 0 || rename(w->tmpPath, w->path) == -1) {
+        perror("gcArchiveFinish");
+    } else {
+        res = SUCCESS;
+    }
+    free(w->entries);
+    free(w->path);
+    free(w->tmpPath);
+    return res;
+}
+
+static GCArchive *
+archiveMap(const char *dir, int batch)
+{
+    GCArchive *ar;
+    struct stat st;
+    char *path;
+    int fd;
+
+    path = archivePath(dir, batch, "");
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        free(path);
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(GCArchiveHeader)) {
+        fprintf(stderr, "%s: truncated archive\n", path);
+        free(path);
+        (void) close(fd);
+        return NULL;
+    }
+
+    ar = calloc(1, sizeof *ar);
+    ar->size = st.st_size;
+    /* private and writable: callers may scribble on a component's arrays
+     * without touching the file */
+    ar->base = mmap(NULL, ar->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    (void) close(fd);
+    if (ar->base == MAP_FAILED) {
+        perror("mmap");
+        free(ar);
+        free(path);
+        return NULL;
+    }
+    /* start reading the whole archive in while the caller gets going */
+    (void) madvise(ar->base, ar->size, MADV_WILLNEED);
+
+    ar->header = (const GCArchiveHeader *) ar->base;
+    ar->index = (const GCArchiveEntry *) (ar->base + ar->header->indexOffset);
+    if (ar->header->magic != GC_ARCHIVE_MAGIC
+        || ar->header->version != GC_ARCHIVE_VERSION
+        || ar->header->indexOffset > ar->size
+        || (ar->size - ar->header->indexOffset) / sizeof(GCArchiveEntry)
+           < ar->header->count) {
+        fprintf(stderr, "%s: not a garbled circuit archive\n", path);
+        (void) munmap(ar->base, ar->size);
+        free(ar);
+        free(path);
+        return NULL;
+    }
+    free(path);
+    ar->dir = strdup(dir);
+    ar->batch = batch;
+    return ar;
+}
+
+GCArchive *
+gcArchiveGet(const char *dir, int batch)
+{
+    GCArchive *ar;
+
+    pthread_mutex_lock(&archivesLock);
+    for (ar = archives; ar; ar = ar->next) {
+        if (ar->batch == batch && strcmp(ar->dir, dir) == 0)
+            break;
+    }
+    if (ar == NULL && (ar = archiveMap(dir, batch)) != NULL) {
+        ar->next = archives;
+        archives = ar;
+    }
+    if (ar)
+        ar->refs++;
+    pthread_mutex_unlock(&archivesLock);
+    return ar;
+}
+
+void
+gcArchivePut(GCArchive *ar)
+{
+    GCArchive **p;
+
+    pthread_mutex_lock(&archivesLock);
+    if (--ar->refs == 0) {
+        for (p = &archives; *p != ar; p = &(*p)->next)
+            ;
+        *p = ar->next;
+        (void) munmap(ar->base, ar->size);
+        free(ar->dir);
+        free(ar);
+    }
+    pthread_mutex_unlock(&archivesLock);
+}
+
+const GCArchiveEntry *
+gcArchiveFind(const GCArchive *ar, int id)
+{
+    GCArchiveEntry key;
+
+    key.id = id;
+    return bsearch(&key, ar->index, ar->header->count, sizeof ar->index[0],
+                   compareEntries);
+}
+
+int
+gcArchiveLoad(GCArchive *ar, ChainedGarbledCircuit *cgc, int id,
+              bool isGarbler, ChainingType chainingType)
+{
+    const GCArchiveEntry *e;
+
+    if ((e = gcArchiveFind(ar, id)) == NULL || e->end > ar->size) {
+        fprintf(stderr, "Chained GC %d is not in batch %d of %s\n", id,
+                ar->batch, ar->dir);
+        return FAILURE;
+    }
+    if ((bool) ar->header->isGarbler != isGarbler
+        || (ChainingType) ar->header->chainingType != chainingType) {
+        fprintf(stderr, "%s was written by the other party or chaining type\n",
+                ar->dir);
+        return FAILURE;
+    }
+
+    memset(cgc, '\0', sizeof *cgc);
+    cgc->id = e->id;
+    cgc->type = e->type;
+    if (isGarbler) {
+        /* the online garbler only needs the circuit's size */
+        block delta;
+
+        memcpy(&delta, e->delta, sizeof delta);
+        cgc->gc.n = e->n;
+        cgc->gc.m = e->m;
+        cgc->gc.q = e->q;
+        cgc->inputLabels = expandLabels((block *) (ar->base + e->inputLabelsOffset),
+                                        e->n, delta);
+        cgc->outputMap = expandLabels((block *) (ar->base + e->outputMapOffset),
+                                      e->m, delta);
+        if (chainingType == CHAINING_TYPE_SIMD) {
+            SimdInformation *si = &cgc->simd_info;
+            char *p = ar->base + e->simdOffset;
+            si->output_block = *(block *) p;
+            si->num_iblocks = e->numIblocks;
+            si->input_blocks = garble_allocate_blocks(e->numIblocks);
+            memcpy(si->input_blocks, p + sizeof(block),
+                   sizeof(block) * e->numIblocks);
+            si->iblock_map = malloc(sizeof(int) * e->n);
+            memcpy(si->iblock_map, p + sizeof(block) * (1 + e->numIblocks),
+                   sizeof(int) * e->n);
+        }
+        /* nothing points into the mapping */
+        return SUCCESS;
+    }
+
+    if (garble_from_buffer(&cgc->gc, ar->base + e->gcOffset, true, isGarbler) != 0)
+        return FAILURE;
+    /* as after chained_gc_comm_recv */
+    cgc->gc.wires = NULL;
+    cgc->gc.gates = NULL;
+    if (chainingType == CHAINING_TYPE_SIMD)
+        cgc->offlineChainingOffsets = (block *) (ar->base + e->chainingOffsetsOffset);
+    cgc->archive = ar;
+    return SUCCESS;
+}
+
+int
+gcArchiveLoadCircuit(GCArchive *ar, garble_circuit *gc, int id,
+                     CircuitType *type)
+{
+    const GCArchiveEntry *e;
+
+    if ((e = gcArchiveFind(ar, id)) == NULL || e->end > ar->size
+        || e->gcSize == 0) {
+        fprintf(stderr, "No circuit of chained GC %d in batch %d of %s\n", id,
+                ar->batch, ar->dir);
+        return FAILURE;
+    }
+    if (garble_from_buffer(gc, ar->base + e->gcOffset, true,
+                           ar->header->isGarbler) != 0)
+        return FAILURE;
+    *type = e->type;
+    return SUCCESS;
+}
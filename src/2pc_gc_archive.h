@@ -0,0 +1,82 @@
+#ifndef MPC_GC_ARCHIVE_H
+#define MPC_GC_ARCHIVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Packed archive of a batch of chained garbled circuits of one party, stored
+ * in its directory as GC_ARCHIVE_NAME formatted with the batch's number, the
+ * id of its first component:
+ *
+ *   header | component sections ... | index
+ *
+ * Each component has a page-aligned section with the libgarble encoding of
+ * its circuit (tables included), followed by 64-byte aligned sections with
+ * its labels, output map and SIMD chaining data.  The index, sorted by id,
+ * gives the sizes and offsets of every section.
+ *
+ * The garbler never evaluates, and with free-XOR every label pair is
+ * (L, L ^ delta), so its records are lean: the zero-labels of the inputs and
+ * of the output map and the component's delta, without the circuit.  Only
+ * the first component of each type in a batch keeps its circuit, without
+ * which it could not be garbled anew; see gcArchiveLoadCircuit.
+ *
+ * Loading maps the whole archive once.  The evaluator's chaining arrays of a
+ * loaded component point into the mapping instead of being read and copied,
+ * and only the circuit itself is decoded onto the heap by libgarble.  The
+ * garbler's label pairs are expanded onto the heap.
+ */
+#define GC_ARCHIVE_NAME "chained_gcs.%d.gca"
+#define GC_ARCHIVE_MAGIC 0x52414347     /* "GCAR" */
+#define GC_ARCHIVE_VERSION 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;             /* number of components */
+    uint32_t isGarbler;
+    uint32_t chainingType;
+    uint32_t pad;
+    uint64_t indexOffset;
+} GCArchiveHeader;
+
+typedef struct {
+    int32_t id;
+    int32_t type;               /* CircuitType */
+    uint64_t n, m, q;
+    uint64_t gcOffset, gcSize;  /* libgarble encoding of the circuit, if kept */
+    uint64_t inputLabelsOffset; /* n zero-labels; garbler only */
+    uint64_t outputMapOffset;   /* m zero-labels; garbler only */
+    uint8_t delta[16];          /* free-XOR offset; garbler only */
+    uint64_t simdOffset;        /* output block, input blocks and iblock map */
+    uint64_t numIblocks;
+    uint64_t chainingOffsetsOffset; /* m blocks; SIMD evaluator only */
+    uint64_t end;               /* end of the component's last section */
+} GCArchiveEntry;
+
+/* an archive being written, one component at a time */
+typedef struct {
+    FILE *f;
+    char *path, *tmpPath;
+    uint64_t pos;
+    GCArchiveHeader header;
+    GCArchiveEntry *entries;
+    uint32_t capacity;
+    uint64_t circuitTypes;      /* types whose circuit a garbler record kept */
+} GCArchiveWriter;
+
+/* a mapped archive, shared by all the components loaded from it */
+typedef struct GCArchive {
+    struct GCArchive *next;
+    char *dir;
+    int batch;
+    int refs;
+    char *base;
+    size_t size;
+    const GCArchiveHeader *header;
+    const GCArchiveEntry *index;
+} GCArchive;
+
+#endif
@@ -0,0 +1,449 @@
+#include "2pc_gc_pool.h"
+
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define GC_POOL_MAGIC 0x4c4f4f5043474347ULL  /* "GCGCPOOL" */
+/* size of the file header; records start at this offset */
+#define GC_POOL_HDR_SIZE 4096
+
+int gc_pool_watermark = 0;
+
+enum {
+    GC_POOL_MISSING = 0,        /* id handed out, batch never added */
+    GC_POOL_FREE = 1,
+    GC_POOL_CONSUMED = 2,
+};
+
+struct gc_pool_hdr {
+    uint64_t magic;
+    uint64_t isGarbler;
+    int64_t nextId;             /* first id not yet handed out */
+    int64_t count;              /* records [0, count) exist */
+    /* free lists, linked through the records; the evaluator only counts */
+    int64_t nfree[GC_POOL_NTYPES];
+    int64_t head[GC_POOL_NTYPES];
+    int64_t tail[GC_POOL_NTYPES];
+    int64_t proto[GC_POOL_NTYPES];  /* first component added, or -1 */
+};
+
+/* record of component id, at GC_POOL_HDR_SIZE + id * sizeof(record) */
+struct gc_pool_rec {
+    int32_t type;
+    int32_t state;
+    int64_t batch;
+    int64_t next;               /* next free component of the same type */
+};
+
+static int
+hdr_read(GCPool *pool, struct gc_pool_hdr *hdr)
+{
+    if (pread(pool->fd, hdr, sizeof *hdr, 0) != sizeof *hdr)
+        return FAILURE;
+    if (hdr->magic != GC_POOL_MAGIC || (bool) hdr->isGarbler != pool->isGarbler)
+        return FAILURE;
+    return SUCCESS;
+}
+
+static int
+hdr_write(GCPool *pool, const struct gc_pool_hdr *hdr)
+{
+    if (pwrite(pool->fd, hdr, sizeof *hdr, 0) != sizeof *hdr)
+        return FAILURE;
+    return SUCCESS;
+}
+
+static int
+rec_read(GCPool *pool, int64_t id, struct gc_pool_rec *rec)
+{
+    off_t pos = GC_POOL_HDR_SIZE + id * sizeof *rec;
+
+    if (pread(pool->fd, rec, sizeof *rec, pos) != sizeof *rec) {
+        memset(rec, '\0', sizeof *rec);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+static int
+rec_write(GCPool *pool, int64_t id, const struct gc_pool_rec *rec)
+{
+    off_t pos = GC_POOL_HDR_SIZE + id * sizeof *rec;
+
+    if (pwrite(pool->fd, rec, sizeof *rec, pos) != sizeof *rec)
+        return FAILURE;
+    return SUCCESS;
+}
+
+static int
+pool_lock(GCPool *pool, struct gc_pool_hdr *hdr)
+{
+    if (flock(pool->fd, LOCK_EX) == -1) {
+        perror("flock");
+        return FAILURE;
+    }
+    if (hdr_read(pool, hdr) == FAILURE) {
+        fprintf(stderr, "GC pool: corrupt header\n");
+        (void) flock(pool->fd, LOCK_UN);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+static void
+pool_unlock(GCPool *pool)
+{
+    (void) flock(pool->fd, LOCK_UN);
+}
+
+static bool
+valid_type(CircuitType type)
+{
+    return type >= 0 && type < GC_POOL_NTYPES;
+}
+
+int
+gcPoolOpen(GCPool *pool, const char *dir, bool isGarbler)
+{
+    struct gc_pool_hdr hdr;
+    size_t size = strlen(dir) + strlen("/gcpool") + 1;
+    char fname[size];
+    struct stat st;
+
+    (void) snprintf(fname, size, "%s/%s", dir, "gcpool");
+
+    pool->isGarbler = isGarbler;
+    if ((pool->fd = open(fname, O_RDWR | O_CREAT, 0644)) == -1) {
+        fprintf(stderr, "GC pool: could not open %s: %s\n", fname,
+                strerror(errno));
+        return FAILURE;
+    }
+
+    /* initialize the header of a new pool */
+    (void) flock(pool->fd, LOCK_EX);
+    if (fstat(pool->fd, &st) == 0 && st.st_size == 0) {
+        memset(&hdr, '\0', sizeof hdr);
+        hdr.magic = GC_POOL_MAGIC;
+        hdr.isGarbler = isGarbler;
+        for (int t = 0; t < GC_POOL_NTYPES; ++t)
+            hdr.head[t] = hdr.tail[t] = hdr.proto[t] = -1;
+        (void) hdr_write(pool, &hdr);
+    }
+    if (hdr_read(pool, &hdr) == FAILURE) {
+        fprintf(stderr, "GC pool: %s is not a %s pool\n", fname,
+                isGarbler ? "garbler" : "evaluator");
+        (void) flock(pool->fd, LOCK_UN);
+        (void) close(pool->fd);
+        return FAILURE;
+    }
+    (void) flock(pool->fd, LOCK_UN);
+    pool->dir = strdup(dir);
+    return SUCCESS;
+}
+
+void
+gcPoolClose(GCPool *pool)
+{
+    (void) close(pool->fd);
+    free(pool->dir);
+}
+
+int
+gcPoolNewBatch(GCPool *pool, int n, int *first)
+{
+    struct gc_pool_hdr hdr;
+    int res;
+
+    if (pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    *first = hdr.nextId;
+    hdr.nextId += n;
+    res = hdr_write(pool, &hdr);
+    pool_unlock(pool);
+    return res;
+}
+
+/*
+ * Adds every component in the archive of 'batch', which must be complete,
+ * as free.  The evaluator learns about batches from the garbler, so it moves
+ * its own nextId past them.
+ */
+int
+gcPoolAddBatch(GCPool *pool, int batch)
+{
+    struct gc_pool_hdr hdr;
+    GCArchive *ar;
+    int res = SUCCESS;
+
+    if ((ar = gcArchiveGet(pool->dir, batch)) == NULL)
+        return FAILURE;
+    if (pool_lock(pool, &hdr) == FAILURE) {
+        gcArchivePut(ar);
+        return FAILURE;
+    }
+    for (uint32_t i = 0; res == SUCCESS && i < ar->header->count; ++i) {
+        const GCArchiveEntry *e = &ar->index[i];
+        struct gc_pool_rec rec = { e->type, GC_POOL_FREE, batch, -1 }, old;
+        int t = e->type;
+
+        if (!valid_type(t) || e->id < 0) {
+            fprintf(stderr, "GC pool: bad component %d in batch %d\n",
+                    e->id, batch);
+            res = FAILURE;
+            break;
+        }
+        /* already added */
+        if (e->id < hdr.count && rec_read(pool, e->id, &old) == SUCCESS
+            && old.state != GC_POOL_MISSING)
+            continue;
+        if ((res = rec_write(pool, e->id, &rec)) == FAILURE)
+            break;
+        if (pool->isGarbler) {
+            if (hdr.tail[t] == -1) {
+                hdr.head[t] = e->id;
+            } else {
+                struct gc_pool_rec prev;
+                if ((res = rec_read(pool, hdr.tail[t], &prev)) == FAILURE)
+                    break;
+                prev.next = e->id;
+                if ((res = rec_write(pool, hdr.tail[t], &prev)) == FAILURE)
+                    break;
+            }
+            hdr.tail[t] = e->id;
+        }
+        /* only records that kept their circuit can be garbled anew */
+        if (hdr.proto[t] == -1 && e->gcSize > 0)
+            hdr.proto[t] = e->id;
+        hdr.nfree[t]++;
+        hdr.count = MAX(hdr.count, e->id + 1);
+        hdr.nextId = MAX(hdr.nextId, e->id + 1);
+    }
+    if (res == SUCCESS)
+        res = hdr_write(pool, &hdr);
+    pool_unlock(pool);
+    gcArchivePut(ar);
+    if (res == FAILURE)
+        fprintf(stderr, "GC pool: could not add batch %d\n", batch);
+    return res;
+}
+
+/*
+ * Atomically takes the 'n' oldest free components of 'type' off its free
+ * list and marks them consumed
+ */
+int
+gcPoolReserve(GCPool *pool, CircuitType type, int n, int *ids)
+{
+    struct gc_pool_hdr hdr;
+    int res = SUCCESS;
+
+    if (!pool->isGarbler || !valid_type(type))
+        return FAILURE;
+    if (pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    if (hdr.nfree[type] < n) {
+        fprintf(stderr, "GC pool: %d components of type %d requested but only "
+                "%ld available\n", n, type, (long) hdr.nfree[type]);
+        pool_unlock(pool);
+        return FAILURE;
+    }
+    for (int i = 0; i < n; ++i) {
+        struct gc_pool_rec rec;
+
+        ids[i] = hdr.head[type];
+        if (rec_read(pool, ids[i], &rec) == FAILURE
+            || rec.state != GC_POOL_FREE || rec.type != type) {
+            fprintf(stderr, "GC pool: corrupt free list of type %d\n", type);
+            res = FAILURE;
+            break;
+        }
+        hdr.head[type] = rec.next;
+        if (hdr.head[type] == -1)
+            hdr.tail[type] = -1;
+        hdr.nfree[type]--;
+        rec.state = GC_POOL_CONSUMED;
+        rec.next = -1;
+        if ((res = rec_write(pool, ids[i], &rec)) == FAILURE)
+            break;
+    }
+    /* the records taken so far stay consumed even on failure */
+    if (hdr_write(pool, &hdr) == FAILURE)
+        res = FAILURE;
+    pool_unlock(pool);
+    return res;
+}
+
+int
+gcPoolConsume(GCPool *pool, const int *ids, int n)
+{
+    struct gc_pool_hdr hdr;
+    int res = SUCCESS;
+
+    if (pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    /* check them all first, so that nothing is consumed on failure */
+    for (int i = 0; i < n && res == SUCCESS; ++i) {
+        struct gc_pool_rec rec = { 0, GC_POOL_MISSING, 0, -1 };
+
+        if (ids[i] < 0 || ids[i] >= hdr.count
+            || rec_read(pool, ids[i], &rec) == FAILURE
+            || rec.state != GC_POOL_FREE) {
+            fprintf(stderr, "GC pool: component %d is %s\n", ids[i],
+                    rec.state == GC_POOL_CONSUMED ? "already used" : "unknown");
+            res = FAILURE;
+        }
+        for (int j = 0; j < i && res == SUCCESS; ++j) {
+            if (ids[j] == ids[i]) {
+                fprintf(stderr, "GC pool: component %d used twice\n", ids[i]);
+                res = FAILURE;
+            }
+        }
+    }
+    for (int i = 0; i < n && res == SUCCESS; ++i) {
+        struct gc_pool_rec rec;
+
+        if ((res = rec_read(pool, ids[i], &rec)) == FAILURE)
+            break;
+        rec.state = GC_POOL_CONSUMED;
+        hdr.nfree[rec.type]--;
+        res = rec_write(pool, ids[i], &rec);
+    }
+    if (res == SUCCESS)
+        res = hdr_write(pool, &hdr);
+    pool_unlock(pool);
+    return res;
+}
+
+int
+gcPoolAvailable(GCPool *pool, CircuitType type, int *nfree)
+{
+    struct gc_pool_hdr hdr;
+
+    if (!valid_type(type) || pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    pool_unlock(pool);
+    *nfree = hdr.nfree[type];
+    return SUCCESS;
+}
+
+int
+gcPoolTemplate(GCPool *pool, CircuitType type, int *id)
+{
+    struct gc_pool_hdr hdr;
+
+    if (!valid_type(type) || pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    pool_unlock(pool);
+    if (hdr.proto[type] == -1)
+        return FAILURE;
+    *id = hdr.proto[type];
+    return SUCCESS;
+}
+
+int
+gcPoolLookup(GCPool *pool, int id, int *batch, CircuitType *type)
+{
+    struct gc_pool_rec rec;
+
+    /* the type and batch of a record never change once it is added */
+    if (id < 0 || rec_read(pool, id, &rec) == FAILURE
+        || rec.state == GC_POOL_MISSING) {
+        fprintf(stderr, "GC pool: no component %d in %s\n", id, pool->dir);
+        return FAILURE;
+    }
+    if (batch)
+        *batch = rec.batch;
+    if (type)
+        *type = rec.type;
+    return SUCCESS;
+}
+
+int
+gcPoolLoadCircuit(GCPool *pool, garble_circuit *gc, int id, CircuitType *type)
+{
+    GCArchive *ar;
+    int batch, res;
+
+    if (gcPoolLookup(pool, id, &batch, NULL) == FAILURE
+        || (ar = gcArchiveGet(pool->dir, batch)) == NULL)
+        return FAILURE;
+    res = gcArchiveLoadCircuit(ar, gc, id, type);
+    gcArchivePut(ar);
+    return res;
+}
+
+int
+gcPoolLoad(GCPool *pool, ChainedGarbledCircuit *cgc, int id,
+           ChainingType chainingType)
+{
+    int batch;
+
+    if (gcPoolLookup(pool, id, &batch, NULL) == FAILURE)
+        return FAILURE;
+    return loadChainedGC(cgc, pool->dir, batch, id, pool->isGarbler,
+                         chainingType);
+}
+
+int
+gcPoolRefillerStart(GCPoolRefiller *r, const char *dir,
+                    ChainingType chainingType, void *(*worker)(void *))
+{
+    r->dir = strdup(dir);
+    r->chainingType = chainingType;
+    r->stop = false;
+    (void) pthread_mutex_init(&r->lock, NULL);
+    (void) pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, worker, r) != 0) {
+        perror("pthread_create");
+        free(r->dir);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+bool
+gcPoolRefillerWait(GCPoolRefiller *r, int ms)
+{
+    struct timespec ts;
+    bool stop;
+
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000 * 1000;
+    if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000 * 1000 * 1000;
+    }
+    pthread_mutex_lock(&r->lock);
+    if (!r->stop && ms > 0)
+        (void) pthread_cond_timedwait(&r->cond, &r->lock, &ts);
+    stop = r->stop;
+    pthread_mutex_unlock(&r->lock);
+    return stop;
+}
+
+/*
+ * Stops the refiller.  The evaluator's refiller finishes once the garbler's
+ * has been stopped.
+ */
+void
+gcPoolRefillerStop(GCPoolRefiller *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    (void) pthread_join(r->thread, NULL);
+    (void) pthread_cond_destroy(&r->cond);
+    (void) pthread_mutex_destroy(&r->lock);
+    free(r->dir);
+}
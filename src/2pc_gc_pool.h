@@ -0,0 +1,81 @@
+#ifndef MPC_GC_POOL_H
+#define MPC_GC_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "2pc_garbled_circuit.h"
+
+/* circuit types the ledger keeps free lists for */
+#define GC_POOL_NTYPES 32
+
+/* number of free components of each type the garbler's pool is kept at or
+ * above in the background; 0 disables replenishment */
+extern int gc_pool_watermark;
+
+/*
+ * Ledger of the garbled components in one party's directory.  Components get
+ * monotonically increasing ids, never reused, and are written in batches,
+ * one archive per batch, named after the batch's first id.  The ledger
+ * records the type, batch and state of every id, so that each component is
+ * used by exactly one online session.
+ *
+ * The garbler owns consumption: a session reserves the components it needs
+ * from per-type free lists, each reservation taking O(1) ledger updates, and
+ * sends their ids to the evaluator, whose ledger marks the same ids consumed
+ * and refuses any it has seen used before.  The ledger is updated under an
+ * exclusive flock, so several processes may share a pool.
+ */
+typedef struct {
+    int fd;
+    char *dir;
+    bool isGarbler;
+} GCPool;
+
+int gcPoolOpen(GCPool *pool, const char *dir, bool isGarbler);
+void gcPoolClose(GCPool *pool);
+
+/* takes 'n' fresh ids for a batch being garbled, the first in '*first' */
+int gcPoolNewBatch(GCPool *pool, int n, int *first);
+/* adds the components of the archive of batch 'batch' to the pool */
+int gcPoolAddBatch(GCPool *pool, int batch);
+
+/* garbler: takes 'n' free components of 'type', oldest first */
+int gcPoolReserve(GCPool *pool, CircuitType type, int n, int *ids);
+/* evaluator: marks components reserved by the garbler as consumed */
+int gcPoolConsume(GCPool *pool, const int *ids, int n);
+
+int gcPoolAvailable(GCPool *pool, CircuitType type, int *nfree);
+/* some component of 'type' ever added, whose circuit can be garbled anew */
+int gcPoolTemplate(GCPool *pool, CircuitType type, int *id);
+int gcPoolLookup(GCPool *pool, int id, int *batch, CircuitType *type);
+int gcPoolLoad(GCPool *pool, ChainedGarbledCircuit *cgc, int id,
+               ChainingType chainingType);
+/* decodes just the circuit of a template; see gcPoolTemplate */
+int gcPoolLoadCircuit(GCPool *pool, garble_circuit *gc, int id,
+                      CircuitType *type);
+
+/*
+ * Background worker that keeps each type of the pool at or above
+ * gc_pool_watermark free components, over its own connection on
+ * net_port(NET_PORT_GC_POOL).  The garbler's worker garbles and sends new batches; the
+ * evaluator's worker follows.  See garbler_pool_refiller_start and
+ * evaluator_pool_refiller_start.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *dir;
+    ChainingType chainingType;
+    bool stop;
+} GCPoolRefiller;
+
+int gcPoolRefillerStart(GCPoolRefiller *r, const char *dir,
+                        ChainingType chainingType, void *(*worker)(void *));
+/* waits up to 'ms' milliseconds; returns whether the refiller was stopped */
+bool gcPoolRefillerWait(GCPoolRefiller *r, int ms);
+void gcPoolRefillerStop(GCPoolRefiller *r);
+
+#endif
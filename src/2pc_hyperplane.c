@@ -10,6 +10,7 @@
 #include "2pc_evaluator.h"
 #include "components.h"
 #include "utils.h"
+#include "workpool.h"
 
 #include <garble.h>
 
@@ -25,91 +26,139 @@ typedef struct {
     int domain_size;
 } cgc_information;
 
+static void
+build_cgc(ChainedGarbledCircuit *cgc, const cgc_information *info)
+{
+    int input_array_size = 0;
+    assert(input_array_size == 0);
+    switch(info->circuit_type) {
+        case INNER_PRODUCT:
+            build_inner_product_circuit(&cgc->gc, info->n, info->num_len);
+            break;
+        case SIGNED_COMPARISON:
+            build_signed_comparison_circuit(&cgc->gc, info->num_len);
+            break;
+        case AND:
+            build_and_circuit(&cgc->gc);
+            break;
+        case NOT:
+            build_not_circuit(&cgc->gc);
+            break;
+        case SELECT:
+            input_array_size = info->num_classes * info->vector_size * info->domain_size;
+
+            build_select_circuit(&cgc->gc, info->num_len, input_array_size);
+            break;
+        case ADD:
+            build_add_circuit(&cgc->gc, info->num_len);
+            break;
+        case ARGMAX:
+            build_argmax_circuit(&cgc->gc, info->n, info->num_len);
+            break;
+        case GR0:
+            build_gr0_circuit(&cgc->gc, info->num_len);
+            break;
+        default:
+            fprintf(stderr, "Nothing here yet!\n");
+            assert(false);
+            break;
+    }
+}
+
+typedef struct {
+    cgc_information *cgc_info;
+    block delta;
+} cgc_garbling_args;
+
+static void
+garble_cgc(ChainedGarbledCircuit *cgc, int i, void *arg)
+{
+    /* Builds and garbles the circuit described by cgc_info[i] */
+    cgc_garbling_args *args = arg;
+    int n = args->cgc_info[i].n;
+    int m = args->cgc_info[i].m;
+
+    build_cgc(cgc, &args->cgc_info[i]);
+
+    cgc->inputLabels = garble_allocate_blocks(2 * n);
+    cgc->outputMap = garble_allocate_blocks(2 * m);
+    createInputLabels(cgc->inputLabels, n, args->delta);
+    garble_garble(&cgc->gc, cgc->inputLabels, cgc->outputMap);
+
+    cgc->id = i;
+    cgc->type = args->cgc_info[i].circuit_type;
+}
+
+typedef struct {
+    ChainedGarbledCircuit *cgcs;
+    cgc_garbling_args args;
+    bool is_garb;
+} cgc_generation_task;
+
+static void
+generate_cgc(int i, int worker, void *arg)
+{
+    cgc_generation_task *task = arg;
+
+    (void) worker;
+    if (task->is_garb) {
+        garble_cgc(&task->cgcs[i], i, &task->args);
+    } else {
+        build_cgc(&task->cgcs[i], &task->args.cgc_info[i]);
+    }
+}
+
 void generate_cgcs(ChainedGarbledCircuit *cgcs, cgc_information *cgc_info, int ncircuits, bool is_garb) 
 {
     /* Fills the cgcs array with built and garbled chained garbled circuits
      * whose information is sotred in cgc_info. ncircuits is the size
      * of the preallocated cgcs and cgc_info arrays.
      */
-    block delta = garble_create_delta();
-
-    for (uint32_t i = 0; i < ncircuits; ++i) {
-        int n = cgc_info[i].n;
-        int m = cgc_info[i].m;
-        ChainedGarbledCircuit *cgc = &cgcs[i];
-        CircuitType circuit_type = cgc_info[i].circuit_type;
-
-        int input_array_size = 0;
-        assert(input_array_size == 0);
-        switch(circuit_type) {
-            case INNER_PRODUCT:
-                build_inner_product_circuit(&cgc->gc, n, cgc_info[i].num_len);
-                break;
-            case SIGNED_COMPARISON:
-                build_signed_comparison_circuit(&cgc->gc, cgc_info[i].num_len);
-                break;
-            case AND:
-                build_and_circuit(&cgc->gc);
-                break;
-            case NOT:
-                build_not_circuit(&cgc->gc);
-                break;
-            case SELECT:
-                input_array_size = cgc_info[i].num_classes * cgc_info[i].vector_size * cgc_info[i].domain_size;
-
-                build_select_circuit(&cgc->gc, cgc_info[i].num_len, input_array_size);
-                break;
-            case ADD:
-                build_add_circuit(&cgc->gc, cgc_info[i].num_len);
-                break;
-            case ARGMAX:
-                build_argmax_circuit(&cgc->gc, cgc_info[i].n, cgc_info[i].num_len);
-                break;
-            default:
-                fprintf(stderr, "Nothing here yet!\n");
-                assert(false);
-                break;
-        }
-
-        if (is_garb) {
+    cgc_generation_task task = { cgcs, { cgc_info, garble_zero_block() }, is_garb };
+    struct workpool workers;
 
-            cgc->inputLabels = garble_allocate_blocks(2 * n);
-            cgc->outputMap = garble_allocate_blocks(2 * m);
-            garble_create_input_labels(cgc->inputLabels, n, &delta, false);
-            garble_garble(&cgc->gc, cgc->inputLabels, cgc->outputMap);
+    if (is_garb)
+        task.args.delta = garblerDelta(GARBLER_DIR);
 
-            cgc->id = i;
-            cgc->type = circuit_type;
-        }
+    if (workpool_init(&workers, component_threads) == FAILURE) {
+        for (int i = 0; i < ncircuits; ++i)
+            generate_cgc(i, 0, &task);
+        return;
     }
+    (void) workpool_run(&workers, ncircuits, generate_cgc, &task);
+    workpool_destroy(&workers);
+}
+
+static void
+garb_off_cgcs(char *dir, cgc_information *cgc_info, int ncircuits, int num_eval_inputs)
+{
+    /* Garbles the circuits described by cgc_info and runs the offline
+     * phase with them, without holding them all in memory.
+     */
+    cgc_garbling_args args = { cgc_info, garblerDelta(dir) };
+
+    garbler_offline(dir, garble_cgc, &args, num_eval_inputs, ncircuits,
+                    CHAINING_TYPE_STANDARD);
 }
 
 void hyperplane_garb_off(char *dir, uint32_t n, uint32_t num_len, HYPERPLANE_TYPE type) {
     if (type == WDBC || type == CREDIT) {
-        block delta = garble_create_delta();
-        ChainedGarbledCircuit cgc[2];
-        build_inner_product_circuit(&cgc[0].gc, n, num_len);
-        cgc[0].inputLabels = garble_allocate_blocks(2 * n);
-        cgc[0].outputMap = garble_allocate_blocks(2 * num_len);
-        garble_create_input_labels(cgc[0].inputLabels, n, &delta, false);
-        garble_garble(&cgc[0].gc, cgc[0].inputLabels, cgc[0].outputMap);
-
-        cgc[0].id = 0;
-        cgc[0].type = INNER_PRODUCT;
-
-        build_gr0_circuit(&cgc[1].gc, num_len);
-        cgc[1].inputLabels = garble_allocate_blocks(2 * num_len);
-        cgc[1].outputMap = garble_allocate_blocks(2);
-        garble_create_input_labels(cgc[1].inputLabels, num_len, &delta, false);
-        garble_garble(&cgc[1].gc, cgc[1].inputLabels, cgc[1].outputMap);
-
-        cgc[1].id = 1;
-        cgc[1].type = GR0;
+        cgc_information cgc_info[2];
+
+        cgc_info[0].circuit_type = INNER_PRODUCT;
+        cgc_info[0].n = n;
+        cgc_info[0].m = num_len;
+        cgc_info[0].num_len = num_len;
+
+        cgc_info[1].circuit_type = GR0;
+        cgc_info[1].n = num_len;
+        cgc_info[1].m = 1;
+        cgc_info[1].num_len = num_len;
 
         int num_eval_inputs = n / 2;
         int num_circuits = 2;
 
-        garbler_offline(dir, cgc, num_eval_inputs, num_circuits, CHAINING_TYPE_STANDARD);
+        garb_off_cgcs(dir, cgc_info, num_circuits, num_eval_inputs);
     }
 }
 
@@ -128,11 +177,7 @@ void dt_garb_off(char *dir, uint32_t n, uint32_t num_len, DECISION_TREE_TYPE typ
             cgc_info[i].m = 1;
         }
 
-        ChainedGarbledCircuit cgcs[ncircuits];
-        generate_cgcs(cgcs, cgc_info, ncircuits, true);
-                
-
-        garbler_offline(dir, cgcs, num_eval_inputs, ncircuits, CHAINING_TYPE_STANDARD);
+        garb_off_cgcs(dir, cgc_info, ncircuits, num_eval_inputs);
     } else if (type == DT_NURSERY) {
         // generate 4 comparators and 3 ANDs
         uint32_t ncircuits = 7;
@@ -153,11 +198,7 @@ void dt_garb_off(char *dir, uint32_t n, uint32_t num_len, DECISION_TREE_TYPE typ
             cgc_info[i].num_len = num_len;
         }
 
-        ChainedGarbledCircuit cgcs[ncircuits];
-        generate_cgcs(cgcs, cgc_info, ncircuits, true);
-                
-
-        garbler_offline(dir, cgcs, num_eval_inputs, ncircuits, CHAINING_TYPE_STANDARD);
+        garb_off_cgcs(dir, cgc_info, ncircuits, num_eval_inputs);
     } else if (type == DT_ECG) {
         // generate 4 comparators and 3 ANDs
         uint32_t ncircuits = 13;
@@ -185,9 +226,7 @@ void dt_garb_off(char *dir, uint32_t n, uint32_t num_len, DECISION_TREE_TYPE typ
             cgc_info[i].num_len = num_len;
         }
 
-        ChainedGarbledCircuit cgcs[ncircuits];
-        generate_cgcs(cgcs, cgc_info, ncircuits, true);
-        garbler_offline(dir, cgcs, num_eval_inputs, ncircuits, CHAINING_TYPE_STANDARD);
+        garb_off_cgcs(dir, cgc_info, ncircuits, num_eval_inputs);
     } else {
         printf("not doing anything\n");
     }
@@ -229,9 +268,7 @@ void nb_garb_off(char *dir, int num_len, int num_classes, int vector_size, int d
     cgc_info[ncircuits-1].m = num_len;
     cgc_info[ncircuits-1].num_len = num_len;
 
-    ChainedGarbledCircuit cgcs[ncircuits];
-    generate_cgcs(cgcs, cgc_info, ncircuits, true);
-    garbler_offline(dir, cgcs, num_eval_inputs, ncircuits, CHAINING_TYPE_STANDARD);
+    garb_off_cgcs(dir, cgc_info, ncircuits, num_eval_inputs);
 
 } 
 
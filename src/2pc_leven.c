@@ -26,49 +26,54 @@ static int getCoreN(int l, int sigma) { return (3 * getDIntSize(l)) + (2 * sigma
 static int getCoreM(int l) { return getDIntSize(l); }
 static int getCoreQ() { return 10000; } // TODO figure out this number
 
-void
-leven_garb_off(int l, int sigma, ChainingType chainingType) 
+typedef struct {
+    int l;
+    int sigma;
+    block delta;
+    ChainingType chainingType;
+} LevenOfflineArgs;
+
+static void
+leven_garble_component(ChainedGarbledCircuit *cgc, int i, void *arg)
 {
-    block delta = garble_create_delta();
+    LevenOfflineArgs *args = arg;
+    int coreN = getCoreN(args->l, args->sigma);
+    int coreM = getCoreM(args->l);
 
-    int coreN = getCoreN(l, sigma);
-    int coreM = getCoreM(l);
-    int numCircuits = levenNumCircs(l);
-    ChainedGarbledCircuit chainedGCs[numCircuits];
-    for (int i = 0; i < numCircuits; i++) {
-        /* Initialize */
-        garble_context gcContext;
-        int inputWires[coreN], outputWires[coreM];
-        countToN(inputWires, coreN);
-        chainedGCs[i].inputLabels = garble_allocate_blocks(2*coreN);
-        chainedGCs[i].outputMap = garble_allocate_blocks(2*coreM);
-        garble_circuit *gc = &chainedGCs[i].gc;
+    /* Initialize */
+    garble_context gcContext;
+    int inputWires[coreN], outputWires[coreM];
+    countToN(inputWires, coreN);
+    cgc->inputLabels = garble_allocate_blocks(2*coreN);
+    cgc->outputMap = garble_allocate_blocks(2*coreM);
+    garble_circuit *gc = &cgc->gc;
 
-        /* Garble */
-	    garble_new(gc, coreN, coreM, garble_type);
-	    builder_start_building(gc, &gcContext);
-        addLevenshteinCoreCircuit(gc, &gcContext, l, sigma, inputWires, outputWires);
-	    builder_finish_building(gc, &gcContext, outputWires);
-        if (chainingType == CHAINING_TYPE_SIMD) {
-            createSIMDInputLabelsWithRForLeven(&chainedGCs[i], delta, l);
-        } else {
-            garble_create_input_labels(chainedGCs[i].inputLabels, coreN, &delta, false);
-        }
+    /* Garble */
+    garble_new(gc, coreN, coreM, garble_type);
+    builder_start_building(gc, &gcContext);
+    addLevenshteinCoreCircuit(gc, &gcContext, args->l, args->sigma, inputWires, outputWires);
+    builder_finish_building(gc, &gcContext, outputWires);
+    if (args->chainingType == CHAINING_TYPE_SIMD) {
+        createSIMDInputLabelsWithRForLeven(cgc, args->delta, args->l);
+    } else {
+        createInputLabels(cgc->inputLabels, coreN, args->delta);
+    }
 
-        garble_garble(gc, chainedGCs[i].inputLabels, chainedGCs[i].outputMap);
+    garble_garble(gc, cgc->inputLabels, cgc->outputMap);
 
-        /* Declare chaining vars */
-        chainedGCs[i].id = i;
-        chainedGCs[i].type = LEVEN_CORE;
-    }
+    /* Declare chaining vars */
+    cgc->id = i;
+    cgc->type = LEVEN_CORE;
+}
 
-    if (chainingType == CHAINING_TYPE_SIMD) {
-        for (int i = 0; i < numCircuits; i++)
-            generateOfflineChainingOffsets(&chainedGCs[i]);
-    }
+void
+leven_garb_off(int l, int sigma, ChainingType chainingType) 
+{
+    LevenOfflineArgs args = { l, sigma, garblerDelta(GARBLER_DIR), chainingType };
 
     int num_eval_inputs = levenNumEvalInputs(l, sigma);
-    garbler_offline(GARBLER_DIR, chainedGCs, num_eval_inputs, numCircuits, chainingType);
+    garbler_offline(GARBLER_DIR, leven_garble_component, &args, num_eval_inputs,
+                    levenNumCircs(l), chainingType);
 }
 
 ChainedGarbledCircuit* leven_circuits(int l, int sigma) 
@@ -0,0 +1,347 @@
+#include "2pc_server.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "2pc_common.h"
+#include "2pc_garbler.h"
+#include "bqueue.h"
+#include "net.h"
+#include "utils.h"
+
+#define SERVER_MAX_EVENTS 64
+
+/* epoll tags of the two descriptors that are not evaluator connections */
+static char listenTag, wakeTag;
+
+typedef struct {
+    struct net_conn *conn;
+    int slice;
+    bool started;
+} ServerClient;
+
+typedef struct {
+    int epfd;
+    int wakefd;                 /* workers signal finished sessions here */
+    int serverfd;
+    bool accepting;
+    struct bqueue jobs;
+    sem_t njobs;
+    bool *inputs;
+
+    pthread_mutex_t lock;       /* protects everything below */
+    GarblerSession *slices;
+    bool *sliceBusy;
+    int nslices;
+    int nactive;
+    uint64_t *latencies;
+    uint64_t maxQueries;
+    uint64_t nqueries;
+} Server;
+
+static void
+serverPush(Server *srv, ServerClient *client)
+{
+    bqueue_push(&srv->jobs, client);
+    (void) sem_post(&srv->njobs);
+}
+
+static void
+serverWake(Server *srv)
+{
+    uint64_t one = 1;
+    if (write(srv->wakefd, &one, sizeof one) != sizeof one)
+        perror("write");
+}
+
+/*
+ * Ends a client's session and frees its slice; every query already reserved
+ * its own components, so the slice holds nothing the next client may not see
+ */
+static void
+serverFinish(Server *srv, ServerClient *client)
+{
+    net_conn_close(client->conn);
+    pthread_mutex_lock(&srv->lock);
+    srv->sliceBusy[client->slice] = false;
+    srv->nactive--;
+    pthread_mutex_unlock(&srv->lock);
+    free(client);
+    serverWake(srv);
+}
+
+static void *
+serverWorker(void *arg)
+{
+    Server *srv = arg;
+    ServerClient *client;
+
+    for (;;) {
+        GarblerSession *session;
+        bool ran = false, done = false;
+        uint64_t t;
+        int res;
+
+        while (sem_wait(&srv->njobs) != 0)
+            ;
+        if ((client = bqueue_pop(&srv->jobs)) == NULL)
+            break;
+        session = &srv->slices[client->slice];
+
+        if (!client->started) {
+            client->started = true;
+            res = garbler_session_start(session, client->conn);
+        } else {
+            res = garbler_session_step(session, client->conn, srv->inputs,
+                                       &ran, &done, &t);
+        }
+
+        if (ran) {
+            pthread_mutex_lock(&srv->lock);
+            if (srv->nqueries < srv->maxQueries)
+                srv->latencies[srv->nqueries] = t;
+            srv->nqueries++;
+            pthread_mutex_unlock(&srv->lock);
+        }
+
+        if (res == FAILURE || done) {
+            serverFinish(srv, client);
+        } else if (client->conn->rpos < client->conn->rlen) {
+            /* next message already read ahead; epoll would not see it */
+            serverPush(srv, client);
+        } else {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.ptr = client;
+            if (epoll_ctl(srv->epfd, EPOLL_CTL_MOD, client->conn->fd, &ev) == -1) {
+                perror("epoll_ctl");
+                serverFinish(srv, client);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Accepts an evaluator if a slice is free, and stops watching the listening
+ * socket while none is.
+ */
+static void
+serverAccept(Server *srv)
+{
+    ServerClient *client;
+    struct epoll_event ev;
+    int fd, slice = -1, nfree = 0;
+
+    pthread_mutex_lock(&srv->lock);
+    for (int i = 0; i < srv->nslices; ++i) {
+        if (!srv->sliceBusy[i]) {
+            if (slice == -1)
+                slice = i;
+            nfree++;
+        }
+    }
+    pthread_mutex_unlock(&srv->lock);
+    if (slice == -1)
+        return;
+
+    if ((fd = net_server_accept(srv->serverfd)) == FAILURE) {
+        perror("net_server_accept");
+        return;
+    }
+    client = calloc(1, sizeof *client);
+    if ((client->conn = net_conn_new(fd)) == NULL) {
+        perror("net_conn_new");
+        close(fd);
+        free(client);
+        return;
+    }
+    client->slice = slice;
+
+    pthread_mutex_lock(&srv->lock);
+    srv->sliceBusy[slice] = true;
+    srv->nactive++;
+    pthread_mutex_unlock(&srv->lock);
+
+    /* registered disarmed; the worker arms it once the session is started */
+    ev.events = EPOLLONESHOT;
+    ev.data.ptr = client;
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        serverFinish(srv, client);
+        return;
+    }
+    serverPush(srv, client);
+
+    if (nfree == 1 && srv->accepting) {
+        (void) epoll_ctl(srv->epfd, EPOLL_CTL_DEL, srv->serverfd, NULL);
+        srv->accepting = false;
+    }
+}
+
+static int
+compareLatencies(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void
+serverReport(Server *srv, int nworkers, uint64_t elapsed)
+{
+    uint64_t n = srv->nqueries < srv->maxQueries ? srv->nqueries : srv->maxQueries;
+
+    printf("SERVER queries: %lu, slices: %d, workers: %d\n",
+           srv->nqueries, srv->nslices, nworkers);
+    if (n == 0)
+        return;
+    qsort(srv->latencies, n, sizeof srv->latencies[0], compareLatencies);
+    printf("SERVER queries/sec: %f\n", srv->nqueries / (elapsed / 1000000000.0));
+    printf("SERVER latency p50: %lu microsec\n", srv->latencies[n / 2] / 1000);
+    printf("SERVER latency p99: %lu microsec\n",
+           srv->latencies[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] / 1000);
+}
+
+int
+garbler_serve(char *function_path, char *dir, bool *inputs,
+              int nworkers, uint64_t max_queries, ChainingType chainingType)
+{
+    Server srv;
+    pthread_t workers[nworkers];
+    struct epoll_event ev, events[SERVER_MAX_EVENTS];
+    uint64_t start = 0, end;
+    int res = SUCCESS, nloaded = 0;
+    bool queued = false;
+
+    if (net_transport == NET_SHM) {
+        /* readiness of a ring is not visible to epoll */
+        fprintf(stderr, "garbler_serve: use the tcp or unix transport\n");
+        return FAILURE;
+    }
+
+    memset(&srv, '\0', sizeof srv);
+    srv.serverfd = srv.epfd = srv.wakefd = -1;
+    srv.inputs = inputs;
+    srv.nslices = component_slices;
+    srv.maxQueries = max_queries;
+    srv.slices = calloc(srv.nslices, sizeof srv.slices[0]);
+    srv.sliceBusy = calloc(srv.nslices, sizeof srv.sliceBusy[0]);
+    srv.latencies = calloc(max_queries, sizeof srv.latencies[0]);
+    pthread_mutex_init(&srv.lock, NULL);
+    (void) sem_init(&srv.njobs, 0, 0);
+    if (srv.slices == NULL || srv.sliceBusy == NULL
+        || (max_queries > 0 && srv.latencies == NULL)) {
+        perror("calloc");
+        res = FAILURE;
+        goto cleanup;
+    }
+    if (bqueue_init(&srv.jobs, 2 * srv.nslices + nworkers) == FAILURE) {
+        perror("bqueue_init");
+        res = FAILURE;
+        goto cleanup;
+    }
+    queued = true;
+
+    if ((srv.serverfd = net_init_server(HOST, net_port(NET_PORT_MAIN))) == FAILURE) {
+        perror("net_init_server");
+        res = FAILURE;
+        goto cleanup;
+    }
+
+    /* each slice holds one client's session; its queries reserve their
+     * own components from the pool */
+    for (; nloaded < srv.nslices; ++nloaded) {
+        if (garbler_session_load(&srv.slices[nloaded], function_path, dir,
+                                 chainingType) == FAILURE) {
+            res = FAILURE;
+            goto cleanup;
+        }
+    }
+
+    if ((srv.epfd = epoll_create1(0)) == -1
+        || (srv.wakefd = eventfd(0, 0)) == -1) {
+        perror("epoll_create1");
+        res = FAILURE;
+        goto cleanup;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listenTag;
+    (void) epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.serverfd, &ev);
+    srv.accepting = true;
+    ev.data.ptr = &wakeTag;
+    (void) epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.wakefd, &ev);
+
+    for (int i = 0; i < nworkers; ++i)
+        (void) pthread_create(&workers[i], NULL, serverWorker, &srv);
+
+    for (;;) {
+        bool finished, reopen;
+        int n;
+
+        pthread_mutex_lock(&srv.lock);
+        finished = srv.nqueries >= srv.maxQueries && srv.nactive == 0;
+        reopen = !srv.accepting && srv.nqueries < srv.maxQueries
+            && srv.nactive < srv.nslices;
+        pthread_mutex_unlock(&srv.lock);
+        if (finished)
+            break;
+        if (reopen) {
+            ev.events = EPOLLIN;
+            ev.data.ptr = &listenTag;
+            (void) epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.serverfd, &ev);
+            srv.accepting = true;
+        }
+
+        if ((n = epoll_wait(srv.epfd, events, SERVER_MAX_EVENTS, -1)) == -1) {
+            perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == &listenTag) {
+                if (start == 0)
+                    start = current_time_();
+                serverAccept(&srv);
+            } else if (events[i].data.ptr == &wakeTag) {
+                uint64_t count;
+                if (read(srv.wakefd, &count, sizeof count) != sizeof count)
+                    perror("read");
+            } else {
+                serverPush(&srv, events[i].data.ptr);
+            }
+        }
+    }
+    end = current_time_();
+
+    for (int i = 0; i < nworkers; ++i) {
+        bqueue_push(&srv.jobs, NULL);
+        (void) sem_post(&srv.njobs);
+    }
+    for (int i = 0; i < nworkers; ++i)
+        (void) pthread_join(workers[i], NULL);
+
+    serverReport(&srv, nworkers, end - start);
+
+cleanup:
+    if (srv.wakefd != -1)
+        close(srv.wakefd);
+    if (srv.epfd != -1)
+        close(srv.epfd);
+    for (int i = 0; i < nloaded; ++i)
+        garbler_session_cleanup(&srv.slices[i]);
+    if (srv.serverfd != -1)
+        close(srv.serverfd);
+    if (queued)
+        bqueue_destroy(&srv.jobs);
+    (void) sem_destroy(&srv.njobs);
+    pthread_mutex_destroy(&srv.lock);
+    free(srv.latencies);
+    free(srv.sliceBusy);
+    free(srv.slices);
+    return res;
+}
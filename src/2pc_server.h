@@ -0,0 +1,32 @@
+#ifndef MPC_SERVER_H
+#define MPC_SERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "2pc_garbled_circuit.h"
+
+/*
+ * Serves any number of concurrent evaluator sessions until 'max_queries'
+ * queries have been answered and all evaluators have disconnected.
+ *
+ * An epoll loop watches the listening socket and every idle evaluator
+ * connection.  When a message arrives, the connection is handed to one of
+ * 'nworkers' worker threads, which handles that message and re-arms the
+ * connection: a query header is answered with the query's announcement, and
+ * the query runs once the evaluator's OT corrections arrive, so no worker
+ * waits on a slow client.  Each connected evaluator gets one of
+ * component_slices session slices, and every query reserves fresh
+ * components from the component pool and a fresh slice of the OT pool, so
+ * no garbled material is shared between queries.  Connections beyond
+ * component_slices wait in the listen backlog.
+ *
+ * Prints the aggregate queries per second and the median and 99th
+ * percentile query latency, measured from the arrival of a query header to
+ * the garbler's response.
+ */
+int
+garbler_serve(char *function_path, char *dir, bool *inputs,
+              int nworkers, uint64_t max_queries, ChainingType chainingType);
+
+#endif
@@ -5,12 +5,16 @@
 #include <time.h>
 #include <assert.h>
 #include <math.h>
+#include <dirent.h>
+#include <unistd.h>
 
 #include "components.h"
 #include "2pc_garbler.h" 
 #include "2pc_evaluator.h"
+#include "2pc_gc_pool.h"
 #include "ml_models.h"
 #include "circuits.h"
+#include "codec.h"
 #include "utils.h"
 
 #include "2pc_tests.h"
@@ -876,6 +880,413 @@ static void test_les(int n)
     }
 }
 
+static void test_range_chains(int n)
+{
+    /* applying a chain's offsets to its whole range of wires must give what
+     * chaining one wire at a time does */
+    block in[n], offsets[n], offset;
+    block ranged[n], wired[n];
+
+    componentRandomBlocks(in, n);
+    componentRandomBlocks(offsets, n);
+    offset = componentRandomBlock();
+
+    xorLabels(ranged, in, offsets, n);
+    for (int i = 0; i < n; i++)
+        wired[i] = garble_xor(in[i], offsets[i]);
+    if (memcmp(ranged, wired, sizeof ranged) != 0)
+        printf("Range chain test failed with one offset per wire, n = %d\n", n);
+
+    xorLabelsWith(ranged, in, offset, n);
+    for (int i = 0; i < n; i++)
+        wired[i] = garble_xor(in[i], offset);
+    if (memcmp(ranged, wired, sizeof ranged) != 0)
+        printf("Range chain test failed with one offset, n = %d\n", n);
+
+    /* in place, as SIMD chains apply their second offset */
+    memcpy(ranged, in, sizeof ranged);
+    xorLabelsWith(ranged, ranged, offset, n);
+    if (memcmp(ranged, wired, sizeof ranged) != 0)
+        printf("Range chain test failed in place, n = %d\n", n);
+}
+
+/* appends a chain of 'len' wires, taking its offsets from *noffsets on */
+static void addChain(Instructions *instructions, int from, int fromWire,
+                     int to, int toWire, int len, ChainingType chainingType,
+                     int *noffsets)
+{
+    Instruction *cur = &instructions->instr[instructions->size++];
+
+    cur->type = CHAIN;
+    cur->ch.fromCircId = from;
+    cur->ch.fromWireId = fromWire;
+    cur->ch.toCircId = to;
+    cur->ch.toWireId = toWire;
+    cur->ch.offsetIdx = *noffsets;
+    cur->ch.wireDist = len;
+    /* inputs and SIMD chains take one offset, others one per wire */
+    *noffsets += (from == 0 || chainingType == CHAINING_TYPE_SIMD) ? 1 : len;
+}
+
+static void test_plan(ChainingType chainingType, int nthreads)
+{
+    /* A grid of components, each fed by the one above and the one to its
+     * left.  The compiled plan, run on nthreads workers along the
+     * dependency graph when nthreads > 1, must give every component the
+     * output labels that evaluating the instructions in order gives. */
+    int side = 5, d = 4;
+    int nc = side * side, ninputs = d + 4, noffsets = 0;
+    ChainedGarbledCircuit cgcs[nc];
+    Instruction instr[3 * nc];
+    Instructions instructions = { 0, instr };
+    int circuitMapping[nc + 1];
+    block inputs[ninputs];
+    block *offsets;
+
+    for (int k = 0; k < nc; k++) {
+        block inputLabels[2 * 2 * d], outputMap[2 * 2 * d];
+
+        memset(&cgcs[k], '\0', sizeof cgcs[k]);
+        buildANDCircuit(&cgcs[k].gc, 2 * d, 1);
+        garble_create_input_labels(inputLabels, 2 * d, NULL, false);
+        garble_garble(&cgcs[k].gc, inputLabels, outputMap);
+        cgcs[k].type = AND;
+        if (chainingType == CHAINING_TYPE_SIMD) {
+            cgcs[k].offlineChainingOffsets = garble_allocate_blocks(2 * d);
+            componentRandomBlocks(cgcs[k].offlineChainingOffsets, 2 * d);
+        }
+    }
+    /* 25 is prime to 7, so this maps the circuits onto all components */
+    circuitMapping[0] = 0;
+    for (int c = 1; c <= nc; c++)
+        circuitMapping[c] = ((c - 1) * 7) % nc;
+
+    for (int i = 0; i < side; i++) {
+        for (int j = 0; j < side; j++) {
+            int c = 1 + i * side + j;
+
+            if (i == 0)
+                addChain(&instructions, 0, j % 4, c, 0, d, chainingType, &noffsets);
+            else
+                addChain(&instructions, c - side, 0, c, 0, d, chainingType, &noffsets);
+            if (j == 0)
+                addChain(&instructions, 0, i % 4, c, d, d, chainingType, &noffsets);
+            else
+                addChain(&instructions, c - 1, d, c, d, d, chainingType, &noffsets);
+            instr[instructions.size].type = EVAL;
+            instr[instructions.size].ev.circId = c;
+            instructions.size++;
+        }
+    }
+
+    componentRandomBlocks(inputs, ninputs);
+    offsets = garble_allocate_blocks(noffsets);
+    componentRandomBlocks(offsets, noffsets);
+
+    if (evaluator_check_plan(cgcs, nc, &instructions, circuitMapping, nc + 1,
+                             chainingType, inputs, offsets, nthreads) == FAILURE)
+        printf("Plan test failed with %s chaining on %d threads\n",
+               chainingType == CHAINING_TYPE_SIMD ? "SIMD" : "standard",
+               nthreads);
+
+    free(offsets);
+    for (int k = 0; k < nc; k++) {
+        garble_delete(&cgcs[k].gc);
+        free(cgcs[k].offlineChainingOffsets);
+    }
+}
+
+static void test_codec(enum codec_type type, size_t len)
+{
+    /* labels interleaved with runs of zeros, so that something compresses */
+    struct codec codec = { type, 0 };
+    unsigned char *src = calloc(len + 1, 1), *out = malloc(len + 1);
+    size_t cap = codec_bound(type, len), clen;
+    unsigned char *packed = malloc(cap + 1);
+
+    for (size_t i = 0; i + sizeof(block) <= len; i += 2 * sizeof(block)) {
+        block b = componentRandomBlock();
+        memcpy(src + i, &b, sizeof b);
+    }
+
+    if (codec_compress(&codec, src, len, packed, cap, &clen) == FAILURE
+        || codec_decompress(type, packed, clen, out, len) == FAILURE
+        || memcmp(src, out, len) != 0)
+        printf("Codec test failed for %s, %zu bytes\n", codec_name(type), len);
+
+    /* neither a truncated chunk nor the wrong size may decompress */
+    if (len > 0
+        && (codec_decompress(type, packed, clen - 1, out, len) == SUCCESS
+            || codec_decompress(type, packed, clen, out, len - 1) == SUCCESS
+            || codec_decompress(type, packed, clen, out, len + 1) == SUCCESS))
+        printf("Codec test failed for %s on a malformed chunk of %zu bytes\n",
+               codec_name(type), len);
+
+    free(src);
+    free(out);
+    free(packed);
+}
+
+static char *makeTestDir(void)
+{
+    char *dir = strdup("/tmp/compgc-test.XXXXXX");
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+static void removeTestDir(char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *e;
+
+    while (d && (e = readdir(d)) != NULL) {
+        size_t size = strlen(dir) + strlen(e->d_name) + 2;
+        char path[size];
+
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        (void) snprintf(path, size, "%s/%s", dir, e->d_name);
+        (void) unlink(path);
+    }
+    if (d)
+        (void) closedir(d);
+    (void) rmdir(dir);
+    free(dir);
+}
+
+/* garbles 'n' AND components of growing size, with ids first, first + 1, ... */
+static void makeTestComponents(ChainedGarbledCircuit *cgcs, int n, int first)
+{
+    block delta = garble_create_delta();
+
+    for (int k = 0; k < n; k++) {
+        ChainedGarbledCircuit *cgc = &cgcs[k];
+        garble_circuit *gc = &cgc->gc;
+
+        memset(cgc, '\0', sizeof *cgc);
+        buildANDCircuit(gc, 2 * (k + 1), 1);
+        cgc->id = first + k;
+        cgc->type = AND;
+        cgc->inputLabels = garble_allocate_blocks(2 * gc->n);
+        cgc->outputMap = garble_allocate_blocks(2 * gc->m);
+        createInputLabels(cgc->inputLabels, gc->n, delta);
+        garble_garble(gc, cgc->inputLabels, cgc->outputMap);
+
+        cgc->offlineChainingOffsets = garble_allocate_blocks(gc->m);
+        componentRandomBlocks(cgc->offlineChainingOffsets, gc->m);
+        cgc->simd_info.num_iblocks = 2;
+        cgc->simd_info.input_blocks = garble_allocate_blocks(2);
+        componentRandomBlocks(cgc->simd_info.input_blocks, 2);
+        cgc->simd_info.output_block = componentRandomBlock();
+        cgc->simd_info.iblock_map = malloc(sizeof(int) * gc->n);
+        for (size_t i = 0; i < gc->n; i++)
+            cgc->simd_info.iblock_map[i] = i % 2;
+    }
+}
+
+static void freeTestComponents(ChainedGarbledCircuit *cgcs, int n)
+{
+    for (int k = 0; k < n; k++)
+        freeChainedGarbledCircuit(&cgcs[k], true, CHAINING_TYPE_SIMD);
+}
+
+/* writes the components as batch 'batch', last one first */
+static int writeTestBatch(const char *dir, int batch, ChainedGarbledCircuit *cgcs,
+                          int n, bool isGarbler, ChainingType chainingType)
+{
+    GCArchiveWriter w;
+
+    if (gcArchiveCreate(&w, dir, batch, isGarbler, chainingType) == FAILURE)
+        return FAILURE;
+    for (int k = n; k-- > 0;) {
+        if (gcArchiveAppend(&w, &cgcs[k]) == FAILURE) {
+            (void) gcArchiveFinish(&w);
+            return FAILURE;
+        }
+    }
+    return gcArchiveFinish(&w);
+}
+
+static bool sameCircuit(const garble_circuit *a, const garble_circuit *b)
+{
+    size_t size = garble_size(a, true, false);
+    char *x, *y;
+    bool same;
+
+    if (a->n != b->n || a->m != b->m || a->q != b->q
+        || garble_size(b, true, false) != size)
+        return false;
+    x = garble_to_buffer(a, NULL, true, false);
+    y = garble_to_buffer(b, NULL, true, false);
+    same = memcmp(x, y, size) == 0;
+    free(x);
+    free(y);
+    return same;
+}
+
+static void test_gc_archive(bool isGarbler, ChainingType chainingType)
+{
+    /* every component must load back as it was appended, the garbler's
+     * label pairs rebuilt from their zero-labels and offset */
+    enum { n = 3, batch = 10 };
+    ChainedGarbledCircuit cgcs[n], loaded;
+    char *dir = makeTestDir();
+    const char *party = isGarbler ? "garbler" : "evaluator";
+    GCArchive *ar;
+    int bad = 0;
+
+    if (dir == NULL)
+        return;
+    makeTestComponents(cgcs, n, batch);
+    if (writeTestBatch(dir, batch, cgcs, n, isGarbler, chainingType) == FAILURE
+        || (ar = gcArchiveGet(dir, batch)) == NULL) {
+        printf("Archive test failed to write the %s's batch\n", party);
+        freeTestComponents(cgcs, n);
+        removeTestDir(dir);
+        return;
+    }
+
+    for (int k = 0; k < n; k++) {
+        const ChainedGarbledCircuit *cgc = &cgcs[k];
+        const garble_circuit *gc = &cgc->gc;
+        garble_circuit circuit;
+        CircuitType type;
+        int res;
+
+        if (loadChainedGC(&loaded, dir, batch, cgc->id, isGarbler,
+                          chainingType) == FAILURE) {
+            bad++;
+            continue;
+        }
+        if (loaded.id != cgc->id || loaded.type != cgc->type
+            || loaded.gc.n != gc->n || loaded.gc.m != gc->m
+            || loaded.gc.q != gc->q)
+            bad++;
+        if (isGarbler) {
+            const SimdInformation *si = &cgc->simd_info;
+
+            if (memcmp(loaded.inputLabels, cgc->inputLabels,
+                       sizeof(block) * 2 * gc->n) != 0
+                || memcmp(loaded.outputMap, cgc->outputMap,
+                          sizeof(block) * 2 * gc->m) != 0)
+                bad++;
+            if (chainingType == CHAINING_TYPE_SIMD
+                && (!garble_equal(loaded.simd_info.output_block, si->output_block)
+                    || loaded.simd_info.num_iblocks != si->num_iblocks
+                    || memcmp(loaded.simd_info.input_blocks, si->input_blocks,
+                              sizeof(block) * si->num_iblocks) != 0
+                    || memcmp(loaded.simd_info.iblock_map, si->iblock_map,
+                              sizeof(int) * gc->n) != 0))
+                bad++;
+            /* only the first component appended keeps its circuit */
+            res = gcArchiveLoadCircuit(ar, &circuit, cgc->id, &type);
+            if ((res == SUCCESS) != (k == n - 1))
+                bad++;
+            if (res == SUCCESS) {
+                if (type != AND || !sameCircuit(&circuit, gc))
+                    bad++;
+                garble_delete(&circuit);
+            }
+        } else {
+            if (!sameCircuit(&loaded.gc, gc))
+                bad++;
+            if (chainingType == CHAINING_TYPE_SIMD
+                && memcmp(loaded.offlineChainingOffsets,
+                          cgc->offlineChainingOffsets,
+                          sizeof(block) * gc->m) != 0)
+                bad++;
+        }
+        freeChainedGarbledCircuit(&loaded, isGarbler, chainingType);
+    }
+
+    /* neither a component of another batch nor the other party's load */
+    if (gcArchiveLoad(ar, &loaded, batch + n, isGarbler, chainingType) == SUCCESS
+        || gcArchiveLoad(ar, &loaded, batch, !isGarbler, chainingType) == SUCCESS)
+        bad++;
+
+    if (bad)
+        printf("Archive test failed for the %s with %s chaining\n", party,
+               chainingType == CHAINING_TYPE_SIMD ? "SIMD" : "standard");
+
+    gcArchivePut(ar);
+    freeTestComponents(cgcs, n);
+    removeTestDir(dir);
+}
+
+static void test_gc_pool(void)
+{
+    /* The garbler hands out each component once, and the evaluator's
+     * ledger refuses any it has seen used, even after the batch is added
+     * again or the ledger reopened */
+    enum { n = 4 };
+    ChainedGarbledCircuit cgcs[n];
+    char *gdir = makeTestDir(), *edir = makeTestDir();
+    GCPool garbler, evaluator;
+    bool gopen = false, eopen = false;
+    int first, nfree, ids[n], twice[2];
+    int bad = 0;
+
+    if (gdir == NULL || edir == NULL
+        || !(gopen = gcPoolOpen(&garbler, gdir, true) == SUCCESS)
+        || !(eopen = gcPoolOpen(&evaluator, edir, false) == SUCCESS)
+        || gcPoolNewBatch(&garbler, n, &first) == FAILURE) {
+        printf("GC pool test failed to open the pools\n");
+        goto cleanup;
+    }
+
+    makeTestComponents(cgcs, n, first);
+    if (writeTestBatch(gdir, first, cgcs, n, true, CHAINING_TYPE_STANDARD) == FAILURE
+        || writeTestBatch(edir, first, cgcs, n, false, CHAINING_TYPE_STANDARD) == FAILURE
+        || gcPoolAddBatch(&garbler, first) == FAILURE
+        || gcPoolAddBatch(&evaluator, first) == FAILURE
+        || gcPoolAvailable(&garbler, AND, &nfree) == FAILURE || nfree != n)
+        bad++;
+
+    /* oldest first, and never more than are free */
+    if (gcPoolReserve(&garbler, AND, n - 1, ids) == FAILURE)
+        bad++;
+    for (int k = 0; k < n - 1; k++)
+        bad += ids[k] != first + k;
+    if (gcPoolReserve(&garbler, AND, 2, twice) == SUCCESS)
+        bad++;
+
+    if (gcPoolConsume(&evaluator, ids, n - 1) == FAILURE)
+        bad++;
+    if (gcPoolConsume(&evaluator, &ids[1], 1) == SUCCESS)
+        bad++;
+    /* nothing is consumed by a call that fails */
+    twice[0] = twice[1] = first + n - 1;
+    if (gcPoolConsume(&evaluator, twice, 2) == SUCCESS
+        || gcPoolConsume(&evaluator, twice, 1) == FAILURE)
+        bad++;
+
+    gcPoolClose(&evaluator);
+    if (!(eopen = gcPoolOpen(&evaluator, edir, false) == SUCCESS)
+        || gcPoolAddBatch(&evaluator, first) == FAILURE
+        || gcPoolConsume(&evaluator, ids, 1) == SUCCESS
+        || gcPoolAvailable(&evaluator, AND, &nfree) == FAILURE || nfree != 0)
+        bad++;
+
+    if (bad)
+        printf("GC pool test failed\n");
+    freeTestComponents(cgcs, n);
+
+cleanup:
+    if (gopen)
+        gcPoolClose(&garbler);
+    if (eopen)
+        gcPoolClose(&evaluator);
+    if (gdir)
+        removeTestDir(gdir);
+    if (edir)
+        removeTestDir(edir);
+}
+
 static void test_get_model() 
 {
     printf("Testing get_model");
@@ -909,4 +1320,28 @@ void runAllTests(void)
     for (int i = 0; i < 100; ++i) {
         test_mux();
     }
+
+    /* ranges shorter than, equal to and beyond a vector's worth of labels */
+    for (int n = 1; n <= 67; ++n) {
+        test_range_chains(n);
+    }
+
+    /* one thread runs the plan serially, more walk its dependency graph */
+    for (int nthreads = 1; nthreads <= 4; nthreads *= 2) {
+        test_plan(CHAINING_TYPE_STANDARD, nthreads);
+        test_plan(CHAINING_TYPE_SIMD, nthreads);
+    }
+
+    for (int type = CODEC_NONE; type <= CODEC_ZSTD; ++type) {
+        if (!codec_available(type))
+            continue;
+        for (size_t len = 0; len <= 100000; len = 3 * len + 1)
+            test_codec(type, len);
+    }
+
+    test_gc_archive(true, CHAINING_TYPE_STANDARD);
+    test_gc_archive(true, CHAINING_TYPE_SIMD);
+    test_gc_archive(false, CHAINING_TYPE_STANDARD);
+    test_gc_archive(false, CHAINING_TYPE_SIMD);
+    test_gc_pool();
 }  
@@ -0,0 +1,135 @@
+#include "bqueue.h"
+
+#include "utils.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* number of yields before a blocked push or pop starts sleeping */
+#define BQUEUE_SPINS 64
+/* sleep between retries once spinning gave up, in nanoseconds */
+#define BQUEUE_SLEEP_NS 20000
+
+int
+bqueue_init(struct bqueue *q, size_t capacity)
+{
+    size_t size = 2;
+
+    while (size < capacity)
+        size <<= 1;
+    if ((q->cells = malloc(size * sizeof q->cells[0])) == NULL)
+        return FAILURE;
+    for (size_t i = 0; i < size; ++i) {
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].item = NULL;
+    }
+    q->mask = size - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return SUCCESS;
+}
+
+void
+bqueue_destroy(struct bqueue *q)
+{
+    free(q->cells);
+    q->cells = NULL;
+}
+
+bool
+bqueue_try_push(struct bqueue *q, void *item)
+{
+    struct bqueue_cell *cell;
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        size_t seq;
+        intptr_t diff;
+
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            /* cell is free in this lap; claim it */
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos,
+                                                      pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* cell still holds last lap's item: full */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->item = item;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+bool
+bqueue_try_pop(struct bqueue *q, void **item)
+{
+    struct bqueue_cell *cell;
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        size_t seq;
+        intptr_t diff;
+
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos,
+                                                      pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* cell not written yet in this lap: empty */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    *item = cell->item;
+    /* hand the cell to the producer of the next lap */
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return true;
+}
+
+static void
+backoff(int *spins)
+{
+    if (*spins < BQUEUE_SPINS) {
+        ++*spins;
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, BQUEUE_SLEEP_NS };
+        (void) nanosleep(&ts, NULL);
+    }
+}
+
+void
+bqueue_push(struct bqueue *q, void *item)
+{
+    int spins = 0;
+
+    while (!bqueue_try_push(q, item))
+        backoff(&spins);
+}
+
+void *
+bqueue_pop(struct bqueue *q)
+{
+    void *item;
+    int spins = 0;
+
+    while (!bqueue_try_pop(q, &item))
+        backoff(&spins);
+    return item;
+}
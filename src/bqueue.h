@@ -0,0 +1,50 @@
+#ifndef __BQUEUE_H
+#define __BQUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Bounded lock-free multi-producer multi-consumer queue of pointers (Vyukov's
+ * array-based queue).  Each cell carries a sequence number telling whether it
+ * is ready to be written or read in the current lap, so producers and
+ * consumers only contend on their own position counter.
+ *
+ * bqueue_push and bqueue_pop block (spinning, then sleeping) while the queue
+ * is full or empty, which is what bounds the memory of a pipeline built from
+ * these queues.  NULL may be pushed, e.g. as an end-of-stream marker.
+ */
+struct bqueue_cell {
+    atomic_size_t seq;
+    void *item;
+};
+
+struct bqueue {
+    struct bqueue_cell *cells;
+    size_t mask;
+    /* keep the two counters on separate cache lines */
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+};
+
+/* 'capacity' is rounded up to a power of two */
+int
+bqueue_init(struct bqueue *q, size_t capacity);
+
+void
+bqueue_destroy(struct bqueue *q);
+
+bool
+bqueue_try_push(struct bqueue *q, void *item);
+
+bool
+bqueue_try_pop(struct bqueue *q, void **item);
+
+void
+bqueue_push(struct bqueue *q, void *item);
+
+void *
+bqueue_pop(struct bqueue *q);
+
+#endif
@@ -0,0 +1,195 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "codec.h"
+#include "utils.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static const char *codec_names[] = { "none", "zlib", "lz4", "zstd" };
+
+#ifdef HAVE_ZSTD
+/* compression contexts are reused by each thread across chunks */
+static __thread ZSTD_CCtx *zstd_cctx;
+static __thread ZSTD_DCtx *zstd_dctx;
+#endif
+
+const char *
+codec_name(enum codec_type type)
+{
+    if (type < CODEC_NONE || type > CODEC_ZSTD)
+        return "unknown";
+    return codec_names[type];
+}
+
+int
+codec_available(enum codec_type type)
+{
+    switch (type) {
+    case CODEC_NONE:
+    case CODEC_ZLIB:
+        return 1;
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+int
+codec_parse(struct codec *codec, const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    size_t namelen = colon ? (size_t) (colon - spec) : strlen(spec);
+
+    for (int i = CODEC_NONE; i <= CODEC_ZSTD; ++i) {
+        if (strlen(codec_names[i]) == namelen
+            && strncmp(spec, codec_names[i], namelen) == 0) {
+            if (!codec_available(i)) {
+                fprintf(stderr, "codec %s was not compiled in\n", codec_names[i]);
+                return FAILURE;
+            }
+            codec->type = i;
+            codec->level = colon ? atoi(colon + 1) : 0;
+            return SUCCESS;
+        }
+    }
+    fprintf(stderr, "unknown codec %s\n", spec);
+    return FAILURE;
+}
+
+size_t
+codec_bound(enum codec_type type, size_t length)
+{
+    switch (type) {
+    case CODEC_ZLIB:
+        return compressBound(length);
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        return LZ4_compressBound(length);
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        return ZSTD_compressBound(length);
+#endif
+    default:
+        return length;
+    }
+}
+
+int
+codec_compress(const struct codec *codec, const void *src, size_t srclen,
+               void *dst, size_t dstcap, size_t *dstlen)
+{
+    switch (codec->type) {
+    case CODEC_NONE:
+        if (dstcap < srclen)
+            return FAILURE;
+        (void) memcpy(dst, src, srclen);
+        *dstlen = srclen;
+        return SUCCESS;
+    case CODEC_ZLIB: {
+        uLongf len = dstcap;
+        int level = codec->level > 0 ? codec->level : 1;
+        if (compress2(dst, &len, src, srclen, level) != Z_OK)
+            return FAILURE;
+        *dstlen = len;
+        return SUCCESS;
+    }
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+        int len;
+        if (srclen > INT_MAX)
+            return FAILURE;
+        if (dstcap > INT_MAX)
+            dstcap = INT_MAX;
+        if (codec->level >= LZ4HC_CLEVEL_MIN)
+            len = LZ4_compress_HC(src, dst, srclen, dstcap, codec->level);
+        else
+            len = LZ4_compress_default(src, dst, srclen, dstcap);
+        if (len <= 0)
+            return FAILURE;
+        *dstlen = len;
+        return SUCCESS;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        size_t len;
+        int level = codec->level > 0 ? codec->level : 1;
+        if (zstd_cctx == NULL && (zstd_cctx = ZSTD_createCCtx()) == NULL)
+            return FAILURE;
+        len = ZSTD_compressCCtx(zstd_cctx, dst, dstcap, src, srclen, level);
+        if (ZSTD_isError(len))
+            return FAILURE;
+        *dstlen = len;
+        return SUCCESS;
+    }
+#endif
+    default:
+        return FAILURE;
+    }
+}
+
+int
+codec_decompress(enum codec_type type, const void *src, size_t srclen,
+                 void *dst, size_t dstlen)
+{
+    switch (type) {
+    case CODEC_NONE:
+        if (srclen != dstlen)
+            return FAILURE;
+        (void) memcpy(dst, src, srclen);
+        return SUCCESS;
+    case CODEC_ZLIB: {
+        /* uncompress reports success for a stream it squeezed into an empty
+         * buffer, so that gets a byte to overflow into */
+        unsigned char spare;
+        uLongf len = dstlen ? dstlen : sizeof spare;
+        if (uncompress(dstlen ? dst : &spare, &len, src, srclen) != Z_OK
+            || len != dstlen)
+            return FAILURE;
+        return SUCCESS;
+    }
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        if (srclen > INT_MAX || dstlen > INT_MAX)
+            return FAILURE;
+        if (LZ4_decompress_safe(src, dst, srclen, dstlen) != (int) dstlen)
+            return FAILURE;
+        return SUCCESS;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        size_t len;
+        if (zstd_dctx == NULL && (zstd_dctx = ZSTD_createDCtx()) == NULL)
+            return FAILURE;
+        len = ZSTD_decompressDCtx(zstd_dctx, dst, dstlen, src, srclen);
+        if (ZSTD_isError(len) || len != dstlen)
+            return FAILURE;
+        return SUCCESS;
+    }
+#endif
+    default:
+        return FAILURE;
+    }
+}
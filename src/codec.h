@@ -0,0 +1,56 @@
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include <stddef.h>
+
+/*
+ * Block compressors usable by net_send_compressed.  LZ4 and zstd are only
+ * available when configure found the libraries (HAVE_LZ4, HAVE_ZSTD).
+ *
+ * Each call compresses one independent chunk, so a stream can be compressed
+ * and sent piecewise with a scratch buffer of one chunk.
+ */
+enum codec_type {
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1,
+    CODEC_LZ4 = 2,
+    CODEC_ZSTD = 3,
+};
+
+struct codec {
+    enum codec_type type;
+    int level;                  /* codec-specific; 0 picks the default */
+};
+
+const char *
+codec_name(enum codec_type type);
+
+/* whether 'type' was compiled in */
+int
+codec_available(enum codec_type type);
+
+/* parses "NAME[:LEVEL]", e.g. "zstd:3", "lz4", "zlib:6" or "none" */
+int
+codec_parse(struct codec *codec, const char *spec);
+
+/* upper bound on the compressed size of 'length' bytes */
+size_t
+codec_bound(enum codec_type type, size_t length);
+
+/*
+ * Compresses 'srclen' bytes into 'dst', which holds 'dstcap' bytes, and sets
+ * '*dstlen' to the compressed size.  Returns FAILURE on error.
+ */
+int
+codec_compress(const struct codec *codec, const void *src, size_t srclen,
+               void *dst, size_t dstcap, size_t *dstlen);
+
+/*
+ * Decompresses 'srclen' bytes into exactly 'dstlen' bytes.  Returns FAILURE
+ * if the input is malformed or does not expand to exactly 'dstlen' bytes.
+ */
+int
+codec_decompress(enum codec_type type, const void *src, size_t srclen,
+                 void *dst, size_t dstlen);
+
+#endif
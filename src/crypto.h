@@ -1,9 +1,12 @@
 #ifndef __OTLIB_CRYPTO_H__
 #define __OTLIB_CRYPTO_H__
 
+#include <stdint.h>
 #include <stdlib.h>
 /* #include <openssl/evp.h> */
 
+#include <garble.h>
+
 int
 random_permutation(unsigned int *array, unsigned int size,
                    unsigned int *sorted, unsigned int seed);
@@ -12,6 +15,12 @@ void
 sha1_hash(char *output, size_t outputlen, int counter,
           const unsigned char *hash, size_t hashlen);
 
+void
+aes_crh(block *out, const block *in, const block *tweaks, size_t n);
+
+void
+aes_crh_bytes(char *out, size_t outlen, uint64_t counter, block in);
+
 void
 xorarray(unsigned char *a, const size_t alen,
          const unsigned char *b, const size_t blen);
@@ -3,61 +3,88 @@
 #include <assert.h>
 
 #include "gc_comm.h"
-#include "net.h"
+#include "utils.h"
 
 int
-gc_comm_send(int sock, garble_circuit *gc)
+gc_comm_send(struct net_conn *c, garble_circuit *gc)
 {
     const size_t size = garble_size(gc, true, false);
     char *buf = garble_to_buffer(gc, NULL, true, false);
-    net_send(sock, &size, sizeof size, 0);
-    net_send(sock, buf, size, 0);
+    struct iovec iov[2] = {
+        { (void *) &size, sizeof size },
+        { buf, size },
+    };
+    int res = net_conn_sendv(c, iov, 2);
     free(buf);
-    return 0;
+    return res;
 }
 
 int
-gc_comm_recv(int sock, garble_circuit *gc)
+gc_comm_recv(struct net_conn *c, garble_circuit *gc)
 {
     size_t size;
     char *buf;
 
-    net_recv(sock, &size, sizeof size, 0);
+    if (net_conn_recv(c, &size, sizeof size) == FAILURE)
+        return FAILURE;
     buf = calloc(1, size);
-    net_recv(sock, buf, size, 0);
+    if (net_conn_recv(c, buf, size) == FAILURE) {
+        free(buf);
+        return FAILURE;
+    }
     garble_from_buffer(gc, buf, true, false);
 
     free(buf);
-    return 0;
+    return SUCCESS;
 }
 
 int
-chained_gc_comm_send(int sock, ChainedGarbledCircuit *chained_gc, ChainingType chainingType)
+chained_gc_comm_send(struct net_conn *c, ChainedGarbledCircuit *chained_gc, ChainingType chainingType)
 {
-    gc_comm_send(sock, &chained_gc->gc);
-    net_send(sock, &chained_gc->id, sizeof(chained_gc->id), 0);
-    net_send(sock, &chained_gc->type, sizeof(chained_gc->type), 0);
+    /* the whole circuit goes out as one gathered write */
+    const size_t size = garble_size(&chained_gc->gc, true, false);
+    char *buf = garble_to_buffer(&chained_gc->gc, NULL, true, false);
+    struct iovec iov[5] = {
+        { (void *) &size, sizeof size },
+        { buf, size },
+        { &chained_gc->id, sizeof chained_gc->id },
+        { &chained_gc->type, sizeof chained_gc->type },
+    };
+    static const enum net_category cats[5] = {
+        NET_CAT_TABLES, NET_CAT_TABLES, NET_CAT_TABLES, NET_CAT_TABLES,
+        NET_CAT_OFFSETS,
+    };
+    int iovcnt = 4, res;
 
     if (chainingType == CHAINING_TYPE_SIMD) {
         assert(chained_gc->offlineChainingOffsets && "offlineChainingOffsets should be allocated");
-        net_send(sock, chained_gc->offlineChainingOffsets, sizeof(block) * chained_gc->gc.m, 0);
+        iov[4].iov_base = chained_gc->offlineChainingOffsets;
+        iov[4].iov_len = sizeof(block) * chained_gc->gc.m;
+        iovcnt++;
     }
-    return 0;
+    res = net_conn_sendv_tagged(c, iov, cats, iovcnt);
+    free(buf);
+    return res;
 }
 
 int 
-chained_gc_comm_recv(int sock, ChainedGarbledCircuit *chained_gc, ChainingType chainingType) 
+chained_gc_comm_recv(struct net_conn *c, ChainedGarbledCircuit *chained_gc, ChainingType chainingType) 
 {
-    gc_comm_recv(sock, &chained_gc->gc);
+    net_conn_tag(c, NET_CAT_TABLES);
+    if (gc_comm_recv(c, &chained_gc->gc) != 0)
+        return FAILURE;
     chained_gc->gc.wires = NULL;
     chained_gc->gc.gates = NULL;
-    net_recv(sock, &chained_gc->id, sizeof(chained_gc->id), 0);
-    net_recv(sock, &chained_gc->type, sizeof(chained_gc->type), 0);
+    if (net_conn_recv(c, &chained_gc->id, sizeof(chained_gc->id)) == FAILURE
+        || net_conn_recv(c, &chained_gc->type, sizeof(chained_gc->type)) == FAILURE)
+        return FAILURE;
 
     if (chainingType == CHAINING_TYPE_SIMD) {
         chained_gc->offlineChainingOffsets = garble_allocate_blocks(chained_gc->gc.m);
-        net_recv(sock, chained_gc->offlineChainingOffsets, sizeof(block) * chained_gc->gc.m, 0);
+        net_conn_tag(c, NET_CAT_OFFSETS);
+        if (net_conn_recv(c, chained_gc->offlineChainingOffsets, sizeof(block) * chained_gc->gc.m) == FAILURE)
+            return FAILURE;
     }
     
-    return 0;
+    return SUCCESS;
 }
@@ -3,10 +3,11 @@
 
 #include <garble.h>
 #include "2pc_garbled_circuit.h"
+#include "net.h"
 
-int gc_comm_send(int sock, garble_circuit *gc);
-int gc_comm_recv(int sock, garble_circuit *gc);
-int chained_gc_comm_send(int sock, ChainedGarbledCircuit *chained_gc, ChainingType chainingType);
-int chained_gc_comm_recv(int sock, ChainedGarbledCircuit *chained_gc, ChainingType chainingType) ;
+int gc_comm_send(struct net_conn *c, garble_circuit *gc);
+int gc_comm_recv(struct net_conn *c, garble_circuit *gc);
+int chained_gc_comm_send(struct net_conn *c, ChainedGarbledCircuit *chained_gc, ChainingType chainingType);
+int chained_gc_comm_recv(struct net_conn *c, ChainedGarbledCircuit *chained_gc, ChainingType chainingType) ;
 
 #endif
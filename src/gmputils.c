@@ -3,7 +3,11 @@
 #include "state.h"
 #include "utils.h"
 
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 void
 random_element(mpz_t out, struct params *p)
@@ -43,6 +47,188 @@ find_generator(mpz_t g, struct params *params)
     mpz_clears(exp, pminusone, tmp, NULL);
 }
 
+#define FB_DIGITS (1 << FB_WINDOW)
+#define FB_MAGIC 0x31544246     /* "FBT1" */
+
+static mpz_t *
+fb_entry(const struct fb_table *t, int window, int digit)
+{
+    return &t->tab[window * (FB_DIGITS - 1) + digit - 1];
+}
+
+static int
+fb_alloc(struct fb_table *t, const mpz_t base, size_t nbits)
+{
+    t->nwindows = (nbits + FB_WINDOW - 1) / FB_WINDOW;
+    t->tab = (mpz_t *) malloc(sizeof(mpz_t) * t->nwindows * (FB_DIGITS - 1));
+    if (t->tab == NULL)
+        return FAILURE;
+    for (int i = 0; i < t->nwindows * (FB_DIGITS - 1); ++i)
+        mpz_init(t->tab[i]);
+    mpz_init_set(t->base, base);
+    return SUCCESS;
+}
+
+/*
+ * Builds a table for exponents of up to 'nbits' bits
+ */
+int
+fb_init(struct fb_table *t, const mpz_t base, const mpz_t mod, size_t nbits)
+{
+    if (fb_alloc(t, base, nbits) == FAILURE)
+        return FAILURE;
+
+    mpz_mod(*fb_entry(t, 0, 1), base, mod);
+    for (int i = 0; i < t->nwindows; ++i) {
+        if (i > 0) {
+            /* entry (i, 1) is entry (i - 1, 1) raised to 2^FB_WINDOW */
+            mpz_mul(*fb_entry(t, i, 1), *fb_entry(t, i - 1, FB_DIGITS - 1),
+                    *fb_entry(t, i - 1, 1));
+            mpz_mod(*fb_entry(t, i, 1), *fb_entry(t, i, 1), mod);
+        }
+        for (int d = 2; d < FB_DIGITS; ++d) {
+            mpz_mul(*fb_entry(t, i, d), *fb_entry(t, i, d - 1),
+                    *fb_entry(t, i, 1));
+            mpz_mod(*fb_entry(t, i, d), *fb_entry(t, i, d), mod);
+        }
+    }
+    return SUCCESS;
+}
+
+void
+fb_clear(struct fb_table *t)
+{
+    if (t->tab == NULL)
+        return;
+    for (int i = 0; i < t->nwindows * (FB_DIGITS - 1); ++i)
+        mpz_clear(t->tab[i]);
+    free(t->tab);
+    t->tab = NULL;
+    mpz_clear(t->base);
+}
+
+/*
+ * Computes base^exp mod 'mod' using the table, falling back to mpz_powm if
+ * 'exp' is negative or too large for the table
+ */
+void
+fb_powm(mpz_t out, const struct fb_table *t, const mpz_t exp, const mpz_t mod)
+{
+    unsigned char digits[t->nwindows];
+    size_t ndigits = 0;
+
+    if (mpz_sgn(exp) < 0
+        || mpz_sizeinbase(exp, 2) > (size_t) t->nwindows * FB_WINDOW) {
+        mpz_powm(out, t->base, exp, mod);
+        return;
+    }
+
+    (void) mpz_export(digits, &ndigits, -1, sizeof digits[0], 0, 0, exp);
+    mpz_set_ui(out, 1);
+    for (size_t i = 0; i < ndigits; ++i) {
+        if (digits[i] == 0)
+            continue;
+        mpz_mul(out, out, *fb_entry(t, i, digits[i]));
+        mpz_mod(out, out, mod);
+    }
+}
+
+/*
+ * Table files start with a header identifying the modulus and base, so that
+ * a stale file is never used for a different group
+ */
+int
+fb_save(const struct fb_table *t, const mpz_t mod, const char *fname)
+{
+    uint32_t hdr[3] = { FB_MAGIC, field_size, t->nwindows };
+    char buf[field_size];
+    char *tmp;
+    FILE *f;
+    int res = SUCCESS;
+
+    /* write a temporary file and rename it over 'fname', so that a crash
+     * never leaves a truncated table behind for fb_load; the pid keeps
+     * both parties on one host from writing the same temporary file */
+    if ((tmp = malloc(strlen(fname) + sizeof ".tmp." + 20)) == NULL)
+        return FAILURE;
+    (void) sprintf(tmp, "%s.tmp.%ld", fname, (long) getpid());
+    if ((f = fopen(tmp, "w")) == NULL) {
+        free(tmp);
+        return FAILURE;
+    }
+    if (fwrite(hdr, sizeof hdr, 1, f) != 1)
+        res = FAILURE;
+    mpz_to_array(buf, mod, sizeof buf);
+    if (res == SUCCESS && fwrite(buf, sizeof buf, 1, f) != 1)
+        res = FAILURE;
+    mpz_to_array(buf, t->base, sizeof buf);
+    if (res == SUCCESS && fwrite(buf, sizeof buf, 1, f) != 1)
+        res = FAILURE;
+    for (int i = 0; res == SUCCESS && i < t->nwindows * (FB_DIGITS - 1); ++i) {
+        mpz_to_array(buf, t->tab[i], sizeof buf);
+        if (fwrite(buf, sizeof buf, 1, f) != 1)
+            res = FAILURE;
+    }
+    if (res == SUCCESS && (fflush(f) != 0 || fsync(fileno(f)) == -1))
+        res = FAILURE;
+    if (fclose(f) != 0)
+        res = FAILURE;
+    if (res == SUCCESS && rename(tmp, fname) == -1)
+        res = FAILURE;
+    if (res == FAILURE)
+        (void) unlink(tmp);
+    free(tmp);
+    return res;
+}
+
+int
+fb_load(struct fb_table *t, const mpz_t base, const mpz_t mod, size_t nbits,
+        const char *fname)
+{
+    uint32_t hdr[3];
+    char buf[field_size], expected[field_size];
+    FILE *f;
+    int res = SUCCESS;
+
+    t->tab = NULL;
+    if ((f = fopen(fname, "r")) == NULL)
+        return FAILURE;
+    if (fread(hdr, sizeof hdr, 1, f) != 1
+        || hdr[0] != FB_MAGIC || hdr[1] != field_size
+        || hdr[2] != (nbits + FB_WINDOW - 1) / FB_WINDOW) {
+        res = FAILURE;
+        goto cleanup;
+    }
+    mpz_to_array(expected, mod, sizeof expected);
+    if (fread(buf, sizeof buf, 1, f) != 1
+        || memcmp(buf, expected, sizeof buf) != 0) {
+        res = FAILURE;
+        goto cleanup;
+    }
+    mpz_to_array(expected, base, sizeof expected);
+    if (fread(buf, sizeof buf, 1, f) != 1
+        || memcmp(buf, expected, sizeof buf) != 0) {
+        res = FAILURE;
+        goto cleanup;
+    }
+    if (fb_alloc(t, base, nbits) == FAILURE) {
+        res = FAILURE;
+        goto cleanup;
+    }
+    for (int i = 0; i < t->nwindows * (FB_DIGITS - 1); ++i) {
+        if (fread(buf, sizeof buf, 1, f) != 1) {
+            fb_clear(t);
+            res = FAILURE;
+            goto cleanup;
+        }
+        array_to_mpz(t->tab[i], buf, sizeof buf);
+    }
+
+cleanup:
+    (void) fclose(f);
+    return res;
+}
+
 int
 encode(mpz_t elem, const char *str, size_t strlen, const struct params *p)
 {
@@ -24,6 +24,36 @@ array_to_mpz(mpz_t out, const char *buf, const size_t buflen);
 void
 find_generator(mpz_t g, struct params *params);
 
+/*
+ * Fixed-base exponentiation table for 'base' with FB_WINDOW-bit windows:
+ * entry (i, d) holds base^(d * 2^(FB_WINDOW * i)) for d = 1, ..., 2^FB_WINDOW
+ * - 1, so that base^e for an exponent of at most nwindows * FB_WINDOW bits
+ * costs one modular multiplication per non-zero window of e.
+ */
+#define FB_WINDOW 8
+
+struct fb_table {
+    mpz_t base;
+    int nwindows;
+    mpz_t *tab;
+};
+
+int
+fb_init(struct fb_table *t, const mpz_t base, const mpz_t mod, size_t nbits);
+
+void
+fb_clear(struct fb_table *t);
+
+void
+fb_powm(mpz_t out, const struct fb_table *t, const mpz_t exp, const mpz_t mod);
+
+int
+fb_save(const struct fb_table *t, const mpz_t mod, const char *fname);
+
+int
+fb_load(struct fb_table *t, const mpz_t base, const mpz_t mod, size_t nbits,
+        const char *fname);
+
 int
 encode(mpz_t elem, const char *str, size_t strlen, const struct params *p);
 
@@ -10,11 +10,15 @@
 #include "2pc_garbler.h"
 #include "2pc_evaluator.h"
 #include "2pc_aes.h"
+#include "2pc_bench.h"
 #include "2pc_cbc.h"
 #include "2pc_leven.h"
+#include "2pc_server.h"
 #include "2pc_tests.h"
 #include "2pc_hyperplane.h"
 #include "net.h"
+#include "otpool.h"
+#include "state.h"
 #include "utils.h"
 #include "ml_models.h"
 
@@ -52,6 +56,11 @@ struct args {
     uint64_t nsymbols;
     experiment type;
     uint64_t ntrials;
+    bool bench_ot;
+    bool bench_hash;
+    char *bench_codec;
+    bool session;
+    int serve;
 };
 
 static void
@@ -68,11 +77,16 @@ args_init(struct args *args, const char *progname)
     args->type = EXPERIMENT_NONE;
     args->ntrials = 1;
     args->nsymbols = 30;
+    args->bench_ot = false;
+    args->bench_hash = false;
+    args->bench_codec = NULL;
+    args->session = false;
+    args->serve = 0;
 }
 
 static struct option opts[] =
 {
-    /* {"chaining", required_argument, 0, 'c'}, */
+    {"chaining", required_argument, 0, 'c'},
     {"garb-off", no_argument, 0, 'g'},
     {"eval-off", no_argument, 0, 'e'},
     {"garb-on", no_argument, 0, 'G'},
@@ -82,7 +96,26 @@ static struct option opts[] =
     {"nsymbols", required_argument, 0, 'l'},
     {"test", no_argument, 0, 'p'},
     {"type", required_argument, 0, 't'},
+    {"base-ot", required_argument, 0, 'b'},
+    {"bench-ot", no_argument, 0, 'B'},
+    {"bench-hash", no_argument, 0, 'H'},
+    {"bench-codec", required_argument, 0, 'Z'},
+    {"codec", required_argument, 0, 'z'},
+    {"ot-threads", required_argument, 0, 'j'},
+    {"ot-pool", required_argument, 0, 'P'},
+    {"ot-correlated", no_argument, 0, 'C'},
+    {"no-nodelay", no_argument, 0, 'N'},
+    {"sock-buf", required_argument, 0, 'S'},
+    {"transport", required_argument, 0, 'X'},
+    {"link", required_argument, 0, 'L'},
+    {"port", required_argument, 0, 'O'},
     {"times", required_argument, 0, 'T'},
+    {"session", no_argument, 0, 's'},
+    {"serve", required_argument, 0, 'W'},
+    {"slices", required_argument, 0, 'k'},
+    {"gc-pool", required_argument, 0, 'R'},
+    {"garble-threads", required_argument, 0, 'Y'},
+    {"eval-threads", required_argument, 0, 'J'},
     {"help", no_argument, 0, 'h'},
     {0, 0, 0, 0}
 };
@@ -103,14 +136,52 @@ usage(const char *prog, int ret)
 "  --type T        Run circuit T\n"
 "                  Options: AES, CBC, LEVEN, WDBC, CREDIT, HYPER, RANDOM_DT, "
 "NURSERY_DT, ECG_DT, WDBC_NB, NURSERY_NB, AUD_NB\n"
-"  --times T       Do T runs\n", prog);
+"  --times T       Do T runs\n"
+"  --chaining C    Chain components with C: STANDARD (default), one offset\n"
+"                  per wire, or SCMC, one offset per component edge (AES,\n"
+"                  CBC and LEVEN only; both parties must agree)\n"
+"  --session       Run the online trials as queries of one long-lived\n"
+"                  session, loading the function and connecting only\n"
+"                  once; every query still takes fresh components\n"
+"  --serve W       With --garb-on, serve concurrent evaluator sessions on\n"
+"                  W worker threads until T queries have been answered\n"
+"  --slices K      Garble K disjoint copies of the components offline,\n"
+"                  so that K evaluators can be served at once\n"
+"  --gc-pool W     Keep at least W fresh components of each type in the\n"
+"                  component pool, garbling more in the background\n"
+"  --garble-threads N\n"
+"                  Garble offline components on N threads\n"
+"  --eval-threads N\n"
+"                  Evaluate independent components on N threads online\n"
+"  --base-ot T     Use base OT T for OT extension\n"
+"                  Options: NP, CO\n"
+"  --bench-ot      Benchmark the OT implementations\n"
+"  --bench-hash    Benchmark SHA-1 against fixed-key AES hashing\n"
+"  --bench-codec F Benchmark the codecs on the instructions of function F\n"
+"                  and pick the best one per link bandwidth\n"
+"  --codec C[:L]   Compress instructions with codec C at level L\n"
+"                  Options: none, zlib, lz4, zstd\n"
+"  --ot-threads N  Use N threads for Naor-Pinkas OT\n"
+"  --ot-pool N     Keep a pool of N preprocessed OTs, refilled in the\n"
+"                  background, and use a fresh slice of it for each run\n"
+"  --ot-correlated Use correlated OTs, sending one label per evaluator\n"
+"                  input online (both parties must agree)\n"
+"  --no-nodelay    Leave Nagle's algorithm enabled on connections\n"
+"  --sock-buf N    Set socket send and receive buffers to N bytes\n"
+"  --transport T   Connect the parties over T: tcp (default), or, when both\n"
+"                  run on this machine, unix or shm (shared-memory rings)\n"
+"  --link D[:R[:J]] Emulate a link with D ms one-way delay, R Mbit/s and up\n"
+"                  to J ms jitter; both parties must pass the same link\n"
+"  --port P        Connect on port P (default 8000), and run the OT pool\n"
+"                  and the component pool on P+1 and P+2; both parties\n"
+"                  must pass the same port\n", prog);
     exit(ret);
 }
 
 static void
-eval_off(int ninputs, int nchains, ChainingType chainingType)
+eval_off(int ninputs, ChainingType chainingType)
 {
-    evaluator_offline(EVALUATOR_DIR, ninputs, nchains, chainingType);
+    evaluator_offline(EVALUATOR_DIR, ninputs, chainingType);
 }
 
 static size_t
@@ -136,6 +207,39 @@ confidence(uint64_t *a, size_t n, uint64_t avg)
     return 1.96 * sigma / sqrt((double) n);
 }
 
+/*
+ * Prints the traffic of the last 'n' runs and starts a new ledger.  The Kbits
+ * lines are per run and count the per-query (online) phase only; the
+ * breakdown and the JSON line are totals.
+ */
+static void
+traffic(const char *name, uint64_t n)
+{
+    struct net_traffic online = net_ledger_phase(&net_ledger, NET_PHASE_ONLINE);
+
+    printf("%s Kbits sent: %lu\n", name,
+           n > 0 ? online.bytes_sent * 8 / 1000 / n : 0);
+    printf("%s Kbits received: %lu\n", name,
+           n > 0 ? online.bytes_received * 8 / 1000 / n : 0);
+    for (int p = 0; p < NET_NPHASES; ++p) {
+        for (int c = 0; c < NET_NCATEGORIES; ++c) {
+            const struct net_traffic *t = &net_ledger.traffic[p][c];
+            if (t->msgs_sent == 0 && t->msgs_received == 0)
+                continue;
+            printf("%s %s %s: %lu bytes sent (%lu msgs), %lu bytes received (%lu msgs)\n",
+                   name, net_phase_name(p), net_category_name(c),
+                   t->bytes_sent, t->msgs_sent, t->bytes_received,
+                   t->msgs_received);
+        }
+        if (net_ledger.round_trips[p] > 0)
+            printf("%s %s round trips: %lu\n", name, net_phase_name(p),
+                   net_ledger.round_trips[p]);
+    }
+    printf("%s traffic: ", name);
+    net_ledger_json(stdout, &net_ledger, n);
+    net_ledger_reset();
+}
+
 static void
 results(const char *name, uint64_t *totals, uint64_t *totals_no_load, uint64_t n)
 {
@@ -150,16 +254,18 @@ results(const char *name, uint64_t *totals, uint64_t *totals_no_load, uint64_t n
         conf = confidence(totals_no_load, n, avg);
         printf("%s avg (no load): %lu +- %f microsec\n", name, avg / 1000, conf / 1000);
     }
-    printf("%s Kbits sent: %lu\n", name, g_bytes_sent * 8 / 1000);
-    printf("%s Kbits received: %lu\n", name, g_bytes_received * 8 / 1000);
+    traffic(name, n);
 }
 
 static void
-garb_on(char *function_path, int ninputs, int nchains, uint64_t ntrials,
-        ChainingType chainingType, int l, int sigma, experiment which_experiment)
+garb_on(char *function_path, int ninputs, uint64_t ntrials,
+        ChainingType chainingType, int l, int sigma, experiment which_experiment,
+        bool session, int serve)
 {
     uint64_t *tot_time;
     bool *inputs;
+    struct otpool_refiller refiller;
+    GCPoolRefiller gcRefiller;
 
     inputs = calloc(ninputs, sizeof inputs[0]);
 
@@ -196,14 +302,56 @@ garb_on(char *function_path, int ninputs, int nchains, uint64_t ntrials,
     }
     tot_time = calloc(ntrials, sizeof tot_time[0]);
 
-    for (size_t i = 0; i < ntrials; i++) {
-        /* sleep(2); */
-        g_bytes_sent = g_bytes_received = 0;
-        garbler_online(function_path, GARBLER_DIR, inputs, ninputs, nchains, 
-                       &tot_time[i], chainingType);
-        fprintf(stderr, "Total: %lu\n", tot_time[i]);
+    if (ot_pool_size > 0)
+        (void) otpool_refiller_start(&refiller, GARBLER_DIR, true);
+    if (gc_pool_watermark > 0)
+        (void) garbler_pool_refiller_start(&gcRefiller, GARBLER_DIR, chainingType);
+
+    if (serve > 0) {
+        /* reports its own throughput and latency */
+        (void) garbler_serve(function_path, GARBLER_DIR, inputs, serve,
+                             ntrials, chainingType);
+        if (ot_pool_size > 0)
+            otpool_refiller_stop(&refiller);
+        if (gc_pool_watermark > 0)
+            gcPoolRefillerStop(&gcRefiller);
+        traffic("GARB", ntrials);
+        free(inputs);
+        free(tot_time);
+        return;
+    } else if (session) {
+        /* serve evaluator sessions until ntrials queries have run */
+        GarblerSession gs;
+        uint64_t nqueries = 0;
+
+        if (garbler_session_init(&gs, function_path, GARBLER_DIR,
+                                 chainingType) == FAILURE)
+            exit(EXIT_FAILURE);
+        while (nqueries < ntrials) {
+            uint64_t prev = nqueries;
+            if (garbler_session_serve(&gs, inputs, tot_time, ntrials,
+                                      &nqueries) == FAILURE)
+                break;
+            for (uint64_t i = prev; i < nqueries && i < ntrials; ++i)
+                fprintf(stderr, "Total: %lu\n", tot_time[i]);
+        }
+        garbler_session_cleanup(&gs);
+        if (nqueries > 0 && nqueries < ntrials)
+            ntrials = nqueries;
+    } else {
+        for (size_t i = 0; i < ntrials; i++) {
+            /* sleep(2); */
+            garbler_online(function_path, GARBLER_DIR, inputs, ninputs,
+                           &tot_time[i], chainingType);
+            fprintf(stderr, "Total: %lu\n", tot_time[i]);
+        }
     }
 
+    if (ot_pool_size > 0)
+        otpool_refiller_stop(&refiller);
+    if (gc_pool_watermark > 0)
+        gcPoolRefillerStop(&gcRefiller);
+
     results("GARB", tot_time, NULL, ntrials);
 
     free(inputs);
@@ -212,27 +360,61 @@ garb_on(char *function_path, int ninputs, int nchains, uint64_t ntrials,
 
 static void
 eval_on(int ninputs, int nlabels, int nchains, int ntrials,
-        ChainingType chainingType, ChainedGarbledCircuit *cgcs)
+        ChainingType chainingType, ChainedGarbledCircuit *cgcs, bool session)
 {
     (void) nlabels;
     uint64_t *tot_time, *tot_time_no_load;
     int *inputs;
+    struct otpool_refiller refiller;
+    GCPoolRefiller gcRefiller;
 
     tot_time = calloc(ntrials, sizeof tot_time[0]);
     tot_time_no_load = calloc(ntrials, sizeof tot_time_no_load[0]);
     inputs = calloc(ninputs, sizeof inputs[0]);
 
-    for (int i = 0; i < ntrials; i++) {
-        sleep(1); // uncomment this if getting hung up
-        g_bytes_sent = g_bytes_received = 0;
-        for (int j = 0; j < ninputs; j++) {
-            inputs[j] = rand() % 2;
+    if (ot_pool_size > 0)
+        (void) otpool_refiller_start(&refiller, EVALUATOR_DIR, false);
+    if (gc_pool_watermark > 0)
+        (void) evaluator_pool_refiller_start(&gcRefiller, EVALUATOR_DIR,
+                                             chainingType);
+
+    if (session) {
+        /* one connection for all trials; the load is paid once */
+        EvaluatorSession es;
+        uint64_t load_time;
+
+        if (evaluator_session_open(&es, EVALUATOR_DIR, ninputs, nchains,
+                                   chainingType, cgcs, &load_time) == FAILURE)
+            exit(EXIT_FAILURE);
+        fprintf(stderr, "Load: %lu\n", load_time);
+        for (int i = 0; i < ntrials; i++) {
+            for (int j = 0; j < ninputs; j++) {
+                inputs[j] = rand() % 2;
+            }
+            if (evaluator_session_query(&es, inputs, i == ntrials - 1,
+                                        &tot_time_no_load[i]) == FAILURE)
+                exit(EXIT_FAILURE);
+            tot_time[i] = tot_time_no_load[i];
+            fprintf(stderr, "Total: %lu\n", tot_time[i]);
+        }
+        evaluator_session_close(&es);
+    } else {
+        for (int i = 0; i < ntrials; i++) {
+            sleep(1); // uncomment this if getting hung up
+            for (int j = 0; j < ninputs; j++) {
+                inputs[j] = rand() % 2;
+            }
+            evaluator_online(EVALUATOR_DIR, inputs, ninputs, nchains, chainingType,
+                             &tot_time[i], &tot_time_no_load[i], cgcs);
+            fprintf(stderr, "Total: %lu\n", tot_time[i]);
         }
-        evaluator_online(EVALUATOR_DIR, inputs, ninputs, nchains, chainingType,
-                         &tot_time[i], &tot_time_no_load[i], cgcs);
-        fprintf(stderr, "Total: %lu\n", tot_time[i]);
     }
 
+    if (ot_pool_size > 0)
+        otpool_refiller_stop(&refiller);
+    if (gc_pool_watermark > 0)
+        gcPoolRefillerStop(&gcRefiller);
+
     results("EVAL", tot_time, tot_time_no_load, ntrials);
 
     for (int i = 0; i < nchains; ++i) {
@@ -261,7 +443,6 @@ garb_full(garble_circuit *gc, int num_garb_inputs, int num_eval_inputs,
         uint64_t *tot_time = calloc(ntrials, sizeof tot_time[0]);
 
         for (int i = 0; i < ntrials; ++i) {
-            g_bytes_sent = g_bytes_received = 0;
             int DIntSize = (int) floor(log2(l)) + 1;
             int inputsDevotedToD = DIntSize * (l+1);
             if (EXPERIMENT_LEVEN == which_experiment) {
@@ -310,7 +491,6 @@ eval_full(garble_circuit *gc, int n_garb_inputs, int n_eval_inputs, int noutputs
 
     for (int i = 0; i < ntrials; ++i) {
         sleep(1);
-        g_bytes_sent = g_bytes_received = 0;
         for (int i = 0; i < n_eval_inputs; i++) {
             eval_inputs[i] = rand() % 2;
         }
@@ -339,7 +519,6 @@ go(struct args *args)
     int C_size = 0, T_size = 0;
 
 
-    /* chainingType = CHAINING_TYPE_SIMD; */
     switch (args->type) {
     case EXPERIMENT_AES:
         n_garb_inputs = aesNumGarbInputs();
@@ -485,8 +664,17 @@ go(struct args *args)
         usage(args->progname, EXIT_FAILURE);
     }
 
-    if (args->chaining_type != CHAINING_TYPE_STANDARD)
-        abort();
+    /* only these components are garbled with SIMD input labels */
+    if (args->chaining_type == CHAINING_TYPE_SIMD
+        && args->type != EXPERIMENT_AES && args->type != EXPERIMENT_CBC
+        && args->type != EXPERIMENT_LEVEN) {
+        fprintf(stderr, "SCMC chaining is only supported for AES, CBC and LEVEN\n");
+        exit(EXIT_FAILURE);
+    }
+    if (args->chaining_type == CHAINING_TYPE_SIMD && gc_pool_watermark > 0) {
+        fprintf(stderr, "SCMC chaining does not support --gc-pool\n");
+        exit(EXIT_FAILURE);
+    }
 
     printf("Running %s with (%d, %d) inputs, %d outputs, %d chains, %d trials\n",
            type, n_garb_inputs, n_eval_inputs, noutputs, ncircs, args->ntrials);
@@ -529,8 +717,10 @@ go(struct args *args)
         default:
             abort();
         }
+        traffic("GARB", 1);
     } else if (args->eval_off) {
-        eval_off(n_eval_inputs, ncircs, args->chaining_type);
+        eval_off(n_eval_inputs, args->chaining_type);
+        traffic("EVAL", 1);
     } else if (args->garb_on) {
         if (args->type == EXPERIMENT_LEVEN) {
             char *fn;
@@ -540,10 +730,12 @@ go(struct args *args)
                 + (int) floor(log10((float) l)) + 2;
             fn = malloc(size);
             (void) snprintf(fn, size, "functions/leven_%d.json", l);
-            garb_on(fn, n_garb_inputs, ncircs, args->ntrials, args->chaining_type, l, sigma, args->type);
+            garb_on(fn, n_garb_inputs, args->ntrials, args->chaining_type, l, sigma, args->type,
+                    args->session, args->serve);
             free(fn);
         } else {
-            garb_on(fn, n_garb_inputs, ncircs, args->ntrials, args->chaining_type, 0, 0, args->type);
+            garb_on(fn, n_garb_inputs, args->ntrials, args->chaining_type, 0, 0, args->type,
+                    args->session, args->serve);
         }
     } else if (args->eval_on) {
         ChainedGarbledCircuit *cgcs;
@@ -584,7 +776,8 @@ go(struct args *args)
         default:
             abort();
         }
-        eval_on(n_eval_inputs, n_eval_labels, ncircs, args->ntrials, args->chaining_type, cgcs);
+        eval_on(n_eval_inputs, n_eval_labels, ncircs, args->ntrials, args->chaining_type, cgcs,
+                args->session);
     } else if (args->garb_full || args->eval_full) {
         garble_circuit gc;
         switch (args->type) {
@@ -656,16 +849,16 @@ main(int argc, char *argv[])
         switch (c) {
         case 0:
             break;
-            /* case 'c': */
-            /*     if (strcmp(optarg, "STANDARD") == 0) { */
-            /*         args.chaining_type = CHAINING_TYPE_STANDARD; */
-            /*     } else if (strcmp(optarg, "SCMC") == 0) { */
-            /*         args.chaining_type = CHAINING_TYPE_SIMD; */
-            /*     } else { */
-            /*         fprintf(stderr, "Unknown chaining type %s\n", optarg); */
-            /*         exit(EXIT_FAILURE); */
-            /*     } */
-            /*     break; */
+        case 'c':
+            if (strcmp(optarg, "STANDARD") == 0) {
+                args.chaining_type = CHAINING_TYPE_STANDARD;
+            } else if (strcmp(optarg, "SCMC") == 0) {
+                args.chaining_type = CHAINING_TYPE_SIMD;
+            } else {
+                fprintf(stderr, "Unknown chaining type %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'g':
             args.garb_off = true;
             break;
@@ -720,6 +913,98 @@ main(int argc, char *argv[])
         case 'T':
             args.ntrials = atoi(optarg);
             break;
+        case 's':
+            args.session = true;
+            break;
+        case 'W':
+            args.serve = atoi(optarg);
+            if (args.serve < 1) {
+                fprintf(stderr, "Invalid number of workers %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'k':
+            component_slices = atoi(optarg);
+            if (component_slices < 1) {
+                fprintf(stderr, "Invalid number of slices %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            gc_pool_watermark = atoi(optarg);
+            if (gc_pool_watermark < 0) {
+                fprintf(stderr, "Invalid pool watermark %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Y':
+            component_threads = atoi(optarg);
+            if (component_threads < 1) {
+                fprintf(stderr, "Invalid number of threads %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'J':
+            evaluator_threads = atoi(optarg);
+            if (evaluator_threads < 1) {
+                fprintf(stderr, "Invalid number of threads %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "NP") == 0) {
+                ot_base_type = OT_BASE_NP;
+            } else if (strcmp(optarg, "CO") == 0) {
+                ot_base_type = OT_BASE_CO;
+            } else {
+                fprintf(stderr, "Unknown base OT type %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            args.bench_ot = true;
+            break;
+        case 'H':
+            args.bench_hash = true;
+            break;
+        case 'Z':
+            args.bench_codec = optarg;
+            break;
+        case 'z':
+            if (codec_parse(&net_codec, optarg) == FAILURE)
+                exit(EXIT_FAILURE);
+            break;
+        case 'P':
+            ot_pool_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'C':
+            ot_correlated = true;
+            break;
+        case 'N':
+            net_sockopts.nodelay = false;
+            break;
+        case 'S':
+            net_sockopts.sndbuf = net_sockopts.rcvbuf = atoi(optarg);
+            break;
+        case 'X':
+            if (net_transport_parse(optarg) == FAILURE)
+                exit(EXIT_FAILURE);
+            break;
+        case 'L':
+            if (net_link_parse(optarg) == FAILURE)
+                exit(EXIT_FAILURE);
+            break;
+        case 'O':
+            if (net_port_parse(optarg) == FAILURE)
+                exit(EXIT_FAILURE);
+            break;
+        case 'j':
+            ot_nthreads = atoi(optarg);
+            if (ot_nthreads < 1) {
+                fprintf(stderr, "Invalid number of threads %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'p':
             printf("Running tests\n");
             runAllTests();
@@ -733,5 +1018,14 @@ main(int argc, char *argv[])
             abort();
         }
     }
+    if (args.bench_ot || args.bench_hash || args.bench_codec) {
+        if (args.bench_ot)
+            benchOT(1000, 1000000);
+        if (args.bench_hash)
+            benchHash(1 << 22);
+        if (args.bench_codec)
+            benchCodec(args.bench_codec);
+        return 0;
+    }
     return go(&args);
 }
@@ -1,31 +1,280 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "net.h"
 #include "utils.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <assert.h>
 
-#include <zlib.h>
-
 #define BACKLOG 5
-/* between -1 and 9 */
-#define COMPRESSION_LEVEL 9
+#ifndef IOV_MAX
+/* not exposed by limits.h without _XOPEN_SOURCE; the Linux limit */
+#define IOV_MAX 1024
+#endif
+
+struct net_ledger net_ledger;
+/* protects net_ledger against connections closed concurrently and against
+ * raw sockets accounted from other threads */
+static pthread_mutex_t net_ledger_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *net_category_names[] = {
+    "other", "ot", "tables", "instructions", "mapping", "labels", "output",
+    "offsets", "control",
+};
+
+static const char *net_phase_names[] = {
+    "offline", "preprocess", "setup", "online",
+};
+
+struct net_sockopts net_sockopts = { true, 0, 0 };
+
+#if defined(HAVE_ZSTD)
+struct codec net_codec = { CODEC_ZSTD, 1 };
+#elif defined(HAVE_LZ4)
+struct codec net_codec = { CODEC_LZ4, 0 };
+#else
+struct codec net_codec = { CODEC_ZLIB, 1 };
+#endif
+
+enum net_transport_type net_transport = NET_TCP;
+
+static const char *net_transport_names[] = { "tcp", "unix", "shm" };
+
+/* set before any connection is made, so read without a lock */
+static char net_ports[NET_NPORTS][8] = { "8000", "8001", "8002" };
+
+struct net_fd_entry {
+    struct net_conn *conn;      /* connection wrapping the socket */
+    bool accepted;              /* whether it came from net_server_accept */
+};
+
+/*
+ * Per-descriptor state of the sockets, indexed by descriptor.  The table is
+ * grown under net_fds_lock to fit the largest descriptor registered and is
+ * read without the lock; replaced tables are never freed, as a concurrent
+ * lookup may still be reading one.
+ */
+struct net_fd_table {
+    int size;
+    struct net_fd_entry ent[];
+};
+
+static struct net_fd_table *net_fds;
+static pthread_mutex_t net_fds_lock = PTHREAD_MUTEX_INITIALIZER;
 
-size_t g_bytes_sent = 0;
-size_t g_bytes_received = 0;
+int
+net_transport_parse(const char *name)
+{
+    for (int i = NET_TCP; i <= NET_SHM; ++i) {
+        if (strcmp(name, net_transport_names[i]) == 0) {
+            net_transport = i;
+            return SUCCESS;
+        }
+    }
+    fprintf(stderr, "unknown transport %s\n", name);
+    return FAILURE;
+}
+
+const char *
+net_transport_name(enum net_transport_type type)
+{
+    if (type < NET_TCP || type > NET_SHM)
+        return "unknown";
+    return net_transport_names[type];
+}
+
+int
+net_port_parse(const char *base)
+{
+    char *end;
+    long port = strtol(base, &end, 10);
+
+    if (*base == '\0' || *end != '\0' || port < 1
+        || port > 65535 - (NET_NPORTS - 1)) {
+        fprintf(stderr, "invalid port %s\n", base);
+        return FAILURE;
+    }
+    for (int i = 0; i < NET_NPORTS; ++i)
+        (void) snprintf(net_ports[i], sizeof net_ports[i], "%ld", port + i);
+    return SUCCESS;
+}
+
+const char *
+net_port(enum net_port_id id)
+{
+    return net_ports[id];
+}
+
+static struct net_conn *
+net_conn_lookup(int fd)
+{
+    struct net_fd_table *t = __atomic_load_n(&net_fds, __ATOMIC_ACQUIRE);
+
+    if (fd < 0 || t == NULL || fd >= t->size)
+        return NULL;
+    return __atomic_load_n(&t->ent[fd].conn, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the entry of 'fd', growing the table to fit it.  Must be called
+ * with net_fds_lock held.  Returns NULL on error.
+ */
+static struct net_fd_entry *
+net_fd_entry(int fd)
+{
+    struct net_fd_table *t = net_fds, *bigger;
+    int size;
+
+    if (fd < 0)
+        return NULL;
+    if (t != NULL && fd < t->size)
+        return &t->ent[fd];
+    size = t ? 2 * t->size : 1024;
+    if (size <= fd)
+        size = fd + 1;
+    bigger = calloc(1, sizeof *bigger + size * sizeof bigger->ent[0]);
+    if (bigger == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    bigger->size = size;
+    if (t != NULL)
+        (void) memcpy(bigger->ent, t->ent, t->size * sizeof t->ent[0]);
+    __atomic_store_n(&net_fds, bigger, __ATOMIC_RELEASE);
+    return &bigger->ent[fd];
+}
+
+/*
+ * Records which side of the connection 'fd' is, which the shared-memory
+ * handshake needs to avoid both sides waiting for the other
+ */
+static int
+net_fd_set_accepted(int fd, bool accepted)
+{
+    struct net_fd_entry *e;
+
+    pthread_mutex_lock(&net_fds_lock);
+    if ((e = net_fd_entry(fd)) != NULL)
+        e->accepted = accepted;
+    pthread_mutex_unlock(&net_fds_lock);
+    return e == NULL ? FAILURE : SUCCESS;
+}
+
+static void
+net_account_raw(uint64_t *bytes, uint64_t *msgs, size_t length)
+{
+    pthread_mutex_lock(&net_ledger_lock);
+    *bytes += length;
+    *msgs += 1;
+    pthread_mutex_unlock(&net_ledger_lock);
+}
+
+const char *
+net_category_name(enum net_category cat)
+{
+    if (cat < NET_CAT_OTHER || cat >= NET_NCATEGORIES)
+        return "unknown";
+    return net_category_names[cat];
+}
+
+const char *
+net_phase_name(enum net_phase phase)
+{
+    if (phase < NET_PHASE_OFFLINE || phase >= NET_NPHASES)
+        return "unknown";
+    return net_phase_names[phase];
+}
+
+void
+net_ledger_reset(void)
+{
+    pthread_mutex_lock(&net_ledger_lock);
+    memset(&net_ledger, '\0', sizeof net_ledger);
+    pthread_mutex_unlock(&net_ledger_lock);
+}
+
+void
+net_ledger_merge(struct net_ledger *dst, const struct net_ledger *src)
+{
+    for (int p = 0; p < NET_NPHASES; ++p) {
+        for (int c = 0; c < NET_NCATEGORIES; ++c) {
+            struct net_traffic *d = &dst->traffic[p][c];
+            const struct net_traffic *s = &src->traffic[p][c];
+            d->bytes_sent += s->bytes_sent;
+            d->bytes_received += s->bytes_received;
+            d->msgs_sent += s->msgs_sent;
+            d->msgs_received += s->msgs_received;
+        }
+        dst->round_trips[p] += src->round_trips[p];
+    }
+}
+
+struct net_traffic
+net_ledger_phase(const struct net_ledger *l, enum net_phase phase)
+{
+    struct net_traffic t;
+
+    memset(&t, '\0', sizeof t);
+    for (int c = 0; c < NET_NCATEGORIES; ++c) {
+        t.bytes_sent += l->traffic[phase][c].bytes_sent;
+        t.bytes_received += l->traffic[phase][c].bytes_received;
+        t.msgs_sent += l->traffic[phase][c].msgs_sent;
+        t.msgs_received += l->traffic[phase][c].msgs_received;
+    }
+    return t;
+}
+
+void
+net_ledger_json(FILE *f, const struct net_ledger *l, uint64_t nruns)
+{
+    /* {"runs": 10, "online": {"round_trips": 20, "labels": {...}, ...}} */
+    fprintf(f, "{\"runs\": %lu", nruns);
+    for (int p = 0; p < NET_NPHASES; ++p) {
+        struct net_traffic tot = net_ledger_phase(l, p);
+
+        if (tot.msgs_sent == 0 && tot.msgs_received == 0)
+            continue;
+        fprintf(f, ", \"%s\": {\"round_trips\": %lu", net_phase_names[p],
+                l->round_trips[p]);
+        for (int c = 0; c < NET_NCATEGORIES; ++c) {
+            const struct net_traffic *t = &l->traffic[p][c];
+            if (t->msgs_sent == 0 && t->msgs_received == 0)
+                continue;
+            fprintf(f, ", \"%s\": {\"bytes_sent\": %lu, \"bytes_received\": %lu, "
+                    "\"msgs_sent\": %lu, \"msgs_received\": %lu}",
+                    net_category_names[c], t->bytes_sent, t->bytes_received,
+                    t->msgs_sent, t->msgs_received);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "}\n");
+}
 
 int
 net_send(int socket, const void *buffer, size_t length, int flags)
 {
+    struct net_conn *c;
     size_t total = 0;
     ssize_t bytesleft = length;
 
+    if ((c = net_conn_lookup(socket)) != NULL)
+        return net_conn_send(c, buffer, length);
+
     while (total < length) {
         ssize_t n = send(socket, ((char *) buffer) + total, bytesleft, flags);
         if (n == -1) {
@@ -35,52 +284,84 @@ net_send(int socket, const void *buffer, size_t length, int flags)
         total += n;
         bytesleft -= n;
     }
-    g_bytes_sent += length;
+    net_account_raw(&net_ledger.traffic[NET_PHASE_OFFLINE][NET_CAT_OT].bytes_sent,
+                    &net_ledger.traffic[NET_PHASE_OFFLINE][NET_CAT_OT].msgs_sent,
+                    length);
     return SUCCESS;
 }
 
 int
 net_recv(int socket, void *buffer, size_t length, int flags)
 {
+    struct net_conn *c;
     size_t total = 0;
     ssize_t bytesleft = length;
 
+    if ((c = net_conn_lookup(socket)) != NULL)
+        return net_conn_recv(c, buffer, length);
+
     while (total < length) {
         ssize_t n = recv(socket, ((char *) buffer) + total, bytesleft, flags);
         if (n == -1) {
             perror("recv");
             return FAILURE;
         }
+        if (n == 0) {
+            fprintf(stderr, "recv: connection closed\n");
+            return FAILURE;
+        }
         total += n;
         bytesleft -= n;
     }
-    g_bytes_received += length;
+    net_account_raw(&net_ledger.traffic[NET_PHASE_OFFLINE][NET_CAT_OT].bytes_received,
+                    &net_ledger.traffic[NET_PHASE_OFFLINE][NET_CAT_OT].msgs_received,
+                    length);
     return SUCCESS;
 }
 
+/* header preceding each chunk of a compressed stream */
+struct net_chunk_hdr {
+    uint8_t codec;
+    uint8_t pad[3];
+    uint32_t clen;              /* compressed size of the chunk */
+};
+
 int
 net_send_compressed(int socket, const void *buffer, size_t length, int flags)
 {
-    int ret;
-    z_stream strm;
-    unsigned char *cbuffer;
-    size_t clength;
-
-    cbuffer = calloc(length, sizeof cbuffer[0]);
-
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    (void) deflateInit(&strm, COMPRESSION_LEVEL);
-    strm.avail_in = length;
-    strm.next_in = buffer;
-    strm.avail_out = length;
-    strm.next_out = cbuffer;
-    (void) deflate(&strm, Z_FINISH);
-    clength = length - strm.avail_out;
-    (void) net_send(socket, &clength, sizeof clength, flags);
-    ret = net_send(socket, cbuffer, length - strm.avail_out, flags);
-    (void) deflateEnd(&strm);
+    /* The stream is cut into NET_CODEC_CHUNK-byte chunks that are compressed
+     * independently, so each chunk is on the wire while the next one is
+     * compressed.  Chunks that do not shrink are sent as they are.
+     */
+    char *cbuffer;
+    size_t cap;
+    int ret = SUCCESS;
+
+    cap = codec_bound(net_codec.type, NET_CODEC_CHUNK);
+    if ((cbuffer = malloc(cap)) == NULL)
+        return FAILURE;
+
+    for (size_t off = 0; off < length && ret == SUCCESS; off += NET_CODEC_CHUNK) {
+        const char *chunk = (const char *) buffer + off;
+        size_t rawlen = length - off, clen;
+        struct net_chunk_hdr hdr;
+
+        if (rawlen > NET_CODEC_CHUNK)
+            rawlen = NET_CODEC_CHUNK;
+        memset(&hdr, '\0', sizeof hdr);
+        if (net_codec.type != CODEC_NONE
+            && codec_compress(&net_codec, chunk, rawlen, cbuffer, cap, &clen) == SUCCESS
+            && clen < rawlen) {
+            hdr.codec = net_codec.type;
+            hdr.clen = clen;
+            chunk = cbuffer;
+        } else {
+            hdr.codec = CODEC_NONE;
+            hdr.clen = rawlen;
+        }
+        if ((ret = net_send(socket, &hdr, sizeof hdr, flags)) == SUCCESS)
+            ret = net_send(socket, chunk, hdr.clen, flags);
+    }
     free(cbuffer);
     return ret;
 }
@@ -88,29 +369,52 @@ net_send_compressed(int socket, const void *buffer, size_t length, int flags)
 int
 net_recv_compressed(int socket, void *buffer, size_t length, int flags)
 {
-    int ret;
-    z_stream strm;
-    unsigned char *cbuffer;
-    size_t clength;
-
-    cbuffer = calloc(length, sizeof cbuffer[0]);
-
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    (void) inflateInit(&strm);
-    (void) net_recv(socket, &clength, sizeof clength, flags);
-    (void) net_recv(socket, cbuffer, clength, flags);
-    strm.avail_in = clength;
-    strm.next_in = cbuffer;
-    strm.avail_out = length;
-    strm.next_out = buffer;
-    (void) inflate(&strm, Z_NO_FLUSH);
-    (void) inflateEnd(&strm);
+    char *cbuffer = NULL;
+    size_t cap = 0;
+    int ret = SUCCESS;
+
+    for (size_t off = 0; off < length && ret == SUCCESS; off += NET_CODEC_CHUNK) {
+        char *chunk = (char *) buffer + off;
+        size_t rawlen = length - off;
+        struct net_chunk_hdr hdr;
+
+        if (rawlen > NET_CODEC_CHUNK)
+            rawlen = NET_CODEC_CHUNK;
+        if ((ret = net_recv(socket, &hdr, sizeof hdr, flags)) == FAILURE)
+            break;
+        if (!codec_available(hdr.codec)
+            || hdr.clen > codec_bound(hdr.codec, rawlen)) {
+            fprintf(stderr, "net_recv_compressed: bad chunk (codec %d, %u bytes)\n",
+                    hdr.codec, hdr.clen);
+            ret = FAILURE;
+            break;
+        }
+        if (hdr.codec == CODEC_NONE) {
+            if (hdr.clen != rawlen) {
+                fprintf(stderr, "net_recv_compressed: bad chunk length\n");
+                ret = FAILURE;
+                break;
+            }
+            ret = net_recv(socket, chunk, rawlen, flags);
+            continue;
+        }
+        if (cap < hdr.clen) {
+            char *tmp;
+            cap = codec_bound(hdr.codec, NET_CODEC_CHUNK);
+            if ((tmp = realloc(cbuffer, cap)) == NULL) {
+                ret = FAILURE;
+                break;
+            }
+            cbuffer = tmp;
+        }
+        if ((ret = net_recv(socket, cbuffer, hdr.clen, flags)) == FAILURE)
+            break;
+        if ((ret = codec_decompress(hdr.codec, cbuffer, hdr.clen, chunk, rawlen)) == FAILURE)
+            fprintf(stderr, "net_recv_compressed: corrupt %s chunk\n",
+                    codec_name(hdr.codec));
+    }
     free(cbuffer);
-    return SUCCESS;
+    return ret;
 }
 
 static void *
@@ -122,6 +426,65 @@ net_get_in_addr(struct sockaddr *sa)
         return &(((struct sockaddr_in6 *) sa)->sin6_addr);
 }
 
+static void
+net_unix_addr(struct sockaddr_un *sun, const char *port)
+{
+    memset(sun, '\0', sizeof *sun);
+    sun->sun_family = AF_UNIX;
+    (void) snprintf(sun->sun_path, sizeof sun->sun_path, NET_UNIX_PATH, port);
+}
+
+static int
+net_init_server_unix(const char *port)
+{
+    struct sockaddr_un sun;
+    int sockfd;
+
+    net_unix_addr(&sun, port);
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("server: socket");
+        return FAILURE;
+    }
+    /* a stale socket file from an earlier run */
+    (void) unlink(sun.sun_path);
+    if (bind(sockfd, (struct sockaddr *) &sun, sizeof sun) == -1) {
+        perror("server: bind");
+        close(sockfd);
+        return FAILURE;
+    }
+    if (listen(sockfd, BACKLOG) == -1) {
+        perror("listen");
+        close(sockfd);
+        return FAILURE;
+    }
+    return sockfd;
+}
+
+static int
+net_init_client_unix(const char *port)
+{
+    struct sockaddr_un sun;
+    int sockfd;
+
+    net_unix_addr(&sun, port);
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("client: socket");
+        return FAILURE;
+    }
+    if (connect(sockfd, (struct sockaddr *) &sun, sizeof sun) == -1) {
+        perror("client: connect");
+        close(sockfd);
+        return FAILURE;
+    }
+    /* the descriptor may be that of an accepted socket closed without
+     * net_conn_close */
+    if (net_fd_set_accepted(sockfd, false) == FAILURE) {
+        close(sockfd);
+        return FAILURE;
+    }
+    return sockfd;
+}
+
 int
 net_init_server(const char *addr, const char *port)
 {
@@ -130,6 +493,9 @@ net_init_server(const char *addr, const char *port)
     int yes = 1;
     int rv;
 
+    if (net_transport != NET_TCP)
+        return net_init_server_unix(port);
+
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -180,8 +546,17 @@ net_server_accept(int sockfd)
 {
     struct sockaddr_storage their_addr;
     socklen_t addr_size = sizeof their_addr;
+    int fd;
+
 
-    return accept(sockfd, (struct sockaddr *) &their_addr, &addr_size);
+    fd = accept(sockfd, (struct sockaddr *) &their_addr, &addr_size);
+    if (fd == -1)
+        return FAILURE;
+    if (net_fd_set_accepted(fd, true) == FAILURE) {
+        (void) close(fd);
+        return FAILURE;
+    }
+    return fd;
 }
 
 int
@@ -191,6 +566,9 @@ net_init_client(const char *addr, const char *port)
     struct addrinfo hints, *servinfo, *p;
     char s[INET6_ADDRSTRLEN];
 
+    if (net_transport != NET_TCP)
+        return net_init_client_unix(port);
+
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -234,3 +612,288 @@ net_init_client(const char *addr, const char *port)
 
     return sockfd;
 }
+
+static void
+net_set_sockopts(int fd)
+{
+    int yes = 1;
+
+    if (net_transport != NET_TCP)
+        return;
+    if (net_sockopts.nodelay
+        && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes) == -1
+        && errno != EOPNOTSUPP && errno != ENOPROTOOPT)
+        perror("setsockopt: TCP_NODELAY");
+    if (net_sockopts.sndbuf > 0
+        && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &net_sockopts.sndbuf,
+                      sizeof net_sockopts.sndbuf) == -1)
+        perror("setsockopt: SO_SNDBUF");
+    if (net_sockopts.rcvbuf > 0
+        && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &net_sockopts.rcvbuf,
+                      sizeof net_sockopts.rcvbuf) == -1)
+        perror("setsockopt: SO_RCVBUF");
+}
+
+static ssize_t
+net_sock_writev(struct net_conn *c, const struct iovec *iov, int iovcnt)
+{
+    c->nsyscalls++;
+    return writev(c->fd, iov, MIN(iovcnt, IOV_MAX));
+}
+
+static ssize_t
+net_sock_read(struct net_conn *c, void *buffer, size_t length)
+{
+    c->nsyscalls++;
+    return recv(c->fd, buffer, length, 0);
+}
+
+static const struct net_transport_ops net_sock_ops = {
+    "socket", net_sock_writev, net_sock_read, NULL,
+};
+
+/*
+ * Wraps the connected socket 'fd' in a buffered connection.  Returns NULL on
+ * error.
+ */
+struct net_conn *
+net_conn_new(int fd)
+{
+    struct net_conn *c;
+    struct net_fd_entry *e;
+    bool accepted;
+
+    if (fd < 0)
+        return NULL;
+    pthread_mutex_lock(&net_fds_lock);
+    e = net_fd_entry(fd);
+    accepted = e != NULL && e->accepted;
+    pthread_mutex_unlock(&net_fds_lock);
+    if (e == NULL)
+        return NULL;
+    if ((c = calloc(1, sizeof *c)) == NULL)
+        return NULL;
+    c->fd = fd;
+    c->ops = &net_sock_ops;
+    c->phase = NET_PHASE_ONLINE;
+    c->sbuf = malloc(NET_CONN_BUFSIZE);
+    c->rbuf = malloc(NET_CONN_BUFSIZE);
+    if (c->sbuf == NULL || c->rbuf == NULL) {
+        free(c->sbuf);
+        free(c->rbuf);
+        free(c);
+        return NULL;
+    }
+    net_set_sockopts(fd);
+    if (net_transport == NET_SHM
+        && net_shm_attach(c, accepted) == FAILURE) {
+        free(c->sbuf);
+        free(c->rbuf);
+        free(c);
+        return NULL;
+    }
+    if (net_link.enabled && net_link_attach(c) == FAILURE) {
+        if (c->ops->close)
+            c->ops->close(c);
+        free(c->sbuf);
+        free(c->rbuf);
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_lock(&net_fds_lock);
+    __atomic_store_n(&net_fds->ent[fd].conn, c, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&net_fds_lock);
+    return c;
+}
+
+/*
+ * Flushes any pending output and closes the connection and its socket
+ */
+void
+net_conn_close(struct net_conn *c)
+{
+    if (c == NULL)
+        return;
+    (void) net_conn_flush(c);
+    if (c->ops->close)
+        c->ops->close(c);
+    pthread_mutex_lock(&net_ledger_lock);
+    net_ledger_merge(&net_ledger, &c->ledger);
+    pthread_mutex_unlock(&net_ledger_lock);
+    pthread_mutex_lock(&net_fds_lock);
+    __atomic_store_n(&net_fds->ent[c->fd].conn, NULL, __ATOMIC_RELEASE);
+    net_fds->ent[c->fd].accepted = false;
+    pthread_mutex_unlock(&net_fds_lock);
+    (void) close(c->fd);
+    free(c->sbuf);
+    free(c->rbuf);
+    free(c);
+}
+
+/*
+ * Writes out all of 'iov', handling partial writes.  Modifies 'iov'.
+ */
+static int
+net_conn_writev(struct net_conn *c, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = c->ops->writev(c, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("writev");
+            return FAILURE;
+        }
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Queues the concatenation of 'iov' for sending.  Messages that do not fit in
+ * the send buffer are written out right away, together with any pending
+ * output, in a single writev.
+ */
+int
+net_conn_sendv(struct net_conn *c, const struct iovec *iov, int iovcnt)
+{
+    return net_conn_sendv_tagged(c, iov, NULL, iovcnt);
+}
+
+int
+net_conn_sendv_tagged(struct net_conn *c, const struct iovec *iov,
+                      const enum net_category *cats, int iovcnt)
+{
+    size_t total = 0;
+
+    for (int i = 0; i < iovcnt; ++i) {
+        struct net_traffic *t =
+            &c->ledger.traffic[c->phase][cats ? cats[i] : c->cat];
+        t->bytes_sent += iov[i].iov_len;
+        if (i == 0 || (cats && cats[i] != cats[i - 1]))
+            t->msgs_sent++;
+        total += iov[i].iov_len;
+    }
+    c->sent = true;
+
+    if (c->slen + total <= NET_CONN_BUFSIZE) {
+        for (int i = 0; i < iovcnt; ++i) {
+            (void) memcpy(c->sbuf + c->slen, iov[i].iov_base, iov[i].iov_len);
+            c->slen += iov[i].iov_len;
+        }
+    } else {
+        struct iovec v[iovcnt + 1];
+
+        v[0].iov_base = c->sbuf;
+        v[0].iov_len = c->slen;
+        (void) memcpy(&v[1], iov, iovcnt * sizeof iov[0]);
+        c->slen = 0;
+        if (net_conn_writev(c, v, iovcnt + 1) == FAILURE)
+            return FAILURE;
+    }
+    return SUCCESS;
+}
+
+int
+net_conn_send(struct net_conn *c, const void *buffer, size_t length)
+{
+    struct iovec iov = { (void *) buffer, length };
+    return net_conn_sendv(c, &iov, 1);
+}
+
+int
+net_conn_flush(struct net_conn *c)
+{
+    struct iovec iov = { c->sbuf, c->slen };
+
+    if (c->slen == 0)
+        return SUCCESS;
+    c->slen = 0;
+    return net_conn_writev(c, &iov, 1);
+}
+
+/*
+ * Receives exactly 'length' bytes, flushing pending output first so that the
+ * peer is never left waiting for a request still sitting in our buffer
+ */
+int
+net_conn_recv(struct net_conn *c, void *buffer, size_t length)
+{
+    size_t have;
+
+    if (net_conn_flush(c) == FAILURE)
+        return FAILURE;
+    c->ledger.traffic[c->phase][c->cat].bytes_received += length;
+    c->ledger.traffic[c->phase][c->cat].msgs_received++;
+    if (c->sent) {
+        c->ledger.round_trips[c->phase]++;
+        c->sent = false;
+    }
+
+    have = MIN(length, c->rlen - c->rpos);
+    (void) memcpy(buffer, c->rbuf + c->rpos, have);
+    c->rpos += have;
+
+    while (have < length) {
+        size_t need = length - have;
+        ssize_t n;
+
+        if (need >= NET_CONN_BUFSIZE) {
+            /* large reads go straight to the caller's buffer */
+            n = c->ops->read(c, (char *) buffer + have, need);
+        } else {
+            n = c->ops->read(c, c->rbuf, NET_CONN_BUFSIZE);
+        }
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("recv");
+            return FAILURE;
+        }
+        if (n == 0) {
+            fprintf(stderr, "recv: connection closed\n");
+            return FAILURE;
+        }
+        if (need >= NET_CONN_BUFSIZE) {
+            have += n;
+        } else {
+            c->rpos = MIN((size_t) n, need);
+            c->rlen = n;
+            (void) memcpy((char *) buffer + have, c->rbuf, c->rpos);
+            have += c->rpos;
+        }
+    }
+    return SUCCESS;
+}
+
+void
+net_conn_tag(struct net_conn *c, enum net_category cat)
+{
+    c->cat = cat;
+}
+
+void
+net_conn_set_phase(struct net_conn *c, enum net_phase phase)
+{
+    c->phase = phase;
+}
+
+int
+net_conn_send_compressed(struct net_conn *c, const void *buffer, size_t length)
+{
+    return net_send_compressed(c->fd, buffer, length, 0);
+}
+
+int
+net_conn_recv_compressed(struct net_conn *c, void *buffer, size_t length)
+{
+    return net_recv_compressed(c->fd, buffer, length, 0);
+}
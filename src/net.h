@@ -1,10 +1,197 @@
 #ifndef __NET_H
 #define __NET_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-extern size_t g_bytes_sent;
-extern size_t g_bytes_received;
+#include "codec.h"
+
+/* size of a connection's send and receive buffers */
+#define NET_CONN_BUFSIZE (64 * 1024)
+/* net_send_compressed compresses and sends its input in chunks of this size */
+#define NET_CODEC_CHUNK (128 * 1024)
+/* capacity of each direction of a shared-memory connection; a power of 2 */
+#define NET_SHM_RING (4 * 1024 * 1024)
+
+/*
+ * Traffic ledger.  Each connection accounts what it moves to its current
+ * message category and protocol phase, set by the protocol code with
+ * net_conn_tag and net_conn_set_phase.  OT code that only sees the socket is
+ * accounted to whatever the caller tagged the connection with.
+ */
+enum net_category {
+    NET_CAT_OTHER = 0,
+    NET_CAT_OT,                 /* OT extension and its corrections */
+    NET_CAT_TABLES,             /* garbled tables */
+    NET_CAT_INSTRUCTIONS,
+    NET_CAT_MAPPING,            /* circuit and input mappings */
+    NET_CAT_LABELS,             /* input wire labels */
+    NET_CAT_OUTPUT,             /* output instructions and output maps */
+    NET_CAT_OFFSETS,            /* chaining offsets */
+    NET_CAT_CONTROL,            /* session headers and the like */
+    NET_NCATEGORIES
+};
+
+enum net_phase {
+    NET_PHASE_OFFLINE = 0,      /* transfer of garbled components */
+    NET_PHASE_PREPROCESS,       /* OT preprocessing of the classic protocol */
+    NET_PHASE_SETUP,            /* per-session setup of the online phase */
+    NET_PHASE_ONLINE,           /* per-query traffic */
+    NET_NPHASES
+};
+
+struct net_traffic {
+    uint64_t bytes_sent, bytes_received;
+    uint64_t msgs_sent, msgs_received;
+};
+
+struct net_ledger {
+    struct net_traffic traffic[NET_NPHASES][NET_NCATEGORIES];
+    /* times this party waited for a reply to something it sent */
+    uint64_t round_trips[NET_NPHASES];
+};
+
+/*
+ * Traffic of all closed connections, plus that of bare sockets (only the OT
+ * pool refiller talks over those; accounted as offline OT traffic)
+ */
+extern struct net_ledger net_ledger;
+
+const char *
+net_category_name(enum net_category cat);
+
+const char *
+net_phase_name(enum net_phase phase);
+
+void
+net_ledger_reset(void);
+
+/* adds the traffic of 'src' to 'dst' */
+void
+net_ledger_merge(struct net_ledger *dst, const struct net_ledger *src);
+
+/* total traffic of 'phase' over all categories */
+struct net_traffic
+net_ledger_phase(const struct net_ledger *l, enum net_phase phase);
+
+/* writes 'l', which covers 'nruns' runs, as one line of JSON */
+void
+net_ledger_json(FILE *f, const struct net_ledger *l, uint64_t nruns);
+
+/* options applied to every socket wrapped in a net_conn */
+struct net_sockopts {
+    bool nodelay;               /* set TCP_NODELAY */
+    int sndbuf;                 /* SO_SNDBUF in bytes; 0 keeps the default */
+    int rcvbuf;                 /* SO_RCVBUF in bytes; 0 keeps the default */
+};
+
+extern struct net_sockopts net_sockopts;
+
+/* codec used by net_send_compressed; the receiver follows the sender */
+extern struct codec net_codec;
+
+/*
+ * How the two parties are connected.  NET_UNIX and NET_SHM only work when
+ * both run on the same machine; they rendezvous on a Unix-domain socket
+ * named after the port (NET_UNIX_PATH), and NET_SHM then moves the data of
+ * each net_conn through a pair of shared-memory rings instead.
+ */
+enum net_transport_type {
+    NET_TCP = 0,
+    NET_UNIX = 1,
+    NET_SHM = 2,
+};
+
+#define NET_UNIX_PATH "/tmp/garbled-%s.sock"
+
+extern enum net_transport_type net_transport;
+
+/* parses "tcp", "unix" or "shm" */
+int
+net_transport_parse(const char *name);
+
+const char *
+net_transport_name(enum net_transport_type type);
+
+/*
+ * Ports the parties rendezvous on: the main connection uses the base port,
+ * 8000 unless set with net_port_parse, and the OT pool and the component
+ * pool the two ports after it, so that runs with different base ports can
+ * share a machine.
+ */
+enum net_port_id {
+    NET_PORT_MAIN = 0,
+    NET_PORT_OTPOOL = 1,
+    NET_PORT_GC_POOL = 2,
+    NET_NPORTS
+};
+
+/* parses the base port */
+int
+net_port_parse(const char *base);
+
+const char *
+net_port(enum net_port_id id);
+
+/*
+ * In-process link emulation, applied to every net_conn when enabled.  The
+ * sender stamps each frame with the time it would arrive over a link with
+ * the given one-way latency, jitter and token-bucket rate, and the receiver
+ * holds the frame back until then.  Both parties must use the same setting,
+ * and the stamps assume they share a clock (i.e. run on one machine).
+ */
+struct net_link {
+    bool enabled;
+    uint64_t latency;           /* one-way, in nanoseconds */
+    uint64_t jitter;            /* up to this much extra latency */
+    double rate;                /* bytes per nanosecond; 0 is unlimited */
+    double burst;               /* token bucket depth in bytes */
+};
+
+extern struct net_link net_link;
+
+/* parses "LATENCY_MS[:MBITS[:JITTER_MS]]", e.g. "20:50" or "10:100:2" */
+int
+net_link_parse(const char *spec);
+
+struct net_conn;
+
+/* data path of a net_conn; both calls may transfer fewer bytes than asked */
+struct net_transport_ops {
+    const char *name;
+    ssize_t (*writev)(struct net_conn *c, const struct iovec *iov, int iovcnt);
+    ssize_t (*read)(struct net_conn *c, void *buffer, size_t length);
+    void (*close)(struct net_conn *c);
+};
+
+/*
+ * Buffered connection.  Small sends are coalesced in the send buffer, which
+ * is written out on net_conn_flush, before blocking on a receive, or together
+ * with the next message that does not fit (using one writev).  Receives read
+ * ahead into the receive buffer.
+ *
+ * While a net_conn exists for a socket, net_send and net_recv on that socket
+ * go through the same buffers, so code written against plain descriptors
+ * (e.g. the OT implementations) can share the connection.
+ */
+struct net_conn {
+    int fd;
+    const struct net_transport_ops *ops;
+    void *priv;                 /* transport state */
+    char *sbuf;
+    size_t slen;
+    char *rbuf;
+    size_t rpos, rlen;
+    size_t nsyscalls;           /* number of system calls made to move data */
+    struct net_ledger ledger;
+    enum net_category cat;
+    enum net_phase phase;
+    bool sent;                  /* sent anything since the last receive */
+};
 
 int
 net_send(int socket, const void *buffer, size_t length, int flags);
@@ -27,5 +214,56 @@ net_server_accept(int sockfd);
 int
 net_init_client(const char *addr, const char *port);
 
+struct net_conn *
+net_conn_new(int fd);
+
+void
+net_conn_close(struct net_conn *c);
+
+int
+net_conn_send(struct net_conn *c, const void *buffer, size_t length);
+
+int
+net_conn_sendv(struct net_conn *c, const struct iovec *iov, int iovcnt);
+
+/*
+ * Like net_conn_sendv, accounting each element of 'iov' to the matching
+ * entry of 'cats'
+ */
+int
+net_conn_sendv_tagged(struct net_conn *c, const struct iovec *iov,
+                      const enum net_category *cats, int iovcnt);
+
+int
+net_conn_flush(struct net_conn *c);
+
+/* accounts what follows on 'c' to 'cat' */
+void
+net_conn_tag(struct net_conn *c, enum net_category cat);
+
+void
+net_conn_set_phase(struct net_conn *c, enum net_phase phase);
+
+int
+net_conn_recv(struct net_conn *c, void *buffer, size_t length);
+
+/*
+ * Replaces the data path of the freshly wrapped Unix-domain connection 'c'
+ * with a pair of shared-memory rings.  The accepting side creates the rings
+ * and hands them to the connecting side over the socket.
+ */
+int
+net_shm_attach(struct net_conn *c, bool accepted);
+
+/* makes 'c' go through the emulated link described by net_link */
+int
+net_link_attach(struct net_conn *c);
+
+int
+net_conn_send_compressed(struct net_conn *c, const void *buffer, size_t length);
+
+int
+net_conn_recv_compressed(struct net_conn *c, void *buffer, size_t length);
+
 
 #endif
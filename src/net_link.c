@@ -0,0 +1,248 @@
+#include "net.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* largest payload stamped with a single delivery time */
+#define NET_LINK_MTU (64 * 1024)
+/* bytes the sender may queue on the link before it blocks */
+#define NET_LINK_QUEUE (1024 * 1024)
+
+struct net_link net_link = { false, 0, 0, 0, 0 };
+
+/* header preceding each frame on an emulated link */
+struct net_link_hdr {
+    uint64_t deliver;           /* CLOCK_MONOTONIC time the frame arrives */
+    uint32_t len;
+    uint32_t pad;
+};
+
+struct net_link_state {
+    const struct net_transport_ops *inner;
+    void *innerPriv;
+    /* sender side */
+    double tokens;              /* bytes that may leave without waiting */
+    uint64_t last;              /* time the bucket was last refilled */
+    uint64_t lastDeliver;
+    unsigned int seed;
+    /* receiver side */
+    struct net_link_hdr hdr;
+    size_t hdrHave;
+    size_t frameLeft;
+};
+
+static uint64_t
+net_link_now(void)
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+net_link_sleep_until(uint64_t when)
+{
+    struct timespec ts = { when / 1000000000, when % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+int
+net_link_parse(const char *spec)
+{
+    double latency, mbits = 0, jitter = 0;
+    int n;
+
+    n = sscanf(spec, "%lf:%lf:%lf", &latency, &mbits, &jitter);
+    if (n < 1 || latency < 0 || mbits < 0 || jitter < 0) {
+        fprintf(stderr, "invalid link %s\n", spec);
+        return FAILURE;
+    }
+    net_link.enabled = true;
+    net_link.latency = latency * 1000000;
+    net_link.jitter = jitter * 1000000;
+    net_link.rate = mbits * 1000000 / 8 / 1000000000;
+    /* as much as the link carries in a millisecond, and at least a frame */
+    net_link.burst = net_link.rate * 1000000;
+    if (net_link.burst < NET_LINK_MTU)
+        net_link.burst = NET_LINK_MTU;
+    return SUCCESS;
+}
+
+/* calls the wrapped transport with its own state in place */
+static ssize_t
+net_link_inner_writev(struct net_conn *c, const struct iovec *iov, int iovcnt)
+{
+    struct net_link_state *l = c->priv;
+    ssize_t n;
+
+    c->priv = l->innerPriv;
+    n = l->inner->writev(c, iov, iovcnt);
+    c->priv = l;
+    return n;
+}
+
+static ssize_t
+net_link_inner_read(struct net_conn *c, void *buffer, size_t length)
+{
+    struct net_link_state *l = c->priv;
+    ssize_t n;
+
+    c->priv = l->innerPriv;
+    n = l->inner->read(c, buffer, length);
+    c->priv = l;
+    return n;
+}
+
+/*
+ * Time the last byte of a 'len'-byte frame leaves the sender, draining a
+ * token bucket refilled at the link rate
+ */
+static uint64_t
+net_link_depart(struct net_link_state *l, size_t len)
+{
+    uint64_t t = net_link_now();
+
+    if (net_link.rate <= 0)
+        return t;
+    if (t < l->last)
+        t = l->last;
+    l->tokens += (t - l->last) * net_link.rate;
+    if (l->tokens > net_link.burst)
+        l->tokens = net_link.burst;
+    l->tokens -= len;
+    if (l->tokens < 0) {
+        t += -l->tokens / net_link.rate;
+        l->tokens = 0;
+    }
+    l->last = t;
+    return t;
+}
+
+/*
+ * Sends one frame of at most NET_LINK_MTU bytes of 'iov', stamped with the
+ * time the receiver may have it.  Returns the number of payload bytes sent.
+ */
+static ssize_t
+net_link_writev(struct net_conn *c, const struct iovec *iov, int iovcnt)
+{
+    struct net_link_state *l = c->priv;
+    struct net_link_hdr hdr;
+    struct iovec v[iovcnt + 1];
+    size_t len = 0, left;
+    int cnt = 1;
+    uint64_t depart, deliver, now;
+
+    for (int i = 0; i < iovcnt && len < NET_LINK_MTU; ++i) {
+        v[cnt].iov_base = iov[i].iov_base;
+        v[cnt].iov_len = MIN(iov[i].iov_len, NET_LINK_MTU - len);
+        len += v[cnt].iov_len;
+        cnt++;
+    }
+
+    depart = net_link_depart(l, len);
+    deliver = depart + net_link.latency;
+    if (net_link.jitter > 0)
+        deliver += rand_r(&l->seed) % (net_link.jitter + 1);
+    /* a stream is never reordered */
+    if (deliver < l->lastDeliver)
+        deliver = l->lastDeliver;
+    l->lastDeliver = deliver;
+
+    /* a full link queue pushes back on the sender */
+    now = net_link_now();
+    if (net_link.rate > 0 && depart > now + NET_LINK_QUEUE / net_link.rate)
+        net_link_sleep_until(depart - NET_LINK_QUEUE / net_link.rate);
+
+    memset(&hdr, '\0', sizeof hdr);
+    hdr.deliver = deliver;
+    hdr.len = len;
+    v[0].iov_base = &hdr;
+    v[0].iov_len = sizeof hdr;
+
+    left = sizeof hdr + len;
+    for (struct iovec *p = v; left > 0;) {
+        ssize_t n = net_link_inner_writev(c, p, cnt);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        left -= n;
+        while (cnt > 0 && (size_t) n >= p->iov_len) {
+            n -= p->iov_len;
+            p++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            p->iov_base = (char *) p->iov_base + n;
+            p->iov_len -= n;
+        }
+    }
+    return len;
+}
+
+/*
+ * Returns payload of the current frame, once its delivery time has come
+ */
+static ssize_t
+net_link_read(struct net_conn *c, void *buffer, size_t length)
+{
+    struct net_link_state *l = c->priv;
+    ssize_t n;
+
+    while (l->frameLeft == 0) {
+        n = net_link_inner_read(c, (char *) &l->hdr + l->hdrHave,
+                                sizeof l->hdr - l->hdrHave);
+        if (n <= 0)
+            return n;
+        l->hdrHave += n;
+        if (l->hdrHave == sizeof l->hdr) {
+            l->hdrHave = 0;
+            l->frameLeft = l->hdr.len;
+            if (net_link_now() < l->hdr.deliver)
+                net_link_sleep_until(l->hdr.deliver);
+        }
+    }
+    n = net_link_inner_read(c, buffer, MIN(length, l->frameLeft));
+    if (n > 0)
+        l->frameLeft -= n;
+    return n;
+}
+
+static void
+net_link_close(struct net_conn *c)
+{
+    struct net_link_state *l = c->priv;
+
+    c->priv = l->innerPriv;
+    if (l->inner->close)
+        l->inner->close(c);
+    free(l);
+}
+
+static const struct net_transport_ops net_link_ops = {
+    "link", net_link_writev, net_link_read, net_link_close,
+};
+
+int
+net_link_attach(struct net_conn *c)
+{
+    struct net_link_state *l;
+
+    if ((l = calloc(1, sizeof *l)) == NULL)
+        return FAILURE;
+    l->inner = c->ops;
+    l->innerPriv = c->priv;
+    l->tokens = net_link.burst;
+    l->last = net_link_now();
+    l->seed = (unsigned int) (l->last ^ c->fd);
+    c->ops = &net_link_ops;
+    c->priv = l;
+    return SUCCESS;
+}
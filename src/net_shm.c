@@ -0,0 +1,292 @@
+#include "net.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/* times a waiter re-checks the ring before sleeping on the futex */
+#define NET_SHM_SPIN 256
+/* how often a sleeping waiter checks whether the peer is still there */
+#define NET_SHM_TIMEOUT_NS (100 * 1000 * 1000)
+
+/*
+ * Single-producer single-consumer byte ring.  'head' and 'tail' count the
+ * bytes ever written and read.  After moving its counter each side bumps its
+ * futex word and wakes the other side only if it announced it is sleeping.
+ */
+struct net_shm_ring {
+    uint64_t head;
+    char pad0[56];
+    uint64_t tail;
+    char pad1[56];
+    uint32_t wseq;              /* bumped after each write */
+    uint32_t rseq;              /* bumped after each read */
+    uint32_t rwait;             /* the consumer waits for data */
+    uint32_t wwait;             /* the producer waits for space */
+    uint32_t closed;
+    char pad2[44];
+    char data[NET_SHM_RING];
+};
+
+struct net_shm {
+    struct net_shm_ring *rings;     /* two rings, one per direction */
+    struct net_shm_ring *tx, *rx;
+};
+
+static void
+net_shm_wake(struct net_conn *c, uint32_t *seq, uint32_t *waiting)
+{
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        c->nsyscalls++;
+        (void) syscall(SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+/* whether the peer closed its end of the rendezvous socket */
+static bool
+net_shm_peer_gone(struct net_conn *c)
+{
+    struct pollfd pfd = { c->fd, POLLIN, 0 };
+
+    /* nothing is sent on the socket after the handshake, so any input is
+     * end-of-file */
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+/*
+ * Waits until '*counter' moves away from 'old', sleeping on 'seq' once
+ * spinning did not help
+ */
+static int
+net_shm_wait(struct net_conn *c, struct net_shm_ring *r, uint32_t *seq,
+             uint32_t *waiting, const uint64_t *counter, uint64_t old)
+{
+    for (int i = 0; i < NET_SHM_SPIN; ++i) {
+        if (__atomic_load_n(counter, __ATOMIC_ACQUIRE) != old)
+            return SUCCESS;
+    }
+    for (;;) {
+        uint32_t s = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+        struct timespec ts = { 0, NET_SHM_TIMEOUT_NS };
+
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) != old)
+            break;
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+            return FAILURE;
+        c->nsyscalls++;
+        if (syscall(SYS_futex, seq, FUTEX_WAIT, s, &ts, NULL, 0) == -1
+            && errno == ETIMEDOUT && net_shm_peer_gone(c))
+            return FAILURE;
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+static ssize_t
+net_shm_writev(struct net_conn *c, const struct iovec *iov, int iovcnt)
+{
+    struct net_shm *shm = c->priv;
+    struct net_shm_ring *r = shm->tx;
+    uint64_t head = r->head, tail;
+    size_t space, total = 0;
+
+    while ((tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) + NET_SHM_RING == head) {
+        if (net_shm_wait(c, r, &r->rseq, &r->wwait, &r->tail, tail) == FAILURE) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    space = NET_SHM_RING - (head - tail);
+
+    for (int i = 0; i < iovcnt && total < space; ++i) {
+        const char *src = iov[i].iov_base;
+        size_t len = MIN(iov[i].iov_len, space - total);
+
+        while (len > 0) {
+            size_t pos = (head + total) & (NET_SHM_RING - 1);
+            size_t n = MIN(len, NET_SHM_RING - pos);
+            (void) memcpy(r->data + pos, src, n);
+            src += n;
+            len -= n;
+            total += n;
+        }
+    }
+    __atomic_store_n(&r->head, head + total, __ATOMIC_SEQ_CST);
+    net_shm_wake(c, &r->wseq, &r->rwait);
+    return total;
+}
+
+static ssize_t
+net_shm_read(struct net_conn *c, void *buffer, size_t length)
+{
+    struct net_shm *shm = c->priv;
+    struct net_shm_ring *r = shm->rx;
+    uint64_t tail = r->tail, head;
+    size_t total, done = 0;
+
+    while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail) {
+        /* reported as end-of-file */
+        if (net_shm_wait(c, r, &r->wseq, &r->rwait, &r->head, tail) == FAILURE)
+            return 0;
+    }
+    total = MIN(length, head - tail);
+
+    while (done < total) {
+        size_t pos = (tail + done) & (NET_SHM_RING - 1);
+        size_t n = MIN(total - done, NET_SHM_RING - pos);
+        (void) memcpy((char *) buffer + done, r->data + pos, n);
+        done += n;
+    }
+    __atomic_store_n(&r->tail, tail + total, __ATOMIC_SEQ_CST);
+    net_shm_wake(c, &r->rseq, &r->wwait);
+    return total;
+}
+
+static void
+net_shm_close(struct net_conn *c)
+{
+    struct net_shm *shm = c->priv;
+
+    for (int i = 0; i < 2; ++i) {
+        struct net_shm_ring *r = &shm->rings[i];
+        __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+        net_shm_wake(c, &r->wseq, &r->rwait);
+        net_shm_wake(c, &r->rseq, &r->wwait);
+    }
+    (void) munmap(shm->rings, 2 * sizeof shm->rings[0]);
+    free(shm);
+}
+
+static const struct net_transport_ops net_shm_ops = {
+    "shm", net_shm_writev, net_shm_read, net_shm_close,
+};
+
+/* creates an unlinked file backing the rings */
+static int
+net_shm_create(size_t size)
+{
+    char path[] = "/dev/shm/garbled-XXXXXX";
+    char fallback[] = "/tmp/garbled-shm-XXXXXX";
+    int fd;
+
+    if ((fd = mkstemp(path)) != -1)
+        (void) unlink(path);
+    else if ((fd = mkstemp(fallback)) != -1)
+        (void) unlink(fallback);
+    else
+        return -1;
+    if (ftruncate(fd, size) == -1) {
+        (void) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+net_shm_send_fd(int sock, int fd)
+{
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, '\0', sizeof msg);
+    memset(&ctl, '\0', sizeof ctl);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    (void) memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+    return sendmsg(sock, &msg, 0) == 1 ? SUCCESS : FAILURE;
+}
+
+static int
+net_shm_recv_fd(int sock)
+{
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fd;
+
+    memset(&msg, '\0', sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+    if (recvmsg(sock, &msg, 0) != 1)
+        return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+        || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+    (void) memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+    return fd;
+}
+
+int
+net_shm_attach(struct net_conn *c, bool accepted)
+{
+    struct net_shm *shm;
+    size_t size = 2 * sizeof(struct net_shm_ring);
+    int fd, res;
+
+    if ((shm = calloc(1, sizeof *shm)) == NULL)
+        return FAILURE;
+
+    if (accepted) {
+        if ((fd = net_shm_create(size)) == -1) {
+            perror("net_shm_create");
+            free(shm);
+            return FAILURE;
+        }
+        res = net_shm_send_fd(c->fd, fd);
+    } else {
+        res = (fd = net_shm_recv_fd(c->fd)) == -1 ? FAILURE : SUCCESS;
+    }
+    if (res == FAILURE) {
+        fprintf(stderr, "shm: handshake failed\n");
+        if (fd != -1)
+            (void) close(fd);
+        free(shm);
+        return FAILURE;
+    }
+
+    shm->rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    (void) close(fd);
+    if (shm->rings == MAP_FAILED) {
+        perror("mmap");
+        free(shm);
+        return FAILURE;
+    }
+    /* the accepting side writes on the first ring */
+    shm->tx = &shm->rings[accepted ? 0 : 1];
+    shm->rx = &shm->rings[accepted ? 1 : 0];
+    c->ops = &net_shm_ops;
+    c->priv = shm;
+    return SUCCESS;
+}
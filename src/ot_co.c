@@ -0,0 +1,260 @@
+/*
+ * Implementation of semi-honest OT as detailed by Chou and Orlandi [1], over
+ * the NIST P-256 curve.
+ *
+ * Compared to the Naor-Pinkas implementation in ot_np.c this needs no
+ * 1024-bit exponentiations, and group elements are 33-byte compressed points
+ * rather than 128-byte field elements.  All points of a phase are sent in a
+ * single message.
+ *
+ * [1] "The Simplest Protocol for Oblivious Transfer."
+ *     T. Chou, C. Orlandi. LATINCRYPT 2015.
+ */
+#include "ot_co.h"
+
+#include "crypto.h"
+#include "net.h"
+#include "state.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+
+#define ERROR { err = 1; goto cleanup; }
+
+static int
+point_to_array(const EC_GROUP *group, unsigned char *buf, const EC_POINT *P,
+               BN_CTX *ctx)
+{
+    size_t len;
+
+    len = EC_POINT_point2oct(group, P, POINT_CONVERSION_COMPRESSED, buf,
+                             OT_CO_POINT_SIZE, ctx);
+    return len == OT_CO_POINT_SIZE ? SUCCESS : FAILURE;
+}
+
+/*
+ * Runs sender operations for Chou-Orlandi semi-honest OT
+ */
+int
+ot_co_send(struct state *st, int fd, void *msgs, int msglength, int num_ots,
+           int N, ot_msg_reader msg_reader, ot_item_reader item_reader)
+{
+    const EC_GROUP *group = st->ec;
+    BN_CTX *ctx = NULL;
+    BIGNUM *a = NULL;
+    EC_POINT *A = NULL, *T = NULL, *B = NULL, *P = NULL, *Q = NULL;
+    EC_POINT **iTs = NULL;
+    unsigned char buf[OT_CO_POINT_SIZE], *Bs = NULL;
+    char *e = NULL;
+    int err = 0;
+
+    if ((ctx = BN_CTX_new()) == NULL)
+        ERROR;
+    if ((a = BN_new()) == NULL)
+        ERROR;
+    A = EC_POINT_new(group);
+    T = EC_POINT_new(group);
+    B = EC_POINT_new(group);
+    P = EC_POINT_new(group);
+    Q = EC_POINT_new(group);
+    if (A == NULL || T == NULL || B == NULL || P == NULL || Q == NULL)
+        ERROR;
+    iTs = (EC_POINT **) calloc(N, sizeof(EC_POINT *));
+    if (iTs == NULL)
+        ERROR;
+    Bs = (unsigned char *) malloc(OT_CO_POINT_SIZE * num_ots);
+    if (Bs == NULL)
+        ERROR;
+    e = (char *) malloc(sizeof(char) * msglength * N * num_ots);
+    if (e == NULL)
+        ERROR;
+
+    // choose a \in_R Zq and compute A = aG, T = aA
+    if (BN_rand_range(a, EC_GROUP_get0_order(group)) != 1)
+        ERROR;
+    if (EC_POINT_mul(group, A, a, NULL, NULL, ctx) != 1)
+        ERROR;
+    if (EC_POINT_mul(group, T, NULL, A, a, ctx) != 1)
+        ERROR;
+
+    // precompute -iT for each message index i
+    for (int i = 0; i < N; ++i) {
+        if ((iTs[i] = EC_POINT_new(group)) == NULL)
+            ERROR;
+        if (i == 0) {
+            (void) EC_POINT_set_to_infinity(group, iTs[i]);
+        } else {
+            if (EC_POINT_add(group, iTs[i], iTs[i - 1], T, ctx) != 1)
+                ERROR;
+        }
+    }
+    for (int i = 1; i < N; ++i) {
+        if (EC_POINT_invert(group, iTs[i], ctx) != 1)
+            ERROR;
+    }
+
+    // send A to receiver
+    if (point_to_array(group, buf, A, ctx) == FAILURE)
+        ERROR;
+    if (net_send(fd, buf, sizeof buf, 0) == -1)
+        ERROR;
+
+    // get B_j's from receiver
+    if (net_recv(fd, Bs, OT_CO_POINT_SIZE * num_ots, 0) == -1)
+        ERROR;
+
+    for (int j = 0; j < num_ots; ++j) {
+        void *ot = msg_reader(msgs, j);
+
+        if (EC_POINT_oct2point(group, B, Bs + j * OT_CO_POINT_SIZE,
+                               OT_CO_POINT_SIZE, ctx) != 1)
+            ERROR;
+        // compute aB
+        if (EC_POINT_mul(group, P, NULL, B, a, ctx) != 1)
+            ERROR;
+        for (int i = 0; i < N; ++i) {
+            char *ei = e + (j * N + i) * msglength, *item;
+            ssize_t itemlength;
+
+            // key_i = H(j, aB - iT)
+            if (EC_POINT_add(group, Q, P, iTs[i], ctx) != 1)
+                ERROR;
+            if (point_to_array(group, buf, Q, ctx) == FAILURE)
+                ERROR;
+            (void) memset(ei, '\0', msglength);
+            sha1_hash(ei, msglength, j, buf, sizeof buf);
+
+            item = (char *) item_reader(ot, i, &itemlength);
+            assert(itemlength <= msglength);
+            xorarray((unsigned char *) ei, msglength,
+                     (unsigned char *) item, itemlength);
+        }
+    }
+
+    // send encryptions to receiver
+    if (net_send(fd, e, msglength * N * num_ots, 0) == -1)
+        ERROR;
+
+ cleanup:
+    free(e);
+    free(Bs);
+    if (iTs) {
+        for (int i = 0; i < N; ++i)
+            EC_POINT_free(iTs[i]);
+        free(iTs);
+    }
+    EC_POINT_free(Q);
+    EC_POINT_free(P);
+    EC_POINT_free(B);
+    EC_POINT_free(T);
+    EC_POINT_free(A);
+    BN_clear_free(a);
+    BN_CTX_free(ctx);
+
+    return err;
+}
+
+/*
+ * Runs receiver operations for Chou-Orlandi semi-honest OT
+ */
+int
+ot_co_recv(struct state *st, int fd, const void *choices, int nchoices,
+           int msglength, int N, void *out,
+           ot_choice_reader choice_reader, ot_msg_writer msg_writer)
+{
+    const EC_GROUP *group = st->ec;
+    BN_CTX *ctx = NULL;
+    BIGNUM *b = NULL, *c = NULL;
+    EC_POINT *A = NULL, *B = NULL;
+    unsigned char buf[OT_CO_POINT_SIZE], *Bs = NULL, *Ks = NULL;
+    char *e = NULL, *mask = NULL;
+    int err = 0;
+
+    if ((ctx = BN_CTX_new()) == NULL)
+        ERROR;
+    b = BN_new();
+    c = BN_new();
+    if (b == NULL || c == NULL)
+        ERROR;
+    A = EC_POINT_new(group);
+    B = EC_POINT_new(group);
+    if (A == NULL || B == NULL)
+        ERROR;
+    Bs = (unsigned char *) malloc(OT_CO_POINT_SIZE * nchoices);
+    if (Bs == NULL)
+        ERROR;
+    Ks = (unsigned char *) malloc(OT_CO_POINT_SIZE * nchoices);
+    if (Ks == NULL)
+        ERROR;
+    e = (char *) malloc(sizeof(char) * msglength * N * nchoices);
+    if (e == NULL)
+        ERROR;
+    mask = (char *) malloc(sizeof(char) * msglength);
+    if (mask == NULL)
+        ERROR;
+
+    // get A from sender
+    if (net_recv(fd, buf, sizeof buf, 0) == -1)
+        ERROR;
+    if (EC_POINT_oct2point(group, A, buf, sizeof buf, ctx) != 1)
+        ERROR;
+
+    for (int j = 0; j < nchoices; ++j) {
+        int choice = choice_reader(choices, j);
+        assert(choice >= 0 && choice < N);
+
+        // choose b \in_R Zq and compute B = bG + cA
+        if (BN_rand_range(b, EC_GROUP_get0_order(group)) != 1)
+            ERROR;
+        if (BN_set_word(c, choice) != 1)
+            ERROR;
+        if (EC_POINT_mul(group, B, b, A, c, ctx) != 1)
+            ERROR;
+        if (point_to_array(group, Bs + j * OT_CO_POINT_SIZE, B, ctx) == FAILURE)
+            ERROR;
+        // compute decryption key bA
+        if (EC_POINT_mul(group, B, NULL, A, b, ctx) != 1)
+            ERROR;
+        if (point_to_array(group, Ks + j * OT_CO_POINT_SIZE, B, ctx) == FAILURE)
+            ERROR;
+    }
+
+    // send B_j's to sender
+    if (net_send(fd, Bs, OT_CO_POINT_SIZE * nchoices, 0) == -1)
+        ERROR;
+
+    // get encryptions from sender
+    if (net_recv(fd, e, msglength * N * nchoices, 0) == -1)
+        ERROR;
+
+    for (int j = 0; j < nchoices; ++j) {
+        int choice = choice_reader(choices, j);
+        char *ej = e + (j * N + choice) * msglength;
+
+        (void) memset(mask, '\0', msglength);
+        sha1_hash(mask, msglength, j, Ks + j * OT_CO_POINT_SIZE,
+                  OT_CO_POINT_SIZE);
+        xorarray((unsigned char *) ej, msglength,
+                 (unsigned char *) mask, msglength);
+        msg_writer(out, j, ej, msglength);
+    }
+
+ cleanup:
+    free(mask);
+    free(e);
+    free(Ks);
+    free(Bs);
+    EC_POINT_free(B);
+    EC_POINT_free(A);
+    BN_free(c);
+    BN_clear_free(b);
+    BN_CTX_free(ctx);
+
+    return err;
+}
@@ -0,0 +1,18 @@
+#ifndef __OTLIB_OT_CO_H__
+#define __OTLIB_OT_CO_H__
+
+#include "ot.h"
+#include "state.h"
+
+/* size of a compressed P-256 point on the wire */
+#define OT_CO_POINT_SIZE 33
+
+int
+ot_co_send(struct state *st, int fd, void *msgs, int msglength, int num_ots,
+           int N, ot_msg_reader msg_reader, ot_item_reader item_reader);
+int
+ot_co_recv(struct state *st, int fd, const void *choices, int nchoices,
+           int msglength, int N, void *out,
+           ot_choice_reader choice_reader, ot_msg_writer msg_writer);
+
+#endif
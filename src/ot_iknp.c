@@ -0,0 +1,642 @@
+/*
+ * Implementation of semi-honest OT extension as detailed by Ishai, Kilian,
+ * Nissim and Petrank [1].
+ *
+ * OT_IKNP_K base OTs are run with the roles reversed, using the Naor-Pinkas
+ * (ot_np.c) or Chou-Orlandi (ot_co.c) implementation depending on
+ * ot_base_type.  The seeds learned there key AES-CTR PRGs, after which every
+ * extended OT costs a handful of AES calls, including one fixed-key AES hash
+ * (aes_crh) per 128 bits of message.  OTs are
+ * extended in batches of OT_IKNP_BATCH, so memory use stays constant
+ * regardless of the number of OTs.
+ *
+ * ot_iknp_cot_send/recv implement the correlated variant of Asharov et al.
+ * [2], where the sender's two messages differ by a fixed offset and only one
+ * block per OT is transferred.
+ *
+ * [1] "Extending Oblivious Transfers Efficiently."
+ *     Y. Ishai, J. Kilian, K. Nissim, E. Petrank. CRYPTO 2003.
+ * [2] "More Efficient Oblivious Transfer and Extensions for Faster Secure
+ *     Computation."  G. Asharov, Y. Lindell, T. Schneider, M. Zohner.
+ *     CCS 2013.
+ */
+#include "ot_iknp.h"
+
+#include "crypto.h"
+#include "net.h"
+#include "ot_co.h"
+#include "ot_np.h"
+#include "state.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <emmintrin.h>
+#include <openssl/rand.h>
+#include <garble.h>
+#include <garble/aes.h>
+
+/* number of OTs extended per round trip; must be a multiple of OT_IKNP_K */
+#define OT_IKNP_BATCH (1 << 16)
+
+#define ERROR { err = 1; goto cleanup; }
+
+static void *
+seed_msg_reader(void *msgs, int idx)
+{
+    block *m = (block *) msgs;
+    return &m[2 * idx];
+}
+
+static void *
+seed_item_reader(void *item, int idx, ssize_t *mlen)
+{
+    block *a = (block *) item;
+    *mlen = sizeof(block);
+    return &a[idx];
+}
+
+static int
+seed_choice_reader(const void *choices, int idx)
+{
+    const unsigned char *c = (const unsigned char *) choices;
+    return (c[idx / 8] >> (idx % 8)) & 1;
+}
+
+static int
+seed_msg_writer(void *array, int idx, void *msg, size_t msglength)
+{
+    block *a = (block *) array;
+    assert(msglength == sizeof(block));
+    (void) memcpy(&a[idx], msg, sizeof(block));
+    return 0;
+}
+
+static int
+base_ot_send(struct state *st, int fd, block *seeds)
+{
+    if (ot_base_type == OT_BASE_CO)
+        return ot_co_send(st, fd, seeds, sizeof(block), OT_IKNP_K, 2,
+                          seed_msg_reader, seed_item_reader);
+    else
+        return ot_np_send(st, fd, seeds, sizeof(block), OT_IKNP_K, 2,
+                          seed_msg_reader, seed_item_reader);
+}
+
+static int
+base_ot_recv(struct state *st, int fd, const unsigned char *s, block *seeds)
+{
+    if (ot_base_type == OT_BASE_CO)
+        return ot_co_recv(st, fd, s, OT_IKNP_K, sizeof(block), 2, seeds,
+                          seed_choice_reader, seed_msg_writer);
+    else
+        return ot_np_recv(st, fd, s, OT_IKNP_K, sizeof(block), 2, seeds,
+                          seed_choice_reader, seed_msg_writer);
+}
+
+/*
+ * Writes blocks start, ..., start + nblocks - 1 of the AES-CTR stream keyed by
+ * 'key' to 'out'
+ */
+static void
+prg_expand(const AES_KEY *key, uint64_t start, block *out, size_t nblocks)
+{
+    for (size_t i = 0; i < nblocks; ++i) {
+        out[i] = garble_make_block((uint64_t) 0, start + i);
+    }
+    AES_ecb_encrypt_blks(out, nblocks, key);
+}
+
+/*
+ * Transposes the 'nrows' x 'ncols' bit matrix 'in' into 'out'.  Both matrices
+ * are stored row major, with bits ordered LSB-first within each byte.
+ *
+ * Based on the SSE2 transpose by Mischa Sandberg, which gathers one byte from
+ * each of 16 rows and peels off output rows with _mm_movemask_epi8.
+ */
+static void
+bit_transpose(unsigned char *out, const unsigned char *in,
+              size_t nrows, size_t ncols)
+{
+    union { __m128i x; unsigned char b[16]; } tmp;
+
+    assert(nrows % 16 == 0 && ncols % 8 == 0);
+    for (size_t rr = 0; rr < nrows; rr += 16) {
+        for (size_t cc = 0; cc < ncols; cc += 8) {
+            for (int i = 0; i < 16; ++i)
+                tmp.b[i] = in[(rr + i) * ncols / 8 + cc / 8];
+            for (int i = 7; i >= 0; --i) {
+                uint16_t w = (uint16_t) _mm_movemask_epi8(tmp.x);
+                (void) memcpy(&out[(cc + i) * nrows / 8 + rr / 8], &w, sizeof w);
+                tmp.x = _mm_slli_epi64(tmp.x, 1);
+            }
+        }
+    }
+}
+
+/*
+ * Chooses the sender's secret s and learns the seeds k_{s_i} through the base
+ * OTs, run with the roles reversed
+ */
+static int
+extend_send_init(struct state *st, int fd, unsigned char *s, block *sblock,
+                 AES_KEY *keys, block *seeds)
+{
+    // choose s \in_R {0,1}^k
+    if (RAND_bytes(s, OT_IKNP_K / 8) != 1)
+        return FAILURE;
+    (void) memcpy(sblock, s, OT_IKNP_K / 8);
+
+    // base OTs with reversed roles: learn seed k_{s_i} for each i
+    if (base_ot_recv(st, fd, s, seeds))
+        return FAILURE;
+    for (int i = 0; i < OT_IKNP_K; ++i) {
+        AES_set_encrypt_key(seeds[i], &keys[i]);
+    }
+    return SUCCESS;
+}
+
+/*
+ * Chooses the seed pairs (k0_i, k1_i) and sends them through the base OTs
+ */
+static int
+extend_recv_init(struct state *st, int fd, AES_KEY *keys, block *seeds)
+{
+    if (RAND_bytes((unsigned char *) seeds, sizeof(block) * 2 * OT_IKNP_K) != 1)
+        return FAILURE;
+    if (base_ot_send(st, fd, seeds))
+        return FAILURE;
+    for (int i = 0; i < 2 * OT_IKNP_K; ++i) {
+        AES_set_encrypt_key(seeds[i], &keys[i]);
+    }
+    return SUCCESS;
+}
+
+/*
+ * Sender side of extending OTs [start, start + nots): receives the u_i's and
+ * writes the rows q_j of the transposed matrix Q to 'qt'
+ */
+static int
+extend_send_batch(int fd, const AES_KEY *keys, const unsigned char *s,
+                  int start, int nots, unsigned char *q, unsigned char *u,
+                  block *qt)
+{
+    size_t ncols = (nots + OT_IKNP_K - 1) / OT_IKNP_K * OT_IKNP_K;
+    size_t colbytes = ncols / 8;
+
+    // get u_i = G(k0_i) ^ G(k1_i) ^ r from receiver
+    if (net_recv(fd, u, colbytes * OT_IKNP_K, 0) == -1)
+        return FAILURE;
+
+    // compute q_i = G(k_{s_i}) ^ s_i * u_i
+    for (int i = 0; i < OT_IKNP_K; ++i) {
+        unsigned char *qi = q + i * colbytes;
+
+        prg_expand(&keys[i], start / 128, (block *) qi, ncols / 128);
+        if ((s[i / 8] >> (i % 8)) & 1)
+            xorarray(qi, colbytes, u + i * colbytes, colbytes);
+    }
+    bit_transpose((unsigned char *) qt, q, OT_IKNP_K, ncols);
+    return SUCCESS;
+}
+
+/*
+ * Receiver side of extending OTs [start, start + nots) with the choice bits
+ * packed in 'r': sends the u_i's and writes the rows t_j of the transposed
+ * matrix T to 'tt'
+ */
+static int
+extend_recv_batch(int fd, const AES_KEY *keys, const unsigned char *r,
+                  int start, int nots, unsigned char *t, unsigned char *u,
+                  block *tt)
+{
+    size_t ncols = (nots + OT_IKNP_K - 1) / OT_IKNP_K * OT_IKNP_K;
+    size_t colbytes = ncols / 8;
+
+    // compute t_i = G(k0_i) and u_i = t_i ^ G(k1_i) ^ r
+    for (int i = 0; i < OT_IKNP_K; ++i) {
+        unsigned char *ti = t + i * colbytes, *ui = u + i * colbytes;
+
+        prg_expand(&keys[2 * i], start / 128, (block *) ti, ncols / 128);
+        prg_expand(&keys[2 * i + 1], start / 128, (block *) ui, ncols / 128);
+        xorarray(ui, colbytes, ti, colbytes);
+        xorarray(ui, colbytes, r, colbytes);
+    }
+    // send u_i's to sender
+    if (net_send(fd, u, colbytes * OT_IKNP_K, 0) == -1)
+        return FAILURE;
+    bit_transpose((unsigned char *) tt, t, OT_IKNP_K, ncols);
+    return SUCCESS;
+}
+
+/*
+ * Packs the choice bits of OTs [start, start + nots) into 'r', zero-padded to
+ * a multiple of OT_IKNP_K bits
+ */
+static void
+pack_choices(unsigned char *r, const void *choices, int start, int nots,
+             ot_choice_reader choice_reader)
+{
+    size_t ncols = (nots + OT_IKNP_K - 1) / OT_IKNP_K * OT_IKNP_K;
+
+    (void) memset(r, '\0', ncols / 8);
+    for (int j = 0; j < nots; ++j) {
+        int choice = choice_reader(choices, start + j);
+        assert(choice == 0 || choice == 1);
+        r[j / 8] |= (unsigned char) (choice << (j % 8));
+    }
+}
+
+/*
+ * Runs sender operations for IKNP semi-honest OT extension
+ */
+int
+ot_iknp_send(struct state *st, int fd, void *msgs, int msglength, int num_ots,
+             int N, ot_msg_reader msg_reader, ot_item_reader item_reader)
+{
+    unsigned char s[OT_IKNP_K / 8];
+    unsigned char *q = NULL, *u = NULL;
+    block sblock, *seeds = NULL, *qt = NULL, *pad = NULL, *tweaks = NULL;
+    AES_KEY *keys = NULL;
+    char *y = NULL;
+    int nblocks = (msglength + sizeof(block) - 1) / sizeof(block);
+    int err = 0;
+
+    if (N != 2) {
+        fprintf(stderr, "OT-IKNP: only 1-out-of-2 OT is supported\n");
+        return 1;
+    }
+
+    seeds = (block *) ot_malloc(sizeof(block) * OT_IKNP_K);
+    if (seeds == NULL)
+        ERROR;
+    keys = (AES_KEY *) ot_malloc(sizeof(AES_KEY) * OT_IKNP_K);
+    if (keys == NULL)
+        ERROR;
+    q = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8 * OT_IKNP_K);
+    if (q == NULL)
+        ERROR;
+    u = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8 * OT_IKNP_K);
+    if (u == NULL)
+        ERROR;
+    qt = (block *) ot_malloc(sizeof(block) * OT_IKNP_BATCH);
+    if (qt == NULL)
+        ERROR;
+    y = (char *) ot_malloc(sizeof(char) * 2 * msglength * OT_IKNP_BATCH);
+    if (y == NULL)
+        ERROR;
+    pad = (block *) ot_malloc(sizeof(block) * 2 * nblocks * OT_IKNP_BATCH);
+    if (pad == NULL)
+        ERROR;
+    tweaks = (block *) ot_malloc(sizeof(block) * 2 * nblocks * OT_IKNP_BATCH);
+    if (tweaks == NULL)
+        ERROR;
+
+    if (extend_send_init(st, fd, s, &sblock, keys, seeds) == FAILURE)
+        ERROR;
+
+    for (int start = 0; start < num_ots; start += OT_IKNP_BATCH) {
+        int nots = MIN(num_ots - start, OT_IKNP_BATCH);
+
+        if (extend_send_batch(fd, keys, s, start, nots, q, u, qt) == FAILURE)
+            ERROR;
+
+        // compute y_j^b = x_j^b ^ H(q_j ^ b * s, j), hashing the whole
+        // batch at once
+        for (int j = 0; j < nots; ++j) {
+            for (int i = 0; i < N; ++i) {
+                block qj = i ? garble_xor(qt[j], sblock) : qt[j];
+
+                for (int k = 0; k < nblocks; ++k) {
+                    pad[(2 * j + i) * nblocks + k] = qj;
+                    tweaks[(2 * j + i) * nblocks + k]
+                        = garble_make_block(k, start + j);
+                }
+            }
+        }
+        aes_crh(pad, pad, tweaks, 2 * nblocks * nots);
+        for (int j = 0; j < nots; ++j) {
+            void *ot = msg_reader(msgs, start + j);
+
+            for (int i = 0; i < N; ++i) {
+                char *item, *yi = y + (2 * j + i) * msglength;
+                ssize_t itemlength;
+
+                (void) memcpy(yi, &pad[(2 * j + i) * nblocks], msglength);
+                item = (char *) item_reader(ot, i, &itemlength);
+                assert(itemlength <= msglength);
+                xorarray((unsigned char *) yi, msglength,
+                         (unsigned char *) item, itemlength);
+            }
+        }
+        if (net_send(fd, y, 2 * msglength * nots, 0) == -1)
+            ERROR;
+    }
+
+ cleanup:
+    if (tweaks)
+        ot_free(tweaks);
+    if (pad)
+        ot_free(pad);
+    if (y)
+        ot_free(y);
+    if (qt)
+        ot_free(qt);
+    if (u)
+        ot_free(u);
+    if (q)
+        ot_free(q);
+    if (keys)
+        ot_free(keys);
+    if (seeds)
+        ot_free(seeds);
+
+    return err;
+}
+
+/*
+ * Runs receiver operations for IKNP semi-honest OT extension
+ */
+int
+ot_iknp_recv(struct state *st, int fd, const void *choices, int nchoices,
+             int msglength, int N, void *out,
+             ot_choice_reader choice_reader, ot_msg_writer msg_writer)
+{
+    unsigned char *t = NULL, *u = NULL, *r = NULL;
+    block *seeds = NULL, *tt = NULL, *pad = NULL, *tweaks = NULL;
+    AES_KEY *keys = NULL;
+    char *y = NULL;
+    int nblocks = (msglength + sizeof(block) - 1) / sizeof(block);
+    int err = 0;
+
+    if (N != 2) {
+        fprintf(stderr, "OT-IKNP: only 1-out-of-2 OT is supported\n");
+        return 1;
+    }
+
+    seeds = (block *) ot_malloc(sizeof(block) * 2 * OT_IKNP_K);
+    if (seeds == NULL)
+        ERROR;
+    keys = (AES_KEY *) ot_malloc(sizeof(AES_KEY) * 2 * OT_IKNP_K);
+    if (keys == NULL)
+        ERROR;
+    t = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8 * OT_IKNP_K);
+    if (t == NULL)
+        ERROR;
+    u = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8 * OT_IKNP_K);
+    if (u == NULL)
+        ERROR;
+    r = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8);
+    if (r == NULL)
+        ERROR;
+    tt = (block *) ot_malloc(sizeof(block) * OT_IKNP_BATCH);
+    if (tt == NULL)
+        ERROR;
+    y = (char *) ot_malloc(sizeof(char) * 2 * msglength * OT_IKNP_BATCH);
+    if (y == NULL)
+        ERROR;
+    pad = (block *) ot_malloc(sizeof(block) * nblocks * OT_IKNP_BATCH);
+    if (pad == NULL)
+        ERROR;
+    tweaks = (block *) ot_malloc(sizeof(block) * nblocks * OT_IKNP_BATCH);
+    if (tweaks == NULL)
+        ERROR;
+
+    // choose seed pairs (k0_i, k1_i) and send them via the base OTs
+    if (extend_recv_init(st, fd, keys, seeds) == FAILURE)
+        ERROR;
+
+    for (int start = 0; start < nchoices; start += OT_IKNP_BATCH) {
+        int nots = MIN(nchoices - start, OT_IKNP_BATCH);
+
+        pack_choices(r, choices, start, nots, choice_reader);
+        if (extend_recv_batch(fd, keys, r, start, nots, t, u, tt) == FAILURE)
+            ERROR;
+
+        // compute the masks H(t_j, j) while the sender is busy
+        for (int j = 0; j < nots; ++j) {
+            for (int k = 0; k < nblocks; ++k) {
+                pad[j * nblocks + k] = tt[j];
+                tweaks[j * nblocks + k] = garble_make_block(k, start + j);
+            }
+        }
+        aes_crh(pad, pad, tweaks, nblocks * nots);
+
+        // get y_j^0, y_j^1 from sender and unmask y_j^{r_j}
+        if (net_recv(fd, y, 2 * msglength * nots, 0) == -1)
+            ERROR;
+        for (int j = 0; j < nots; ++j) {
+            int choice = (r[j / 8] >> (j % 8)) & 1;
+            char *yj = y + (2 * j + choice) * msglength;
+
+            xorarray((unsigned char *) yj, msglength,
+                     (unsigned char *) &pad[j * nblocks], msglength);
+            msg_writer(out, start + j, yj, msglength);
+        }
+    }
+
+ cleanup:
+    if (tweaks)
+        ot_free(tweaks);
+    if (pad)
+        ot_free(pad);
+    if (y)
+        ot_free(y);
+    if (tt)
+        ot_free(tt);
+    if (r)
+        ot_free(r);
+    if (u)
+        ot_free(u);
+    if (t)
+        ot_free(t);
+    if (keys)
+        ot_free(keys);
+    if (seeds)
+        ot_free(seeds);
+
+    return err;
+}
+
+/*
+ * Runs sender operations for IKNP correlated OT.  Rather than transferring
+ * chosen messages, the sender learns random m_j^0 along with
+ * m_j^1 = m_j^0 ^ delta, written to msgs[2j] and msgs[2j + 1].  Fixing the
+ * correlation lets the sender send a single block per OT,
+ * y_j = H(q_j, j) ^ H(q_j ^ s, j) ^ delta, with m_j^0 = H(q_j, j).
+ */
+int
+ot_iknp_cot_send(struct state *st, int fd, block delta, block *msgs,
+                 int num_ots)
+{
+    unsigned char s[OT_IKNP_K / 8];
+    unsigned char *q = NULL, *u = NULL;
+    block sblock, *seeds = NULL, *qt = NULL, *pad = NULL, *tweaks = NULL;
+    block *y = NULL;
+    AES_KEY *keys = NULL;
+    int err = 0;
+
+    seeds = (block *) ot_malloc(sizeof(block) * OT_IKNP_K);
+    if (seeds == NULL)
+        ERROR;
+    keys = (AES_KEY *) ot_malloc(sizeof(AES_KEY) * OT_IKNP_K);
+    if (keys == NULL)
+        ERROR;
+    q = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8 * OT_IKNP_K);
+    if (q == NULL)
+        ERROR;
+    u = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8 * OT_IKNP_K);
+    if (u == NULL)
+        ERROR;
+    qt = (block *) ot_malloc(sizeof(block) * OT_IKNP_BATCH);
+    if (qt == NULL)
+        ERROR;
+    y = (block *) ot_malloc(sizeof(block) * OT_IKNP_BATCH);
+    if (y == NULL)
+        ERROR;
+    pad = (block *) ot_malloc(sizeof(block) * 2 * OT_IKNP_BATCH);
+    if (pad == NULL)
+        ERROR;
+    tweaks = (block *) ot_malloc(sizeof(block) * 2 * OT_IKNP_BATCH);
+    if (tweaks == NULL)
+        ERROR;
+
+    if (extend_send_init(st, fd, s, &sblock, keys, seeds) == FAILURE)
+        ERROR;
+
+    for (int start = 0; start < num_ots; start += OT_IKNP_BATCH) {
+        int nots = MIN(num_ots - start, OT_IKNP_BATCH);
+
+        if (extend_send_batch(fd, keys, s, start, nots, q, u, qt) == FAILURE)
+            ERROR;
+
+        for (int j = 0; j < nots; ++j) {
+            pad[2 * j] = qt[j];
+            pad[2 * j + 1] = garble_xor(qt[j], sblock);
+            tweaks[2 * j] = tweaks[2 * j + 1] = garble_make_block(0, start + j);
+        }
+        aes_crh(pad, pad, tweaks, 2 * nots);
+        for (int j = 0; j < nots; ++j) {
+            block m0 = pad[2 * j];
+
+            y[j] = garble_xor(garble_xor(m0, pad[2 * j + 1]), delta);
+            msgs[2 * (start + j)] = m0;
+            msgs[2 * (start + j) + 1] = garble_xor(m0, delta);
+        }
+        if (net_send(fd, y, sizeof(block) * nots, 0) == -1)
+            ERROR;
+    }
+
+ cleanup:
+    if (tweaks)
+        ot_free(tweaks);
+    if (pad)
+        ot_free(pad);
+    if (y)
+        ot_free(y);
+    if (qt)
+        ot_free(qt);
+    if (u)
+        ot_free(u);
+    if (q)
+        ot_free(q);
+    if (keys)
+        ot_free(keys);
+    if (seeds)
+        ot_free(seeds);
+
+    return err;
+}
+
+/*
+ * Runs receiver operations for IKNP correlated OT, learning
+ * m_j^{r_j} = H(t_j, j) ^ r_j * y_j
+ */
+int
+ot_iknp_cot_recv(struct state *st, int fd, const void *choices, int nchoices,
+                 void *out, ot_choice_reader choice_reader,
+                 ot_msg_writer msg_writer)
+{
+    unsigned char *t = NULL, *u = NULL, *r = NULL;
+    block *seeds = NULL, *tt = NULL, *pad = NULL, *tweaks = NULL, *y = NULL;
+    AES_KEY *keys = NULL;
+    int err = 0;
+
+    seeds = (block *) ot_malloc(sizeof(block) * 2 * OT_IKNP_K);
+    if (seeds == NULL)
+        ERROR;
+    keys = (AES_KEY *) ot_malloc(sizeof(AES_KEY) * 2 * OT_IKNP_K);
+    if (keys == NULL)
+        ERROR;
+    t = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8 * OT_IKNP_K);
+    if (t == NULL)
+        ERROR;
+    u = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8 * OT_IKNP_K);
+    if (u == NULL)
+        ERROR;
+    r = (unsigned char *) ot_malloc(OT_IKNP_BATCH / 8);
+    if (r == NULL)
+        ERROR;
+    tt = (block *) ot_malloc(sizeof(block) * OT_IKNP_BATCH);
+    if (tt == NULL)
+        ERROR;
+    y = (block *) ot_malloc(sizeof(block) * OT_IKNP_BATCH);
+    if (y == NULL)
+        ERROR;
+    pad = (block *) ot_malloc(sizeof(block) * OT_IKNP_BATCH);
+    if (pad == NULL)
+        ERROR;
+    tweaks = (block *) ot_malloc(sizeof(block) * OT_IKNP_BATCH);
+    if (tweaks == NULL)
+        ERROR;
+
+    if (extend_recv_init(st, fd, keys, seeds) == FAILURE)
+        ERROR;
+
+    for (int start = 0; start < nchoices; start += OT_IKNP_BATCH) {
+        int nots = MIN(nchoices - start, OT_IKNP_BATCH);
+
+        pack_choices(r, choices, start, nots, choice_reader);
+        if (extend_recv_batch(fd, keys, r, start, nots, t, u, tt) == FAILURE)
+            ERROR;
+
+        for (int j = 0; j < nots; ++j) {
+            pad[j] = tt[j];
+            tweaks[j] = garble_make_block(0, start + j);
+        }
+        aes_crh(pad, pad, tweaks, nots);
+
+        if (net_recv(fd, y, sizeof(block) * nots, 0) == -1)
+            ERROR;
+        for (int j = 0; j < nots; ++j) {
+            if ((r[j / 8] >> (j % 8)) & 1)
+                pad[j] = garble_xor(pad[j], y[j]);
+            msg_writer(out, start + j, &pad[j], sizeof(block));
+        }
+    }
+
+ cleanup:
+    if (tweaks)
+        ot_free(tweaks);
+    if (pad)
+        ot_free(pad);
+    if (y)
+        ot_free(y);
+    if (tt)
+        ot_free(tt);
+    if (r)
+        ot_free(r);
+    if (u)
+        ot_free(u);
+    if (t)
+        ot_free(t);
+    if (keys)
+        ot_free(keys);
+    if (seeds)
+        ot_free(seeds);
+
+    return err;
+}
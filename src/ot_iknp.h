@@ -0,0 +1,28 @@
+#ifndef __OTLIB_OT_IKNP_H__
+#define __OTLIB_OT_IKNP_H__
+
+#include <garble.h>
+
+#include "ot.h"
+#include "state.h"
+
+/* number of base OTs, i.e., the computational security parameter */
+#define OT_IKNP_K 128
+
+int
+ot_iknp_send(struct state *st, int fd, void *msgs, int msglength, int num_ots,
+             int N, ot_msg_reader msg_reader, ot_item_reader item_reader);
+int
+ot_iknp_recv(struct state *st, int fd, const void *choices, int nchoices,
+             int msglength, int N, void *out,
+             ot_choice_reader choice_reader, ot_msg_writer msg_writer);
+
+int
+ot_iknp_cot_send(struct state *st, int fd, block delta, block *msgs,
+                 int num_ots);
+int
+ot_iknp_cot_recv(struct state *st, int fd, const void *choices, int nchoices,
+                 void *out, ot_choice_reader choice_reader,
+                 ot_msg_writer msg_writer);
+
+#endif
@@ -20,43 +20,255 @@
 #include <string.h>
 
 #include <gmp.h>
+#include <pthread.h>
 #include <openssl/sha.h>
-#include <garble/aes.h>
 
-#define SHA
+#define ERROR { err = 1; goto cleanup; }
 
-#if !defined AES_HW && !defined SHA
-#error one of AES_HW, SHA must be defined
-#endif
+/* number of OTs whose group elements are processed per network chunk */
+#define OT_NP_CHUNK 1024
+/* minimum number of OTs for which the receiver builds a fixed-base table for
+ * g^r; below this building the table costs more than it saves */
+#define OT_NP_FB_MIN 64
 
-#define ERROR { err = 1; goto cleanup; }
+/*
+ * Per-thread state.  Each worker gets its own RNG and scratch space so that
+ * workers never touch the shared gmp_randstate_t in struct state.
+ */
+struct np_worker {
+    pthread_t thread;
+    gmp_randstate_t rnd;
+    mpz_t t0, t1;
+    char *buf;
+    char *from;
+    struct np_job *job;
+    int lo, hi;
+};
+
+/*
+ * A single phase of the protocol, applied by the workers to every OT index in
+ * a range.  Only the fields used by 'fn' need to be set.
+ */
+struct np_job {
+    void (*fn)(struct np_job *job, struct np_worker *w, int j);
+    struct state *st;
+    int N;
+    int msglength;
+    int base;                   /* first OT index of the current chunk */
+    char *pk0s;                 /* chunk of serialized pk0's */
+    char *e;                    /* serialized encryptions */
+    /* sender */
+    mpz_t *r;
+    mpz_t *Crs;
+    void *msgs;
+    ot_msg_reader ot_msg_reader;
+    ot_item_reader ot_item_reader;
+    /* receiver */
+    mpz_t *gr;
+    struct fb_table *grtab;     /* table for g^r, or NULL */
+    mpz_t *C1;
+    mpz_t *ks;
+    const void *choices;
+    ot_choice_reader ot_choice_reader;
+    void *out;
+    ot_msg_writer ot_msg_writer;
+};
+
+static int
+np_workers_init(struct np_worker *ws, int nworkers, struct state *st,
+                int msglength)
+{
+    mpz_t seed;
+
+    /* every worker's GMP state first, so that np_workers_cleanup can clear
+     * them all even if an allocation below fails */
+    mpz_init(seed);
+    for (int i = 0; i < nworkers; ++i) {
+        mpz_urandomb(seed, st->p.rnd, 128);
+        gmp_randinit_default(ws[i].rnd);
+        gmp_randseed(ws[i].rnd, seed);
+        mpz_inits(ws[i].t0, ws[i].t1, NULL);
+    }
+    mpz_clear(seed);
+
+    for (int i = 0; i < nworkers; ++i) {
+        ws[i].buf = (char *) ot_malloc(sizeof(char) * field_size);
+        ws[i].from = (char *) ot_malloc(sizeof(char) * msglength);
+        if (ws[i].buf == NULL || ws[i].from == NULL)
+            return FAILURE;
+    }
+    return SUCCESS;
+}
+
+static void
+np_workers_cleanup(struct np_worker *ws, int nworkers)
+{
+    for (int i = 0; i < nworkers; ++i) {
+        gmp_randclear(ws[i].rnd);
+        mpz_clears(ws[i].t0, ws[i].t1, NULL);
+        if (ws[i].buf)
+            ot_free(ws[i].buf);
+        if (ws[i].from)
+            ot_free(ws[i].from);
+    }
+}
+
+static void *
+np_worker_run(void *arg)
+{
+    struct np_worker *w = (struct np_worker *) arg;
+
+    for (int j = w->lo; j < w->hi; ++j)
+        w->job->fn(w->job, w, j);
+    return NULL;
+}
+
+/*
+ * Applies 'job' to OT indices [lo, hi), split into contiguous slices across
+ * the workers.  The calling thread handles the first slice.
+ */
+static int
+np_run(struct np_job *job, struct np_worker *ws, int nworkers, int lo, int hi)
+{
+    int n = hi - lo, nthreads = MIN(nworkers, n), spawned = 1, res = SUCCESS;
+
+    for (int i = 0; i < nthreads; ++i) {
+        ws[i].job = job;
+        ws[i].lo = lo + (int) ((long) n * i / nthreads);
+        ws[i].hi = lo + (int) ((long) n * (i + 1) / nthreads);
+    }
+    for (; spawned < nthreads; ++spawned) {
+        if (pthread_create(&ws[spawned].thread, NULL, np_worker_run,
+                           &ws[spawned]) != 0) {
+            perror("pthread_create");
+            res = FAILURE;
+            break;
+        }
+    }
+    if (nthreads > 0)
+        (void) np_worker_run(&ws[0]);
+    for (int i = 1; i < spawned; ++i)
+        (void) pthread_join(ws[i].thread, NULL);
+    return res;
+}
+
+/*
+ * Sender: computes the N encryptions of the j'th OT from its pk0
+ */
+static void
+np_send_one(struct np_job *job, struct np_worker *w, int j)
+{
+    struct state *st = job->st;
+    void *ot = job->ot_msg_reader(job->msgs, j);
+    mpz_t *pk0 = &w->t0, *pk = &w->t1;
+    char *buf = w->buf;
+
+    array_to_mpz(*pk0, job->pk0s + (j - job->base) * field_size, field_size);
+    for (int i = 0; i < job->N; ++i) {
+        char *msg = job->e + (j * job->N + i) * job->msglength, *item;
+        ssize_t itemlength;
+
+        if (i == 0) {
+            // compute pk0^r
+            mpz_powm(*pk0, *pk0, *job->r, st->p.p);
+            mpz_to_array(buf, *pk0, field_size);
+            (void) mpz_invert(*pk0, *pk0, st->p.p);
+        } else {
+            mpz_mul(*pk, *pk0, job->Crs[i - 1]);
+            mpz_mod(*pk, *pk, st->p.p);
+            mpz_to_array(buf, *pk, field_size);
+        }
+
+        (void) memset(msg, '\0', job->msglength);
+        sha1_hash(msg, job->msglength, i, (unsigned char *) buf, field_size);
+
+        item = (char *) job->ot_item_reader(ot, i, &itemlength);
+        assert(itemlength <= job->msglength);
+
+        xorarray((unsigned char *) msg, job->msglength,
+                 (unsigned char *) item, itemlength);
+    }
+}
+
+/*
+ * Receiver: chooses k and computes pk0 for the j'th OT
+ */
+static void
+np_recv_keys_one(struct np_job *job, struct np_worker *w, int j)
+{
+    struct state *st = job->st;
+    mpz_t *pks = &w->t0, *pk0 = &w->t1;
+    long choice;
+
+    choice = job->ot_choice_reader(job->choices, j);
+    assert(choice == 0 || choice == 1);
+    // choose random k
+    mpz_urandomb(job->ks[j], w->rnd, field_size * 8);
+    mpz_mod(job->ks[j], job->ks[j], st->p.q);
+    // compute pks = g^k
+    fb_powm(*pks, &st->gtab, job->ks[j], st->p.p);
+    // compute pk0 = C_1 / g^k regardless of whether our choice is 0 or 1 to
+    // avoid a potential side-channel attack
+    (void) mpz_invert(*pk0, *pks, st->p.p);
+    mpz_mul(*pk0, *pk0, *job->C1);
+    mpz_mod(*pk0, *pk0, st->p.p);
+    mpz_set(*pk0, choice == 0 ? *pks : *pk0);
+    mpz_to_array(job->pk0s + (j - job->base) * field_size, *pk0, field_size);
+}
+
+/*
+ * Receiver: decrypts the chosen message of the j'th OT
+ */
+static void
+np_recv_msg_one(struct np_job *job, struct np_worker *w, int j)
+{
+    struct state *st = job->st;
+    char *buf = w->buf, *from = w->from, *msg;
+    long choice;
+
+    choice = job->ot_choice_reader(job->choices, j);
+    assert(choice == 0 || choice == 1);
+    msg = job->e + ((j - job->base) * job->N + choice) * job->msglength;
+
+    // compute decryption key (g^r)^k
+    if (job->grtab)
+        fb_powm(job->ks[j], job->grtab, job->ks[j], st->p.p);
+    else
+        mpz_powm(job->ks[j], *job->gr, job->ks[j], st->p.p);
+    mpz_to_array(buf, job->ks[j], field_size);
+
+    (void) memset(from, '\0', job->msglength);
+    sha1_hash(from, job->msglength, choice, (unsigned char *) buf, field_size);
+
+    xorarray((unsigned char *) msg, job->msglength,
+             (unsigned char *) from, job->msglength);
+    job->ot_msg_writer(job->out, j, msg, job->msglength);
+}
 
 /*
  * Runs sender operations for Naor-Pinkas semi-honest OT
+ *
+ * Each phase of the protocol is a single bulk transfer: g^r and the C_i's go
+ * out in one message, the receiver's pk0's are consumed OT_NP_CHUNK at a time
+ * as they arrive, and all encryptions are returned in one message.  The
+ * per-OT work of each chunk is split across ot_nthreads workers.
  */
 int
 ot_np_send(struct state *st, int fd, void *msgs, int msglength, int num_ots,
            int N, ot_msg_reader ot_msg_reader, ot_item_reader ot_item_reader)
 {
-    mpz_t r, gr, pk, pk0;
-    mpz_t *Cs = NULL, *Crs = NULL, *pk0s = NULL;
-    char buf[field_size], *msg = NULL;
+    mpz_t r, gr, c;
+    mpz_t *Cs = NULL, *Crs = NULL;
+    char *hdr = NULL, *pk0s = NULL, *e = NULL;
+    struct np_worker *ws = NULL;
+    struct np_job job;
+    int nworkers = MAX(ot_nthreads, 1);
     int err = 0;
-    /* double start, end; */
-
-#ifdef AES_HW
-    //fprintf(stderr, "OT-NP: Using AESNI\n");
-#endif
-#ifdef SHA
-    //fprintf(stderr, "OT-NP: Using SHA-1\n");
-#endif
 
-    /* start = current_time(); */
+    mpz_inits(r, gr, c, NULL);
 
-    mpz_inits(r, gr, pk, pk0, NULL);
-
-    msg = (char *) ot_malloc(sizeof(char) * msglength);
-    if (msg == NULL)
+    hdr = (char *) ot_malloc(sizeof(char) * field_size * N);
+    if (hdr == NULL)
         ERROR;
     Cs = (mpz_t *) ot_malloc(sizeof(mpz_t) * (N - 1));
     if (Cs == NULL)
@@ -64,117 +276,78 @@ ot_np_send(struct state *st, int fd, void *msgs, int msglength, int num_ots,
     Crs = (mpz_t *) ot_malloc(sizeof(mpz_t) * (N - 1));
     if (Crs == NULL)
         ERROR;
-    pk0s = (mpz_t *) ot_malloc(sizeof(mpz_t) * num_ots);
+    pk0s = (char *) ot_malloc(sizeof(char) * field_size * OT_NP_CHUNK);
     if (pk0s == NULL)
         ERROR;
-
-    for (int i = 0; i < num_ots; ++i) {
-        mpz_init(pk0s[i]);
-    }
-
-#ifdef AES_HW
-    AES_KEY key;
-    AES_set_encrypt_key((unsigned char *) "abcd", 128, &key);
-#endif
+    e = (char *) ot_malloc(sizeof(char) * msglength * N * num_ots);
+    if (e == NULL)
+        ERROR;
+    ws = (struct np_worker *) calloc(nworkers, sizeof(struct np_worker));
+    if (ws == NULL)
+        ERROR;
+    if (np_workers_init(ws, nworkers, st, msglength) == FAILURE)
+        ERROR;
 
     // choose r \in_R Zq
-    random_element(r, &st->p);
+    mpz_urandomb(r, st->p.rnd, field_size * 8);
+    mpz_mod(r, r, st->p.q);
     // compute g^r
-    mpz_powm(gr, st->p.g, r, st->p.p);
+    fb_powm(gr, &st->gtab, r, st->p.p);
 
-    // choose C_i's \in_R Zq
+    // choose C_i = g^c_i for c_i \in_R Zq
     for (int i = 0; i < N - 1; ++i) {
         mpz_inits(Cs[i], Crs[i], NULL);
-        random_element(Cs[i], &st->p);
-    }
-
-    /* end = current_time(); */
-    //fprintf(stderr, "Initialization: %f\n", end - start);
-
-    // send g^r to receiver
-    /* start = current_time(); */
-    mpz_to_array(buf, gr, sizeof buf);
-    if (net_send(fd, buf, sizeof buf, 0) == -1)
-        ERROR;
-    /* end = current_time(); */
-    //fprintf(stderr, "Send g^r to receiver: %f\n", end - start);
-
-    // send Cs to receiver
-    /* start = current_time(); */
-    for (int i = 0; i < N - 1; ++i) {
-        mpz_to_array(buf, Cs[i], sizeof buf);
-        if (net_send(fd, buf, sizeof buf, 0) == -1)
-            ERROR;
+        mpz_urandomb(c, st->p.rnd, field_size * 8);
+        mpz_mod(c, c, st->p.q);
+        fb_powm(Cs[i], &st->gtab, c, st->p.p);
+        // compute C_i^r = g^(c_i r)
+        mpz_mul(c, c, r);
+        mpz_mod(c, c, st->p.q);
+        fb_powm(Crs[i], &st->gtab, c, st->p.p);
     }
-    /* end = current_time(); */
-    //fprintf(stderr, "Send Cs to receiver: %f\n", end - start);
 
-    /* start = current_time(); */
+    // send g^r and C_i's to receiver
+    mpz_to_array(hdr, gr, field_size);
     for (int i = 0; i < N - 1; ++i) {
-        // compute C_i^r
-        mpz_powm(Crs[i], Cs[i], r, st->p.p);
+        mpz_to_array(hdr + (i + 1) * field_size, Cs[i], field_size);
     }
-    /* end = current_time(); */
-    //fprintf(stderr, "Compute C_i^r: %f\n", end - start);
+    if (net_send(fd, hdr, field_size * N, 0) == -1)
+        ERROR;
 
-    /* start = current_time(); */
-    for (int j = 0; j < num_ots; ++j) {
-        // get pk0 from receiver
-        if (net_recv(fd, buf, sizeof buf, 0) == -1)
+    (void) memset(&job, '\0', sizeof job);
+    job.fn = np_send_one;
+    job.st = st;
+    job.N = N;
+    job.msglength = msglength;
+    job.pk0s = pk0s;
+    job.e = e;
+    job.r = &r;
+    job.Crs = Crs;
+    job.msgs = msgs;
+    job.ot_msg_reader = ot_msg_reader;
+    job.ot_item_reader = ot_item_reader;
+
+    for (int start = 0; start < num_ots; start += OT_NP_CHUNK) {
+        int nots = MIN(num_ots - start, OT_NP_CHUNK);
+
+        // get next chunk of pk0's from receiver
+        if (net_recv(fd, pk0s, field_size * nots, 0) == -1)
+            ERROR;
+        job.base = start;
+        if (np_run(&job, ws, nworkers, start, start + nots) == FAILURE)
             ERROR;
-        array_to_mpz(pk0s[j], buf, sizeof buf);
-    }
-    /* end = current_time(); */
-    //fprintf(stderr, "Get pk0 from receiver: %f\n", end - start);
-
-    /* start = current_time(); */
-    for (int j = 0; j < num_ots; ++j) {
-        void *ot = ot_msg_reader(msgs, j);
-        for (int i = 0; i < N; ++i) {
-            char *item;
-            ssize_t itemlength;
-
-            if (i == 0) {
-                // compute pk0^r
-                mpz_powm(pk0, pk0s[j], r, st->p.p);
-                mpz_to_array(buf, pk0, sizeof buf);
-                (void) mpz_invert(pk0, pk0, st->p.p);
-            } else {
-                mpz_mul(pk, pk0, Crs[i - 1]);
-                mpz_mod(pk, pk, st->p.p);
-                mpz_to_array(buf, pk, sizeof buf);
-            }
-
-#ifdef AES_HW
-            if (AES_encrypt_message((unsigned char *) buf, sizeof buf,
-                                    (unsigned char *) msg, msglength, &key))
-                ERROR;
-#endif
-#ifdef SHA
-            (void) memset(msg, '\0', msglength);
-            sha1_hash(msg, msglength, i, (unsigned char *) buf, sizeof buf);
-#endif            
-
-            item = (char *) ot_item_reader(ot, i, &itemlength);
-            assert(itemlength <= msglength);
-
-            xorarray((unsigned char *) msg, msglength,
-                     (unsigned char *) item, itemlength);
-            if (net_send(fd, msg, msglength, 0) == -1)
-                ERROR;
-        }
     }
-    /* end = current_time(); */
-    //fprintf(stderr, "Send hashes to receiver: %f\n", end - start);
+
+    // send all encryptions to receiver
+    if (net_send(fd, e, msglength * N * num_ots, 0) == -1)
+        ERROR;
 
  cleanup:
-    mpz_clears(r, gr, pk, pk0, NULL);
+    mpz_clears(r, gr, c, NULL);
 
-    if (pk0s) {
-        for (int i = 0; i < num_ots; ++i) {
-            mpz_clear(pk0s[i]);
-        }
-        ot_free(pk0s);
+    if (ws) {
+        np_workers_cleanup(ws, nworkers);
+        free(ws);
     }
     if (Crs) {
         for (int i = 0; i < N - 1; ++i)
@@ -186,37 +359,48 @@ ot_np_send(struct state *st, int fd, void *msgs, int msglength, int num_ots,
             mpz_clear(Cs[i]);
         ot_free(Cs);
     }
-    if (msg)
-        ot_free(msg);
+    if (e)
+        ot_free(e);
+    if (pk0s)
+        ot_free(pk0s);
+    if (hdr)
+        ot_free(hdr);
 
     return err;
 }
 
+/*
+ * Runs receiver operations for Naor-Pinkas semi-honest OT
+ *
+ * The pk0's are sent in OT_NP_CHUNK sized chunks as soon as each chunk is
+ * computed, and the sender's encryptions are decrypted chunk by chunk as they
+ * arrive.  As on the sender side, each chunk is split across ot_nthreads
+ * workers; the wire format does not depend on the number of workers.
+ */
 int
 ot_np_recv(struct state *st, int fd, const void *choices, int nchoices, int msglength,
            int N, void *out,
            ot_choice_reader ot_choice_reader, ot_msg_writer ot_msg_writer)
 {
-    mpz_t gr, pk0, pks;
+    mpz_t gr;
     mpz_t *Cs = NULL, *ks = NULL;
-    char buf[field_size], *from = NULL, *msg = NULL;
+    char *hdr = NULL, *pk0s = NULL, *e = NULL;
+    struct fb_table grtab = { .tab = NULL };
+    struct np_worker *ws = NULL;
+    struct np_job job;
+    int nworkers = MAX(ot_nthreads, 1);
     int err = 0;
-    /* double start, end; */
-
-#ifdef AES_HW
-    //fprintf(stderr, "OT-NP: Using AESNI\n");
-#endif
-#ifdef SHA
-    //fprintf(stderr, "OT-NP: Using SHA-1\n");
-#endif
 
-    mpz_inits(gr, pk0, pks, NULL);
+    mpz_init(gr);
 
-    msg = (char *) ot_malloc(sizeof(char) * msglength);
-    if (msg == NULL)
+    hdr = (char *) ot_malloc(sizeof(char) * field_size * N);
+    if (hdr == NULL)
         ERROR;
-    from = (char *) ot_malloc(sizeof(char) * msglength);
-    if (from == NULL)
+    pk0s = (char *) ot_malloc(sizeof(char) * field_size * OT_NP_CHUNK);
+    if (pk0s == NULL)
+        ERROR;
+    e = (char *) ot_malloc(sizeof(char) * msglength * N * OT_NP_CHUNK);
+    if (e == NULL)
         ERROR;
     Cs = (mpz_t *) ot_malloc(sizeof(mpz_t) * (N - 1));
     if (Cs == NULL)
@@ -230,95 +414,71 @@ ot_np_recv(struct state *st, int fd, const void *choices, int nchoices, int msgl
     for (int j = 0; j < nchoices; ++j) {
         mpz_init(ks[j]);
     }
-
-#ifdef AES_HW
-    AES_KEY key;
-    AES_set_encrypt_key((unsigned char *) "abcd", 128, &key);
-#endif
-
-    // get g^r from sender
-    /* start = current_time(); */
-    if (net_recv(fd, buf, sizeof buf, 0) == -1)
+    ws = (struct np_worker *) calloc(nworkers, sizeof(struct np_worker));
+    if (ws == NULL)
+        ERROR;
+    if (np_workers_init(ws, nworkers, st, msglength) == FAILURE)
         ERROR;
-    array_to_mpz(gr, buf, sizeof buf);
-    /* end = current_time(); */
-    //fprintf(stderr, "Get g^r from sender: %f\n", end - start);
 
-    // get Cs from sender
-    /* start = current_time(); */
+    // get g^r and C_i's from sender
+    if (net_recv(fd, hdr, field_size * N, 0) == -1)
+        ERROR;
+    array_to_mpz(gr, hdr, field_size);
     for (int i = 0; i < N - 1; ++i) {
-        if (net_recv(fd, buf, sizeof buf, 0) == -1)
-            ERROR;
-        array_to_mpz(Cs[i], buf, sizeof buf);
+        array_to_mpz(Cs[i], hdr + (i + 1) * field_size, field_size);
     }
-    /* end = current_time(); */
-    //fprintf(stderr, "Get Cs from sender: %f\n", end - start);
 
-    /* start = current_time(); */
-    for (int j = 0; j < nchoices; ++j) {
-        long choice;
-
-        choice = ot_choice_reader(choices, j);
-        assert(choice == 0 || choice == 1);
-        // choose random k
-        mpz_urandomb(ks[j], st->p.rnd, sizeof buf * 8);
-        mpz_mod(ks[j], ks[j], st->p.q);
-        // compute pks = g^k
-        mpz_powm(pks, st->p.g, ks[j], st->p.p);
-        // compute pk0 = C_1 / g^k regardless of whether our choice is 0 or 1 to
-        // avoid a potential side-channel attack
-        (void) mpz_invert(pk0, pks, st->p.p);
-        mpz_mul(pk0, pk0, Cs[0]);
-        mpz_mod(pk0, pk0, st->p.p);
-        mpz_set(pk0, choice == 0 ? pks : pk0);
-        mpz_to_array(buf, pk0, sizeof buf);
-        // send pk0 to sender
-        if (net_send(fd, buf, sizeof buf, 0) == -1)
+    (void) memset(&job, '\0', sizeof job);
+    job.st = st;
+    job.N = N;
+    job.msglength = msglength;
+    job.pk0s = pk0s;
+    job.e = e;
+    job.gr = &gr;
+    job.C1 = &Cs[0];
+    job.ks = ks;
+    job.choices = choices;
+    job.ot_choice_reader = ot_choice_reader;
+    job.out = out;
+    job.ot_msg_writer = ot_msg_writer;
+
+    job.fn = np_recv_keys_one;
+    for (int start = 0; start < nchoices; start += OT_NP_CHUNK) {
+        int nots = MIN(nchoices - start, OT_NP_CHUNK);
+
+        job.base = start;
+        if (np_run(&job, ws, nworkers, start, start + nots) == FAILURE)
+            ERROR;
+        // send chunk of pk0's to sender
+        if (net_send(fd, pk0s, field_size * nots, 0) == -1)
             ERROR;
     }
-    /* end = current_time(); */
-    //fprintf(stderr, "Send pk0s to sender: %f\n", end - start);
 
-    /* start = current_time(); */
-    for (int j = 0; j < nchoices; ++j) {
-        long choice;
-
-        choice = ot_choice_reader(choices, j);
-        assert(choice == 0 || choice == 1);
-
-        // compute decryption key (g^r)^k
-        mpz_powm(ks[j], gr, ks[j], st->p.p);
-
-        for (int i = 0; i < N; ++i) {
-            mpz_to_array(buf, ks[j], sizeof buf);
-            // get H xor M0 from sender
-            if (net_recv(fd, msg, msglength, 0) == -1)
-                ERROR;
-
-#ifdef AES_HW
-            if (AES_encrypt_message((unsigned char *) buf, sizeof buf,
-                                    (unsigned char *) from, msglength, &key))
-                ERROR;
-#endif
-#ifdef SHA
-            (void) memset(from, '\0', msglength);
-            sha1_hash(from, msglength, i, (unsigned char *) buf, sizeof buf);
-#endif
-
-            xorarray((unsigned char *) msg, msglength,
-                     (unsigned char *) from, msglength);
-
-            if (i == choice) {
-                ot_msg_writer(out, j, msg, msglength);
-            }
-        }
+    // while the sender computes its encryptions, build a table for g^r
+    if (nchoices >= OT_NP_FB_MIN
+        && fb_init(&grtab, gr, st->p.p, mpz_sizeinbase(st->p.q, 2)) == SUCCESS)
+        job.grtab = &grtab;
+
+    job.fn = np_recv_msg_one;
+    for (int start = 0; start < nchoices; start += OT_NP_CHUNK) {
+        int nots = MIN(nchoices - start, OT_NP_CHUNK);
+
+        // get next chunk of encryptions from sender
+        if (net_recv(fd, e, msglength * N * nots, 0) == -1)
+            ERROR;
+        job.base = start;
+        if (np_run(&job, ws, nworkers, start, start + nots) == FAILURE)
+            ERROR;
     }
-    /* end = current_time(); */
-    //fprintf(stderr, "Receive hashes from sender: %f\n", end - start);
 
  cleanup:
-    mpz_clears(gr, pk0, pks, NULL);
+    mpz_clear(gr);
+    fb_clear(&grtab);
 
+    if (ws) {
+        np_workers_cleanup(ws, nworkers);
+        free(ws);
+    }
     if (ks) {
         for (int j = 0; j < nchoices; ++j) {
             mpz_clear(ks[j]);
@@ -330,10 +490,12 @@ ot_np_recv(struct state *st, int fd, const void *choices, int nchoices, int msgl
             mpz_clear(Cs[i]);
         ot_free(Cs);
     }
-    if (msg)
-        ot_free(msg);
-    if (from)
-        ot_free(from);
+    if (e)
+        ot_free(e);
+    if (pk0s)
+        ot_free(pk0s);
+    if (hdr)
+        ot_free(hdr);
 
     return err;
 }
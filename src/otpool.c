@@ -0,0 +1,647 @@
+#include "otpool.h"
+
+#include "2pc_common.h"
+#include "net.h"
+#include "ot_iknp.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <openssl/rand.h>
+
+#define OTPOOL_MAGIC 0x4c4f4f50544f4347ULL  /* "GCOTPOOL" */
+/* size of the file header; records start at this offset */
+#define OTPOOL_HDR_SIZE 64
+/* number of OTs run and appended at a time while filling */
+#define OTPOOL_CHUNK (1 << 18)
+
+uint64_t ot_pool_size = 0;
+bool ot_correlated = false;
+
+struct otpool_hdr {
+    uint64_t magic;
+    uint64_t recsize;
+    uint64_t count;             /* number of records in the pool */
+    uint64_t cursor;            /* index of the first unconsumed record */
+    block delta;                /* offset of correlated garbler pools */
+    uint64_t correlated;
+};
+
+/* evaluator record */
+struct otpool_rrec {
+    block label;
+    int sel;
+};
+
+static void *
+pool_msg_reader(void *msgs, int idx)
+{
+    return &((block *) msgs)[2 * idx];
+}
+
+static void *
+pool_item_reader(void *item, int idx, ssize_t *mlen)
+{
+    *mlen = sizeof(block);
+    return &((block *) item)[idx];
+}
+
+static int
+pool_choice_reader(const void *choices, int idx)
+{
+    return ((const struct otpool_rrec *) choices)[idx].sel;
+}
+
+static int
+pool_msg_writer(void *array, int idx, void *msg, size_t maxlength)
+{
+    (void) maxlength;
+    (void) memcpy(&((struct otpool_rrec *) array)[idx].label, msg,
+                  sizeof(block));
+    return 0;
+}
+
+static int
+hdr_read(struct otpool *pool, struct otpool_hdr *hdr)
+{
+    if (pread(pool->fd, hdr, sizeof *hdr, 0) != sizeof *hdr)
+        return FAILURE;
+    if (hdr->magic != OTPOOL_MAGIC || hdr->recsize != pool->recsize)
+        return FAILURE;
+    return SUCCESS;
+}
+
+static int
+hdr_write(struct otpool *pool, const struct otpool_hdr *hdr)
+{
+    if (pwrite(pool->fd, hdr, sizeof *hdr, 0) != sizeof *hdr)
+        return FAILURE;
+    return SUCCESS;
+}
+
+static int
+pool_lock(struct otpool *pool, struct otpool_hdr *hdr)
+{
+    if (flock(pool->fd, LOCK_EX) == -1) {
+        perror("flock");
+        return FAILURE;
+    }
+    if (hdr_read(pool, hdr) == FAILURE) {
+        fprintf(stderr, "OT pool: corrupt header\n");
+        (void) flock(pool->fd, LOCK_UN);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+static void
+pool_unlock(struct otpool *pool)
+{
+    (void) flock(pool->fd, LOCK_UN);
+}
+
+int
+otpool_open(struct otpool *pool, const char *dir, bool isSender)
+{
+    struct otpool_hdr hdr;
+    size_t size = strlen(dir) + strlen("/otpool") + 1;
+    char fname[size];
+    struct stat st;
+
+    (void) snprintf(fname, size, "%s/%s", dir, "otpool");
+
+    pool->isSender = isSender;
+    pool->recsize = isSender ? 2 * sizeof(block) : sizeof(struct otpool_rrec);
+    if ((pool->fd = open(fname, O_RDWR | O_CREAT, 0644)) == -1) {
+        fprintf(stderr, "OT pool: could not open %s: %s\n", fname,
+                strerror(errno));
+        return FAILURE;
+    }
+
+    /* initialize the header of a new pool */
+    (void) flock(pool->fd, LOCK_EX);
+    if (fstat(pool->fd, &st) == 0 && st.st_size == 0) {
+        memset(&hdr, '\0', sizeof hdr);
+        hdr.magic = OTPOOL_MAGIC;
+        hdr.recsize = pool->recsize;
+        hdr.correlated = ot_correlated;
+        hdr.delta = isSender && ot_correlated
+            ? garble_create_delta() : garble_zero_block();
+        (void) hdr_write(pool, &hdr);
+    }
+    if (hdr_read(pool, &hdr) == FAILURE) {
+        fprintf(stderr, "OT pool: %s is not a %s pool\n", fname,
+                isSender ? "garbler" : "evaluator");
+        (void) flock(pool->fd, LOCK_UN);
+        (void) close(pool->fd);
+        return FAILURE;
+    }
+    (void) flock(pool->fd, LOCK_UN);
+    if ((bool) hdr.correlated != ot_correlated) {
+        fprintf(stderr, "OT pool: %s holds %scorrelated OTs; remove it to "
+                "switch modes\n", fname, hdr.correlated ? "" : "non-");
+        (void) close(pool->fd);
+        return FAILURE;
+    }
+    pool->correlated = hdr.correlated;
+    pool->delta = hdr.delta;
+    return SUCCESS;
+}
+
+void
+otpool_close(struct otpool *pool)
+{
+    (void) close(pool->fd);
+}
+
+int
+otpool_available(struct otpool *pool, uint64_t *navailable)
+{
+    struct otpool_hdr hdr;
+
+    if (pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    pool_unlock(pool);
+    *navailable = hdr.count - hdr.cursor;
+    return SUCCESS;
+}
+
+/*
+ * Atomically reserves the next 'n' unconsumed OTs, returning the index of the
+ * first one in 'offset'
+ */
+int
+otpool_reserve(struct otpool *pool, uint64_t n, uint64_t *offset)
+{
+    struct otpool_hdr hdr;
+    int res = SUCCESS;
+
+    if (pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    if (hdr.count - hdr.cursor < n) {
+        fprintf(stderr, "OT pool: %lu OTs requested but only %lu available\n",
+                n, hdr.count - hdr.cursor);
+        res = FAILURE;
+    } else {
+        *offset = hdr.cursor;
+        hdr.cursor += n;
+        res = hdr_write(pool, &hdr);
+    }
+    pool_unlock(pool);
+    return res;
+}
+
+/*
+ * Marks the slice [offset, offset + n) as consumed, for the party that does
+ * not own the cursor
+ */
+int
+otpool_consume(struct otpool *pool, uint64_t offset, uint64_t n)
+{
+    struct otpool_hdr hdr;
+    int res = SUCCESS;
+
+    if (pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    if (offset + n > hdr.count) {
+        fprintf(stderr, "OT pool: slice [%lu, %lu) is past the end of the pool\n",
+                offset, offset + n);
+        res = FAILURE;
+    } else if (offset + n > hdr.cursor) {
+        hdr.cursor = offset + n;
+        res = hdr_write(pool, &hdr);
+    }
+    pool_unlock(pool);
+    return res;
+}
+
+static int
+pool_read(struct otpool *pool, uint64_t offset, uint64_t n, void *recs)
+{
+    size_t len = n * pool->recsize;
+    off_t pos = OTPOOL_HDR_SIZE + offset * pool->recsize;
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t r = pread(pool->fd, (char *) recs + total, len - total,
+                          pos + total);
+        if (r <= 0) {
+            fprintf(stderr, "OT pool: short read\n");
+            return FAILURE;
+        }
+        total += r;
+    }
+    return SUCCESS;
+}
+
+static int
+pool_append(struct otpool *pool, const void *recs, uint64_t n)
+{
+    struct otpool_hdr hdr;
+    size_t len = n * pool->recsize, total = 0;
+    off_t pos;
+    int res = SUCCESS;
+
+    if (pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    pos = OTPOOL_HDR_SIZE + hdr.count * pool->recsize;
+    while (total < len) {
+        ssize_t w = pwrite(pool->fd, (const char *) recs + total, len - total,
+                           pos + total);
+        if (w <= 0) {
+            perror("OT pool: write");
+            res = FAILURE;
+            break;
+        }
+        total += w;
+    }
+    if (res == SUCCESS) {
+        hdr.count += n;
+        res = hdr_write(pool, &hdr);
+    }
+    pool_unlock(pool);
+    return res;
+}
+
+/*
+ * Drops the records past 'count', which the other party's pool does not have
+ */
+static int
+pool_truncate(struct otpool *pool, uint64_t count)
+{
+    struct otpool_hdr hdr;
+    int res = SUCCESS;
+
+    if (pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    if (hdr.count > count) {
+        if (hdr.cursor > count) {
+            fprintf(stderr, "OT pool: the pools diverged after OTs were "
+                    "handed out; remove both pools to reset them\n");
+            res = FAILURE;
+        } else {
+            fprintf(stderr, "OT pool: dropping %lu OTs the other party "
+                    "does not have\n", hdr.count - count);
+            hdr.count = count;
+            if (ftruncate(pool->fd, OTPOOL_HDR_SIZE + count * pool->recsize)
+                == -1) {
+                perror("OT pool: truncate");
+                res = FAILURE;
+            } else {
+                res = hdr_write(pool, &hdr);
+            }
+        }
+    }
+    pool_unlock(pool);
+    return res;
+}
+
+static int
+pool_count(struct otpool *pool, uint64_t *count)
+{
+    struct otpool_hdr hdr;
+
+    if (pool_lock(pool, &hdr) == FAILURE)
+        return FAILURE;
+    pool_unlock(pool);
+    *count = hdr.count;
+    return SUCCESS;
+}
+
+int
+otpool_read_sender(struct otpool *pool, uint64_t offset, uint64_t n,
+                   block *labels)
+{
+    return pool_read(pool, offset, n, labels);
+}
+
+int
+otpool_read_receiver(struct otpool *pool, uint64_t offset, uint64_t n,
+                     block *labels, int *selections)
+{
+    struct otpool_rrec *recs;
+    int res;
+
+    if ((recs = ot_malloc(sizeof(struct otpool_rrec) * n)) == NULL)
+        return FAILURE;
+    if ((res = pool_read(pool, offset, n, recs)) == SUCCESS) {
+        for (uint64_t i = 0; i < n; ++i) {
+            labels[i] = recs[i].label;
+            selections[i] = recs[i].sel;
+        }
+    }
+    ot_free(recs);
+    return res;
+}
+
+/*
+ * Chunk announcement of a refill: the number of OTs that follow, or 0 once the
+ * refill is done, and the number of records the sender's pool holds.
+ */
+struct otpool_chunk {
+    uint64_t nots;
+    uint64_t count;
+};
+
+/*
+ * Runs 'n' random OTs as the sender over 'fd' and appends them to the pool.
+ * Each chunk is announced with its size and the sender's record count, which
+ * the receiver answers with its own; a pool holding records the other lacks,
+ * left behind by a refill that failed between the two appends, is truncated
+ * to the shorter one first, so that record i of both pools stays the same OT.
+ * The chunk is only appended once the receiver has acknowledged appending it,
+ * so the garbler never hands out OTs the evaluator does not yet have.
+ */
+int
+otpool_fill_send(struct otpool *pool, struct state *st, int fd, uint64_t n)
+{
+    block *labels;
+    uint64_t chunk = MIN(n, OTPOOL_CHUNK);
+    int res = SUCCESS;
+
+    labels = garble_allocate_blocks(2 * chunk);
+    if (labels == NULL)
+        return FAILURE;
+
+    for (uint64_t done = 0; res == SUCCESS && done < n; ) {
+        struct otpool_chunk ann;
+        uint64_t nots = MIN(n - done, OTPOOL_CHUNK), count;
+        char ack;
+        int err;
+
+        ann.nots = nots;
+        if (pool_count(pool, &ann.count) == FAILURE
+            || net_send(fd, &ann, sizeof ann, 0) == FAILURE
+            || net_recv(fd, &count, sizeof count, 0) == FAILURE
+            || (count < ann.count
+                && pool_truncate(pool, count) == FAILURE)) {
+            res = FAILURE;
+            break;
+        }
+        if (pool->correlated) {
+            err = ot_iknp_cot_send(st, fd, pool->delta, labels, nots);
+        } else {
+            for (uint64_t i = 0; i < 2 * nots; ++i)
+                labels[i] = garble_random_block();
+            err = ot_iknp_send(st, fd, labels, sizeof(block), nots, 2,
+                               pool_msg_reader, pool_item_reader);
+        }
+        if (err != 0
+            || net_recv(fd, &ack, sizeof ack, 0) == FAILURE
+            || pool_append(pool, labels, nots) == FAILURE) {
+            res = FAILURE;
+            break;
+        }
+        done += nots;
+    }
+    free(labels);
+    return res;
+}
+
+/*
+ * Tells the receiver that no more OTs follow
+ */
+int
+otpool_fill_done(int fd)
+{
+    struct otpool_chunk ann = { 0, 0 };
+    return net_send(fd, &ann, sizeof ann, 0);
+}
+
+/*
+ * Receiver counterpart of otpool_fill_send: runs and appends OT chunks until
+ * the sender calls otpool_fill_done
+ */
+int
+otpool_fill_recv(struct otpool *pool, struct state *st, int fd)
+{
+    struct otpool_rrec *recs = NULL;
+    unsigned char *bits = NULL;
+    int res = SUCCESS;
+
+    recs = ot_malloc(sizeof(struct otpool_rrec) * OTPOOL_CHUNK);
+    bits = malloc(OTPOOL_CHUNK / 8);
+    if (recs == NULL || bits == NULL) {
+        res = FAILURE;
+        goto cleanup;
+    }
+
+    while (true) {
+        struct otpool_chunk ann;
+        uint64_t nots, count;
+        char ack = 1;
+        int err;
+
+        if (net_recv(fd, &ann, sizeof ann, 0) == FAILURE) {
+            res = FAILURE;
+            break;
+        }
+        if ((nots = ann.nots) == 0)
+            break;
+        if (nots > OTPOOL_CHUNK) {
+            fprintf(stderr, "OT pool: invalid chunk size %lu\n", nots);
+            res = FAILURE;
+            break;
+        }
+        /* agree on the shorter pool before appending anything */
+        if (pool_count(pool, &count) == FAILURE
+            || (count > ann.count
+                && pool_truncate(pool, ann.count) == FAILURE)
+            || net_send(fd, &count, sizeof count, 0) == FAILURE) {
+            res = FAILURE;
+            break;
+        }
+        if (RAND_bytes(bits, (nots + 7) / 8) != 1) {
+            res = FAILURE;
+            break;
+        }
+        for (uint64_t i = 0; i < nots; ++i)
+            recs[i].sel = (bits[i / 8] >> (i % 8)) & 1;
+        if (pool->correlated)
+            err = ot_iknp_cot_recv(st, fd, recs, nots, recs,
+                                   pool_choice_reader, pool_msg_writer);
+        else
+            err = ot_iknp_recv(st, fd, recs, nots, sizeof(block), 2, recs,
+                               pool_choice_reader, pool_msg_writer);
+        if (err != 0
+            || pool_append(pool, recs, nots) == FAILURE
+            || net_send(fd, &ack, sizeof ack, 0) == FAILURE) {
+            res = FAILURE;
+            break;
+        }
+    }
+
+cleanup:
+    free(bits);
+    if (recs)
+        ot_free(recs);
+    return res;
+}
+
+static bool
+refiller_stopped(struct otpool_refiller *r)
+{
+    bool stop;
+
+    pthread_mutex_lock(&r->lock);
+    stop = r->stop;
+    pthread_mutex_unlock(&r->lock);
+    return stop;
+}
+
+/*
+ * Waits for the evaluator's refiller to connect, giving up once the refiller
+ * is stopped
+ */
+static int
+refiller_accept(struct otpool_refiller *r, int serverfd)
+{
+    struct pollfd pfd = { .fd = serverfd, .events = POLLIN };
+
+    while (!refiller_stopped(r)) {
+        int res = poll(&pfd, 1, 100);
+        if (res == -1 && errno != EINTR) {
+            perror("poll");
+            return FAILURE;
+        }
+        if (res > 0)
+            return net_server_accept(serverfd);
+    }
+    return FAILURE;
+}
+
+static void *
+refiller_sender(void *arg)
+{
+    struct otpool_refiller *r = (struct otpool_refiller *) arg;
+    struct otpool pool;
+    struct state st;
+    int serverfd, fd = FAILURE;
+    uint64_t watermark = ot_pool_size / 4;
+
+    if (otpool_open(&pool, r->dir, true) == FAILURE)
+        return NULL;
+    state_init(&st);
+
+    if ((serverfd = net_init_server(HOST, net_port(NET_PORT_OTPOOL))) == FAILURE
+        || (fd = refiller_accept(r, serverfd)) == FAILURE) {
+        if (!refiller_stopped(r))
+            fprintf(stderr, "OT pool: could not accept refill connection\n");
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop) {
+        uint64_t navailable;
+
+        if (otpool_available(&pool, &navailable) == FAILURE)
+            break;
+        if (navailable < watermark) {
+            pthread_mutex_unlock(&r->lock);
+            if (otpool_fill_send(&pool, &st, fd,
+                                 ot_pool_size - navailable) == FAILURE) {
+                fprintf(stderr, "OT pool: refill failed\n");
+                pthread_mutex_lock(&r->lock);
+                break;
+            }
+            pthread_mutex_lock(&r->lock);
+        } else {
+            /* other processes may consume from the pool too, so poll */
+            struct timespec ts;
+
+            (void) clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100 * 1000 * 1000;
+            if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000 * 1000 * 1000;
+            }
+            (void) pthread_cond_timedwait(&r->cond, &r->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    (void) otpool_fill_done(fd);
+
+cleanup:
+    if (fd != FAILURE)
+        (void) close(fd);
+    if (serverfd != FAILURE)
+        (void) close(serverfd);
+    state_cleanup(&st);
+    otpool_close(&pool);
+    return NULL;
+}
+
+static void *
+refiller_receiver(void *arg)
+{
+    struct otpool_refiller *r = (struct otpool_refiller *) arg;
+    struct otpool pool;
+    struct state st;
+    int fd = FAILURE;
+
+    if (otpool_open(&pool, r->dir, false) == FAILURE)
+        return NULL;
+    state_init(&st);
+
+    /* the garbler's refiller may not be listening yet */
+    for (int tries = 0; tries < 50; ++tries) {
+        if ((fd = net_init_client(HOST, net_port(NET_PORT_OTPOOL))) != FAILURE)
+            break;
+        (void) usleep(100 * 1000);
+    }
+    if (fd == FAILURE) {
+        fprintf(stderr, "OT pool: could not connect refill connection\n");
+    } else {
+        if (otpool_fill_recv(&pool, &st, fd) == FAILURE)
+            fprintf(stderr, "OT pool: refill failed\n");
+        (void) close(fd);
+    }
+
+    state_cleanup(&st);
+    otpool_close(&pool);
+    return NULL;
+}
+
+int
+otpool_refiller_start(struct otpool_refiller *r, const char *dir,
+                      bool isSender)
+{
+    r->dir = strdup(dir);
+    r->isSender = isSender;
+    r->stop = false;
+    (void) pthread_mutex_init(&r->lock, NULL);
+    (void) pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL,
+                       isSender ? refiller_sender : refiller_receiver, r) != 0) {
+        perror("pthread_create");
+        free(r->dir);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Stops the refiller.  The evaluator's refiller finishes once the garbler's
+ * has been stopped.
+ */
+void
+otpool_refiller_stop(struct otpool_refiller *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    (void) pthread_join(r->thread, NULL);
+    (void) pthread_cond_destroy(&r->cond);
+    (void) pthread_mutex_destroy(&r->lock);
+    free(r->dir);
+}
@@ -0,0 +1,97 @@
+#ifndef __OTLIB_OTPOOL_H__
+#define __OTLIB_OTPOOL_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <garble.h>
+
+#include "state.h"
+
+/* number of unconsumed OTs the pool is kept topped up to; 0 disables the pool
+ * and falls back to the single-run lbl/sel files */
+extern uint64_t ot_pool_size;
+/* use correlated OTs, whose two messages differ by the garbler's free-XOR
+ * offset, so that only one block per evaluator input is sent online */
+extern bool ot_correlated;
+
+/*
+ * On-disk store of precomputed random OTs.  The garbler's pool holds both
+ * random messages of each OT, the evaluator's pool its random choice bit and
+ * the chosen message.  Both pools are filled by the same OT runs in the same
+ * order, so record i of one matches record i of the other.
+ *
+ * The garbler owns the consumption cursor: each online session reserves a
+ * fresh slice from its pool and tells the evaluator the slice's offset.  The
+ * header is updated under an exclusive flock, so several processes may share
+ * a pool.
+ *
+ * A pool created with ot_correlated set holds correlated OTs, and the
+ * garbler's pool fixes the offset 'delta' between the two messages for its
+ * whole lifetime.  Circuits whose evaluator labels are sent using such a pool
+ * must be garbled with that offset.
+ */
+struct otpool {
+    int fd;
+    bool isSender;
+    bool correlated;
+    size_t recsize;
+    block delta;
+};
+
+int
+otpool_open(struct otpool *pool, const char *dir, bool isSender);
+
+void
+otpool_close(struct otpool *pool);
+
+int
+otpool_available(struct otpool *pool, uint64_t *navailable);
+
+int
+otpool_reserve(struct otpool *pool, uint64_t n, uint64_t *offset);
+
+int
+otpool_consume(struct otpool *pool, uint64_t offset, uint64_t n);
+
+int
+otpool_read_sender(struct otpool *pool, uint64_t offset, uint64_t n,
+                   block *labels);
+
+int
+otpool_read_receiver(struct otpool *pool, uint64_t offset, uint64_t n,
+                     block *labels, int *selections);
+
+int
+otpool_fill_send(struct otpool *pool, struct state *st, int fd, uint64_t n);
+
+int
+otpool_fill_done(int fd);
+
+int
+otpool_fill_recv(struct otpool *pool, struct state *st, int fd);
+
+/*
+ * Background worker that tops the pool up to ot_pool_size whenever it drops
+ * below a quarter of that, over its own connection on
+ * net_port(NET_PORT_OTPOOL).  The garbler's worker drives refills; the
+ * evaluator's worker follows.
+ */
+struct otpool_refiller {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *dir;
+    bool isSender;
+    bool stop;
+};
+
+int
+otpool_refiller_start(struct otpool_refiller *r, const char *dir,
+                      bool isSender);
+
+void
+otpool_refiller_stop(struct otpool_refiller *r);
+
+#endif
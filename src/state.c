@@ -10,12 +10,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <openssl/obj_mac.h>
+
 const unsigned int field_size = 1024 / 8;
+ot_base_type_e ot_base_type = OT_BASE_NP;
+int ot_nthreads = 1;
 static const char *ifcp1024 = "B10B8F96A080E01DDE92DE5EAE5D54EC52C99FBCFB06A3C69A6A9DCA52D23B616073E28675A23D189838EF1E2EE652C013ECB4AEA906112324975C3CD49B83BFACCBDD7D90C4BD7098488E9C219A73724EFFD6FAE5644738FAA31A4FF55BCCC0A151AF5F0DC8B4BD45BF37DF365C1A65E68CFDA76D4DA708DF1FB2BC2E4A4371";
 static const char *ifcg1024 = "A4D1CBD5C3FD34126765A442EFB99905F8104DD258AC507FD6406CFF14266D31266FEA1E5C41564B777E690F5504F213160217B4B01B886A5E91547F9E2749F4D7FBD7D3B9A92EE1909D0D2263F80A76A6A24C087A091F531DBF0A0169B6A28AD662A4D18E73AFA32D779D5918D08BC8858F4DCEF97C2A24855E6EEB22B3B2E5";
 static const char *ifcq1024 = "F518AA8781A8DF278ABA4E7D64B7CB9D49462353";
 
 #define RANDFILE "/dev/urandom"
+/* cached fixed-base table for ifcg1024 */
+#define FB_TABLE_FILE "function/ifcg1024.fbt"
 
 int
 state_init(struct state *s)
@@ -44,6 +50,24 @@ state_init(struct state *s)
         gmp_randseed_ui(s->p.rnd, seed);
         (void) close(file);
     }
+
+    /* exponents are always reduced mod q, so the table only needs to cover
+     * |q| bits */
+    if (fb_load(&s->gtab, s->p.g, s->p.p, mpz_sizeinbase(s->p.q, 2),
+                FB_TABLE_FILE) == FAILURE) {
+        if (fb_init(&s->gtab, s->p.g, s->p.p,
+                    mpz_sizeinbase(s->p.q, 2)) == FAILURE) {
+            (void) fprintf(stderr, "Error building fixed-base table\n");
+            ret = FAILURE;
+        } else {
+            (void) fb_save(&s->gtab, s->p.p, FB_TABLE_FILE);
+        }
+    }
+
+    if ((s->ec = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1)) == NULL) {
+        (void) fprintf(stderr, "Error initializing P-256\n");
+        ret = FAILURE;
+    }
     return ret;
 }
 
@@ -52,4 +76,6 @@ state_cleanup(struct state *s)
 {
     mpz_clears(s->p.p, s->p.g, s->p.q, NULL);
     gmp_randclear(s->p.rnd);
+    fb_clear(&s->gtab);
+    EC_GROUP_free(s->ec);
 }
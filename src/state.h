@@ -2,14 +2,26 @@
 #define __OTLIB_STATE_H__
 
 #include <gmp.h>
+#include <openssl/ec.h>
 
 #include "gmputils.h"
 
+/* protocol used for base OTs (and for OT extension's seed transfer) */
+typedef enum {
+    OT_BASE_NP,                 /* Naor-Pinkas over the 1024-bit group */
+    OT_BASE_CO,                 /* Chou-Orlandi over P-256 */
+} ot_base_type_e;
+
 struct state {
     struct params p;
+    struct fb_table gtab;       /* fixed-base table for p.g */
+    EC_GROUP *ec;
 };
 
 extern const unsigned int field_size;
+extern ot_base_type_e ot_base_type;
+/* number of worker threads used by the Naor-Pinkas OT */
+extern int ot_nthreads;
 
 int
 state_init(struct state *s);
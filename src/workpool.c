@@ -0,0 +1,473 @@
+#include "workpool.h"
+
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct workpool_thread {
+    pthread_t thread;
+    int id;
+    struct workpool *pool;
+};
+
+struct workpool_range {
+    pthread_mutex_t lock;       /* protects lo and hi */
+    int lo, hi;                 /* indices not yet taken */
+};
+
+/* the job of workpool_run */
+struct workpool_range_run {
+    struct workpool *pool;
+    workpool_fn fn;
+    void *arg;
+};
+
+static void *
+pool_thread(void *arg)
+{
+    struct workpool_thread *t = (struct workpool_thread *) arg;
+    struct workpool *pool = t->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->gen == seen && !pool->stop)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stop)
+            break;
+        seen = pool->gen;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->job(pool->state, t->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int
+workpool_init(struct workpool *pool, int nworkers)
+{
+    memset(pool, '\0', sizeof *pool);
+    pool->nworkers = MAX(nworkers, 1);
+    pool->threads = calloc(pool->nworkers, sizeof pool->threads[0]);
+    pool->ranges = calloc(pool->nworkers, sizeof pool->ranges[0]);
+    if (pool->threads == NULL || pool->ranges == NULL) {
+        free(pool->threads);
+        free(pool->ranges);
+        return FAILURE;
+    }
+    (void) pthread_mutex_init(&pool->run, NULL);
+    (void) pthread_mutex_init(&pool->lock, NULL);
+    (void) pthread_cond_init(&pool->wake, NULL);
+    (void) pthread_cond_init(&pool->done, NULL);
+    for (int k = 0; k < pool->nworkers; ++k)
+        (void) pthread_mutex_init(&pool->ranges[k].lock, NULL);
+
+    for (int k = 1; k < pool->nworkers; ++k) {
+        struct workpool_thread *t = &pool->threads[k];
+
+        t->id = k;
+        t->pool = pool;
+        if (pthread_create(&t->thread, NULL, pool_thread, t) != 0) {
+            /* the workers running steal the share of the others */
+            perror("pthread_create");
+            break;
+        }
+        pool->nstarted++;
+    }
+    return SUCCESS;
+}
+
+void
+workpool_destroy(struct workpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int k = 1; k <= pool->nstarted; ++k)
+        (void) pthread_join(pool->threads[k].thread, NULL);
+
+    for (int k = 0; k < pool->nworkers; ++k)
+        (void) pthread_mutex_destroy(&pool->ranges[k].lock);
+    (void) pthread_cond_destroy(&pool->done);
+    (void) pthread_cond_destroy(&pool->wake);
+    (void) pthread_mutex_destroy(&pool->lock);
+    (void) pthread_mutex_destroy(&pool->run);
+    free(pool->ranges);
+    free(pool->threads);
+}
+
+/* runs job(state, worker) on every worker, returning once all are done */
+static void
+pool_go(struct workpool *pool, void (*job)(void *, int), void *state)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->state = state;
+    pool->busy = pool->nstarted;
+    pool->gen++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    job(state, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* takes the next index of r, or -1 if it is empty */
+static int
+take(struct workpool_range *r)
+{
+    int i = -1;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->lo < r->hi)
+        i = r->lo++;
+    pthread_mutex_unlock(&r->lock);
+    return i;
+}
+
+/*
+ * Moves the back half of the largest range of another worker to r; returns
+ * whether there was anything left to steal
+ */
+static bool
+steal(struct workpool *pool, struct workpool_range *r)
+{
+    for (;;) {
+        struct workpool_range *victim = NULL;
+        int most = 0;
+
+        /* the victim's range may shrink meanwhile; checked again below */
+        for (int k = 0; k < pool->nworkers; ++k) {
+            struct workpool_range *v = &pool->ranges[k];
+            int left;
+
+            if (v == r)
+                continue;
+            pthread_mutex_lock(&v->lock);
+            left = v->hi - v->lo;
+            pthread_mutex_unlock(&v->lock);
+            if (left > most) {
+                most = left;
+                victim = v;
+            }
+        }
+        if (victim == NULL)
+            return false;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->lo < victim->hi) {
+            int mid = victim->lo + (victim->hi - victim->lo) / 2;
+            int hi = victim->hi;
+
+            victim->hi = mid;
+            pthread_mutex_unlock(&victim->lock);
+            pthread_mutex_lock(&r->lock);
+            r->lo = mid;
+            r->hi = hi;
+            pthread_mutex_unlock(&r->lock);
+            return true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+}
+
+static void
+range_worker_run(void *state, int worker)
+{
+    struct workpool_range_run *run = state;
+    struct workpool_range *r = &run->pool->ranges[worker];
+
+    do {
+        int i;
+        while ((i = take(r)) != -1)
+            run->fn(i, worker, run->arg);
+    } while (steal(run->pool, r));
+}
+
+int
+workpool_run(struct workpool *pool, int n, workpool_fn fn, void *arg)
+{
+    struct workpool_range_run run = { pool, fn, arg };
+
+    pthread_mutex_lock(&pool->run);
+    for (int k = 0; k < pool->nworkers; ++k) {
+        struct workpool_range *r = &pool->ranges[k];
+
+        pthread_mutex_lock(&r->lock);
+        r->lo = (int) ((long long) n * k / pool->nworkers);
+        r->hi = (int) ((long long) n * (k + 1) / pool->nworkers);
+        pthread_mutex_unlock(&r->lock);
+    }
+    pool_go(pool, range_worker_run, &run);
+    pthread_mutex_unlock(&pool->run);
+    return SUCCESS;
+}
+
+int
+workpool_dag_build(struct workpool_dag *dag, int n, const int *from,
+                   const int *to, int nedges)
+{
+    dag->n = n;
+    dag->npreds = calloc(n > 0 ? n : 1, sizeof dag->npreds[0]);
+    dag->succstart = calloc(n + 1, sizeof dag->succstart[0]);
+    dag->succs = malloc((nedges > 0 ? nedges : 1) * sizeof dag->succs[0]);
+    if (dag->npreds == NULL || dag->succstart == NULL || dag->succs == NULL) {
+        workpool_dag_destroy(dag);
+        return FAILURE;
+    }
+    /* counting sort of the edges by source, keeping their order */
+    for (int k = 0; k < nedges; ++k) {
+        dag->npreds[to[k]]++;
+        dag->succstart[from[k] + 1]++;
+    }
+    for (int i = 0; i < n; ++i)
+        dag->succstart[i + 1] += dag->succstart[i];
+    {
+        int *next = malloc((n > 0 ? n : 1) * sizeof next[0]);
+        if (next == NULL) {
+            workpool_dag_destroy(dag);
+            return FAILURE;
+        }
+        memcpy(next, dag->succstart, n * sizeof next[0]);
+        for (int k = 0; k < nedges; ++k)
+            dag->succs[next[from[k]]++] = to[k];
+        free(next);
+    }
+    return SUCCESS;
+}
+
+void
+workpool_dag_destroy(struct workpool_dag *dag)
+{
+    free(dag->npreds);
+    free(dag->succstart);
+    free(dag->succs);
+    memset(dag, '\0', sizeof *dag);
+}
+
+struct workpool_dag_worker {
+    pthread_mutex_t lock;       /* protects head and tail */
+    int *ready;                 /* ready tasks are ready[head] .. ready[tail - 1] */
+    int head, tail;
+    int id;
+    struct workpool_dag_run *run;
+};
+
+struct workpool_dag_run {
+    const struct workpool_dag *dag;
+    struct workpool_dag_worker *ws;
+    int nworkers;
+    int *pending;               /* predecessors not done yet, per task */
+    int remaining;              /* tasks not done yet */
+    bool failed;
+    workpool_dag_fn fn;
+    void *arg;
+    pthread_mutex_t lock;       /* protects nwaiting */
+    pthread_cond_t more;        /* a task was made ready, or the run ended */
+    int nwaiting;
+};
+
+static bool
+dag_ended(struct workpool_dag_run *run)
+{
+    return __atomic_load_n(&run->remaining, __ATOMIC_ACQUIRE) == 0
+        || __atomic_load_n(&run->failed, __ATOMIC_RELAXED);
+}
+
+/* wakes every waiting worker, once the run has ended */
+static void
+dag_wake_all(struct workpool_dag_run *run)
+{
+    pthread_mutex_lock(&run->lock);
+    pthread_cond_broadcast(&run->more);
+    pthread_mutex_unlock(&run->lock);
+}
+
+/*
+ * Each task is made ready exactly once, so a deque of n entries never
+ * overflows even though head and tail only grow back from pops.
+ */
+static void
+dag_push(struct workpool_dag_worker *w, int i)
+{
+    struct workpool_dag_run *run = w->run;
+
+    pthread_mutex_lock(&w->lock);
+    w->ready[w->tail++] = i;
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&run->lock);
+    if (run->nwaiting > 0)
+        pthread_cond_signal(&run->more);
+    pthread_mutex_unlock(&run->lock);
+}
+
+static int
+dag_pop(struct workpool_dag_worker *w)
+{
+    int i = -1;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail)
+        i = w->ready[--w->tail];
+    pthread_mutex_unlock(&w->lock);
+    return i;
+}
+
+static int
+dag_steal(struct workpool_dag_run *run, struct workpool_dag_worker *w)
+{
+    for (int k = 1; k < run->nworkers; ++k) {
+        struct workpool_dag_worker *v = &run->ws[(w->id + k) % run->nworkers];
+        int i = -1;
+
+        pthread_mutex_lock(&v->lock);
+        if (v->head < v->tail)
+            i = v->ready[v->head++];
+        pthread_mutex_unlock(&v->lock);
+        if (i != -1)
+            return i;
+    }
+    return -1;
+}
+
+static bool
+dag_any_ready(struct workpool_dag_run *run)
+{
+    for (int k = 0; k < run->nworkers; ++k) {
+        struct workpool_dag_worker *v = &run->ws[k];
+        bool ready;
+
+        pthread_mutex_lock(&v->lock);
+        ready = v->head < v->tail;
+        pthread_mutex_unlock(&v->lock);
+        if (ready)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Sleeps until some task is ready or the run has ended.  A task made ready
+ * after the check is pushed before dag_push takes run->lock, which the
+ * sleeper only releases by waiting, so its signal is not lost.
+ */
+static void
+dag_wait(struct workpool_dag_run *run)
+{
+    pthread_mutex_lock(&run->lock);
+    while (!dag_ended(run) && !dag_any_ready(run)) {
+        run->nwaiting++;
+        pthread_cond_wait(&run->more, &run->lock);
+        run->nwaiting--;
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
+static void
+dag_worker_run(void *state, int worker)
+{
+    struct workpool_dag_run *run = state;
+    struct workpool_dag_worker *w = &run->ws[worker];
+    const struct workpool_dag *dag = run->dag;
+
+    while (!dag_ended(run)) {
+        int i;
+
+        if ((i = dag_pop(w)) == -1 && (i = dag_steal(run, w)) == -1) {
+            /* tasks in flight elsewhere will make more ready */
+            dag_wait(run);
+            continue;
+        }
+        if (run->fn(i, w->id, run->arg) == FAILURE) {
+            __atomic_store_n(&run->failed, true, __ATOMIC_RELAXED);
+            dag_wake_all(run);
+            break;
+        }
+        for (int k = dag->succstart[i]; k < dag->succstart[i + 1]; ++k) {
+            int s = dag->succs[k];
+            if (__atomic_sub_fetch(&run->pending[s], 1, __ATOMIC_ACQ_REL) == 0)
+                dag_push(w, s);
+        }
+        if (__atomic_sub_fetch(&run->remaining, 1, __ATOMIC_RELEASE) == 0)
+            dag_wake_all(run);
+    }
+}
+
+int
+workpool_run_dag(struct workpool *pool, const struct workpool_dag *dag,
+                 workpool_dag_fn fn, void *arg)
+{
+    struct workpool_dag_run run;
+    int nworkers = pool->nworkers, nroots = 0;
+    int res = SUCCESS;
+
+    if (dag->n == 0)
+        return SUCCESS;
+    run.dag = dag;
+    run.nworkers = nworkers;
+    run.remaining = dag->n;
+    run.failed = false;
+    run.fn = fn;
+    run.arg = arg;
+    run.nwaiting = 0;
+    run.pending = malloc(dag->n * sizeof run.pending[0]);
+    run.ws = calloc(nworkers, sizeof run.ws[0]);
+    if (run.pending == NULL || run.ws == NULL) {
+        free(run.pending);
+        free(run.ws);
+        return FAILURE;
+    }
+    memcpy(run.pending, dag->npreds, dag->n * sizeof run.pending[0]);
+    for (int k = 0; k < nworkers; ++k) {
+        struct workpool_dag_worker *w = &run.ws[k];
+        (void) pthread_mutex_init(&w->lock, NULL);
+        w->ready = malloc(dag->n * sizeof w->ready[0]);
+        w->id = k;
+        w->run = &run;
+        if (w->ready == NULL)
+            res = FAILURE;
+    }
+    (void) pthread_mutex_init(&run.lock, NULL);
+    (void) pthread_cond_init(&run.more, NULL);
+    if (res == FAILURE)
+        goto cleanup;
+    /* the roots, dealt out in order, the first ones at the back */
+    for (int i = dag->n - 1; i >= 0; --i) {
+        if (dag->npreds[i] == 0) {
+            struct workpool_dag_worker *w = &run.ws[nroots++ % nworkers];
+            w->ready[w->tail++] = i;
+        }
+    }
+
+    pthread_mutex_lock(&pool->run);
+    pool_go(pool, dag_worker_run, &run);
+    pthread_mutex_unlock(&pool->run);
+    if (run.failed)
+        res = FAILURE;
+
+cleanup:
+    for (int k = 0; k < nworkers; ++k) {
+        (void) pthread_mutex_destroy(&run.ws[k].lock);
+        free(run.ws[k].ready);
+    }
+    (void) pthread_cond_destroy(&run.more);
+    (void) pthread_mutex_destroy(&run.lock);
+    free(run.ws);
+    free(run.pending);
+    return res;
+}
@@ -0,0 +1,88 @@
+#ifndef __WORKPOOL_H
+#define __WORKPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Pool of 'nworkers' workers, the thread running a job being worker 0 and
+ * the others threads started once by workpool_init.  Between jobs they wait
+ * on a condition variable, so a pool is meant to be kept for as long as its
+ * owner runs jobs.  Jobs on one pool run one at a time.
+ */
+struct workpool_thread;
+struct workpool_range;
+
+struct workpool {
+    int nworkers;
+    int nstarted;               /* threads started besides the caller */
+    struct workpool_thread *threads;
+    struct workpool_range *ranges; /* per worker, for workpool_run */
+    pthread_mutex_t run;        /* held while a job runs */
+    pthread_mutex_t lock;       /* protects everything below */
+    pthread_cond_t wake;        /* a job was posted, or the pool stopped */
+    pthread_cond_t done;        /* the last thread left the job */
+    uint64_t gen;               /* number of jobs posted */
+    int busy;                   /* threads still in the current job */
+    bool stop;
+    void (*job)(void *state, int worker);
+    void *state;
+};
+
+int
+workpool_init(struct workpool *pool, int nworkers);
+void
+workpool_destroy(struct workpool *pool);
+
+/*
+ * Runs fn(i, worker, arg) for every i in [0, n) on the workers of 'pool'.
+ *
+ * Each worker starts with an equal share of the index range and takes
+ * indices from the front of its own range.  A worker whose range runs out
+ * steals the back half of the largest remaining range of another worker, so
+ * uneven task costs still keep every worker busy until the end.
+ */
+typedef void (*workpool_fn)(int i, int worker, void *arg);
+
+int
+workpool_run(struct workpool *pool, int n, workpool_fn fn, void *arg);
+
+/*
+ * Dependency graph of n tasks, in compressed form: task i waits for
+ * npreds[i] predecessors, and succs[succstart[i]] .. succs[succstart[i + 1]
+ * - 1] wait for it.  Built once with workpool_dag_build and run any number
+ * of times.
+ */
+struct workpool_dag {
+    int n;
+    int *npreds;
+    int *succstart;
+    int *succs;
+};
+
+/* builds the graph of n tasks with an edge from[k] -> to[k] for each k */
+int
+workpool_dag_build(struct workpool_dag *dag, int n, const int *from,
+                   const int *to, int nedges);
+void
+workpool_dag_destroy(struct workpool_dag *dag);
+
+/*
+ * Runs fn(i, worker, arg) for every task i of 'dag' on the workers of
+ * 'pool', each task once all its predecessors are done.
+ *
+ * Each worker keeps its own deque of ready tasks: the tasks a worker makes
+ * ready are pushed to and taken from the back of its deque, so a chain of
+ * dependent tasks tends to stay on one thread, and idle workers steal from
+ * the front of the others', sleeping while there is nothing to steal until
+ * a task is made ready or the run ends.  Returns FAILURE if some fn did, in
+ * which case the tasks not yet started are skipped.
+ */
+typedef int (*workpool_dag_fn)(int i, int worker, void *arg);
+
+int
+workpool_run_dag(struct workpool *pool, const struct workpool_dag *dag,
+                 workpool_dag_fn fn, void *arg);
+
+#endif